@@ -4,6 +4,11 @@
 #include "NetKVMAux.h"
 #include "RegParam.h"
 
+#pragma warning(push, 3)
+#include <atlbase.h>
+#include <wbemidl.h>
+#pragma warning(pop)
+
 // This is NetSH Helper GUID {D9C599C4-8DCF-4a6a-93AA-A16FE6D5125C}
 static const GUID NETKVM_HELPER_GUID = {0xd9c599c4, 0x8dcf, 0x4a6a, {0x93, 0xaa, 0xa1, 0x6f, 0xe6, 0xd5, 0x12, 0x5c}};
 static const DWORD NETKVM_HELPER_VERSION = 1;
@@ -461,6 +466,240 @@ static bool _NetKVMSetParamValue(DWORD dwDeviceIndex, const tstring &strParamNam
     return pParam->Save();
 }
 
+// Latency histograms of the driver, see NetKvm_Latency in netkvm.mof
+static const LPCWSTR NETKVM_LATENCY_CLASS_QUERY = L"SELECT * FROM NetKvm_Latency";
+static const DWORD NETKVM_LATENCY_FIRST_BUCKET_BITS = 8;
+static const LPCWSTR NETKVM_LATENCY_HISTOGRAMS[] = {L"TxQueue", L"TxDevice", L"TxComplete", L"RxQueue"};
+static const UINT NETKVM_LATENCY_HISTOGRAM_IDS[] = {IDS_LATENCYTXQUEUE,
+                                                    IDS_LATENCYTXDEVICE,
+                                                    IDS_LATENCYTXCOMPLETE,
+                                                    IDS_LATENCYRXQUEUE};
+
+struct _NetKVMLatency
+{
+    ULONGLONG TicksPerMs;
+    DWORD NumOfQueues;
+    DWORD NumOfBuckets;
+    vector<ULONGLONG> Histograms[ARRAY_SIZE(NETKVM_LATENCY_HISTOGRAMS)];
+};
+
+// WMI returns uint64 properties as strings
+static ULONGLONG _NetKVMVariantToULONGLONG(const CComVariant &Value)
+{
+    CComVariant Converted;
+    return SUCCEEDED(Converted.ChangeType(VT_UI8, &Value)) ? V_UI8(&Converted) : 0;
+}
+
+static void _NetKVMVariantToVector(const CComVariant &Value, vector<ULONGLONG> &Vector)
+{
+    LONG lLower, lUpper;
+
+    Vector.clear();
+    if (!(V_VT(&Value) & VT_ARRAY) || V_ARRAY(&Value) == NULL ||
+        FAILED(SafeArrayGetLBound(V_ARRAY(&Value), 1, &lLower)) ||
+        FAILED(SafeArrayGetUBound(V_ARRAY(&Value), 1, &lUpper)))
+    {
+        return;
+    }
+
+    for (LONG i = lLower; i <= lUpper; ++i)
+    {
+        // the element is stored to the data part of the variant
+        CComVariant Element;
+        if (FAILED(SafeArrayGetElement(V_ARRAY(&Value), &i, &V_UI8(&Element))))
+        {
+            break;
+        }
+        V_VT(&Element) = (VARTYPE)(V_VT(&Value) & ~VT_ARRAY);
+        Vector.push_back(_NetKVMVariantToULONGLONG(Element));
+    }
+}
+
+static bool _NetKVMReadLatency(IWbemClassObject *pObject, _NetKVMLatency &Latency)
+{
+    CComVariant Value;
+
+    if (FAILED(pObject->Get(L"TicksPerMs", 0, &Value, NULL, NULL)))
+    {
+        return false;
+    }
+    Latency.TicksPerMs = _NetKVMVariantToULONGLONG(Value);
+
+    Value.Clear();
+    if (FAILED(pObject->Get(L"NumOfQueues", 0, &Value, NULL, NULL)))
+    {
+        return false;
+    }
+    Latency.NumOfQueues = (DWORD)_NetKVMVariantToULONGLONG(Value);
+
+    Value.Clear();
+    if (FAILED(pObject->Get(L"NumOfBuckets", 0, &Value, NULL, NULL)))
+    {
+        return false;
+    }
+    Latency.NumOfBuckets = (DWORD)_NetKVMVariantToULONGLONG(Value);
+
+    for (DWORD i = 0; i < ARRAY_SIZE(NETKVM_LATENCY_HISTOGRAMS); ++i)
+    {
+        Value.Clear();
+        if (FAILED(pObject->Get(NETKVM_LATENCY_HISTOGRAMS[i], 0, &Value, NULL, NULL)))
+        {
+            return false;
+        }
+        _NetKVMVariantToVector(Value, Latency.Histograms[i]);
+        if (Latency.Histograms[i].size() < (size_t)Latency.NumOfQueues * Latency.NumOfBuckets)
+        {
+            return false;
+        }
+    }
+
+    return Latency.TicksPerMs != 0 && Latency.NumOfBuckets > 1 &&
+           Latency.NumOfBuckets <= 64 - NETKVM_LATENCY_FIRST_BUCKET_BITS;
+}
+
+// The WMI instance of the adapter is named after its friendly name
+static bool _NetKVMQueryLatency(DWORD dwDeviceIndex, _NetKVMLatency &Latency)
+{
+    wstring strInstanceName = tstring2wstring(g_DevicesOfInterest[dwDeviceIndex].strDeviceFriendlyName);
+    bool bFound = false;
+
+    // netsh may have initialized COM of this thread already
+    HRESULT hrInit = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    if (FAILED(hrInit) && hrInit != RPC_E_CHANGED_MODE)
+    {
+        return false;
+    }
+
+    {
+        CComPtr<IWbemLocator> pLocator;
+        CComPtr<IWbemServices> pServices;
+        CComPtr<IEnumWbemClassObject> pEnumerator;
+
+        if (SUCCEEDED(pLocator.CoCreateInstance(CLSID_WbemLocator, NULL, CLSCTX_INPROC_SERVER)) &&
+            SUCCEEDED(pLocator->ConnectServer(CComBSTR(L"ROOT\\WMI"), NULL, NULL, NULL, 0, NULL, NULL, &pServices)) &&
+            SUCCEEDED(CoSetProxyBlanket(pServices,
+                                        RPC_C_AUTHN_WINNT,
+                                        RPC_C_AUTHZ_NONE,
+                                        NULL,
+                                        RPC_C_AUTHN_LEVEL_CALL,
+                                        RPC_C_IMP_LEVEL_IMPERSONATE,
+                                        NULL,
+                                        EOAC_NONE)) &&
+            SUCCEEDED(pServices->ExecQuery(CComBSTR(L"WQL"),
+                                           CComBSTR(NETKVM_LATENCY_CLASS_QUERY),
+                                           WBEM_FLAG_FORWARD_ONLY | WBEM_FLAG_RETURN_IMMEDIATELY,
+                                           NULL,
+                                           &pEnumerator)))
+        {
+            CComPtr<IWbemClassObject> pObject;
+            ULONG uReturned = 0;
+
+            while (!bFound && pEnumerator->Next(WBEM_INFINITE, 1, &pObject, &uReturned) == WBEM_S_NO_ERROR)
+            {
+                CComVariant Name;
+                if (SUCCEEDED(pObject->Get(L"InstanceName", 0, &Name, NULL, NULL)) && V_VT(&Name) == VT_BSTR &&
+                    0 == _wcsicmp(V_BSTR(&Name), strInstanceName.c_str()))
+                {
+                    bFound = _NetKVMReadLatency(pObject, Latency);
+                }
+                pObject.Release();
+            }
+        }
+    }
+
+    if (SUCCEEDED(hrInit))
+    {
+        CoUninitialize();
+    }
+
+    return bFound;
+}
+
+// Upper bound of the bucket in microseconds
+static double _NetKVMLatencyBucketUsecs(const _NetKVMLatency &Latency, DWORD dwBucket)
+{
+    return (double)(1ULL << (NETKVM_LATENCY_FIRST_BUCKET_BITS + dwBucket)) * 1000 / Latency.TicksPerMs;
+}
+
+static void _NetKVMDumpLatencyHistogram(const _NetKVMLatency &Latency, const ULONGLONG *Buckets)
+{
+    static const struct
+    {
+        DWORD dwPerMille;
+        LPCTSTR szName;
+    } Percentiles[] = {{500, TEXT("p50")}, {990, TEXT("p99")}, {999, TEXT("p99.9")}};
+    ULONGLONG ullTotal = 0, ullCounted = 0;
+    DWORD dwPercentile = 0;
+
+    for (DWORD i = 0; i < Latency.NumOfBuckets; ++i)
+    {
+        ullTotal += Buckets[i];
+    }
+    tcout << TEXT(": ") << ullTotal << TEXT(" ");
+    PrintMessageFromModule(g_hinstThisDLL, IDS_LATENCYPACKETS);
+    tcout << endl;
+    if (!ullTotal)
+    {
+        return;
+    }
+
+    tcout << fixed << setprecision(1);
+    for (DWORD i = 0; i < Latency.NumOfBuckets; ++i)
+    {
+        ullCounted += Buckets[i];
+        for (; dwPercentile < ARRAY_SIZE(Percentiles) &&
+               ullCounted * 1000 >= ullTotal * Percentiles[dwPercentile].dwPerMille;
+             ++dwPercentile)
+        {
+            tcout << TEXT("\t\t") << Percentiles[dwPercentile].szName << TEXT(" ");
+            if (i + 1 < Latency.NumOfBuckets)
+            {
+                tcout << TEXT("< ") << _NetKVMLatencyBucketUsecs(Latency, i);
+            }
+            else
+            {
+                tcout << TEXT(">= ") << _NetKVMLatencyBucketUsecs(Latency, i - 1);
+            }
+            tcout << TEXT(" us") << endl;
+        }
+    }
+
+    for (DWORD i = 0; i < Latency.NumOfBuckets; ++i)
+    {
+        if (!Buckets[i])
+        {
+            continue;
+        }
+        if (i + 1 < Latency.NumOfBuckets)
+        {
+            tcout << TEXT("\t\t< ") << _NetKVMLatencyBucketUsecs(Latency, i);
+        }
+        else
+        {
+            tcout << TEXT("\t\t>= ") << _NetKVMLatencyBucketUsecs(Latency, i - 1);
+        }
+        tcout << TEXT(" us: ") << Buckets[i] << endl;
+    }
+    tcout.unsetf(ios_base::floatfield);
+}
+
+static void _NetKVMDumpLatency(const _NetKVMLatency &Latency)
+{
+    for (DWORD i = 0; i < Latency.NumOfQueues; ++i)
+    {
+        PrintMessageFromModule(g_hinstThisDLL, IDS_LATENCYQUEUE);
+        tcout << TEXT(" ") << i << endl;
+
+        for (DWORD j = 0; j < ARRAY_SIZE(NETKVM_LATENCY_HISTOGRAMS); ++j)
+        {
+            tcout << TEXT("\t");
+            PrintMessageFromModule(g_hinstThisDLL, NETKVM_LATENCY_HISTOGRAM_IDS[j]);
+            _NetKVMDumpLatencyHistogram(Latency, &Latency.Histograms[j][i * Latency.NumOfBuckets]);
+        }
+        tcout << endl;
+    }
+}
+
 //
 // Usage: show devices
 //
@@ -913,6 +1152,90 @@ DWORD WINAPI _NetKVMShowParamsCmdHandler(__in PWCHAR /*pwszMachine*/,
     }
 }
 
+//
+// Usage: show latency [idx=]0-N
+//
+// Parameters:
+//
+//      IDX - Specifies the device index as it is shown in "show devices" output.
+//
+// Remarks:
+//
+//      Shows the latency histograms of each TX and RX queue of device specified by index,
+//      with the upper bounds of the buckets and the percentiles in microseconds.
+//
+// Examples:
+//
+//      show latency idx=0
+//      show latency 2
+//
+DWORD WINAPI _NetKVMShowLatencyCmdHandler(__in PWCHAR /*pwszMachine*/,
+                                          __in PWCHAR *ppwcArguments,
+                                          __in DWORD dwCurrentIndex,
+                                          __in DWORD dwArgCount,
+                                          __in DWORD /*dwFlags*/,
+                                          __in PVOID /*pvData*/,
+                                          __out BOOL *pbDone)
+{
+    *pbDone = FALSE; /* Just to make static analyzer happy */
+
+    try
+    {
+        NETCO_DEBUG_PRINT(TEXT("_NetKVMShowLatencyCmdHandler called"));
+        TAG_TYPE TagsList[] = {{NETKVM_IDX_PARAM_NAME, NS_REQ_PRESENT}};
+
+        auto_ptr<DWORD> pdwTagMatchResults(new DWORD[dwArgCount - dwCurrentIndex]);
+        DWORD dwPreprocessResult = PreprocessCommand(NULL,
+                                                     ppwcArguments,
+                                                     dwCurrentIndex,
+                                                     dwArgCount,
+                                                     TagsList,
+                                                     ARRAY_SIZE(TagsList),
+                                                     ARRAY_SIZE(TagsList),
+                                                     ARRAY_SIZE(TagsList),
+                                                     pdwTagMatchResults.get());
+
+        switch (dwPreprocessResult)
+        {
+            case NO_ERROR:
+                {
+                    DWORD dwIndex;
+                    if (__NetKVMConvertDeviceIndex(ppwcArguments[dwCurrentIndex + pdwTagMatchResults.get()[0]],
+                                                   &dwIndex))
+                    {
+                        _NetKVMLatency Latency;
+
+                        if (!_NetKVMQueryLatency(dwIndex, Latency))
+                        {
+                            PrintError(g_hinstThisDLL, IDS_NOLATENCYSTATS);
+                            return ERROR_NOT_FOUND;
+                        }
+                        _NetKVMDumpLatency(Latency);
+                        return NO_ERROR;
+                    }
+                    else
+                    {
+                        return ERROR_INVALID_PARAMETER;
+                    }
+                }
+                __fallthrough;
+            default:
+                NETCO_DEBUG_PRINT(TEXT("PreprocessCommand returned: ") << dwPreprocessResult);
+                return dwPreprocessResult;
+        }
+    }
+    catch (const exception &ex)
+    {
+        PrintError(g_hinstThisDLL, IDS_LOGICEXCEPTION);
+        tcout << TEXT(": ") << string2tstring(string(ex.what())) << endl;
+        return ERROR_EXCEPTION_IN_SERVICE;
+    }
+    catch (...)
+    {
+        return ERROR_UNKNOWN_EXCEPTION;
+    }
+}
+
 //
 // Usage: restart [idx=]0-N
 //
@@ -1013,6 +1336,9 @@ DWORD WINAPI _NetKVMRestartDeviceCmdHandler(__in PWCHAR /*pwszMachine*/,
 #define CMD_NETKVM_SHOW_PARAMINFO    L"paraminfo"
 #define HLP_NETKVM_SHOW_PARAMINFO    IDS_SHOWPARAMINFOSHORT
 #define HLP_NETKVM_SHOW_PARAMINFO_EX IDS_SHOWPARAMINFOLONG
+#define CMD_NETKVM_SHOW_LATENCY      L"latency"
+#define HLP_NETKVM_SHOW_LATENCY      IDS_SHOWLATENCYSHORT
+#define HLP_NETKVM_SHOW_LATENCY_EX   IDS_SHOWLATENCYLONG
 
 #define CREATE_CMD_ENTRY(t, f)                                                                                         \
     {                                                                                                                  \
@@ -1051,6 +1377,9 @@ CMD_ENTRY g_ShowCmdTable[] = {CREATE_CMD_ENTRY_EX(NETKVM_SHOW_DEVICES,
                                                   CMD_FLAG_PRIVATE | CMD_FLAG_LOCAL),
                               CREATE_CMD_ENTRY_EX(NETKVM_SHOW_PARAMINFO,
                                                   (PFN_HANDLE_CMD)_NetKVMShowParamInfoCmdHandler,
+                                                  CMD_FLAG_PRIVATE | CMD_FLAG_LOCAL),
+                              CREATE_CMD_ENTRY_EX(NETKVM_SHOW_LATENCY,
+                                                  (PFN_HANDLE_CMD)_NetKVMShowLatencyCmdHandler,
                                                   CMD_FLAG_PRIVATE | CMD_FLAG_LOCAL)
 
 };
@@ -45,6 +45,15 @@
 #define IDS_SETPARAMLONG       141
 #define IDS_SETPARAM           142
 #define IDS_LOCALONLY          143
+#define IDS_SHOWLATENCYSHORT   144
+#define IDS_SHOWLATENCYLONG    145
+#define IDS_NOLATENCYSTATS     146
+#define IDS_LATENCYQUEUE       147
+#define IDS_LATENCYTXQUEUE     148
+#define IDS_LATENCYTXDEVICE    149
+#define IDS_LATENCYTXCOMPLETE  150
+#define IDS_LATENCYRXQUEUE     151
+#define IDS_LATENCYPACKETS     152
 
 // Next default values for new objects
 //
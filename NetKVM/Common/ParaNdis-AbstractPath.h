@@ -113,6 +113,30 @@ template <class VQ> class CParaNdisTemplatePath : public CParaNdisAbstractPath,
         m_VirtQueue.Shutdown();
     }
 
+    // Serialized with the completion processing, which feeds the coalescing policy
+    void SetInterruptModeration(bool Enable)
+    {
+        TPassiveSpinLocker LockedContext(m_Lock);
+        if (Enable)
+        {
+            m_VirtQueue.EnableCoalescing(VIRTQ_COALESCE_ADAPTIVE);
+        }
+        else
+        {
+            m_VirtQueue.DisableCoalescing();
+        }
+    }
+
+    const struct virtqueue_coalesce_stats &CoalesceStats() const
+    {
+        return m_VirtQueue.CoalesceStats();
+    }
+
+    void QueryRingStats(struct virtqueue_stats &Stats)
+    {
+        m_VirtQueue.QueryStats(Stats);
+    }
+
     static BOOLEAN _Function_class_(MINIPORT_SYNCHRONIZE_INTERRUPT) RestartQueueSynchronously(PVOID ctx)
     {
         auto This = static_cast<CParaNdisTemplatePath<VQ> *>(ctx);
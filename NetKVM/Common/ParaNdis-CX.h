@@ -3,6 +3,19 @@
 #include "ndis56common.h"
 #include "ParaNdis-AbstractPath.h"
 
+// Number of commands kept in the control queue at the same time, each one
+// owns a slot of the shared data block for its parameters and result
+#define CX_MAX_COMMANDS_IN_FLIGHT 8
+#define CX_COMMAND_SLOT_SIZE      512
+// Bucket i of the latency histogram counts the commands completed in less
+// than 2^(i + 4) microseconds, the last bucket counts all the slower ones
+#define CX_LATENCY_BUCKETS        12
+
+// Receives the data the device wrote after the status of a command posted with
+// PostControlQuery, called under the lock of the control queue when the command
+// is completed or dropped. Reply is NULL if the command failed.
+typedef void (*tControlReplyHandler)(PVOID Context, const void *Reply, ULONG Length);
+
 class CParaNdisCX : public CParaNdisTemplatePath<CVirtQueue>, public CPlacementAllocatable
 {
   public:
@@ -13,7 +26,22 @@ class CParaNdisCX : public CParaNdisTemplatePath<CVirtQueue>, public CPlacementA
 
     virtual NDIS_STATUS SetupMessageIndex(u16 vector);
 
+    // Sends the command and waits for its completion, for callers that need the result.
+    // Up to replySize bytes written by the device after the status are copied to reply
     BOOLEAN CParaNdisCX::SendControlMessage(UCHAR cls,
+                                            UCHAR cmd,
+                                            PVOID buffer1,
+                                            ULONG size1,
+                                            PVOID buffer2,
+                                            ULONG size2,
+                                            int levelIfOK,
+                                            PVOID reply = NULL,
+                                            ULONG replySize = 0,
+                                            PULONG replyLength = NULL);
+
+    // Places the command in the control queue, or in the backlog when the queue
+    // is full, and returns. The completion is processed by the CX DPC
+    BOOLEAN CParaNdisCX::PostControlMessage(UCHAR cls,
                                             UCHAR cmd,
                                             PVOID buffer1,
                                             ULONG size1,
@@ -21,14 +49,34 @@ class CParaNdisCX : public CParaNdisTemplatePath<CVirtQueue>, public CPlacementA
                                             ULONG size2,
                                             int levelIfOK);
 
+    // Posts the command like PostControlMessage, with room for replySize bytes of
+    // the reply. The command never belongs to an OID request, the handler is called
+    // for it unless the function fails
+    BOOLEAN CParaNdisCX::PostControlQuery(UCHAR cls,
+                                          UCHAR cmd,
+                                          PVOID buffer,
+                                          ULONG size,
+                                          ULONG replySize,
+                                          tControlReplyHandler handler,
+                                          PVOID handlerContext,
+                                          int levelIfOK);
+
+    // Commands posted between these calls belong to the OID request. When some of them
+    // are still in progress EndOidRequest returns NDIS_STATUS_PENDING and the request
+    // is completed after the last one is done. The request fails if any of its commands
+    // fails, otherwise it completes with the given status. The caller must not touch the
+    // request after EndOidRequest returned NDIS_STATUS_PENDING, it may be completed already
+    void BeginOidRequest();
+    NDIS_STATUS EndOidRequest(PNDIS_OID_REQUEST Request, NDIS_STATUS Status);
+
     bool FireDPC(ULONG messageId) override;
     void Maintain(UINT MaxLoops = MAXUINT);
+    void Shutdown();
+    void PrintStatistics();
 
   protected:
     tCompletePhysicalAddress m_ControlData;
     KDPC m_DPC;
-    // updated under m_Lock
-    ULONG m_ResultOffset = 0;
     struct CommandData
     {
         UCHAR cls;
@@ -38,10 +86,52 @@ class CParaNdisCX : public CParaNdisTemplatePath<CVirtQueue>, public CPlacementA
         PVOID buffer2;
         ULONG size2;
         int logLevel;
+        bool forOid;
+        ULONG replySize;
+        tControlReplyHandler replyHandler;
+        PVOID replyContext;
+    };
+    struct CommandSlot
+    {
+        bool InUse;
+        // SendControlMessage waits for the result and releases the slot
+        bool Waited;
+        bool Done;
+        bool ForOid;
+        UCHAR Result;
+        UCHAR cls;
+        UCHAR cmd;
+        int logLevel;
+        ULONG ResultOffset;
+        // the reply area follows the result
+        ULONG ReplyOffset;
+        ULONG ReplySize;
+        ULONG ReplyLength;
+        tControlReplyHandler ReplyHandler;
+        PVOID ReplyContext;
+        LARGE_INTEGER SubmitTime;
     };
-    void FillSGArray(struct VirtIOBufferDescriptor sg[/*4*/], const CommandData &data, UINT &nOut);
-    BOOLEAN SendInternal(const CommandData &data, bool initial);
-    bool GetResponse(UCHAR &Code, int MicrosecondsToWait, int LogLevel);
+    void FillSGArray(struct VirtIOBufferDescriptor sg[/*5*/],
+                     CommandSlot &Slot,
+                     const CommandData &data,
+                     UINT &nOut,
+                     UINT &nIn);
+    static bool CheckSize(ULONG size1, ULONG size2, ULONG replySize = 0);
+    // the following are called under m_Lock
+    CommandSlot *FindFreeSlot();
+    bool Submit(const CommandData &data, bool Waited, CommandSlot *&Slot);
+    void SubmitBacklog(UINT MaxLoops);
+    void ProcessCompletions();
+    void CompleteCommand(CommandSlot &Slot, UINT Length);
+    void FinishCommand(CommandSlot &Slot, UCHAR Result);
+    void DropCommand(const CommandData &Data);
+    BOOLEAN TakeResult(CommandSlot &Slot, PVOID Reply, ULONG ReplySize, PULONG ReplyLength);
+    void OidCommandDone(bool Failed);
+    PNDIS_OID_REQUEST TakeCompletedOid();
+    // called without m_Lock
+    void CompleteOid(PNDIS_OID_REQUEST Request);
+    BOOLEAN PostCommand(CommandData &data, bool MayBelongToOid);
+
     class CQueuedCommand : public CNdisAllocatable<CQueuedCommand, 'CQXC'>
     {
       public:
@@ -67,34 +157,13 @@ class CParaNdisCX : public CParaNdisTemplatePath<CVirtQueue>, public CPlacementA
     {
         return m_ControlData.Virtual && m_VirtQueue.IsValid() && m_VirtQueue.CanTouchHardware();
     }
-    class CPendingCommand
-    {
-      public:
-        CPendingCommand()
-        {
-            Clear();
-        }
-        bool Pending() const
-        {
-            return m_Present;
-        }
-
-      private:
-        void Clear()
-        {
-            m_Present = m_Counted = false;
-        }
-        // returns true on first call, false of next ones
-        bool Set()
-        {
-            bool b = m_Counted;
-            m_Present = m_Counted = true;
-            return !b;
-        }
-        bool m_Present;
-        bool m_Counted;
-        friend bool CParaNdisCX::GetResponse(UCHAR &Code, int MicrosecondsToWait, int LogLevel);
-    };
     // updated under m_Lock
-    CPendingCommand m_PendingCommand;
+    CommandSlot m_Slots[CX_MAX_COMMANDS_IN_FLIGHT] = {};
+    bool m_OidInProgress = false;
+    ULONG m_OidCommands = 0;
+    PNDIS_OID_REQUEST m_PendingOid = nullptr;
+    PNDIS_OID_REQUEST m_CompletedOid = nullptr;
+    NDIS_STATUS m_OidStatus = NDIS_STATUS_SUCCESS;
+    ULONG m_LatencyHistogram[CX_LATENCY_BUCKETS] = {};
+    LARGE_INTEGER m_PerfFrequency;
 };
@@ -0,0 +1,89 @@
+#pragma once
+
+// Statistics of the device (VIRTIO_NET_F_DEVICE_STATS): the host counts the packets, the drops and
+// the notifications of every virtqueue. The driver queries the RX and TX queues over the control
+// queue from a periodic timer and keeps the counters per path bundle, so the losses in the host can
+// be told apart from the losses in the guest. The drops are also added to the discards reported in
+// OID_GEN_STATISTICS.
+// The device starts its counters from 0 after every reset, the driver accumulates the differences
+// between the replies and keeps the totals over the resets.
+
+// seconds between the queries
+#define DEVICE_STATS_PERIOD_DEFAULT 1
+#define DEVICE_STATS_PERIOD_MAX     60
+
+struct CPUPathBundle;
+struct virtio_net_stats_reply_hdr;
+
+enum eDeviceQueueCounter
+{
+    dqcNotifications,
+    dqcPackets,
+    dqcBytes,
+    dqcInterrupts,
+    // all the packets dropped by the device
+    dqcDrops,
+    // RX: dropped because the ring was full
+    dqcOverruns,
+    // TX: dropped because the packet was malformed
+    dqcMalformed,
+    // RX: received with a wrong checksum
+    dqcChecksumBad,
+    // packets above the rate limit of the device
+    dqcRateLimited,
+    dqcCount
+};
+
+typedef struct _tagDeviceQueueStatistics
+{
+    // accumulated over the resets of the device
+    ULONG64 Counters[dqcCount];
+    // as the device reported them last time
+    ULONG64 Last[dqcCount];
+} tDeviceQueueStatistics;
+
+class CDeviceStatistics
+{
+  public:
+    // Period in seconds, 0 disables the statistics and the feature is not negotiated
+    void Initialize(PPARANDIS_ADAPTER Context, ULONG Period);
+
+    bool IsConfigured() const
+    {
+        return m_Period != 0;
+    }
+
+    // Called at PASSIVE when the device enters D0: queries the types of statistics
+    // the device supports and starts the periodic queries
+    void Start();
+    // Called at PASSIVE before the device is reset
+    void Stop();
+    // Called at PASSIVE on halt
+    void Release();
+
+    bool IsActive() const
+    {
+        return m_RxTypes != 0 || m_TxTypes != 0;
+    }
+
+    // Sum of the counter over the RX or TX queues
+    ULONG64 Total(eDeviceQueueCounter Counter, bool Rx) const;
+
+  private:
+    static VOID OnTimer(PVOID SystemSpecific1, PVOID FunctionContext, PVOID SystemSpecific2, PVOID SystemSpecific3);
+    static void OnReply(PVOID Context, const void *Reply, ULONG Length);
+    void Query();
+    void PostQuery(USHORT QueueIndex, ULONG64 Types);
+    void Update(const virtio_net_stats_reply_hdr *Header);
+    tDeviceQueueStatistics *FindQueue(USHORT QueueIndex, bool Rx) const;
+
+    PPARANDIS_ADAPTER m_Context = NULL;
+    ULONG m_Period = 0;
+    NDIS_HANDLE m_Timer = NULL;
+    // the types of statistics requested for each RX and TX queue
+    ULONG64 m_RxTypes = 0;
+    ULONG64 m_TxTypes = 0;
+    // queries posted and not completed yet, the timer skips
+    // its round when the device did not answer the previous one
+    LONG m_Pending = 0;
+};
@@ -0,0 +1,75 @@
+#pragma once
+
+// Log-scale histograms of the time the packets spend in the stages of the data path, to locate the
+// latency tails. The time is read from the time stamp counter of the processor (the virtual counter
+// on ARM64), each histogram is updated with plain increments by the owner of its queue: under the
+// TX lock, under the waiting list lock or by the DPC that drains the receive queue.
+// Bucket 0 counts the intervals shorter than 2^LATENCY_FIRST_BUCKET_BITS ticks, bucket N the
+// intervals shorter than 2^(LATENCY_FIRST_BUCKET_BITS + N) ticks and not counted by the previous
+// buckets, the last bucket also counts all the longer ones.
+//
+// TX, per path:
+//   Queue    - from the send handler until the last NB of the NBL is submitted to the virtqueue
+//   Device   - from the submission of an NB until the device returns it
+//   Complete - from the send handler until the NBL is completed to NDIS
+// RX, per receive queue:
+//   Queue    - from the classification of a packet until it is taken from the receive queue
+//              to be indicated
+
+#define LATENCY_BUCKETS           32
+#define LATENCY_FIRST_BUCKET_BITS 8
+
+typedef struct _tagLatencyHistogram
+{
+    ULONG64 Buckets[LATENCY_BUCKETS];
+} tLatencyHistogram;
+
+static __inline ULONG64 ParaNdis_LatencyTimestamp()
+{
+#if defined(_ARM64_)
+    return _ReadStatusReg(ARM64_CNTVCT);
+#else
+    return ReadTimeStampCounter();
+#endif
+}
+
+static __inline void ParaNdis_LatencyAdd(tLatencyHistogram &Histogram, ULONG64 Start, ULONG64 End)
+{
+    // the counters of the processors may be slightly off, a negative interval is counted as 0
+    ULONG64 ticks = (LONG64)(End - Start) > 0 ? End - Start : 0;
+    ULONG bit, bits = 0;
+
+    if (_BitScanReverse(&bit, (ULONG)(ticks >> 32)))
+    {
+        bits = bit + 33;
+    }
+    else if (_BitScanReverse(&bit, (ULONG)ticks))
+    {
+        bits = bit + 1;
+    }
+    bits = bits > LATENCY_FIRST_BUCKET_BITS ? bits - LATENCY_FIRST_BUCKET_BITS : 0;
+    Histogram.Buckets[min(bits, (ULONG)LATENCY_BUCKETS - 1)]++;
+}
+
+// Relates the ticks of the counter to the interrupt time, so the buckets can be reported in
+// microseconds without a calibration loop
+class CLatencyClock
+{
+  public:
+    void Start()
+    {
+        m_Ticks = ParaNdis_LatencyTimestamp();
+        m_Time = KeQueryInterruptTime();
+    }
+
+    // measured over the time since Start, 0 during the first millisecond
+    ULONG64 TicksPerMs() const
+    {
+        ULONGLONG ms = (KeQueryInterruptTime() - m_Time) / 10000;
+        return ms ? (ParaNdis_LatencyTimestamp() - m_Ticks) / ms : 0;
+    }
+
+  private:
+    ULONG64 m_Ticks = 0;
+    ULONGLONG m_Time = 0;
+};
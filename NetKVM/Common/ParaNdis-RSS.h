@@ -4,6 +4,7 @@
 #include "osdep.h"
 
 #include "ParaNdis-Util.h"
+#include "ParaNdis-Toeplitz.h"
 
 #if PARANDIS_SUPPORT_RSS
 
@@ -42,6 +43,25 @@ typedef struct _tagPARANDIS_SCALING_SETTINGS
     CCHAR DefaultQueue;
 } PARANDIS_SCALING_SETTINGS, *PPARANDIS_SCALING_SETTINGS;
 
+struct CPUPathBundle;
+
+// Immutable copy of the active settings for the data path. The control path builds a new snapshot
+// under rwLock and publishes it with an interlocked exchange, the send and receive paths read it
+// without any lock (see CRSSSnapshotReader). The readers use the snapshot at DISPATCH_LEVEL only, so
+// the replaced one is freed after the control path thread has run on every processor.
+typedef struct _tagPARANDIS_RSS_SNAPSHOT
+{
+    PARANDIS_RSS_MODE RSSMode;
+    ULONG HashInformation;
+    // CPUIndexMapping points to CPUIndexMappingData
+    PARANDIS_SCALING_SETTINGS Scaling;
+    // TX path bundle per indirection table entry, QueueMapLength is 0 when there is no mapping
+    CPUPathBundle *QueueMap[NDIS_RSS_INDIRECTION_TABLE_MAX_SIZE_REVISION_2 / sizeof(PROCESSOR_NUMBER)];
+    ULONG QueueMapLength;
+    CToeplitzHash ToeplitzHash;
+    CCHAR CPUIndexMappingData[ANYSIZE_ARRAY];
+} PARANDIS_RSS_SNAPSHOT;
+
 class PARANDIS_RSS_PARAMS
 {
   public:
@@ -58,11 +78,36 @@ class PARANDIS_RSS_PARAMS
 
     PARANDIS_HASHING_SETTINGS ActiveHashingSettings = {};
     PARANDIS_SCALING_SETTINGS ActiveRSSScalingSettings = {};
+    // expanded ActiveHashingSettings.HashSecretKey
+    CToeplitzHash ActiveToeplitzHash;
 
+    // serializes the control path, the data path uses Snapshot
     mutable CNdisRWLock rwLock;
+    // NULL until NDIS configures RSS or the receive hash
+    PARANDIS_RSS_SNAPSHOT *volatile Snapshot = NULL;
 };
 typedef PARANDIS_RSS_PARAMS *PPARANDIS_RSS_PARAMS;
 
+// Lock-free access of the data path to the published snapshot, keeps the processor at DISPATCH_LEVEL
+// while the snapshot is in use
+class CRSSSnapshotReader
+{
+  public:
+    CRSSSnapshotReader(const PARANDIS_RSS_PARAMS &Params) : m_Snapshot(Params.Snapshot)
+    {
+    }
+
+    const PARANDIS_RSS_SNAPSHOT *Get() const
+    {
+        return m_Snapshot;
+    }
+
+  private:
+    // raises the IRQL before the snapshot is read
+    CDpcIrqlRaiser m_Raiser;
+    const PARANDIS_RSS_SNAPSHOT *m_Snapshot;
+};
+
 typedef struct _tagRSS_HASH_KEY_PARAMETERS
 {
     NDIS_RECEIVE_HASH_PARAMETERS ReceiveHashParameters;
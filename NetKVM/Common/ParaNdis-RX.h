@@ -1,6 +1,7 @@
 #pragma once
 #include "ParaNdis-VirtQueue.h"
 #include "ParaNdis-AbstractPath.h"
+#include "ParaNdis-RxPagePool.h"
 
 class CParaNdisRX : public CParaNdisTemplatePath<CVirtQueue>, public CNdisAllocatable<CParaNdisRX, 'XRHR'>
 {
@@ -18,6 +19,11 @@ class CParaNdisRX : public CParaNdisTemplatePath<CVirtQueue>, public CNdisAlloca
 
     void ReuseReceiveBuffer(pRxNetDescriptor pBuffersDescriptor)
     {
+        if (RecycleWithoutLock(pBuffersDescriptor))
+        {
+            return;
+        }
+
         TPassiveSpinLocker autoLock(m_Lock);
 
         ReuseReceiveBufferNoLock(pBuffersDescriptor);
@@ -38,6 +44,7 @@ class CParaNdisRX : public CParaNdisTemplatePath<CVirtQueue>, public CNdisAlloca
 
         m_VirtQueue.Shutdown();
         m_Reinsert = false;
+        ReuseRecycledBuffers();
     }
 
     void KickRXRing();
@@ -66,9 +73,19 @@ class CParaNdisRX : public CParaNdisTemplatePath<CVirtQueue>, public CNdisAlloca
 
     PARANDIS_RECEIVE_QUEUE m_UnclassifiedPacketsQueue;
 
+    // Mergeable buffers are slices of these pages
+    CRxPagePool m_PagePool;
+    LONG m_PoolGrowthPending = 0;
+// Pages allocated by one work item when the pool has no room for larger slices
+#define RX_POOL_GROWTH_PAGES 16
+
+    // Buffers returned on the CPU of the queue's DPC without taking m_Lock,
+    // the DPC posts them to the ring
+    SLIST_HEADER m_RecycledBuffers;
+
 // Maximum mergeable packet size per VirtIO spec: 65562 bytes (including 12-byte header)
-// Required buffers: ceil(65562 / 4096) = 17 PAGE-sized buffers maximum
-#define VIRTIO_NET_MAX_MRG_BUFS 17
+// Required buffers: ceil(65562 / 2048) = 33 buffers of the smallest pool slice maximum
+#define VIRTIO_NET_MAX_MRG_BUFS 33
 
     // Merge buffer context structure - pre-allocated to avoid hot-path allocation
     struct _MergeBufferContext
@@ -83,17 +100,64 @@ class CParaNdisRX : public CParaNdisTemplatePath<CVirtQueue>, public CNdisAlloca
         tCompletePhysicalAddress PhysicalPages[VIRTIO_NET_MAX_MRG_BUFS];
     } m_MergeContext;
 
+    // Used buffers fetched from the ring in one batch and not yet processed
+    struct _CompletedBuffers
+    {
+        void *Buffers[CVirtQueue::CompletionBatchSize];
+        UINT Lengths[CVirtQueue::CompletionBatchSize];
+        UINT Count;
+        UINT Next;
+    } m_Completed = {};
+
+#if PARANDIS_SUPPORT_RSC
+// Number of TCP flows coalesced at the same time during one pass over the ring
+#define PARANDIS_RSC_MAX_FLOWS    8
+#define PARANDIS_RSC_MAX_SEGMENTS 64
+
+    // In-order segments of a flow collected during the current pass, the first one
+    // carries the headers of the coalesced frame
+    struct _CoalescingFlow
+    {
+        pRxNetDescriptor Head;
+        pRxNetDescriptor Tail;
+        ULONG NextSeq;
+        ULONG SegmentPayload;
+        ULONG TotalPayload;
+        USHORT Window;
+        bool Push;
+    } m_CoalescingFlows[PARANDIS_RSC_MAX_FLOWS] = {};
+    UINT m_nCoalescingFlows = 0;
+
+    bool CoalesceReceivedPacket(pRxNetDescriptor pBufferDescriptor, CCHAR nCurrCpuReceiveQueue);
+    bool AppendToFlow(_CoalescingFlow &Flow, pRxNetDescriptor pBufferDescriptor, ULONG Payload);
+    void FlushCoalescingFlow(UINT Index, CCHAR nCurrCpuReceiveQueue);
+    void FlushCoalescingFlows(CCHAR nCurrCpuReceiveQueue);
+    void ReleaseCoalescedSegments(pRxNetDescriptor pBufferDescriptor);
+#endif
+
+    pRxNetDescriptor GetCompletedBuffer(UINT *pLength);
     void ReuseReceiveBufferNoLock(pRxNetDescriptor pBuffersDescriptor);
+    bool RecycleWithoutLock(pRxNetDescriptor pBuffersDescriptor);
+    void ReuseRecycledBuffers();
+    void ResizePoolBuffer(pRxNetDescriptor pBuffersDescriptor);
+    void RequestPoolGrowth();
+    static void PoolGrowthWorkItem(PVOID WorkItemContext, NDIS_HANDLE NdisIoWorkItemHandle);
+    bool AddPoolPage();
+    bool GetPoolSliceOnInit(pRxNetDescriptor p);
+    void FreeRxDescriptor(pRxNetDescriptor p);
     pRxNetDescriptor ProcessMergedBuffers(pRxNetDescriptor pFirstBuffer, UINT nFullLength);
     BOOLEAN CollectRemainingMergeBuffers();
     pRxNetDescriptor AssembleMergedPacket();
     void ReuseCollectedBuffers();
+    void DropMergedBuffers(UINT nRemaining);
     void ProcessReceivedPacket(pRxNetDescriptor pBufferDescriptor, CCHAR nCurrCpuReceiveQueue);
+    void DispatchReceivedPacket(pRxNetDescriptor pBufferDescriptor, CCHAR nCurrCpuReceiveQueue);
 
     // Helper function for mergeable buffer state management
     void DisassembleMergedPacket(pRxNetDescriptor pBuffer);
 
   private:
+    bool UseMergeableDescriptors() const;
     int PrepareReceiveBuffers();
     pRxNetDescriptor CreateRxDescriptorOnInit();
     pRxNetDescriptor CreateMergeableRxDescriptorOnInit(); // Simplified descriptor for mergeable buffers
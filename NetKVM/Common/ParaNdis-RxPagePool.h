@@ -0,0 +1,86 @@
+#pragma once
+
+// Pool of shared memory pages of one RX queue for mergeable buffers.
+// Every page is carved into slices of one size class, the slice size is PAGE_SIZE >> Shift.
+// A page without used slices can be carved again for any class. The queue picks the class of
+// the buffers it posts from the running average of the received packet size, like the Linux
+// driver sizes its mergeable buffers, so small packet workloads occupy less memory.
+// Pages are allocated only at PASSIVE level, all the other methods are called under the lock
+// of the owning queue.
+
+// Weight of the last packet in the running average of the packet size is 1/64
+#define RX_POOL_AVERAGE_WEIGHT 64
+// At most 32 slices in a page, one bit per slice in FreeSlices
+#define RX_POOL_MAX_SHIFT      5
+
+typedef struct _tagRxPoolPage
+{
+    // in the list of pages with free slices of its class or in the list of unused pages
+    LIST_ENTRY Link;
+    LIST_ENTRY PoolLink;
+    tCompletePhysicalAddress Memory;
+    ULONG FreeSlices;
+    USHORT UsedSlices;
+    UCHAR Shift;
+} tRxPoolPage;
+
+class CRxPagePool
+{
+  public:
+    CRxPagePool();
+
+    // Slices are not smaller than MinSliceSize, the pool does not grow beyond MaxPages
+    void Initialize(PPARANDIS_ADAPTER Context, ULONG MinSliceSize, ULONG MaxPages);
+    // All the slices must be returned
+    void Destroy();
+
+    // The pool is not used when a slice smaller than a page can't hold the buffer
+    bool IsActive() const
+    {
+        return m_MaxShift > 0;
+    }
+
+    bool CanGrow() const
+    {
+        return m_NumPages < m_MaxPages;
+    }
+
+    // called at PASSIVE level without the lock, the page is passed to AddPage
+    tRxPoolPage *AllocatePage();
+    void FreePage(tRxPoolPage *Page);
+
+    void AddPage(tRxPoolPage *Page);
+    bool GetSlice(UCHAR Shift, tRxPoolSlice &Slice);
+    void PutSlice(const tRxPoolSlice &Slice);
+    // Takes again the given slice returned by PutSlice, nothing else could take it in between
+    void ReclaimSlice(const tRxPoolSlice &Slice);
+    void GetSliceMemory(const tRxPoolSlice &Slice, tCompletePhysicalAddress &Memory) const;
+
+    void UpdateAverage(ULONG PacketLength)
+    {
+        m_ScaledAverage = m_ScaledAverage - m_ScaledAverage / RX_POOL_AVERAGE_WEIGHT + PacketLength;
+    }
+    // Class of the buffers to post, updated by UpdateTargetShift after a batch of packets
+    UCHAR TargetShift() const
+    {
+        return m_TargetShift;
+    }
+    void UpdateTargetShift();
+
+  private:
+    void CarvePage(tRxPoolPage *Page, UCHAR Shift);
+    void TakeSlice(tRxPoolPage *Page, UCHAR Index);
+
+    PPARANDIS_ADAPTER m_Context = NULL;
+    // pages of each class with free slices
+    LIST_ENTRY m_PartialPages[RX_POOL_MAX_SHIFT + 1];
+    // pages without used slices
+    LIST_ENTRY m_UnusedPages;
+    LIST_ENTRY m_AllPages;
+    ULONG m_NumPages = 0;
+    ULONG m_MaxPages = 0;
+    UCHAR m_MaxShift = 0;
+    UCHAR m_TargetShift = 0;
+    // average packet size multiplied by RX_POOL_AVERAGE_WEIGHT
+    ULONG m_ScaledAverage = 0;
+};
@@ -0,0 +1,236 @@
+/*
+ * This file contains the definitions of the packet parsing and SW checksum
+ * offload (sw_offload.cpp)
+ *
+ * Copyright (c) 2008-2017 Red Hat, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#pragma once
+
+// The packet parsing and checksum code does not depend on NDIS. Outside of the kernel it is
+// built with the basic Windows types only, the few NDIS definitions it uses are provided here,
+// so host tools (DebugTools/PacketParser) can run and measure the same code the driver does.
+
+#if !defined(_KERNEL_MODE)
+typedef LARGE_INTEGER PHYSICAL_ADDRESS;
+
+#if !defined(RtlOffsetToPointer)
+#define RtlOffsetToPointer(Base, Offset) ((PCHAR)(((PCHAR)(Base)) + ((ULONG_PTR)(Offset))))
+#endif
+#if !defined(RtlPointerToOffset)
+#define RtlPointerToOffset(Base, Pointer) ((ULONG)(((PCHAR)(Pointer)) - ((PCHAR)(Base))))
+#endif
+#if !defined(RtlUshortByteSwap)
+#define RtlUshortByteSwap(x) _byteswap_ushort((USHORT)(x))
+#endif
+#define NdisMoveMemory(Destination, Source, Length) RtlCopyMemory(Destination, Source, Length)
+#define NdisZeroMemory(Destination, Length)         RtlZeroMemory(Destination, Length)
+#define ETH_IS_BROADCAST(Address)                                                                                      \
+    ((((PUCHAR)(Address))[0] & ((PUCHAR)(Address))[1] & ((PUCHAR)(Address))[2] & ((PUCHAR)(Address))[3] &              \
+      ((PUCHAR)(Address))[4] & ((PUCHAR)(Address))[5]) == (UCHAR)0xFF)
+#define ETH_IS_MULTICAST(Address) (BOOLEAN)(((PUCHAR)(Address))[0] & ((UCHAR)0x01))
+#define NETKVM_ASSERT(x)
+#if !defined(DPrintf)
+#define DPrintf(Level, Fmt, ...)
+#endif
+#endif
+
+#include "ethernetutils.h"
+
+typedef struct _tagCompletePhysicalAddress
+{
+    PHYSICAL_ADDRESS Physical;
+    PVOID Virtual;
+    ULONG size;
+} tCompletePhysicalAddress;
+
+typedef struct _tagNET_PACKET_INFO
+{
+    struct
+    {
+        int isBroadcast : 1;
+        int isMulticast : 1;
+        int isUnicast : 1;
+        int hasVlanHeader : 1;
+        int isIP4 : 1;
+        int isIP6 : 1;
+        int isTCP : 1;
+        int isUDP : 1;
+        int isFragment : 1;
+    };
+
+    struct
+    {
+        UINT32 UserPriority : 3;
+        UINT32 VlanId : 12;
+    } Vlan;
+
+#if PARANDIS_SUPPORT_RSS
+    struct
+    {
+        ULONG Value;
+        ULONG Type;
+        ULONG Function;
+    } RSSHash;
+#endif
+
+    ULONG L2HdrLen;
+    ULONG L3HdrLen;
+    ULONG L2PayloadLen;
+    ULONG ip6HomeAddrOffset;
+    ULONG ip6DestAddrOffset;
+
+    PUCHAR ethDestAddr;
+
+    PVOID headersBuffer;
+    ULONG dataLength;
+} NET_PACKET_INFO, *PNET_PACKET_INFO;
+
+
+typedef enum class _tagppResult
+{
+    ppresNotTested = 0,
+    ppresNotIP = 1,
+    ppresIPV4 = 2,
+    ppresIPV6 = 3,
+    ppresIPTooShort = 1,
+    ppresPCSOK = 1,
+    ppresCSOK = 2,
+    ppresCSBad = 3,
+    ppresXxpOther = 1,
+    ppresXxpKnown = 2,
+    ppresXxpIncomplete = 3,
+    ppresIsTCP = 0,
+    ppresIsUDP = 1,
+} ppResult;
+
+inline bool operator==(ULONG a, ppResult b)
+{
+    return a == static_cast<ULONG>(b);
+}
+
+inline bool operator!=(ULONG a, ppResult b)
+{
+    return a != static_cast<ULONG>(b);
+}
+
+typedef union _tagTcpIpPacketParsingResult {
+    struct
+    {
+        /* 0 - not tested, 1 - not IP, 2 - IPV4, 3 - IPV6 */
+        ULONG ipStatus : 2;
+        /* 0 - not tested, 1 - n/a, 2 - CS, 3 - bad */
+        ULONG ipCheckSum : 2;
+        /* 0 - not tested, 1 - PCS, 2 - CS, 3 - bad */
+        ULONG xxpCheckSum : 2;
+        /* 0 - not tested, 1 - other, 2 - known(contains basic TCP or UDP header), 3 - known incomplete */
+        ULONG xxpStatus : 2;
+        /* 1 - contains complete payload */
+        ULONG xxpFull : 1;
+        ULONG TcpUdp : 1;
+        ULONG fixedIpCS : 1;
+        ULONG fixedXxpCS : 1;
+        ULONG IsFragment : 1;
+        ULONG reserved : 3;
+        ULONG ipHeaderSize : 8;
+        ULONG XxpIpHeaderSize : 8;
+    };
+    ULONG value;
+} tTcpIpPacketParsingResult;
+
+typedef enum class _tagPacketOffloadRequest
+{
+    pcrIpChecksum = (1 << 0),
+    pcrTcpV4Checksum = (1 << 1),
+    pcrUdpV4Checksum = (1 << 2),
+    pcrTcpV6Checksum = (1 << 3),
+    pcrUdpV6Checksum = (1 << 4),
+    pcrTcpChecksum = (pcrTcpV4Checksum | pcrTcpV6Checksum),
+    pcrUdpChecksum = (pcrUdpV4Checksum | pcrUdpV6Checksum),
+    pcrAnyChecksum = (pcrIpChecksum | pcrTcpV4Checksum | pcrUdpV4Checksum | pcrTcpV6Checksum | pcrUdpV6Checksum),
+    pcrLSO = (1 << 5),
+    pcrIsIP = (1 << 6),
+    pcrFixIPChecksum = (1 << 7),
+    pcrFixPHChecksum = (1 << 8),
+    pcrFixTcpV4Checksum = (1 << 9),
+    pcrFixUdpV4Checksum = (1 << 10),
+    pcrFixTcpV6Checksum = (1 << 11),
+    pcrFixUdpV6Checksum = (1 << 12),
+    pcrFixXxpChecksum = (pcrFixTcpV4Checksum | pcrFixUdpV4Checksum | pcrFixTcpV6Checksum | pcrFixUdpV6Checksum),
+    pcrPriorityTag = (1 << 13),
+    pcrNoIndirect = (1 << 14)
+} tPacketOffloadRequest;
+
+inline ULONG operator|(tPacketOffloadRequest a, tPacketOffloadRequest b)
+{
+    return static_cast<ULONG>(a) | static_cast<ULONG>(b);
+}
+
+inline ULONG operator|(ULONG a, tPacketOffloadRequest b)
+{
+    return a | static_cast<ULONG>(b);
+}
+
+inline ULONG &operator|=(ULONG &a, tPacketOffloadRequest b)
+{
+    return a |= static_cast<ULONG>(b);
+}
+
+inline ULONG operator&(tPacketOffloadRequest a, tPacketOffloadRequest b)
+{
+    return static_cast<ULONG>(a) & static_cast<ULONG>(b);
+}
+
+inline ULONG operator&(ULONG a, tPacketOffloadRequest b)
+{
+    return a & static_cast<ULONG>(b);
+}
+
+tTcpIpPacketParsingResult ParaNdis_CheckSumVerify(tCompletePhysicalAddress *pDataPages,
+                                                  ULONG ulDataLength,
+                                                  ULONG ulStartOffset,
+                                                  ULONG flags,
+                                                  BOOLEAN verifyLength,
+                                                  LPCSTR caller);
+
+static __inline tTcpIpPacketParsingResult ParaNdis_CheckSumVerifyFlat(PVOID pBuffer,
+                                                                      ULONG ulDataLength,
+                                                                      ULONG flags,
+                                                                      BOOLEAN verifyLength,
+                                                                      LPCSTR caller)
+{
+    tCompletePhysicalAddress SGBuffer;
+    SGBuffer.Virtual = pBuffer;
+    SGBuffer.size = ulDataLength;
+    return ParaNdis_CheckSumVerify(&SGBuffer, ulDataLength, 0, flags, verifyLength, caller);
+}
+
+USHORT CheckSumCalculator(PVOID buffer, ULONG len);
+
+tTcpIpPacketParsingResult ParaNdis_ReviewIPPacket(PVOID buffer, ULONG size, BOOLEAN verityLength, LPCSTR caller);
+
+BOOLEAN ParaNdis_AnalyzeReceivedPacket(PVOID headersBuffer, ULONG dataLength, PNET_PACKET_INFO packetInfo);
+ULONG ParaNdis_StripVlanHeaderMoveHead(PNET_PACKET_INFO packetInfo);
+VOID ParaNdis_PadPacketToMinimalLength(PNET_PACKET_INFO packetInfo);
@@ -59,6 +59,7 @@ class CNB : public CNdisAllocatableViaHelper<CNB>
     }
 
     bool ScheduleBuildSGListForTx();
+    bool ScheduleInlineForTx();
 
     void MappingDone(PSCATTER_GATHER_LIST SGL);
     void ReleaseResources();
@@ -70,13 +71,23 @@ class CNB : public CNdisAllocatableViaHelper<CNB>
 
     ULONG GetSGLLength() const
     {
-        return m_SGL->NumberOfElements;
+        return m_SGL != nullptr ? m_SGL->NumberOfElements : 0;
     }
 
     NBMappingStatus BindToDescriptor(CTXDescriptor &Descriptor);
     void Report(int level, bool Success);
     void ReturnPages();
 
+    // called under the TX lock when the NB is submitted to the virtqueue
+    void SetSubmitTime(ULONG64 Time)
+    {
+        m_SubmitTime = Time;
+    }
+    ULONG64 GetSubmitTime() const
+    {
+        return m_SubmitTime;
+    }
+
   private:
     ULONG Copy(PVOID Dst, ULONG Length) const;
     static ULONG CopyFromMdlChain(PVOID Dst, ULONG Length, PMDL &Source, ULONG &Offset);
@@ -96,12 +107,16 @@ class CNB : public CNdisAllocatableViaHelper<CNB>
     void PopulateIPLength(IPHeader *IpHeader, USHORT IpLength) const;
     NBMappingStatus MapCopyDataToVirtioSGL(CTXDescriptor &Descriptor) const;
     NBMappingStatus AllocateAndFillCopySGL(ULONG ParsedHeadersLength);
+    NBMappingStatus FillDescriptorInline(CTXDescriptor &Descriptor, ULONG ParsedHeadersLength);
 
     PNET_BUFFER m_NB;
     CNBL *m_ParentNBL;
     PPARANDIS_ADAPTER m_Context;
     PSCATTER_GATHER_LIST m_SGL = nullptr;
     CExtendedNBStorage *m_ExtraNBStorage = nullptr;
+    // the frame is copied to the headers area of the descriptor, no SG list is allocated
+    bool m_Inline = false;
+    ULONG64 m_SubmitTime = 0;
 
     CNB(const CNB &) = delete;
     CNB &operator=(const CNB &) = delete;
@@ -346,6 +361,11 @@ class CNBL : public CNdisAllocatableViaHelper<CNBL>, public CRefCountingObject,
     {
         return m_ParentTXPath;
     }
+    // when the send handler received the NBL, see ParaNdis-Latency.h
+    ULONG64 GetSendTime() const
+    {
+        return m_SendTime;
+    }
 #if NBL_MAINTAIN_HISTORY
     void AddHistory(LPCSTR Func,
                     LPCSTR Title,
@@ -407,6 +427,7 @@ class CNBL : public CNdisAllocatableViaHelper<CNBL>, public CRefCountingObject,
     ULONG m_MaxDataLength = 0;
     ULONG m_TransferSize = 0;
     ULONG m_LogIndex;
+    ULONG64 m_SendTime;
 
     UINT16 m_TCI = 0;
 
@@ -482,6 +503,45 @@ class CParaNdisTX : public CParaNdisTemplatePath<CTXVirtQueue>, public CNdisAllo
     void ReturnPages(CExtendedNBStorage *extraNBStorage);
     void CheckStuckPackets(ULONG GraceTimeMillies);
 
+    // NBLs queued on the path by the send handler when the TX steering is enabled,
+    // returns the count including this one
+    LONG QueueNBL()
+    {
+        return InterlockedIncrement(&m_QueuedNBLs);
+    }
+    // All the NBLs of the send handler up to the given count are completed
+    bool CompletedUpTo(LONG Queued) const
+    {
+        return (LONG)(m_CompletedNBLs - Queued) >= 0;
+    }
+
+    // How the send handler assigned the NBLs to this path, see CTxSteering
+    struct
+    {
+        ULONG ByHash;
+        ULONG ByCpu;
+        ULONG ByFlow;
+    } SteeringStatistics = {};
+
+    // Latency histograms of the path, see ParaNdis-Latency.h
+    struct
+    {
+        // updated under the TX lock
+        tLatencyHistogram Queue;
+        // updated under the waiting list lock
+        tLatencyHistogram Complete;
+    } Latency = {};
+    // updated by the virtqueue under the TX lock
+    tLatencyHistogram &DeviceLatency()
+    {
+        return m_VirtQueue.DeviceLatency();
+    }
+    void ResetLatency()
+    {
+        NdisZeroMemory(&Latency, sizeof(Latency));
+        NdisZeroMemory(&DeviceLatency(), sizeof(tLatencyHistogram));
+    }
+
   private:
     virtual void Notify(SMNotifications message) override;
 
@@ -519,6 +579,9 @@ class CParaNdisTX : public CParaNdisTemplatePath<CTXVirtQueue>, public CNdisAllo
     // indication that DPC waits on TX lock
     CNdisRefCounter m_DpcWaiting;
 
+    LONG m_QueuedNBLs = 0;
+    LONG m_CompletedNBLs = 0;
+
     CLockFreeCNBLQueue m_SendQueue;
 
     CRawCNBLList m_WaitingList;
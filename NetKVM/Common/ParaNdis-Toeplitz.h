@@ -0,0 +1,64 @@
+#pragma once
+
+// Toeplitz hash function of RSS, see "Verifying the RSS Hash Calculation" in the WDK documentation.
+// The definition slides a 32-bit window over the secret key, one input bit at a time. Instead of
+// that the key is expanded once into a table holding, for every input byte position and every
+// byte value, the XOR of the windows the byte selects, so the hash costs one lookup per input byte.
+// On CPUs with carry-less multiplication (PCLMULQDQ) inputs made of whole 32-bit words are hashed
+// with one multiplication per word instead.
+// The header does not depend on NDIS so the DebugTools/RSS-Toeplitz test can build it as well.
+
+#define TOEPLITZ_MAX_KEY_SIZE (40)
+// every input bit needs 32 bits of key starting at its position
+#define TOEPLITZ_MAX_INPUT_SIZE (TOEPLITZ_MAX_KEY_SIZE - sizeof(UINT32))
+
+typedef struct _tagTOEPLITZ_CHUNK
+{
+    PCHAR chunkPtr;
+    ULONG chunkLen;
+} TOEPLITZ_CHUNK, *PTOEPLITZ_CHUNK;
+
+class CToeplitzHash
+{
+  public:
+    CToeplitzHash()
+    {
+        SetKey(NULL, 0);
+    }
+
+    // Expands the key, bytes beyond KeySize are treated as zero
+    void SetKey(const CCHAR *Key, ULONG KeySize);
+
+    // The chunks are hashed as one input of at most TOEPLITZ_MAX_INPUT_SIZE bytes
+    UINT32 Hash(const TOEPLITZ_CHUNK *Chunks, ULONG NumChunks) const
+    {
+        if (m_UseClmul && WordAligned(Chunks, NumChunks))
+        {
+            return HashClmul(Chunks, NumChunks);
+        }
+        return HashTable(Chunks, NumChunks);
+    }
+
+    UINT32 HashTable(const TOEPLITZ_CHUNK *Chunks, ULONG NumChunks) const;
+    // Requires ClmulSupported() and chunk lengths that are multiples of 4
+    UINT32 HashClmul(const TOEPLITZ_CHUNK *Chunks, ULONG NumChunks) const;
+
+    static bool ClmulSupported();
+
+  private:
+    static bool WordAligned(const TOEPLITZ_CHUNK *Chunks, ULONG NumChunks)
+    {
+        ULONG lengths = 0;
+        for (ULONG i = 0; i < NumChunks; ++i)
+        {
+            lengths |= Chunks[i].chunkLen;
+        }
+        return (lengths & (sizeof(UINT32) - 1)) == 0;
+    }
+
+    // per input byte position and byte value
+    UINT32 m_Table[TOEPLITZ_MAX_INPUT_SIZE][256];
+    // per input word, the 64 key bits starting at the word in reversed bit order
+    UINT64 m_ReversedKeyWindows[TOEPLITZ_MAX_INPUT_SIZE / sizeof(UINT32)];
+    bool m_UseClmul;
+};
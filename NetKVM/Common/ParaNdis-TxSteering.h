@@ -0,0 +1,49 @@
+#pragma once
+
+// Selection of the TX path for the NBLs without an RSS hash: RSS is off, the protocol did not
+// compute the hash (many UDP senders) or a filter driver generated the traffic. Like XPS in Linux,
+// such an NBL goes to the path bundle whose DPC runs on the submitting processor, so the senders
+// do not contend on the lock of one TX path. Bundle N is bound to the processor with index N (see
+// SetupDPCTarget), the processors beyond the last bundle are spread over the bundles.
+// The packets of a flow must not be reordered when its sender moves to another processor: the
+// path of every IPv4/IPv6 flow is kept in a table indexed by a software hash of its addresses and
+// ports, with the number of NBLs queued on that path up to the last NBL of the flow. The flow
+// moves to the path of the current processor only after the old path has completed them.
+// The table is updated without a lock, the entries of two flows with the same hash are shared.
+
+#define TX_STEERING_FLOWS 256
+// Ethernet, VLAN, IPv6 with a few extension headers and the ports
+#define TX_STEERING_HEADERS_SIZE 128
+
+struct CPUPathBundle;
+
+typedef struct _tagTxSteeringFlow
+{
+    // on the path of the flow, including its last NBL
+    LONG LastQueued;
+    // index of the path bundle + 1, 0 when the entry is not used
+    ULONG Bundle;
+} tTxSteeringFlow;
+
+class CTxSteering
+{
+  public:
+    void Initialize(PPARANDIS_ADAPTER Context, bool Enable);
+
+    bool IsEnabled() const
+    {
+        return m_Enabled;
+    }
+
+    // Called by the send handler at DISPATCH for every NBL when there are several path bundles.
+    // NBLs with a hash go to the path of the RSS indirection table when QueueMap is set.
+    CPUPathBundle *SelectPath(PNET_BUFFER_LIST NBL, CPUPathBundle *const *QueueMap, ULONG HashMask);
+
+  private:
+    CPUPathBundle *LocalPath() const;
+    static bool GetFlowHash(PNET_BUFFER_LIST NBL, ULONG &Hash);
+
+    PPARANDIS_ADAPTER m_Context = NULL;
+    bool m_Enabled = false;
+    tTxSteeringFlow m_Flows[TX_STEERING_FLOWS] = {};
+};
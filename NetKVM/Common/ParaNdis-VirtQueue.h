@@ -11,6 +11,7 @@ extern "C"
 }
 
 #include "ParaNdis-Util.h"
+#include "ParaNdis-Latency.h"
 #include "virtio_net.h"
 
 class CNB;
@@ -116,18 +117,18 @@ class CTXDescriptor : public CNdisAllocatable<CTXDescriptor, 'DTHR'>
                 ULONG VirtioHeaderSize,
                 struct VirtIOBufferDescriptor *VirtioSGL,
                 ULONG VirtioSGLSize,
-                bool Indirect,
+                ULONG IndirectAreaSize,
                 bool AnyLayout)
     {
         m_MemoryBuffer.Initialize(DrvHandle);
-        // allocate 8K buffer (or 4K if indirect is not used)
-        if (!m_MemoryBuffer.Allocate(PAGE_SIZE * (Indirect ? 2 : 1)))
+        // allocate 4K for the headers followed by the indirect area, if indirect is used
+        if (!m_MemoryBuffer.Allocate(PAGE_SIZE + IndirectAreaSize))
         {
             return false;
         }
         m_VirtioSGL = VirtioSGL;
         m_VirtioSGLSize = VirtioSGLSize;
-        m_Indirect = Indirect;
+        m_Indirect = IndirectAreaSize != 0;
         m_AnyLayout = AnyLayout;
 
         // first 4K is for headers area
@@ -137,13 +138,13 @@ class CTXDescriptor : public CNdisAllocatable<CTXDescriptor, 'DTHR'>
         headers.size = PAGE_SIZE;
         m_Headers.Initialize(VirtioHeaderSize, headers);
 
-        // second 4K is for indirect area
+        // the rest is for indirect area, one or more physically contiguous pages
         if (m_Indirect)
         {
             m_IndirectArea.Physical = m_MemoryBuffer.GetPA();
             m_IndirectArea.Physical.QuadPart += PAGE_SIZE;
             m_IndirectArea.Virtual = RtlOffsetToPointer(m_MemoryBuffer.GetVA(), PAGE_SIZE);
-            m_IndirectArea.size = PAGE_SIZE;
+            m_IndirectArea.size = IndirectAreaSize;
         }
         return true;
     }
@@ -257,6 +258,22 @@ class CVirtQueue
         return virtqueue_get_buf(m_VirtQueue, len);
     }
 
+    unsigned int AddBufs(struct virtqueue_buf bufs[], unsigned int num)
+    {
+        return virtqueue_add_bufs(m_VirtQueue, bufs, num);
+    }
+
+    unsigned int GetBufs(void *data[], unsigned int len[], unsigned int num)
+    {
+        return virtqueue_get_bufs(m_VirtQueue, data, len, num);
+    }
+
+    enum
+    {
+        // number of completed buffers fetched from the ring at once
+        CompletionBatchSize = 16
+    };
+
     // TODO: Needs review / temporary
     void Kick()
     {
@@ -271,7 +288,9 @@ class CVirtQueue
 
     bool Restart()
     {
-        if (!virtqueue_enable_cb(m_VirtQueue))
+        // with coalescing the used event is placed by the policy instead of the next buffer
+        bool bEnabled = m_Coalescing ? virtqueue_enable_cb_delayed(m_VirtQueue) : virtqueue_enable_cb(m_VirtQueue);
+        if (!bEnabled)
         {
             virtqueue_disable_cb(m_VirtQueue);
             return false;
@@ -303,6 +322,41 @@ class CVirtQueue
         return m_VirtQueue != nullptr;
     }
 
+    void EnableCoalescing(enum virtqueue_coalesce_policy Policy);
+    void DisableCoalescing();
+
+    bool IsCoalescing() const
+    {
+        return m_Coalescing;
+    }
+
+    // Reports the buffers and bytes completed in response to one interrupt
+    void CoalesceSample(UINT Buffers, ULONGLONG Bytes)
+    {
+        if (m_Coalescing)
+        {
+            virtqueue_coalesce_sample(m_VirtQueue, Buffers, Bytes);
+        }
+    }
+
+    const struct virtqueue_coalesce_stats &CoalesceStats() const
+    {
+        return m_Coalesce.stats;
+    }
+
+    // Counters of the ring itself, they restart when the queue is renewed
+    void QueryStats(struct virtqueue_stats &Stats)
+    {
+        if (m_VirtQueue != nullptr)
+        {
+            virtqueue_query_stats(m_VirtQueue, &Stats);
+        }
+        else
+        {
+            Stats = {};
+        }
+    }
+
   protected:
     NDIS_HANDLE m_DrvHandle;
 
@@ -317,6 +371,9 @@ class CVirtQueue
 
     CNdisSharedMemory m_SharedMemory;
     struct virtqueue *m_VirtQueue = nullptr;
+    struct virtqueue_coalesce m_Coalesce = {};
+    bool m_Coalescing = false;
+    struct virtqueue_stats m_Stats = {};
 
     CVirtQueue(const CVirtQueue &) = delete;
     CVirtQueue &operator=(const CVirtQueue &) = delete;
@@ -368,6 +425,20 @@ class CTXVirtQueue : public CVirtQueue
     // TODO: Needs review
     void Shutdown();
 
+    // Reports the completions collected since the last call, called from the DPC
+    void ReportCompletions()
+    {
+        CoalesceSample(m_CompletedBuffers, m_CompletedBytes);
+        m_CompletedBuffers = 0;
+        m_CompletedBytes = 0;
+    }
+
+    // from the submission of the packets until the device returns them
+    tLatencyHistogram &DeviceLatency()
+    {
+        return m_DeviceLatency;
+    }
+
   private:
     UINT ReleaseTransmitBuffers(CRawCNBList &listDone);
     void ReleaseOneBuffer(CTXDescriptor *TXDescriptor, CRawCNBList &listDone);
@@ -379,6 +450,11 @@ class CTXVirtQueue : public CVirtQueue
     void KickQueueOnOverflow();
     void UpdateTXStats(const CNB &NB, CTXDescriptor &Descriptor);
 
+    // completions since the last report to the coalescing policy
+    UINT m_CompletedBuffers = 0;
+    ULONGLONG m_CompletedBytes = 0;
+    tLatencyHistogram m_DeviceLatency = {};
+
     CNdisList<CTXDescriptor, CRawAccess, CCountingObject> m_Descriptors;
     CNdisList<CTXDescriptor, CRawAccess, CNonCountingObject> m_DescriptorsInUse;
     ULONGLONG m_LastTxCompletionTimestamp = 0;
@@ -391,6 +467,8 @@ class CTXVirtQueue : public CVirtQueue
 
     struct VirtIOBufferDescriptor *m_SGTable = nullptr;
     ULONG m_SGTableCapacity = 0;
+    // size of the indirect table of each descriptor, 0 if indirect is not used
+    ULONG m_IndirectAreaSize = 0;
     bool m_Killed = false;
 
     // TODO Temporary, must go way
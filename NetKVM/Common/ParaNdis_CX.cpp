@@ -6,13 +6,13 @@
 #include "ParaNdis_CX.tmh"
 #endif
 
-#define LONG_CTL_TIMEOUT  500000
-#define SHORT_CTL_TIMEOUT 1000
+#define LONG_CTL_TIMEOUT 500000
 
 CParaNdisCX::CParaNdisCX(PPARANDIS_ADAPTER Context)
 {
     m_Context = Context;
     m_ControlData.Virtual = nullptr;
+    KeQueryPerformanceCounter(&m_PerfFrequency);
     KeInitializeDpc(&m_DPC, MiniportMSIInterruptCXDpc, m_Context);
 }
 
@@ -30,7 +30,9 @@ bool CParaNdisCX::Create(UINT DeviceQueueIndex)
 {
     m_queueIndex = (u16)DeviceQueueIndex;
 
-    if (!ParaNdis_InitialAllocatePhysicalMemory(m_Context, 512, &m_ControlData))
+    if (!ParaNdis_InitialAllocatePhysicalMemory(m_Context,
+                                                CX_MAX_COMMANDS_IN_FLIGHT * CX_COMMAND_SLOT_SIZE,
+                                                &m_ControlData))
     {
         DPrintf(0, "ParaNdis_InitialAllocatePhysicalMemory failed for %u", DeviceQueueIndex);
         m_ControlData.Virtual = nullptr;
@@ -44,16 +46,28 @@ bool CParaNdisCX::Create(UINT DeviceQueueIndex)
     return m_VirtQueue.Create(DeviceQueueIndex, &m_Context->IODevice, m_Context->MiniportHandle);
 }
 
+bool CParaNdisCX::CheckSize(ULONG size1, ULONG size2, ULONG replySize)
+{
+    // the reply starts at the 8-byte boundary after the result
+    return size1 + size2 + 16 + (replySize ? replySize + 8 : 0) < CX_COMMAND_SLOT_SIZE;
+}
+
 // should be called under m_Lock
-// fills the data area with command parameters
-// returns the offset of the response field
-void CParaNdisCX::FillSGArray(struct VirtIOBufferDescriptor sg[/*4*/], const CommandData &data, UINT &nOut)
+// fills the data area of the slot with command parameters
+// and remembers the offsets of the response field and the reply
+void CParaNdisCX::FillSGArray(struct VirtIOBufferDescriptor sg[/*5*/],
+                              CommandSlot &Slot,
+                              const CommandData &data,
+                              UINT &nOut,
+                              UINT &nIn)
 {
-    PUCHAR pBase = (PUCHAR)m_ControlData.Virtual;
+    ULONG slotOffset = (ULONG)(&Slot - m_Slots) * CX_COMMAND_SLOT_SIZE;
+    PUCHAR pBase = (PUCHAR)m_ControlData.Virtual + slotOffset;
     PHYSICAL_ADDRESS phBase = m_ControlData.Physical;
     ULONG offset = 0;
     nOut = 1;
 
+    phBase.QuadPart += slotOffset;
     ((virtio_net_ctrl_hdr *)pBase)->class_of_command = data.cls;
     ((virtio_net_ctrl_hdr *)pBase)->cmd = data.cmd;
     sg[0].physAddr = phBase;
@@ -84,69 +98,271 @@ void CParaNdisCX::FillSGArray(struct VirtIOBufferDescriptor sg[/*4*/], const Com
     sg[nOut].physAddr.QuadPart += offset;
     sg[nOut].length = sizeof(virtio_net_ctrl_ack);
     *(virtio_net_ctrl_ack *)(pBase + offset) = VIRTIO_NET_ERR;
-    m_ResultOffset = offset;
+    Slot.ResultOffset = slotOffset + offset;
+    nIn = 1;
+    Slot.ReplySize = data.replySize;
+    Slot.ReplyLength = 0;
+    if (data.replySize)
+    {
+        offset = (offset + sizeof(virtio_net_ctrl_ack) + 7) & ~7;
+        sg[nOut + nIn].physAddr = phBase;
+        sg[nOut + nIn].physAddr.QuadPart += offset;
+        sg[nOut + nIn].length = data.replySize;
+        Slot.ReplyOffset = slotOffset + offset;
+        nIn++;
+    }
 }
 
-// should be called under m_Lock
-// returns false it there is no response at all
-// if there is some response returns true and
-// sets Code to received response code if possible
-bool CParaNdisCX::GetResponse(UCHAR &Code, int MicrosecondsToWait, int LogLevel)
+// called under m_Lock
+CParaNdisCX::CommandSlot *CParaNdisCX::FindFreeSlot()
 {
-    PUCHAR pBase = (PUCHAR)m_ControlData.Virtual;
-    UINT len = 0;
-    auto ctl = (virtio_net_ctrl_hdr *)pBase;
-    UCHAR cls = ctl->class_of_command;
-    UCHAR cmd = ctl->cmd;
-    void *p = NULL;
-    int i = 0;
-
-    while (ReadyForControls() && i++ <= MicrosecondsToWait)
-    {
-        UINT interval = 1;
-        p = m_VirtQueue.GetBuf(&len);
-        if (p)
+    for (ULONG i = 0; i < CX_MAX_COMMANDS_IN_FLIGHT; ++i)
+    {
+        if (!m_Slots[i].InUse)
         {
-            break;
+            return &m_Slots[i];
         }
-        NdisStallExecution(interval);
     }
-    if (!p)
+    return nullptr;
+}
+
+// called under m_Lock
+// places the command in a free slot and in the queue
+// returns false if the device can't take it, Slot is
+// nullptr if there is no free slot
+bool CParaNdisCX::Submit(const CommandData &data, bool Waited, CommandSlot *&Slot)
+{
+    struct VirtIOBufferDescriptor sg[5];
+    UINT nOut = 0, nIn = 0;
+
+    Slot = FindFreeSlot();
+    if (!Slot)
     {
-        // timed out
-        DPrintf(0, "ERROR: cmd %d.%d timed out", cls, cmd);
-        m_Context->extraStatistics.ctrlTimedOut += m_PendingCommand.Set();
-        return false;
+        return true;
+    }
+
+    FillSGArray(sg, *Slot, data, nOut, nIn);
+
+    m_Context->extraStatistics.ctrlCommands++;
+
+    m_Context->m_CxStateMachine.RegisterOutstandingItem();
+    bool bOK = 0 <= m_VirtQueue.AddBuf(sg, nOut, nIn, Slot, NULL, 0);
+    if (bOK)
+    {
+        Slot->InUse = true;
+        Slot->Waited = Waited;
+        Slot->Done = false;
+        Slot->ForOid = data.forOid;
+        Slot->Result = VIRTIO_NET_ERR;
+        Slot->cls = data.cls;
+        Slot->cmd = data.cmd;
+        Slot->logLevel = data.logLevel;
+        Slot->ReplyHandler = data.replyHandler;
+        Slot->ReplyContext = data.replyContext;
+        Slot->SubmitTime = KeQueryPerformanceCounter(NULL);
+        m_VirtQueue.Kick();
+    }
+    else
+    {
+        DPrintf(0, "ERROR: add_buf failed");
+        m_Context->extraStatistics.ctrlFailed++;
+        Slot = nullptr;
+    }
+    m_Context->m_CxStateMachine.UnregisterOutstandingItem();
+    return bOK;
+}
+
+// called under m_Lock
+// moves the backlog to the free slots, keeping the order
+void CParaNdisCX::SubmitBacklog(UINT MaxLoops)
+{
+    UINT n = 1;
+    while (!m_CommandQueue.IsEmpty() && FindFreeSlot() && n++ <= MaxLoops)
+    {
+        CQueuedCommand *e = m_CommandQueue.Pop();
+        CommandSlot *slot;
+        if (!Submit(e->Data(), false, slot))
+        {
+            DropCommand(e->Data());
+        }
+        CQueuedCommand::Destroy(e, m_Context->MiniportHandle);
+    }
+}
+
+// called under m_Lock
+void CParaNdisCX::ProcessCompletions()
+{
+    void *cookies[CVirtQueue::CompletionBatchSize];
+    unsigned int lengths[CVirtQueue::CompletionBatchSize];
+    unsigned int n;
+
+    do
+    {
+        n = m_VirtQueue.GetBufs(cookies, lengths, ARRAYSIZE(cookies));
+        for (unsigned int i = 0; i < n; ++i)
+        {
+            CompleteCommand(*(CommandSlot *)cookies[i], lengths[i]);
+        }
+    } while (n == ARRAYSIZE(cookies));
+}
+
+// called under m_Lock
+void CParaNdisCX::CompleteCommand(CommandSlot &Slot, UINT Length)
+{
+    LARGE_INTEGER now = KeQueryPerformanceCounter(NULL);
+    ULONGLONG usec = (ULONGLONG)(now.QuadPart - Slot.SubmitTime.QuadPart) * 1000000 / m_PerfFrequency.QuadPart;
+    ULONG bucket = 0;
+    UCHAR Code;
+
+    while (bucket < CX_LATENCY_BUCKETS - 1 && usec >= (16ULL << bucket))
+    {
+        bucket++;
     }
-    if (len == sizeof(virtio_net_ctrl_ack))
+    m_LatencyHistogram[bucket]++;
+
+    if (Length >= sizeof(virtio_net_ctrl_ack) && Length - sizeof(virtio_net_ctrl_ack) <= Slot.ReplySize)
     {
         // the response status is probably OK or ERR
-        Code = *(virtio_net_ctrl_ack *)(pBase + m_ResultOffset);
+        Code = *(virtio_net_ctrl_ack *)((PUCHAR)m_ControlData.Virtual + Slot.ResultOffset);
+        Slot.ReplyLength = Length - sizeof(virtio_net_ctrl_ack);
         m_Context->extraStatistics.ctrlFailed += Code != VIRTIO_NET_OK;
         switch (Code)
         {
             case VIRTIO_NET_OK:
-                DPrintf(LogLevel, "%d.%d finished OK", cls, cmd);
+                DPrintf(Slot.logLevel, "%d.%d finished OK in %I64u us", Slot.cls, Slot.cmd, usec);
                 break;
             case VIRTIO_NET_ERR:
-                DPrintf(0, "VIRTIO_NET_ERROR returned for %d.%d", cls, cmd);
+                DPrintf(0, "VIRTIO_NET_ERROR returned for %d.%d", Slot.cls, Slot.cmd);
                 break;
             default:
-                DPrintf(0, "unexpected ERROR %d for %d.%d", Code, cls, cmd);
+                DPrintf(0, "unexpected ERROR %d for %d.%d", Code, Slot.cls, Slot.cmd);
                 m_Context->RaiseUnrecoverableError(__FUNCTION__);
                 break;
         }
-        m_PendingCommand.Clear();
-        return true;
     }
-    // the length of response is wrong, we can't expect
-    // meaningful result, the device is probably broken
-    DPrintf(0, "ERROR: wrong len %d on %d.%d", len, cls, cmd);
-    m_Context->extraStatistics.ctrlFailed++;
-    Code = (UCHAR)(-1);
-    m_Context->RaiseUnrecoverableError(__FUNCTION__);
-    m_PendingCommand.Clear();
-    return true;
+    else
+    {
+        // the length of response is wrong, we can't expect
+        // meaningful result, the device is probably broken
+        DPrintf(0, "ERROR: wrong len %d on %d.%d", Length, Slot.cls, Slot.cmd);
+        m_Context->extraStatistics.ctrlFailed++;
+        Code = (UCHAR)(-1);
+        m_Context->RaiseUnrecoverableError(__FUNCTION__);
+    }
+    FinishCommand(Slot, Code);
+}
+
+// called under m_Lock
+void CParaNdisCX::FinishCommand(CommandSlot &Slot, UCHAR Result)
+{
+    if (Slot.ForOid)
+    {
+        OidCommandDone(Result != VIRTIO_NET_OK);
+    }
+    if (Slot.ReplyHandler)
+    {
+        PUCHAR reply = (PUCHAR)m_ControlData.Virtual + Slot.ReplyOffset;
+        Slot.ReplyHandler(Slot.ReplyContext, Result == VIRTIO_NET_OK ? reply : NULL, Slot.ReplyLength);
+    }
+    if (Slot.Waited)
+    {
+        Slot.Result = Result;
+        Slot.Done = true;
+    }
+    else
+    {
+        Slot.InUse = false;
+    }
+}
+
+// called under m_Lock
+// for a command of the backlog the device did not take
+void CParaNdisCX::DropCommand(const CommandData &Data)
+{
+    if (Data.forOid)
+    {
+        OidCommandDone(true);
+    }
+    if (Data.replyHandler)
+    {
+        Data.replyHandler(Data.replyContext, NULL, 0);
+    }
+}
+
+// called under m_Lock
+// releases the slot of a finished waited command and copies its reply
+BOOLEAN CParaNdisCX::TakeResult(CommandSlot &Slot, PVOID Reply, ULONG ReplySize, PULONG ReplyLength)
+{
+    BOOLEAN bOK = Slot.Result == VIRTIO_NET_OK;
+    if (bOK && ReplySize)
+    {
+        ULONG length = min(Slot.ReplyLength, ReplySize);
+        NdisMoveMemory(Reply, (PUCHAR)m_ControlData.Virtual + Slot.ReplyOffset, length);
+        if (ReplyLength)
+        {
+            *ReplyLength = length;
+        }
+    }
+    Slot.InUse = false;
+    return bOK;
+}
+
+// called under m_Lock
+// a failed command fails the whole OID request
+void CParaNdisCX::OidCommandDone(bool Failed)
+{
+    if (Failed && m_OidStatus == NDIS_STATUS_SUCCESS)
+    {
+        m_OidStatus = NDIS_STATUS_FAILURE;
+    }
+    if (--m_OidCommands == 0 && m_PendingOid)
+    {
+        m_CompletedOid = m_PendingOid;
+        m_PendingOid = nullptr;
+    }
+}
+
+// called under m_Lock
+PNDIS_OID_REQUEST CParaNdisCX::TakeCompletedOid()
+{
+    PNDIS_OID_REQUEST Request = m_CompletedOid;
+    m_CompletedOid = nullptr;
+    return Request;
+}
+
+void CParaNdisCX::CompleteOid(PNDIS_OID_REQUEST Request)
+{
+    if (Request)
+    {
+        DPrintf(1, "completing OID 0x%X", Request->DATA.SET_INFORMATION.Oid);
+        NdisMOidRequestComplete(m_Context->MiniportHandle, Request, m_OidStatus);
+    }
+}
+
+void CParaNdisCX::BeginOidRequest()
+{
+    CLockedContext<CNdisSpinLock> autoLock(m_Lock);
+    m_OidInProgress = true;
+    m_OidCommands = 0;
+    m_OidStatus = NDIS_STATUS_SUCCESS;
+}
+
+NDIS_STATUS CParaNdisCX::EndOidRequest(PNDIS_OID_REQUEST Request, NDIS_STATUS Status)
+{
+    CLockedContext<CNdisSpinLock> autoLock(m_Lock);
+    m_OidInProgress = false;
+    if (Status == NDIS_STATUS_SUCCESS)
+    {
+        // some commands of the request may have failed already
+        Status = m_OidStatus;
+    }
+    if (m_OidCommands == 0 || Status == NDIS_STATUS_PENDING)
+    {
+        return Status;
+    }
+    m_PendingOid = Request;
+    m_OidStatus = Status;
+    return NDIS_STATUS_PENDING;
 }
 
 BOOLEAN CParaNdisCX::SendControlMessage(UCHAR cls,
@@ -155,15 +371,22 @@ BOOLEAN CParaNdisCX::SendControlMessage(UCHAR cls,
                                         ULONG size1,
                                         PVOID buffer2,
                                         ULONG size2,
-                                        int levelIfOK)
+                                        int levelIfOK,
+                                        PVOID reply,
+                                        ULONG replySize,
+                                        PULONG replyLength)
 {
-    if (m_ControlData.size <= (size1 + size2 + 16))
+    if (replyLength)
     {
-        DPrintf(0, "(buffer %d,%d) - ERROR: message too LARGE", size1, size2);
+        *replyLength = 0;
+    }
+    if (!CheckSize(size1, size2, replySize))
+    {
+        DPrintf(0, "(buffer %d,%d,%d) - ERROR: message too LARGE", size1, size2, replySize);
         m_Context->extraStatistics.ctrlFailed++;
         return FALSE;
     }
-    CommandData data;
+    CommandData data = {};
     data.cls = cls;
     data.cmd = cmd;
     data.buffer1 = buffer1;
@@ -171,84 +394,213 @@ BOOLEAN CParaNdisCX::SendControlMessage(UCHAR cls,
     data.size1 = size1;
     data.size2 = size2;
     data.logLevel = levelIfOK;
-    CLockedContext<CNdisSpinLock> autoLock(m_Lock);
-    return SendInternal(data, true);
-}
+    data.forOid = false;
+    data.replySize = replySize;
 
-// called under m_Lock
-// initial = true when called from SendControlMessage
-// initial = true when called from Maintain
-// timeout is long
-// if cvq is busy OR the list is full - queue current command
-// if possible, continue with one from the list
-// timeout is short
-// do not schedule current command and do not get it from the list
-BOOLEAN CParaNdisCX::SendInternal(const CommandData &data, bool initial)
-{
-    UCHAR result = VIRTIO_NET_ERR;
-    BOOLEAN bOK = FALSE;
-    UINT nOut = 0;
-    if (ReadyForControls())
+    CommandSlot *slot = nullptr;
+    // the completions are normally processed by the DPC, while waiting for
+    // the own result take the ones that are already there
+    for (ULONG i = 0; i <= LONG_CTL_TIMEOUT; ++i)
     {
-        struct VirtIOBufferDescriptor sg[4];
-        int logLevel = data.logLevel;
-        if (m_PendingCommand.Pending())
+        PNDIS_OID_REQUEST completedOid;
+        bool finished = false;
+        BOOLEAN bOK = FALSE;
         {
-            GetResponse(result, SHORT_CTL_TIMEOUT, 0);
-        }
-        if (initial && (m_PendingCommand.Pending() || !m_CommandQueue.IsEmpty()))
-        {
-            ScheduleCommand(data);
-        }
-        if (m_PendingCommand.Pending())
-        {
-            return FALSE;
+            CLockedContext<CNdisSpinLock> autoLock(m_Lock);
+            if (slot && slot->Done)
+            {
+                bOK = TakeResult(*slot, reply, replySize, replyLength);
+                finished = true;
+            }
+            else if (!ReadyForControls())
+            {
+                DPrintf(0, "control queue is not ready");
+                m_Context->extraStatistics.ctrlFailed++;
+                if (slot)
+                {
+                    // released by Shutdown
+                    slot->Waited = false;
+                }
+                finished = true;
+            }
+            else
+            {
+                ProcessCompletions();
+                if (slot && slot->Done)
+                {
+                    bOK = TakeResult(*slot, reply, replySize, replyLength);
+                    finished = true;
+                }
+                else if (!slot)
+                {
+                    // the queued commands go first
+                    SubmitBacklog(MAXUINT);
+                    if (m_CommandQueue.IsEmpty() && !Submit(data, true, slot))
+                    {
+                        finished = true;
+                    }
+                }
+            }
+            completedOid = TakeCompletedOid();
         }
-        if (initial && !m_CommandQueue.IsEmpty())
+        CompleteOid(completedOid);
+        if (finished)
         {
-            // retrieve first queued command
-            CQueuedCommand *e = m_CommandQueue.Pop();
-            // use the data from it
-            FillSGArray(sg, e->Data(), nOut);
-            logLevel = e->Data().logLevel;
-            CQueuedCommand::Destroy(e, m_Context->MiniportHandle);
+            return bOK;
         }
-        else
+        NdisStallExecution(1);
+    }
+
+    DPrintf(0, "ERROR: cmd %d.%d timed out", cls, cmd);
+    m_Context->extraStatistics.ctrlTimedOut++;
+    if (slot)
+    {
+        CLockedContext<CNdisSpinLock> autoLock(m_Lock);
+        // nobody waits for it anymore, the slot is released on completion
+        if (slot->Done)
         {
-            FillSGArray(sg, data, nOut);
+            slot->InUse = false;
         }
+        slot->Waited = false;
+    }
+    return FALSE;
+}
 
-        m_Context->extraStatistics.ctrlCommands++;
+BOOLEAN CParaNdisCX::PostControlMessage(UCHAR cls,
+                                        UCHAR cmd,
+                                        PVOID buffer1,
+                                        ULONG size1,
+                                        PVOID buffer2,
+                                        ULONG size2,
+                                        int levelIfOK)
+{
+    if (!CheckSize(size1, size2))
+    {
+        DPrintf(0, "(buffer %d,%d) - ERROR: message too LARGE", size1, size2);
+        m_Context->extraStatistics.ctrlFailed++;
+        return FALSE;
+    }
+    CommandData data = {};
+    data.cls = cls;
+    data.cmd = cmd;
+    data.buffer1 = buffer1;
+    data.buffer2 = buffer2;
+    data.size1 = size1;
+    data.size2 = size2;
+    data.logLevel = levelIfOK;
 
-        if (0 <= m_VirtQueue.AddBuf(sg, nOut, 1, (PVOID)1, NULL, 0))
-        {
-            ULONG timeout = initial ? LONG_CTL_TIMEOUT : SHORT_CTL_TIMEOUT;
+    return PostCommand(data, true);
+}
 
-            m_Context->m_CxStateMachine.RegisterOutstandingItem();
+BOOLEAN CParaNdisCX::PostControlQuery(UCHAR cls,
+                                      UCHAR cmd,
+                                      PVOID buffer,
+                                      ULONG size,
+                                      ULONG replySize,
+                                      tControlReplyHandler handler,
+                                      PVOID handlerContext,
+                                      int levelIfOK)
+{
+    if (!CheckSize(size, 0, replySize))
+    {
+        DPrintf(0, "(buffer %d, reply %d) - ERROR: message too LARGE", size, replySize);
+        m_Context->extraStatistics.ctrlFailed++;
+        return FALSE;
+    }
+    CommandData data = {};
+    data.cls = cls;
+    data.cmd = cmd;
+    data.buffer1 = buffer;
+    data.size1 = size;
+    data.logLevel = levelIfOK;
+    data.replySize = replySize;
+    data.replyHandler = handler;
+    data.replyContext = handlerContext;
 
-            m_VirtQueue.Kick();
+    return PostCommand(data, false);
+}
 
-            if (GetResponse(result, timeout, logLevel))
+BOOLEAN CParaNdisCX::PostCommand(CommandData &data, bool MayBelongToOid)
+{
+    PNDIS_OID_REQUEST completedOid;
+    BOOLEAN bOK = FALSE;
+    {
+        CLockedContext<CNdisSpinLock> autoLock(m_Lock);
+        data.forOid = MayBelongToOid && m_OidInProgress;
+        if (ReadyForControls())
+        {
+            CommandSlot *slot = nullptr;
+            ProcessCompletions();
+            SubmitBacklog(MAXUINT);
+            if (m_CommandQueue.IsEmpty())
+            {
+                bOK = Submit(data, false, slot) && (slot || ScheduleCommand(data));
+            }
+            else
             {
-                // OK/error/invalid
-                bOK = result == VIRTIO_NET_OK;
+                bOK = ScheduleCommand(data);
+            }
+            if (bOK && data.forOid)
+            {
+                m_OidCommands++;
             }
-            // we just keep the previous behavior at the moment
-            // although the command is inside and can't be aborted
-            m_Context->m_CxStateMachine.UnregisterOutstandingItem();
         }
         else
         {
-            DPrintf(0, "ERROR: add_buf failed");
+            DPrintf(0, "control queue is not ready");
             m_Context->extraStatistics.ctrlFailed++;
         }
+        completedOid = TakeCompletedOid();
     }
-    else
+    CompleteOid(completedOid);
+    return bOK;
+}
+
+// fails the commands that are still in the device, the
+// backlog is kept and sent after the queue is renewed
+void CParaNdisCX::Shutdown()
+{
+    PNDIS_OID_REQUEST completedOid;
     {
-        DPrintf(0, "control queue is not ready");
-        m_Context->extraStatistics.ctrlFailed++;
+        CLockedContext<CNdisSpinLock> autoLock(m_Lock);
+        m_VirtQueue.Shutdown();
+        for (ULONG i = 0; i < CX_MAX_COMMANDS_IN_FLIGHT; ++i)
+        {
+            if (m_Slots[i].InUse && !m_Slots[i].Done)
+            {
+                DPrintf(0, "cmd %d.%d dropped", m_Slots[i].cls, m_Slots[i].cmd);
+                m_Context->extraStatistics.ctrlFailed++;
+                FinishCommand(m_Slots[i], VIRTIO_NET_ERR);
+            }
+        }
+        completedOid = TakeCompletedOid();
     }
-    return bOK;
+    CompleteOid(completedOid);
+}
+
+void CParaNdisCX::PrintStatistics()
+{
+    ULONG histogram[CX_LATENCY_BUCKETS];
+    {
+        CLockedContext<CNdisSpinLock> autoLock(m_Lock);
+        NdisMoveMemory(histogram, m_LatencyHistogram, sizeof(histogram));
+    }
+    DPrintf(0,
+            "[Diag!] CX latency <16us %d, <32us %d, <64us %d, <128us %d, <256us %d, <512us %d",
+            histogram[0],
+            histogram[1],
+            histogram[2],
+            histogram[3],
+            histogram[4],
+            histogram[5]);
+    DPrintf(0,
+            "[Diag!] CX latency <1ms %d, <2ms %d, <4ms %d, <8ms %d, <16ms %d, longer %d",
+            histogram[6],
+            histogram[7],
+            histogram[8],
+            histogram[9],
+            histogram[10],
+            histogram[11]);
 }
 
 NDIS_STATUS CParaNdisCX::SetupMessageIndex(u16 vector)
@@ -308,7 +660,7 @@ bool CParaNdisCX::ScheduleCommand(const CommandData &Data)
     if (e && e->Create(Data))
     {
         m_CommandQueue.PushBack(e);
-        DPrintf(0, "command %d.%d scheduled", Data.cls, Data.cmd);
+        DPrintf(5, "command %d.%d scheduled", Data.cls, Data.cmd);
         return true;
     }
     if (e)
@@ -319,26 +671,23 @@ bool CParaNdisCX::ScheduleCommand(const CommandData &Data)
     return false;
 }
 
-// to be called from CX DRPC
-// check pending command and submit the
-// next one if possible
+// to be called from CX DPC
+// processes the completed commands and submits
+// the queued ones to the freed slots
 void CParaNdisCX::Maintain(UINT MaxLoops)
 {
-    CLockedContext<CNdisSpinLock> autoLock(m_Lock);
-    UCHAR result = VIRTIO_NET_ERR;
-    if (!m_PendingCommand.Pending() || GetResponse(result, SHORT_CTL_TIMEOUT, 0))
+    PNDIS_OID_REQUEST completedOid;
     {
-        UINT n = 1;
-        while (!m_CommandQueue.IsEmpty() && n++ <= MaxLoops)
+        CLockedContext<CNdisSpinLock> autoLock(m_Lock);
+        if (ReadyForControls())
         {
-            CQueuedCommand *e = m_CommandQueue.Pop();
-            SendInternal(e->Data(), false);
-            CQueuedCommand::Destroy(e, m_Context->MiniportHandle);
-            if (m_PendingCommand.Pending())
+            do
             {
-                break;
-            }
+                ProcessCompletions();
+                SubmitBacklog(MaxLoops);
+            } while (!m_VirtQueue.Restart());
         }
+        completedOid = TakeCompletedOid();
     }
-    m_VirtQueue.Restart();
+    CompleteOid(completedOid);
 }
@@ -103,6 +103,7 @@ typedef struct _tagConfigurationEntries
 #if PARANDIS_SUPPORT_RSC
     tConfigurationEntry RSCIPv4Supported;
     tConfigurationEntry RSCIPv6Supported;
+    tConfigurationEntry SoftwareRSC;
 #endif
 #if PARANDIS_SUPPORT_USO
     tConfigurationEntry USOv4Supported;
@@ -110,7 +111,18 @@ typedef struct _tagConfigurationEntries
 #endif
     tConfigurationEntry MinRxBufferPercent;
     tConfigurationEntry PollMode;
+    tConfigurationEntry PollBusyUsecs;
     tConfigurationEntry MergeableBuffers;
+    tConfigurationEntry RxPagePool;
+    tConfigurationEntry TxSteering;
+    tConfigurationEntry InterruptModeration;
+    tConfigurationEntry MaxTxFragments;
+    tConfigurationEntry TxInlineThreshold;
+    tConfigurationEntry CoalesceRxUsecs;
+    tConfigurationEntry CoalesceRxFrames;
+    tConfigurationEntry CoalesceTxUsecs;
+    tConfigurationEntry CoalesceTxFrames;
+    tConfigurationEntry DeviceStatsPeriod;
 } tConfigurationEntries;
 
 // clang-format off
@@ -146,6 +158,7 @@ static const tConfigurationEntries defaultConfiguration =
 #if PARANDIS_SUPPORT_RSC
     { "*RscIPv4", 1, 0, 1},
     { "*RscIPv6", 1, 0, 1},
+    { "SoftwareRsc", 1, 0, 1},
 #endif
 #if PARANDIS_SUPPORT_USO
     { "*UsoIPv4", 1, 0, 1},
@@ -153,7 +166,18 @@ static const tConfigurationEntries defaultConfiguration =
 #endif
     { "MinRxBufferPercent", PARANDIS_MIN_RX_BUFFER_PERCENT_DEFAULT, 0, 100},
     { "*NdisPoll", 0, 0, 1},
+    { "PollBusyUsecs", 0, 0, 1000},
     { "MergeableBuffers", 0, 0, 1},
+    { "RxPagePool", 1, 0, 1},
+    { "TxSteering", 1, 0, 1},
+    { "*InterruptModeration", 0, 0, 1},
+    { "MaxTxFragments", MAX_FRAGMENTS_IN_ONE_NB, 16, 1024},
+    { "TxInlineThreshold", PARANDIS_TX_INLINE_THRESHOLD_DEFAULT, 0, 1514},
+    { "CoalesceRxUsecs", 16, 0, 1000},
+    { "CoalesceRxFrames", 32, 0, 1024},
+    { "CoalesceTxUsecs", 64, 0, 1000},
+    { "CoalesceTxFrames", 64, 0, 1024},
+    { "DeviceStatsPeriod", DEVICE_STATS_PERIOD_DEFAULT, 0, DEVICE_STATS_PERIOD_MAX},
 };
 
 static void ParaNdis_ResetVirtIONetDevice(PARANDIS_ADAPTER *pContext)
@@ -283,6 +307,7 @@ static bool ReadNicConfiguration(PARANDIS_ADAPTER *pContext, PUCHAR pNewMACAddre
 #if PARANDIS_SUPPORT_RSC
             GetConfigurationEntry(cfg, &pConfiguration->RSCIPv4Supported);
             GetConfigurationEntry(cfg, &pConfiguration->RSCIPv6Supported);
+            GetConfigurationEntry(cfg, &pConfiguration->SoftwareRSC);
 #endif
 #if PARANDIS_SUPPORT_USO
             GetConfigurationEntry(cfg, &pConfiguration->USOv4Supported);
@@ -290,7 +315,18 @@ static bool ReadNicConfiguration(PARANDIS_ADAPTER *pContext, PUCHAR pNewMACAddre
 #endif
             GetConfigurationEntry(cfg, &pConfiguration->MinRxBufferPercent);
             GetConfigurationEntry(cfg, &pConfiguration->PollMode);
+            GetConfigurationEntry(cfg, &pConfiguration->PollBusyUsecs);
             GetConfigurationEntry(cfg, &pConfiguration->MergeableBuffers);
+            GetConfigurationEntry(cfg, &pConfiguration->RxPagePool);
+            GetConfigurationEntry(cfg, &pConfiguration->TxSteering);
+            GetConfigurationEntry(cfg, &pConfiguration->InterruptModeration);
+            GetConfigurationEntry(cfg, &pConfiguration->MaxTxFragments);
+            GetConfigurationEntry(cfg, &pConfiguration->TxInlineThreshold);
+            GetConfigurationEntry(cfg, &pConfiguration->CoalesceRxUsecs);
+            GetConfigurationEntry(cfg, &pConfiguration->CoalesceRxFrames);
+            GetConfigurationEntry(cfg, &pConfiguration->CoalesceTxUsecs);
+            GetConfigurationEntry(cfg, &pConfiguration->CoalesceTxFrames);
+            GetConfigurationEntry(cfg, &pConfiguration->DeviceStatsPeriod);
 
             bDebugPrint = pConfiguration->isLogEnabled.ulValue;
             virtioDebugLevel = pConfiguration->debugLevel.ulValue;
@@ -392,8 +428,21 @@ static bool ReadNicConfiguration(PARANDIS_ADAPTER *pContext, PUCHAR pNewMACAddre
 #if PARANDIS_SUPPORT_RSC
             pContext->RSC.bIPv4SupportedSW = (UCHAR)pConfiguration->RSCIPv4Supported.ulValue;
             pContext->RSC.bIPv6SupportedSW = (UCHAR)pConfiguration->RSCIPv6Supported.ulValue;
+            pContext->RSC.bSoftwareAllowed = (UCHAR)pConfiguration->SoftwareRSC.ulValue;
 #endif
-            pContext->uMaxFragmentsInOneNB = MAX_FRAGMENTS_IN_ONE_NB;
+            // Fragments of a NB beyond this limit are copied to a contiguous buffer.
+            // With indirect descriptors the limit also sets the size of the indirect
+            // table of each TX descriptor, 256 fragments per page.
+            pContext->uMaxFragmentsInOneNB = pConfiguration->MaxTxFragments.ulValue;
+            // Frames up to this size are copied to the headers page of the TX descriptor
+            // instead of being mapped by NDIS, 0 disables the copy
+            pContext->uTxInlineThreshold = pConfiguration->TxInlineThreshold.ulValue;
+            pContext->NotifyCoalescing.RxUsecs = pConfiguration->CoalesceRxUsecs.ulValue;
+            pContext->NotifyCoalescing.RxFrames = pConfiguration->CoalesceRxFrames.ulValue;
+            pContext->NotifyCoalescing.TxUsecs = pConfiguration->CoalesceTxUsecs.ulValue;
+            pContext->NotifyCoalescing.TxFrames = pConfiguration->CoalesceTxFrames.ulValue;
+            // seconds between the queries of the device statistics, 0 does not negotiate them
+            pContext->DeviceStatistics.Initialize(pContext, pConfiguration->DeviceStatsPeriod.ulValue);
 #if PARANDIS_SUPPORT_POLL
             // Win10 build: poll mode keyword is not in the INF, poll mode is disabled by compilation
             // Win11 build: poll mode keyword is in the INF
@@ -402,10 +451,17 @@ static bool ReadNicConfiguration(PARANDIS_ADAPTER *pContext, PUCHAR pNewMACAddre
             bool bPollModeTestOnWin11 = false;
             pContext->bPollModeTry = pConfiguration->PollMode.ulValue &&
                                      CheckOSNdisVersion(6, bPollModeTestOnWin11 ? 85 : 89);
+            // keep polling that long after the rings go empty before the RX interrupt is re-armed
+            pContext->uPollBusyUsecs = pConfiguration->PollBusyUsecs.ulValue;
 #endif
             // Allow fallback to non-mergeable buffers via registry.
             // Setting MergeableBuffers=0 prevents negotiating the mergeable RX buffers feature.
             pContext->bMergeableBuffersConfigured = pConfiguration->MergeableBuffers.ulValue != 0;
+            // Mergeable buffers are carved from the per-queue page pool, otherwise each one takes a page
+            pContext->bRxPagePool = pConfiguration->RxPagePool.ulValue != 0;
+            // NBLs without an RSS hash are sent on the queue of the submitting processor, not on queue 0
+            pContext->TxSteering.Initialize(pContext, pConfiguration->TxSteering.ulValue != 0);
+            pContext->bInterruptModeration = pConfiguration->InterruptModeration.ulValue != 0;
 
             if (!pContext->bDoSupportPriority)
             {
@@ -520,13 +576,19 @@ static void DumpVirtIOFeatures(PPARANDIS_ADAPTER pContext)
         {VIRTIO_RING_F_EVENT_IDX, "VIRTIO_RING_F_EVENT_IDX"},
         {VIRTIO_F_VERSION_1, "VIRTIO_F_VERSION_1"},
         {VIRTIO_F_RING_PACKED, "VIRTIO_F_RING_PACKED"},
+        {VIRTIO_F_IN_ORDER, "VIRTIO_F_IN_ORDER"},
         {VIRTIO_F_ACCESS_PLATFORM, "VIRTIO_F_ACCESS_PLATFORM"},
         {VIRTIO_NET_F_CTRL_GUEST_OFFLOADS, "VIRTIO_NET_F_CTRL_GUEST_OFFLOADS" },
         {VIRTIO_NET_F_RSC_EXT, "VIRTIO_NET_F_RSC_EXT" },
         {VIRTIO_NET_F_RSS, "VIRTIO_NET_F_RSS" },
         {VIRTIO_NET_F_HASH_REPORT, "VIRTIO_NET_F_HASH_REPORT" },
         {VIRTIO_NET_F_STANDBY, "VIRTIO_NET_F_STANDBY" },
+        {VIRTIO_NET_F_GUEST_USO4, "VIRTIO_NET_F_GUEST_USO4" },
+        {VIRTIO_NET_F_GUEST_USO6, "VIRTIO_NET_F_GUEST_USO6" },
         {VIRTIO_NET_F_HOST_USO, "VIRTIO_NET_F_HOST_USO" },
+        {VIRTIO_NET_F_NOTF_COAL, "VIRTIO_NET_F_NOTF_COAL" },
+        {VIRTIO_NET_F_VQ_NOTF_COAL, "VIRTIO_NET_F_VQ_NOTF_COAL" },
+        {VIRTIO_NET_F_DEVICE_STATS, "VIRTIO_NET_F_DEVICE_STATS" },
     };
     UINT i;
     for (i = 0; i < sizeof(Features) / sizeof(Features[0]); ++i)
@@ -549,6 +611,12 @@ static BOOLEAN AckFeature(PPARANDIS_ADAPTER pContext, UINT64 Feature)
     return FALSE;
 }
 
+// The device moderates the interrupts when it supports notification coalescing
+static bool IsDeviceCoalescing(PARANDIS_ADAPTER *pContext)
+{
+    return pContext->bNotifyCoalescingSupported || pContext->bVQNotifyCoalescingSupported;
+}
+
 /**********************************************************
 Prints out statistics
 ***********************************************************/
@@ -570,18 +638,127 @@ static void PrintStatistics(PARANDIS_ADAPTER *pContext)
             pContext->Statistics.ifHCOutOctets,
             pContext->Statistics.ifHCInOctets);
     DPrintf(0,
-            "[Diag!] Tx frames %I64u, CSO %d, LSO %d, Min TX buffers %d, dropped Tx %d",
+            "[Diag!] Tx frames %I64u, CSO %d, LSO %d, Min TX buffers %d, dropped Tx %d, inlined Tx %d",
             totalTxFrames,
             pContext->extraStatistics.framesCSOffload,
             pContext->extraStatistics.framesLSO,
             pContext->extraStatistics.minFreeTxBuffers,
-            pContext->extraStatistics.droppedTxPackets);
+            pContext->extraStatistics.droppedTxPackets,
+            pContext->extraStatistics.inlinedTxPackets);
     DPrintf(0,
-            "[Diag!] Rx frames %I64u, Rx.Pri %d, RxHwCS.OK %d, FiltOut %d",
+            "[Diag!] Rx frames %I64u, Rx.Pri %d, RxHwCS.OK %d, FiltOut %d, SwRSC %d",
             totalRxFrames,
             pContext->extraStatistics.framesRxPriority,
             pContext->extraStatistics.framesRxCSHwOK,
-            pContext->extraStatistics.framesFilteredOut);
+            pContext->extraStatistics.framesFilteredOut,
+            pContext->extraStatistics.framesCoalescedSoftware);
+
+    if (pContext->bInterruptModeration && !IsDeviceCoalescing(pContext) && pContext->pPathBundles != nullptr)
+    {
+        ULONG64 delivered = 0, suppressed = 0, late = 0;
+        for (UINT i = 0; i < pContext->nPathBundles; i++)
+        {
+            const CPUPathBundle &bundle = pContext->pPathBundles[i];
+            if (bundle.txCreated)
+            {
+                delivered += bundle.txPath.CoalesceStats().interrupts;
+                suppressed += bundle.txPath.CoalesceStats().suppressed;
+                late += bundle.txPath.CoalesceStats().late;
+            }
+        }
+        DPrintf(0,
+                "[Diag!] Tx interrupts delivered %I64u, suppressed by moderation %I64u, late %I64u",
+                delivered,
+                suppressed,
+                late);
+    }
+
+    if (pContext->pPathBundles != nullptr)
+    {
+        struct virtqueue_stats rx = {}, tx = {};
+        for (UINT i = 0; i < pContext->nPathBundles; i++)
+        {
+            CPUPathBundle &bundle = pContext->pPathBundles[i];
+            struct virtqueue_stats stats;
+            if (bundle.rxCreated)
+            {
+                bundle.rxPath.QueryRingStats(stats);
+                rx.added += stats.added;
+                rx.used += stats.used;
+                rx.get_empty += stats.get_empty;
+                rx.kicks += stats.kicks;
+            }
+            if (bundle.txCreated)
+            {
+                bundle.txPath.QueryRingStats(stats);
+                tx.added += stats.added;
+                tx.added_indirect += stats.added_indirect;
+                tx.add_no_space += stats.add_no_space;
+                tx.sg_elements += stats.sg_elements;
+                tx.kick_checks += stats.kick_checks;
+                tx.kicks += stats.kicks;
+                tx.used += stats.used;
+                tx.occupancy_max = max(tx.occupancy_max, stats.occupancy_max);
+            }
+        }
+        DPrintf(0,
+                "[Diag!] Rx rings: added %I64u, used %I64u, empty polls %I64u, kicks %I64u",
+                rx.added,
+                rx.used,
+                rx.get_empty,
+                rx.kicks);
+        DPrintf(0,
+                "[Diag!] Tx rings: added %I64u (indirect %I64u, %I64u SG), ring full %I64u, kicks %I64u of "
+                "%I64u, used %I64u, max occupancy %u",
+                tx.added,
+                tx.added_indirect,
+                tx.sg_elements,
+                tx.add_no_space,
+                tx.kicks,
+                tx.kick_checks,
+                tx.used,
+                tx.occupancy_max);
+    }
+
+    if (pContext->DeviceStatistics.IsActive())
+    {
+        DPrintf(0,
+                "[Diag!] Device: Rx drops %I64u (overruns %I64u), Tx drops %I64u (malformed %I64u)",
+                pContext->DeviceStatistics.Total(dqcDrops, true),
+                pContext->DeviceStatistics.Total(dqcOverruns, true),
+                pContext->DeviceStatistics.Total(dqcDrops, false),
+                pContext->DeviceStatistics.Total(dqcMalformed, false));
+    }
+
+    if (pContext->bCXPathCreated)
+    {
+        pContext->CXPath.PrintStatistics();
+    }
+}
+
+/**********************************************************
+Enables or disables the interrupt moderation. When the device supports notification
+coalescing it moderates the interrupts itself (see ParaNdis_DeviceConfigureNotifyCoalescing),
+otherwise the adaptive interrupt coalescing is used on the TX queues. Never both, their delays
+would add up. The RX queues always interrupt on the next packet: nothing flushes a delayed RX
+queue, so the last packets of a burst would wait in the used ring for the next burst
+***********************************************************/
+VOID ParaNdis_SetInterruptModeration(PARANDIS_ADAPTER *pContext, BOOLEAN bEnable)
+{
+    bool bGuestModeration = bEnable && !IsDeviceCoalescing(pContext);
+
+    pContext->bInterruptModeration = bEnable;
+    for (UINT i = 0; i < pContext->nPathBundles; i++)
+    {
+        if (pContext->pPathBundles[i].rxCreated)
+        {
+            pContext->pPathBundles[i].rxPath.SetInterruptModeration(false);
+        }
+        if (pContext->pPathBundles[i].txCreated)
+        {
+            pContext->pPathBundles[i].txPath.SetInterruptModeration(bGuestModeration);
+        }
+    }
 }
 
 static VOID InitializeRSCState(PPARANDIS_ADAPTER pContext)
@@ -619,6 +796,23 @@ static VOID InitializeRSCState(PPARANDIS_ADAPTER pContext)
         pContext->RSC.bIPv6SupportedHW = virtio_is_feature_enabled(pContext->u64HostFeatures, VIRTIO_NET_F_GUEST_TSO6);
     }
 
+    // VIRTIO_NET_F_GUEST_USO4/6 are not acked: NDIS takes coalesced UDP datagrams (URO) from 6.89 on,
+    // and none of the configurations targets it yet
+
+    // Without guest TSO the device delivers MTU-sized segments only, merge them in the RX path.
+    // The checksums are validated by the device, so the guest checksum is required here as well.
+    if (pContext->RSC.bSoftwareAllowed)
+    {
+        if (pContext->RSC.bIPv4SupportedSW && !pContext->RSC.bIPv4SupportedHW)
+        {
+            pContext->RSC.bIPv4Enabled = pContext->RSC.bIPv4SupportedHW = pContext->RSC.bIPv4Software = TRUE;
+        }
+        if (pContext->RSC.bIPv6SupportedSW && !pContext->RSC.bIPv6SupportedHW)
+        {
+            pContext->RSC.bIPv6Enabled = pContext->RSC.bIPv6SupportedHW = pContext->RSC.bIPv6Software = TRUE;
+        }
+    }
+
     pContext->RSC.bHasDynamicConfig = bDynamicOffloadsPossible;
     pContext->RSC.bQemuSupported = bQemuRscSupport;
 
@@ -629,6 +823,7 @@ static VOID InitializeRSCState(PPARANDIS_ADAPTER pContext)
             pContext->RSC.bHasDynamicConfig);
 
     DPrintf(0, "Guest QEMU RSC support state: %sresent", pContext->RSC.bQemuSupported ? "P" : "Not p");
+    DPrintf(0, "Software RSC: IP4=%d, IP6=%d", pContext->RSC.bIPv4Software, pContext->RSC.bIPv6Software);
 #else
     UNREFERENCED_PARAMETER(pContext);
 #endif
@@ -846,6 +1041,7 @@ NDIS_STATUS ParaNdis_InitializeContext(PARANDIS_ADAPTER *pContext, PNDIS_RESOURC
         return NDIS_STATUS_RESOURCES;
     }
 
+    pContext->LatencyClock.Start();
     pContext->fCurrentLinkState = MediaConnectStateUnknown;
 
     if (pContext->PciResources.Init(pContext->MiniportHandle, pResourceList))
@@ -895,6 +1091,13 @@ NDIS_STATUS ParaNdis_InitializeContext(PARANDIS_ADAPTER *pContext, PNDIS_RESOURC
         pContext->bControlQueueSupported = AckFeature(pContext, VIRTIO_NET_F_CTRL_VQ);
         pContext->bGuestAnnounceSupported = pContext->bLinkDetectSupported && pContext->bControlQueueSupported &&
                                             AckFeature(pContext, VIRTIO_NET_F_GUEST_ANNOUNCE);
+        pContext->bNotifyCoalescingSupported = pContext->bControlQueueSupported &&
+                                               AckFeature(pContext, VIRTIO_NET_F_NOTF_COAL);
+        pContext->bVQNotifyCoalescingSupported = pContext->bControlQueueSupported &&
+                                                 AckFeature(pContext, VIRTIO_NET_F_VQ_NOTF_COAL);
+        pContext->bDeviceStatsSupported = pContext->bControlQueueSupported &&
+                                          pContext->DeviceStatistics.IsConfigured() &&
+                                          AckFeature(pContext, VIRTIO_NET_F_DEVICE_STATS);
         InitializeMAC(pContext, CurrentMAC);
         InitializeMaxMTUConfig(pContext);
 
@@ -908,6 +1111,8 @@ NDIS_STATUS ParaNdis_InitializeContext(PARANDIS_ADAPTER *pContext, PNDIS_RESOURC
         pContext->nVirtioHeaderSize = (pContext->bUseMergedBuffers) ? sizeof(virtio_net_hdr_mrg_rxbuf)
                                                                     : sizeof(virtio_net_hdr);
         AckFeature(pContext, VIRTIO_RING_F_EVENT_IDX);
+        // the ring code handles in-order completion, the data path does not depend on the order
+        AckFeature(pContext, VIRTIO_F_IN_ORDER);
     }
     else
     {
@@ -982,7 +1187,8 @@ NDIS_STATUS ParaNdis_InitializeContext(PARANDIS_ADAPTER *pContext, PNDIS_RESOURC
     pContext->MaxPacketSize.nMaxFullSizeOS = pContext->MaxPacketSize.nMaxDataSize + ETH_HEADER_SIZE;
     pContext->MaxPacketSize.nMaxFullSizeHwTx = pContext->MaxPacketSize.nMaxFullSizeOS;
 
-    if (pContext->RSC.bIPv4SupportedHW || pContext->RSC.bIPv6SupportedHW)
+    if ((pContext->RSC.bIPv4SupportedHW && !pContext->RSC.bIPv4Software) ||
+        (pContext->RSC.bIPv6SupportedHW && !pContext->RSC.bIPv6Software))
     {
         pContext->MaxPacketSize.nMaxDataSizeHwRx = MAX_HW_RX_PACKET_SIZE;
         pContext->MaxPacketSize.nMaxFullSizeOsRx = MAX_OS_RX_PACKET_SIZE;
@@ -991,6 +1197,11 @@ NDIS_STATUS ParaNdis_InitializeContext(PARANDIS_ADAPTER *pContext, PNDIS_RESOURC
     {
         pContext->MaxPacketSize.nMaxDataSizeHwRx = pContext->MaxPacketSize.nMaxFullSizeOS + ETH_PRIORITY_HEADER_SIZE;
         pContext->MaxPacketSize.nMaxFullSizeOsRx = pContext->MaxPacketSize.nMaxFullSizeOS;
+        // the device buffers stay MTU-sized, only the indicated frames grow
+        if (pContext->RSC.bIPv4Software || pContext->RSC.bIPv6Software)
+        {
+            pContext->MaxPacketSize.nMaxFullSizeOsRx = MAX_OS_RX_PACKET_SIZE;
+        }
     }
 
     // now, after we checked the capabilities, we can initialize current
@@ -1308,6 +1519,8 @@ static NDIS_STATUS ParaNdis_VirtIONetInit(PARANDIS_ADAPTER *pContext)
         pContext->pPathBundles[i].txCreated = true;
     }
 
+    ParaNdis_SetInterruptModeration(pContext, pContext->bInterruptModeration);
+
     if (pContext->bCXPathCreated)
     {
         pContext->pPathBundles[0].cxPath = &pContext->CXPath;
@@ -1338,15 +1551,18 @@ void ParaNdis_DeviceConfigureRSC(PARANDIS_ADAPTER *pContext)
 
 #if PARANDIS_SUPPORT_RSC
     UINT64 GuestOffloads;
+    // software coalescing does not need guest TSO from the device
+    BOOLEAN bHostTSO4 = pContext->RSC.bIPv4Enabled && !pContext->RSC.bIPv4Software;
+    BOOLEAN bHostTSO6 = pContext->RSC.bIPv6Enabled && !pContext->RSC.bIPv6Software;
 
-    GuestOffloads = 1 << VIRTIO_NET_F_GUEST_CSUM | ((pContext->RSC.bIPv4Enabled) ? (1 << VIRTIO_NET_F_GUEST_TSO4) : 0) |
-                    ((pContext->RSC.bIPv6Enabled) ? (1 << VIRTIO_NET_F_GUEST_TSO6) : 0) |
+    GuestOffloads = 1 << VIRTIO_NET_F_GUEST_CSUM | ((bHostTSO4) ? (1 << VIRTIO_NET_F_GUEST_TSO4) : 0) |
+                    ((bHostTSO6) ? (1 << VIRTIO_NET_F_GUEST_TSO6) : 0) |
                     ((pContext->RSC.bQemuSupported) ? (1LL << VIRTIO_NET_F_RSC_EXT) : 0);
 
     if (pContext->RSC.bHasDynamicConfig)
     {
         DPrintf(0, "Updating offload settings with %I64x", GuestOffloads);
-        pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_GUEST_OFFLOADS,
+        pContext->CXPath.PostControlMessage(VIRTIO_NET_CTRL_GUEST_OFFLOADS,
                                             VIRTIO_NET_CTRL_GUEST_OFFLOADS_SET,
                                             &GuestOffloads,
                                             sizeof(GuestOffloads),
@@ -1363,6 +1579,77 @@ void ParaNdis_DeviceConfigureRSC(PARANDIS_ADAPTER *pContext)
 #endif /* PARANDIS_SUPPORT_RSC */
 }
 
+/**********************************************************
+Passes the notification coalescing parameters to the device, per queue when the device
+supports it. With interrupt moderation disabled the device notifies on every buffer
+***********************************************************/
+void ParaNdis_DeviceConfigureNotifyCoalescing(PARANDIS_ADAPTER *pContext)
+{
+    struct virtio_net_ctrl_coal rx = {}, tx = {};
+
+    if (pContext->bInterruptModeration)
+    {
+        rx.max_packets = pContext->NotifyCoalescing.RxFrames;
+        rx.max_usecs = pContext->NotifyCoalescing.RxUsecs;
+        tx.max_packets = pContext->NotifyCoalescing.TxFrames;
+        tx.max_usecs = pContext->NotifyCoalescing.TxUsecs;
+    }
+
+    if (pContext->bVQNotifyCoalescingSupported)
+    {
+        for (UINT i = 0; i < pContext->nPathBundles; i++)
+        {
+            CPUPathBundle &bundle = pContext->pPathBundles[i];
+            struct virtio_net_ctrl_coal_vq cfg = {};
+
+            if (bundle.rxCreated)
+            {
+                cfg.vqn = (USHORT)bundle.rxPath.getQueueIndex();
+                cfg.coal = rx;
+                pContext->CXPath.PostControlMessage(VIRTIO_NET_CTRL_NOTF_COAL,
+                                                    VIRTIO_NET_CTRL_NOTF_COAL_VQ_SET,
+                                                    &cfg,
+                                                    sizeof(cfg),
+                                                    NULL,
+                                                    0,
+                                                    2);
+            }
+            if (bundle.txCreated)
+            {
+                cfg.vqn = (USHORT)bundle.txPath.getQueueIndex();
+                cfg.coal = tx;
+                pContext->CXPath.PostControlMessage(VIRTIO_NET_CTRL_NOTF_COAL,
+                                                    VIRTIO_NET_CTRL_NOTF_COAL_VQ_SET,
+                                                    &cfg,
+                                                    sizeof(cfg),
+                                                    NULL,
+                                                    0,
+                                                    2);
+            }
+        }
+    }
+    else if (pContext->bNotifyCoalescingSupported)
+    {
+        struct virtio_net_ctrl_coal_rx rxCfg = {rx.max_packets, rx.max_usecs};
+        struct virtio_net_ctrl_coal_tx txCfg = {tx.max_packets, tx.max_usecs};
+
+        pContext->CXPath.PostControlMessage(VIRTIO_NET_CTRL_NOTF_COAL,
+                                            VIRTIO_NET_CTRL_NOTF_COAL_RX_SET,
+                                            &rxCfg,
+                                            sizeof(rxCfg),
+                                            NULL,
+                                            0,
+                                            2);
+        pContext->CXPath.PostControlMessage(VIRTIO_NET_CTRL_NOTF_COAL,
+                                            VIRTIO_NET_CTRL_NOTF_COAL_TX_SET,
+                                            &txCfg,
+                                            sizeof(txCfg),
+                                            NULL,
+                                            0,
+                                            2);
+    }
+}
+
 static NDIS_STATUS SetInitialDeviceRSS(PARANDIS_ADAPTER *pContext)
 {
     NDIS_STATUS status;
@@ -1436,8 +1723,10 @@ NDIS_STATUS ParaNdis_DeviceEnterD0(PARANDIS_ADAPTER *pContext)
     ParaNdis_AddDriverOKStatus(pContext);
     ParaNdis_DeviceConfigureMultiQueue(pContext);
     ParaNdis_DeviceConfigureRSC(pContext);
+    ParaNdis_DeviceConfigureNotifyCoalescing(pContext);
     ParaNdis_UpdateMAC(pContext);
     ParaNdis_KickRX(pContext);
+    pContext->DeviceStatistics.Start();
 
     DEBUG_EXIT_STATUS(0, status);
     return status;
@@ -1596,6 +1885,8 @@ Parameters:
 ***********************************************************/
 static VOID ParaNdis_CleanupContext(PARANDIS_ADAPTER *pContext)
 {
+    pContext->DeviceStatistics.Release();
+
     /* disable any interrupt generation */
     if (pContext->bDeviceInitialized)
     {
@@ -1628,13 +1919,6 @@ static VOID ParaNdis_CleanupContext(PARANDIS_ADAPTER *pContext)
         pContext->pPathBundles = nullptr;
     }
 
-    if (pContext->RSS2QueueMap)
-    {
-        NdisFreeMemoryWithTagPriority(pContext->MiniportHandle, pContext->RSS2QueueMap, PARANDIS_MEMORY_TAG);
-        pContext->RSS2QueueMap = nullptr;
-        pContext->RSS2QueueLength = 0;
-    }
-
     virtio_device_shutdown(&pContext->IODevice);
 }
 
@@ -1737,6 +2021,9 @@ static BOOLEAN ProcessReceiveQueue(PARANDIS_ADAPTER *pContext,
                                                                      &nCoalescedSegmentsCount);
             if (packet != NULL)
             {
+                ParaNdis_LatencyAdd(pTargetReceiveQueue->Latency,
+                                    pBufferDescriptor->QueuedTime,
+                                    ParaNdis_LatencyTimestamp());
                 UpdateReceiveSuccessStatistics(pContext, pPacketInfo, nCoalescedSegmentsCount);
                 if (*indicate == nullptr)
                 {
@@ -1897,7 +2184,7 @@ static BOOLEAN RxDPCWorkBody(PARANDIS_ADAPTER *pContext, CPUPathBundle *pathBund
     return res;
 }
 
-void RxPoll(PARANDIS_ADAPTER *pContext, UINT BundleIndex, NDIS_POLL_RECEIVE_DATA &RxData)
+void RxPoll(PARANDIS_ADAPTER *pContext, UINT BundleIndex, NDIS_POLL_RECEIVE_DATA &RxData, bool RearmQueue)
 {
     ULONG &collected = RxData.NumberOfIndicatedNbls;
     ULONG MaxPacketsToIndicate = RxData.MaxNblsToIndicate;
@@ -1957,7 +2244,8 @@ void RxPoll(PARANDIS_ADAPTER *pContext, UINT BundleIndex, NDIS_POLL_RECEIVE_DATA
     // that we need to respawn the DPC to get more data from the queue
     if (pathBundle != nullptr && !hasMore)
     {
-        hasMore |= pathBundle->rxPath.RestartQueue() |
+        // when busy polling the ring is checked again by the next poll
+        hasMore |= (RearmQueue && pathBundle->rxPath.RestartQueue()) |
                    ReceiveQueueHasBuffers(&pathBundle->rxPath.UnclassifiedPacketsQueue());
     }
     if (hasMore)
@@ -2005,7 +2293,7 @@ void ParaNdis_CXDPCWorkBody(PARANDIS_ADAPTER *pContext)
         if (pContext->bGuestAnnounceSupported && pContext->bGuestAnnounced)
         {
             ParaNdis_SendGratuitousArpPacket(pContext);
-            pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_ANNOUNCE,
+            pContext->CXPath.PostControlMessage(VIRTIO_NET_CTRL_ANNOUNCE,
                                                 VIRTIO_NET_CTRL_ANNOUNCE_ACK,
                                                 NULL,
                                                 0,
@@ -2073,6 +2361,21 @@ bool ParaNdis_RXTXDPCWorkBody(PARANDIS_ADAPTER *pContext, ULONG ulMaxPacketsToIn
     return stillRequiresProcessing;
 }
 
+static VOID BuildMulticastHashTable(tMulticastData *Data)
+{
+    NdisZeroMemory(Data->HashTable, sizeof(Data->HashTable));
+    for (ULONG i = 0; i < Data->nofMulticastEntries; i++)
+    {
+        ULONG slot = ParaNdis_MulticastHash(&Data->MulticastList[i * ETH_ALEN]);
+
+        while (Data->HashTable[slot])
+        {
+            slot = (slot + 1) & (PARANDIS_MULTICAST_HASH_SIZE - 1);
+        }
+        Data->HashTable[slot] = (UCHAR)(i + 1);
+    }
+}
+
 /**********************************************************
 Common handler of multicast address configuration
 Parameters:
@@ -2109,6 +2412,7 @@ NDIS_STATUS ParaNdis_SetMulticastList(PARANDIS_ADAPTER *pContext,
             NdisMoveMemory(pContext->MulticastData.MulticastList, Buffer, length);
         }
         pContext->MulticastData.nofMulticastEntries = length / ETH_ALEN;
+        BuildMulticastHashTable(&pContext->MulticastData);
         DPrintf(1, "New multicast list of %d bytes", length);
         *pBytesRead = length;
         status = NDIS_STATUS_SUCCESS;
@@ -2172,14 +2476,14 @@ static VOID ParaNdis_DeviceFiltersUpdateRxMode(PARANDIS_ADAPTER *pContext)
     u8 val;
     ULONG f = pContext->PacketFilter;
     val = (f & NDIS_PACKET_TYPE_PROMISCUOUS) ? 1 : 0;
-    pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_PROMISC, &val, sizeof(val), NULL, 0, 2);
+    pContext->CXPath.PostControlMessage(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_PROMISC, &val, sizeof(val), NULL, 0, 2);
     val = (f & NDIS_PACKET_TYPE_ALL_MULTICAST) ? 1 : 0;
-    pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_ALLMULTI, &val, sizeof(val), NULL, 0, 2);
+    pContext->CXPath.PostControlMessage(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_ALLMULTI, &val, sizeof(val), NULL, 0, 2);
 
     if (pContext->bCtrlRXExtraFiltersSupported)
     {
         val = (f & (NDIS_PACKET_TYPE_MULTICAST | NDIS_PACKET_TYPE_ALL_MULTICAST)) ? 0 : 1;
-        pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_RX,
+        pContext->CXPath.PostControlMessage(VIRTIO_NET_CTRL_RX,
                                             VIRTIO_NET_CTRL_RX_NOMULTI,
                                             &val,
                                             sizeof(val),
@@ -2187,7 +2491,7 @@ static VOID ParaNdis_DeviceFiltersUpdateRxMode(PARANDIS_ADAPTER *pContext)
                                             0,
                                             2);
         val = (f & NDIS_PACKET_TYPE_DIRECTED) ? 0 : 1;
-        pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_RX,
+        pContext->CXPath.PostControlMessage(VIRTIO_NET_CTRL_RX,
                                             VIRTIO_NET_CTRL_RX_NOUNI,
                                             &val,
                                             sizeof(val),
@@ -2195,7 +2499,7 @@ static VOID ParaNdis_DeviceFiltersUpdateRxMode(PARANDIS_ADAPTER *pContext)
                                             0,
                                             2);
         val = (f & NDIS_PACKET_TYPE_BROADCAST) ? 0 : 1;
-        pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_RX,
+        pContext->CXPath.PostControlMessage(VIRTIO_NET_CTRL_RX,
                                             VIRTIO_NET_CTRL_RX_NOBCAST,
                                             &val,
                                             sizeof(val),
@@ -2208,7 +2512,7 @@ static VOID ParaNdis_DeviceFiltersUpdateRxMode(PARANDIS_ADAPTER *pContext)
 static VOID ParaNdis_DeviceFiltersUpdateAddresses(PARANDIS_ADAPTER *pContext)
 {
     u32 u32UniCastEntries = 0;
-    pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_MAC,
+    pContext->CXPath.PostControlMessage(VIRTIO_NET_CTRL_MAC,
                                         VIRTIO_NET_CTRL_MAC_TABLE_SET,
                                         &u32UniCastEntries,
                                         sizeof(u32UniCastEntries),
@@ -2221,7 +2525,7 @@ static VOID SetSingleVlanFilter(PARANDIS_ADAPTER *pContext, ULONG vlanId, BOOLEA
 {
     u16 val = vlanId & 0xfff;
     UCHAR cmd = bOn ? VIRTIO_NET_CTRL_VLAN_ADD : VIRTIO_NET_CTRL_VLAN_DEL;
-    pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_VLAN, cmd, &val, sizeof(val), NULL, 0, levelIfOK);
+    pContext->CXPath.PostControlMessage(VIRTIO_NET_CTRL_VLAN, cmd, &val, sizeof(val), NULL, 0, levelIfOK);
 }
 
 static VOID SetAllVlanFilters(PARANDIS_ADAPTER *pContext, BOOLEAN bOn)
@@ -2293,7 +2597,7 @@ static VOID ParaNdis_UpdateMAC(PARANDIS_ADAPTER *pContext)
 {
     if (pContext->bCtrlMACAddrSupported)
     {
-        pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_MAC,
+        pContext->CXPath.PostControlMessage(VIRTIO_NET_CTRL_MAC,
                                             VIRTIO_NET_CTRL_MAC_ADDR_SET,
                                             pContext->CurrentMacAddress,
                                             ETH_ALEN,
@@ -2371,6 +2675,8 @@ VOID ParaNdis_PowerOff(PARANDIS_ADAPTER *pContext)
 
     pContext->bConnected = FALSE;
 
+    pContext->DeviceStatistics.Stop();
+
     ParaNdis_ResetVirtIONetDevice(pContext);
 
 #if !NDIS_SUPPORT_NDIS620
@@ -0,0 +1,301 @@
+#include "ndis56common.h"
+#include "virtio_net.h"
+#include "kdebugprint.h"
+#include "Trace.h"
+#ifdef NETKVM_WPP_ENABLED
+#include "ParaNdis_DeviceStats.tmh"
+#endif
+
+// the types of statistics the driver keeps, when the device supports them
+#define DEVICE_STATS_RX_TYPES                                                                                          \
+    (VIRTIO_NET_STATS_TYPE_RX_BASIC | VIRTIO_NET_STATS_TYPE_RX_CSUM | VIRTIO_NET_STATS_TYPE_RX_SPEED)
+#define DEVICE_STATS_TX_TYPES (VIRTIO_NET_STATS_TYPE_TX_BASIC | VIRTIO_NET_STATS_TYPE_TX_SPEED)
+
+void CDeviceStatistics::Initialize(PPARANDIS_ADAPTER Context, ULONG Period)
+{
+    m_Context = Context;
+    m_Period = Period;
+
+    DPrintf(0, "Device statistics %s, period %d sec", Period ? "enabled" : "disabled", Period);
+}
+
+static ULONG GetReplySize(ULONG64 Types)
+{
+    ULONG size = 0;
+    size += (Types & VIRTIO_NET_STATS_TYPE_RX_BASIC) ? sizeof(virtio_net_stats_rx_basic) : 0;
+    size += (Types & VIRTIO_NET_STATS_TYPE_RX_CSUM) ? sizeof(virtio_net_stats_rx_csum) : 0;
+    size += (Types & VIRTIO_NET_STATS_TYPE_RX_SPEED) ? sizeof(virtio_net_stats_rx_speed) : 0;
+    size += (Types & VIRTIO_NET_STATS_TYPE_TX_BASIC) ? sizeof(virtio_net_stats_tx_basic) : 0;
+    size += (Types & VIRTIO_NET_STATS_TYPE_TX_SPEED) ? sizeof(virtio_net_stats_tx_speed) : 0;
+    return size;
+}
+
+void CDeviceStatistics::Start()
+{
+    virtio_net_stats_capabilities caps = {};
+    ULONG length = 0;
+
+    if (!m_Context->bDeviceStatsSupported)
+    {
+        return;
+    }
+
+    if (!m_Context->CXPath.SendControlMessage(VIRTIO_NET_CTRL_STATS,
+                                              VIRTIO_NET_CTRL_STATS_QUERY,
+                                              NULL,
+                                              0,
+                                              NULL,
+                                              0,
+                                              2,
+                                              &caps,
+                                              sizeof(caps),
+                                              &length) ||
+        length < sizeof(caps))
+    {
+        DPrintf(0, "Failed to query the statistics capabilities (%d bytes)", length);
+        m_RxTypes = m_TxTypes = 0;
+        return;
+    }
+
+    m_RxTypes = caps.supported_stats_types[0] & DEVICE_STATS_RX_TYPES;
+    m_TxTypes = caps.supported_stats_types[0] & DEVICE_STATS_TX_TYPES;
+    DPrintf(0,
+            "Device statistics %I64X, using RX %I64X, TX %I64X",
+            caps.supported_stats_types[0],
+            m_RxTypes,
+            m_TxTypes);
+    if (!IsActive())
+    {
+        return;
+    }
+
+    // the device has been reset and counts from 0
+    for (UINT i = 0; i < m_Context->nPathBundles; ++i)
+    {
+        CPUPathBundle &bundle = m_Context->pPathBundles[i];
+        NdisZeroMemory(bundle.rxDeviceStatistics.Last, sizeof(bundle.rxDeviceStatistics.Last));
+        NdisZeroMemory(bundle.txDeviceStatistics.Last, sizeof(bundle.txDeviceStatistics.Last));
+    }
+
+    if (!m_Timer)
+    {
+        NDIS_TIMER_CHARACTERISTICS timer = {};
+        timer.Header.Type = NDIS_OBJECT_TYPE_TIMER_CHARACTERISTICS;
+        timer.Header.Revision = NDIS_TIMER_CHARACTERISTICS_REVISION_1;
+        timer.Header.Size = NDIS_SIZEOF_TIMER_CHARACTERISTICS_REVISION_1;
+        timer.AllocationTag = PARANDIS_MEMORY_TAG;
+        timer.TimerFunction = OnTimer;
+        timer.FunctionContext = this;
+        if (NdisAllocateTimerObject(m_Context->MiniportHandle, &timer, &m_Timer) != NDIS_STATUS_SUCCESS)
+        {
+            DPrintf(0, "Failed to allocate the statistics timer");
+            m_Timer = NULL;
+            return;
+        }
+    }
+
+    LARGE_INTEGER dueTime;
+    dueTime.QuadPart = -(LONGLONG)m_Period * 10000000;
+    NdisSetTimerObject(m_Timer, dueTime, m_Period * 1000, NULL);
+}
+
+void CDeviceStatistics::Stop()
+{
+    if (m_Timer)
+    {
+        NdisCancelTimerObject(m_Timer);
+        // the callback may be running on another processor
+        KeFlushQueuedDpcs();
+    }
+}
+
+void CDeviceStatistics::Release()
+{
+    Stop();
+    if (m_Timer)
+    {
+        NdisFreeTimerObject(m_Timer);
+        m_Timer = NULL;
+    }
+}
+
+VOID CDeviceStatistics::OnTimer(PVOID SystemSpecific1,
+                                PVOID FunctionContext,
+                                PVOID SystemSpecific2,
+                                PVOID SystemSpecific3)
+{
+    UNREFERENCED_PARAMETER(SystemSpecific1);
+    UNREFERENCED_PARAMETER(SystemSpecific2);
+    UNREFERENCED_PARAMETER(SystemSpecific3);
+
+    ((CDeviceStatistics *)FunctionContext)->Query();
+}
+
+// called by the timer at DISPATCH, posts one query per virtqueue
+void CDeviceStatistics::Query()
+{
+    if (m_Pending || m_Context->bSurprizeRemoved)
+    {
+        DPrintf(5, "skipped, %d queries pending", m_Pending);
+        return;
+    }
+
+    for (UINT i = 0; i < m_Context->nPathBundles; ++i)
+    {
+        CPUPathBundle &bundle = m_Context->pPathBundles[i];
+        if (m_RxTypes && bundle.rxCreated)
+        {
+            PostQuery((USHORT)bundle.rxPath.getQueueIndex(), m_RxTypes);
+        }
+        if (m_TxTypes && bundle.txCreated)
+        {
+            PostQuery((USHORT)bundle.txPath.getQueueIndex(), m_TxTypes);
+        }
+    }
+}
+
+void CDeviceStatistics::PostQuery(USHORT QueueIndex, ULONG64 Types)
+{
+    virtio_net_ctrl_queue_stats request = {};
+    request.stats[0].vq_index = QueueIndex;
+    request.stats[0].types_bitmap[0] = Types;
+
+    InterlockedIncrement(&m_Pending);
+    if (!m_Context->CXPath.PostControlQuery(VIRTIO_NET_CTRL_STATS,
+                                            VIRTIO_NET_CTRL_STATS_GET,
+                                            &request,
+                                            sizeof(request),
+                                            GetReplySize(Types),
+                                            OnReply,
+                                            this,
+                                            5))
+    {
+        InterlockedDecrement(&m_Pending);
+    }
+}
+
+// called by the control queue under its lock
+void CDeviceStatistics::OnReply(PVOID Context, const void *Reply, ULONG Length)
+{
+    CDeviceStatistics *stats = (CDeviceStatistics *)Context;
+    const UCHAR *p = (const UCHAR *)Reply;
+
+    while (p && Length >= sizeof(virtio_net_stats_reply_hdr))
+    {
+        const virtio_net_stats_reply_hdr *header = (const virtio_net_stats_reply_hdr *)p;
+        if (header->size < sizeof(*header) || header->size > Length)
+        {
+            DPrintf(0, "Wrong size %d of statistics type %d", header->size, header->type);
+            break;
+        }
+        stats->Update(header);
+        p += header->size;
+        Length -= header->size;
+    }
+    InterlockedDecrement(&stats->m_Pending);
+}
+
+tDeviceQueueStatistics *CDeviceStatistics::FindQueue(USHORT QueueIndex, bool Rx) const
+{
+    for (UINT i = 0; i < m_Context->nPathBundles; ++i)
+    {
+        CPUPathBundle &bundle = m_Context->pPathBundles[i];
+        if (Rx && bundle.rxCreated && bundle.rxPath.getQueueIndex() == QueueIndex)
+        {
+            return &bundle.rxDeviceStatistics;
+        }
+        if (!Rx && bundle.txCreated && bundle.txPath.getQueueIndex() == QueueIndex)
+        {
+            return &bundle.txDeviceStatistics;
+        }
+    }
+    return NULL;
+}
+
+static void Accumulate(tDeviceQueueStatistics &Queue, eDeviceQueueCounter Counter, ULONG64 Value)
+{
+    // a smaller value means the device started to count again
+    Queue.Counters[Counter] += Value >= Queue.Last[Counter] ? Value - Queue.Last[Counter] : Value;
+    Queue.Last[Counter] = Value;
+}
+
+// newer devices may append fields to a reply, the size is checked
+// against the fields the driver knows about
+void CDeviceStatistics::Update(const virtio_net_stats_reply_hdr *Header)
+{
+    tDeviceQueueStatistics *queue = FindQueue(Header->vq_index, Header->type < VIRTIO_NET_STATS_TYPE_REPLY_TX_BASIC);
+
+    if (!queue)
+    {
+        DPrintf(0, "Statistics type %d for unknown queue %d", Header->type, Header->vq_index);
+        return;
+    }
+
+    switch (Header->type)
+    {
+        case VIRTIO_NET_STATS_TYPE_REPLY_RX_BASIC:
+            if (Header->size >= sizeof(virtio_net_stats_rx_basic))
+            {
+                const virtio_net_stats_rx_basic *rx = (const virtio_net_stats_rx_basic *)Header;
+                Accumulate(*queue, dqcNotifications, rx->rx_notifications);
+                Accumulate(*queue, dqcPackets, rx->rx_packets);
+                Accumulate(*queue, dqcBytes, rx->rx_bytes);
+                Accumulate(*queue, dqcInterrupts, rx->rx_interrupts);
+                Accumulate(*queue, dqcDrops, rx->rx_drops);
+                Accumulate(*queue, dqcOverruns, rx->rx_drop_overruns);
+            }
+            break;
+        case VIRTIO_NET_STATS_TYPE_REPLY_RX_CSUM:
+            if (Header->size >= sizeof(virtio_net_stats_rx_csum))
+            {
+                const virtio_net_stats_rx_csum *rx = (const virtio_net_stats_rx_csum *)Header;
+                Accumulate(*queue, dqcChecksumBad, rx->rx_csum_bad);
+            }
+            break;
+        case VIRTIO_NET_STATS_TYPE_REPLY_RX_SPEED:
+            if (Header->size >= sizeof(virtio_net_stats_rx_speed))
+            {
+                const virtio_net_stats_rx_speed *rx = (const virtio_net_stats_rx_speed *)Header;
+                Accumulate(*queue, dqcRateLimited, rx->rx_ratelimit_packets);
+            }
+            break;
+        case VIRTIO_NET_STATS_TYPE_REPLY_TX_BASIC:
+            if (Header->size >= sizeof(virtio_net_stats_tx_basic))
+            {
+                const virtio_net_stats_tx_basic *tx = (const virtio_net_stats_tx_basic *)Header;
+                Accumulate(*queue, dqcNotifications, tx->tx_notifications);
+                Accumulate(*queue, dqcPackets, tx->tx_packets);
+                Accumulate(*queue, dqcBytes, tx->tx_bytes);
+                Accumulate(*queue, dqcInterrupts, tx->tx_interrupts);
+                Accumulate(*queue, dqcDrops, tx->tx_drops);
+                Accumulate(*queue, dqcMalformed, tx->tx_drop_malformed);
+            }
+            break;
+        case VIRTIO_NET_STATS_TYPE_REPLY_TX_SPEED:
+            if (Header->size >= sizeof(virtio_net_stats_tx_speed))
+            {
+                const virtio_net_stats_tx_speed *tx = (const virtio_net_stats_tx_speed *)Header;
+                Accumulate(*queue, dqcRateLimited, tx->tx_ratelimit_packets);
+            }
+            break;
+        default:
+            // not requested
+            break;
+    }
+}
+
+ULONG64 CDeviceStatistics::Total(eDeviceQueueCounter Counter, bool Rx) const
+{
+    ULONG64 total = 0;
+
+    if (m_Context == NULL || m_Context->pPathBundles == NULL)
+    {
+        return 0;
+    }
+    for (UINT i = 0; i < m_Context->nPathBundles; ++i)
+    {
+        const CPUPathBundle &bundle = m_Context->pPathBundles[i];
+        total += Rx ? bundle.rxDeviceStatistics.Counters[Counter] : bundle.txDeviceStatistics.Counters[Counter];
+    }
+    return total;
+}
@@ -12,6 +12,7 @@
 
 static FORCEINLINE VOID ParaNdis_ReceiveQueueAddBuffer(PPARANDIS_RECEIVE_QUEUE pQueue, pRxNetDescriptor pBuffer)
 {
+    pBuffer->QueuedTime = ParaNdis_LatencyTimestamp();
     NdisInterlockedInsertTailList(&pQueue->BuffersList, &pBuffer->ReceiveQueueListEntry, &pQueue->Lock);
 }
 
@@ -191,6 +192,7 @@ static void ParaNdis_FreeRxBufferDescriptor(PARANDIS_ADAPTER *pContext, pRxNetDe
 CParaNdisRX::CParaNdisRX()
 {
     InitializeListHead(&m_NetReceiveBuffers);
+    InitializeSListHead(&m_RecycledBuffers);
 }
 
 CParaNdisRX::~CParaNdisRX()
@@ -226,6 +228,19 @@ bool CParaNdisRX::Create(PPARANDIS_ADAPTER Context, UINT DeviceQueueIndex)
         return false;
     }
 
+    if (UseMergeableDescriptors() && Context->bRxPagePool)
+    {
+        // A frame of the MTU size fits into one buffer and the largest packet
+        // the device may deliver (up to 64K with TSO/RSC) fits into VIRTIO_NET_MAX_MRG_BUFS buffers
+        ULONG maxPacketSize = Context->nVirtioHeaderSize + Context->MaxPacketSize.nMaxDataSizeHwRx;
+        ULONG minSliceSize = Context->nVirtioHeaderSize + Context->MaxPacketSize.nMaxFullSizeOS +
+                             ETH_PRIORITY_HEADER_SIZE;
+
+        minSliceSize = max(minSliceSize, (maxPacketSize + VIRTIO_NET_MAX_MRG_BUFS - 1) / VIRTIO_NET_MAX_MRG_BUFS);
+        // the pool never takes more memory than a page per buffer
+        m_PagePool.Initialize(Context, minSliceSize, Context->maxRxBufferPerQueue);
+    }
+
     PrepareReceiveBuffers();
 
     CreatePath();
@@ -266,7 +281,7 @@ int CParaNdisRX::PrepareReceiveBuffers()
 
         if (!AddRxBufferToQueue(pBuffersDescriptor))
         {
-            ParaNdis_FreeRxBufferDescriptor(m_Context, pBuffersDescriptor);
+            FreeRxDescriptor(pBuffersDescriptor);
             break;
         }
 
@@ -321,17 +336,31 @@ pRxNetDescriptor CParaNdisRX::CreateMergeableRxDescriptorOnInit()
 
     p->OriginalPhysicalPages = p->PhysicalPages;
 
-    if (!ParaNdis_InitialAllocatePhysicalMemory(m_Context, PAGE_SIZE, &p->PhysicalPages[0]))
+    if (m_PagePool.IsActive())
     {
-        DPrintf(0, "ERROR: Failed to allocate physical memory (1 page = %u bytes)", PAGE_SIZE);
-        goto error_exit;
+        if (!GetPoolSliceOnInit(p))
+        {
+            DPrintf(0, "ERROR: Failed to get a slice of the page pool");
+            goto error_exit;
+        }
+        m_PagePool.GetSliceMemory(p->PoolSlice, p->PhysicalPages[0]);
+        // the page belongs to the pool
+        p->NumOwnedPages = 0;
+    }
+    else
+    {
+        if (!ParaNdis_InitialAllocatePhysicalMemory(m_Context, PAGE_SIZE, &p->PhysicalPages[0]))
+        {
+            DPrintf(0, "ERROR: Failed to allocate physical memory (1 page = %u bytes)", PAGE_SIZE);
+            goto error_exit;
+        }
+        p->NumOwnedPages = 1;
     }
 
     // Setup for mergeable buffer with ANY_LAYOUT
     // Physical allocation: Single buffer containing virtio header + payload
-    // Logical layout: NumPages=1, single page for header+data
+    // Logical layout: NumPages=1, single page (or pool slice) for header+data
     p->NumPages = 1;
-    p->NumOwnedPages = 1;
     p->HeaderPage = 0;
     p->FirstRxDataPage = 0;
     p->DataStartOffset = (USHORT)m_Context->nVirtioHeaderSize;
@@ -339,7 +368,7 @@ pRxNetDescriptor CParaNdisRX::CreateMergeableRxDescriptorOnInit()
     // Combined header and data in single SG entry (ANY_LAYOUT)
     p->BufferSGLength = 1;
     p->BufferSGArray[0].physAddr = p->PhysicalPages[0].Physical;
-    p->BufferSGArray[0].length = PAGE_SIZE;
+    p->BufferSGArray[0].length = p->PhysicalPages[0].size;
 
     // Pre-allocate MDL covering entire page to avoid MDL allocation/free
     // in hot path during packet assembly/disassembly.
@@ -362,13 +391,76 @@ pRxNetDescriptor CParaNdisRX::CreateMergeableRxDescriptorOnInit()
     return p;
 
 error_exit:
-    ParaNdis_FreeRxBufferDescriptor(m_Context, p);
+    if (p->PoolSlice.Page)
+    {
+        TPassiveSpinLocker autoLock(m_Lock);
+
+        FreeRxDescriptor(p);
+    }
+    else
+    {
+        ParaNdis_FreeRxBufferDescriptor(m_Context, p);
+    }
     return NULL;
 }
 
+// Called on PASSIVE level without m_Lock
+bool CParaNdisRX::GetPoolSliceOnInit(pRxNetDescriptor p)
+{
+    {
+        TPassiveSpinLocker autoLock(m_Lock);
+
+        if (m_PagePool.GetSlice(m_PagePool.TargetShift(), p->PoolSlice))
+        {
+            return true;
+        }
+    }
+
+    if (!AddPoolPage())
+    {
+        return false;
+    }
+
+    TPassiveSpinLocker autoLock(m_Lock);
+
+    return m_PagePool.GetSlice(m_PagePool.TargetShift(), p->PoolSlice);
+}
+
+// Allocates a page for the pool, called on PASSIVE level without m_Lock
+bool CParaNdisRX::AddPoolPage()
+{
+    tRxPoolPage *page = m_PagePool.AllocatePage();
+
+    if (page == NULL)
+    {
+        return false;
+    }
+
+    TPassiveSpinLocker autoLock(m_Lock);
+
+    m_PagePool.AddPage(page);
+    return true;
+}
+
+// Called under m_Lock or when the queue does not run
+void CParaNdisRX::FreeRxDescriptor(pRxNetDescriptor p)
+{
+    if (p->PoolSlice.Page)
+    {
+        m_PagePool.PutSlice(p->PoolSlice);
+        p->PoolSlice.Page = NULL;
+    }
+    ParaNdis_FreeRxBufferDescriptor(m_Context, p);
+}
+
+bool CParaNdisRX::UseMergeableDescriptors() const
+{
+    return m_Context->bUseMergedBuffers && m_Context->bAnyLayout && m_Context->RxLayout.TotalAllocationsPerBuffer > 1;
+}
+
 pRxNetDescriptor CParaNdisRX::CreateRxDescriptorOnInit()
 {
-    if (m_Context->bUseMergedBuffers && m_Context->bAnyLayout && m_Context->RxLayout.TotalAllocationsPerBuffer > 1)
+    if (UseMergeableDescriptors())
     {
         DPrintf(5, "Using mergeable buffer allocation");
         return CreateMergeableRxDescriptorOnInit();
@@ -535,7 +627,7 @@ BOOLEAN CParaNdisRX::AllocateMore()
         }
         else
         {
-            ParaNdis_FreeRxBufferDescriptor(m_Context, pBuffersDescriptor);
+            FreeRxDescriptor(pBuffersDescriptor);
         }
     }
     return result;
@@ -557,11 +649,21 @@ BOOLEAN CParaNdisRX::AddRxBufferToQueue(pRxNetDescriptor pBufferDescriptor)
 
 void CParaNdisRX::FreeRxDescriptorsFromList()
 {
+    // the work item growing the pool uses the queue
+    while (InterlockedCompareExchange(&m_PoolGrowthPending, 0, 0))
+    {
+        NdisMSleep(1000);
+    }
+
+    ReuseRecycledBuffers();
+
     while (!IsListEmpty(&m_NetReceiveBuffers))
     {
         pRxNetDescriptor pBufferDescriptor = (pRxNetDescriptor)RemoveHeadList(&m_NetReceiveBuffers);
-        ParaNdis_FreeRxBufferDescriptor(m_Context, pBufferDescriptor);
+        FreeRxDescriptor(pBufferDescriptor);
     }
+
+    m_PagePool.Destroy();
 }
 
 // Disassemble a merged packet back to its original single-buffer state.
@@ -580,7 +682,6 @@ void CParaNdisRX::DisassembleMergedPacket(pRxNetDescriptor pBuffer)
 
     pBuffer->PhysicalPages = pBuffer->OriginalPhysicalPages;
     pBuffer->NumPages = 1;
-    pBuffer->NumOwnedPages = 1;
     pBuffer->MergedBufferCount = 0;
 }
 
@@ -588,6 +689,13 @@ void CParaNdisRX::ReuseReceiveBufferNoLock(pRxNetDescriptor pBuffersDescriptor)
 {
     DEBUG_ENTRY(4);
 
+#if PARANDIS_SUPPORT_RSC
+    if (pBuffersDescriptor->CoalescedSegments > 0)
+    {
+        ReleaseCoalescedSegments(pBuffersDescriptor);
+    }
+#endif
+
     // Handle merged packets: recursively reuse all constituent buffers
     if (pBuffersDescriptor->MergedBufferCount > 0)
     {
@@ -605,6 +713,12 @@ void CParaNdisRX::ReuseReceiveBufferNoLock(pRxNetDescriptor pBuffersDescriptor)
         DisassembleMergedPacket(pBuffersDescriptor);
     }
 
+    if (m_Reinsert && pBuffersDescriptor->PoolSlice.Page &&
+        pBuffersDescriptor->PoolSlice.Shift != m_PagePool.TargetShift())
+    {
+        ResizePoolBuffer(pBuffersDescriptor);
+    }
+
     if (!m_Reinsert)
     {
         InsertTailList(&m_NetReceiveBuffers, &pBuffersDescriptor->listEntry);
@@ -636,7 +750,7 @@ void CParaNdisRX::ReuseReceiveBufferNoLock(pRxNetDescriptor pBuffersDescriptor)
     {
         /* TODO - NetMaxReceiveBuffers per queue or per context ?*/
         DPrintf(0, "FAILED TO REUSE THE BUFFER!!!!");
-        ParaNdis_FreeRxBufferDescriptor(m_Context, pBuffersDescriptor);
+        FreeRxDescriptor(pBuffersDescriptor);
         m_NetMaxReceiveBuffers--;
     }
 }
@@ -646,6 +760,146 @@ VOID CParaNdisRX::KickRXRing()
     m_VirtQueue.Kick();
 }
 
+// A buffer returned on the CPU of the queue's DPC is parked in m_RecycledBuffers and posted
+// to the ring by the next DPC, which holds m_Lock anyway. It is done only while the ring has
+// enough buffers to make the device trigger that DPC, otherwise the caller posts the buffer.
+bool CParaNdisRX::RecycleWithoutLock(pRxNetDescriptor pBuffersDescriptor)
+{
+    PROCESSOR_NUMBER procNumber;
+
+    if (!m_Reinsert || IsRxBuffersShortage() || m_NetNofReceiveBuffers < m_nReusedRxBuffersLimit ||
+        QueryDepthSList(&m_RecycledBuffers) >= m_nReusedRxBuffersLimit)
+    {
+        return false;
+    }
+
+    KeGetCurrentProcessorNumberEx(&procNumber);
+    if (procNumber.Group != DPCAffinity.Group || !(DPCAffinity.Mask & ((KAFFINITY)1 << procNumber.Number)))
+    {
+        return false;
+    }
+
+    InterlockedPushEntrySList(&m_RecycledBuffers, &pBuffersDescriptor->RecycleEntry);
+    return true;
+}
+
+// Called under m_Lock
+void CParaNdisRX::ReuseRecycledBuffers()
+{
+    PSLIST_ENTRY pEntry = InterlockedFlushSList(&m_RecycledBuffers);
+
+    while (pEntry)
+    {
+        pRxNetDescriptor pBuffersDescriptor = CONTAINING_RECORD(pEntry, RxNetDescriptor, RecycleEntry);
+
+        pEntry = pEntry->Next;
+        ReuseReceiveBufferNoLock(pBuffersDescriptor);
+    }
+}
+
+// Called under m_Lock. Moves the buffer to a slice of the size the pool targets now.
+// When there is no free memory for it the buffer keeps its slice.
+void CParaNdisRX::ResizePoolBuffer(pRxNetDescriptor pBuffersDescriptor)
+{
+    tRxPoolSlice oldSlice = pBuffersDescriptor->PoolSlice;
+    tRxPoolSlice newSlice;
+    tCompletePhysicalAddress memory;
+    // smaller shift means larger slice
+    bool bLarger = m_PagePool.TargetShift() < oldSlice.Shift;
+
+    if (bLarger)
+    {
+        if (!m_PagePool.GetSlice(m_PagePool.TargetShift(), newSlice))
+        {
+            RequestPoolGrowth();
+            return;
+        }
+    }
+    else
+    {
+        // return the slice first, the page it leaves may be carved for the smaller ones
+        m_PagePool.PutSlice(oldSlice);
+        if (!m_PagePool.GetSlice(m_PagePool.TargetShift(), newSlice))
+        {
+            m_PagePool.ReclaimSlice(oldSlice);
+            return;
+        }
+    }
+
+    m_PagePool.GetSliceMemory(newSlice, memory);
+
+    PMDL pHolder = NdisAllocateMdl(m_Context->MiniportHandle,
+                                   RtlOffsetToPointer(memory.Virtual, pBuffersDescriptor->DataStartOffset),
+                                   memory.size - pBuffersDescriptor->DataStartOffset);
+    PMDL pFullPageMDL = NdisAllocateMdl(m_Context->MiniportHandle, memory.Virtual, memory.size);
+
+    if (pHolder == NULL || pFullPageMDL == NULL)
+    {
+        if (pHolder)
+        {
+            NdisFreeMdl(pHolder);
+        }
+        if (pFullPageMDL)
+        {
+            NdisFreeMdl(pFullPageMDL);
+        }
+        m_PagePool.PutSlice(newSlice);
+        if (!bLarger)
+        {
+            m_PagePool.ReclaimSlice(oldSlice);
+        }
+        return;
+    }
+
+    NDIS_MDL_LINKAGE(pHolder) = NULL;
+    NDIS_MDL_LINKAGE(pFullPageMDL) = NULL;
+    NdisFreeMdl(pBuffersDescriptor->Holder);
+    NdisFreeMdl(pBuffersDescriptor->FullPageMDL);
+    pBuffersDescriptor->Holder = pHolder;
+    pBuffersDescriptor->FullPageMDL = pFullPageMDL;
+
+    pBuffersDescriptor->PhysicalPages[0] = memory;
+    pBuffersDescriptor->BufferSGArray[0].physAddr = memory.Physical;
+    pBuffersDescriptor->BufferSGArray[0].length = memory.size;
+    pBuffersDescriptor->PoolSlice = newSlice;
+
+    if (bLarger)
+    {
+        m_PagePool.PutSlice(oldSlice);
+    }
+}
+
+// Pages are added to the pool on PASSIVE level, called under m_Lock
+void CParaNdisRX::RequestPoolGrowth()
+{
+    if (m_PoolGrowthPending || !m_PagePool.CanGrow() || !m_Reinsert)
+    {
+        return;
+    }
+
+    NDIS_HANDLE hwo = NdisAllocateIoWorkItem(m_Context->MiniportHandle);
+    if (hwo)
+    {
+        InterlockedExchange(&m_PoolGrowthPending, 1);
+        NdisQueueIoWorkItem(hwo, PoolGrowthWorkItem, this);
+    }
+}
+
+void CParaNdisRX::PoolGrowthWorkItem(PVOID WorkItemContext, NDIS_HANDLE NdisIoWorkItemHandle)
+{
+    CParaNdisRX *pQueue = (CParaNdisRX *)WorkItemContext;
+    UINT nPages = 0;
+
+    while (nPages < RX_POOL_GROWTH_PAGES && pQueue->m_PagePool.CanGrow() && pQueue->AddPoolPage())
+    {
+        nPages++;
+    }
+
+    DPrintf(1, "%u pages added to the pool of RX queue %u", nPages, pQueue->m_queueIndex);
+    NdisFreeIoWorkItem(NdisIoWorkItemHandle);
+    InterlockedExchange(&pQueue->m_PoolGrowthPending, 0);
+}
+
 #if PARANDIS_SUPPORT_RSS
 static FORCEINLINE VOID ParaNdis_QueueRSSDpc(PARANDIS_ADAPTER *pContext,
                                              ULONG MessageIndex,
@@ -664,8 +918,6 @@ static FORCEINLINE CCHAR ParaNdis_GetScalingDataForPacket(PARANDIS_ADAPTER *pCon
 
 static ULONG ShallPassPacket(PARANDIS_ADAPTER *pContext, PNET_PACKET_INFO pPacketInfo)
 {
-    ULONG i;
-
     if (pPacketInfo->dataLength > pContext->MaxPacketSize.nMaxFullSizeOsRx + ETH_PRIORITY_HEADER_SIZE)
     {
         return FALSE;
@@ -719,20 +971,7 @@ static ULONG ShallPassPacket(PARANDIS_ADAPTER *pContext, PNET_PACKET_INFO pPacke
         return FALSE;
     }
 
-    for (i = 0; i < pContext->MulticastData.nofMulticastEntries; i++)
-    {
-        ULONG Res;
-        PUCHAR CurrMcastAddr = &pContext->MulticastData.MulticastList[i * ETH_ALEN];
-
-        ETH_COMPARE_NETWORK_ADDRESSES_EQ_SAFE(pPacketInfo->ethDestAddr, CurrMcastAddr, &Res);
-
-        if (!Res)
-        {
-            return TRUE;
-        }
-    }
-
-    return FALSE;
+    return ParaNdis_IsMulticastInList(&pContext->MulticastData, pPacketInfo->ethDestAddr);
 }
 
 #define LogRedirectedPacket(p)
@@ -870,10 +1109,25 @@ void CParaNdisRX::ProcessReceivedPacket(pRxNetDescriptor pBufferDescriptor, CCHA
         return;
     }
 
+#if PARANDIS_SUPPORT_RSC
+    if (CoalesceReceivedPacket(pBufferDescriptor, nCurrCpuReceiveQueue))
+    {
+        return;
+    }
+#endif
+
+    DispatchReceivedPacket(pBufferDescriptor, nCurrCpuReceiveQueue);
+}
+
+// Places the packet to the receive queue of its RSS target
+void CParaNdisRX::DispatchReceivedPacket(pRxNetDescriptor pBufferDescriptor, CCHAR nCurrCpuReceiveQueue)
+{
 #ifdef PARANDIS_SUPPORT_RSS
     if (m_Context->RSSParameters.RSSMode != PARANDIS_RSS_MODE::PARANDIS_RSS_DISABLED)
     {
-        ParaNdis6_RSSAnalyzeReceivedPacket(&m_Context->RSSParameters, data, &pBufferDescriptor->PacketInfo);
+        ParaNdis6_RSSAnalyzeReceivedPacket(&m_Context->RSSParameters,
+                                           pBufferDescriptor->PacketInfo.headersBuffer,
+                                           &pBufferDescriptor->PacketInfo);
     }
     CCHAR nTargetReceiveQueueNum;
     GROUP_AFFINITY TargetAffinity;
@@ -922,22 +1176,400 @@ void CParaNdisRX::ProcessReceivedPacket(pRxNetDescriptor pBufferDescriptor, CCHA
 #endif
 }
 
+#if PARANDIS_SUPPORT_RSC
+
+#define RSC_TCP_FLAG_PSH 0x08
+#define RSC_TCP_FLAG_ACK 0x10
+
+/* Software receive segment coalescing.
+
+When the device does not coalesce (no guest TSO) every MTU-sized segment is
+indicated separately. Instead, in-order TCP segments of the same flow fetched
+during one pass over the ring are merged into one frame: the first segment
+keeps its headers, updated for the total length, and the TCP payloads of the
+following segments are chained after it by MDLs. The NBL of the coalesced
+frame carries the RSC information like the one coalesced by the host.
+Segments are merged only if the device validated their TCP checksum, they have
+no IP options or extension headers, only ACK/PSH flags and the same TCP
+options (i.e. timestamps) as the first one. The burst ends with a segment
+shorter than the first one or with PSH. Any other TCP packet of the flow
+flushes the collected segments first, so the order within the flow is kept. */
+
+static FORCEINLINE TCPHeader *RscTcpHeader(const NET_PACKET_INFO &Info)
+{
+    return (TCPHeader *)RtlOffsetToPointer(Info.headersBuffer, Info.L2HdrLen + Info.L3HdrLen);
+}
+
+// Returns the TCP payload length of a segment that can be coalesced, 0 otherwise
+static ULONG RscSegmentPayload(PARANDIS_ADAPTER *pContext, pRxNetDescriptor p)
+{
+    const NET_PACKET_INFO &info = p->PacketInfo;
+    tOffloadSettingsFlags f = pContext->Offload.flags;
+    virtio_net_hdr_mrg_rxbuf *pHeader = (virtio_net_hdr_mrg_rxbuf *)p->PhysicalPages[p->HeaderPage].Virtual;
+    ULONG ipLength;
+
+    if (p->MergedBufferCount || pHeader->hdr.gso_type != VIRTIO_NET_HDR_GSO_NONE ||
+        !(pHeader->hdr.flags & VIRTIO_NET_HDR_F_DATA_VALID) || !info.isTCP || info.isFragment)
+    {
+        return 0;
+    }
+
+    // the frame is chained as is, it must be contiguous in the first MDL
+    if (p->DataStartOffset + info.dataLength > p->PhysicalPages[p->FirstRxDataPage].size)
+    {
+        return 0;
+    }
+
+    if (info.isIP4)
+    {
+        IPv4Header *pIpHeader = (IPv4Header *)RtlOffsetToPointer(info.headersBuffer, info.L2HdrLen);
+
+        if (!pContext->RSC.bIPv4Software || !pContext->RSC.bIPv4Enabled || !f.fRxTCPChecksum ||
+            info.L3HdrLen != sizeof(IPv4Header))
+        {
+            return 0;
+        }
+        // the device validates only the TCP checksum
+        if (CheckSumCalculator(pIpHeader, sizeof(IPv4Header)) != 0)
+        {
+            return 0;
+        }
+        ipLength = RtlUshortByteSwap(pIpHeader->ip_length);
+    }
+    else if (info.isIP6)
+    {
+        IPv6Header *pIpHeader = (IPv6Header *)RtlOffsetToPointer(info.headersBuffer, info.L2HdrLen);
+
+        if (!pContext->RSC.bIPv6Software || !pContext->RSC.bIPv6Enabled || !f.fRxTCPv6Checksum ||
+            info.L3HdrLen != sizeof(IPv6Header))
+        {
+            return 0;
+        }
+        ipLength = sizeof(IPv6Header) + RtlUshortByteSwap(pIpHeader->ip6_payload_len);
+    }
+    else
+    {
+        return 0;
+    }
+
+    // no Ethernet padding, otherwise the payload does not end the frame
+    if (info.L2HdrLen + ipLength != info.dataLength)
+    {
+        return 0;
+    }
+
+    TCPHeader *pTcpHeader = RscTcpHeader(info);
+    ULONG headersLength = info.L3HdrLen + TCP_HEADER_LENGTH(pTcpHeader);
+    UCHAR flags = (UCHAR)(pTcpHeader->tcp_flags >> 8);
+
+    // pure ACKs are not coalesced, they may be duplicate ones
+    if (TCP_HEADER_LENGTH(pTcpHeader) < sizeof(TCPHeader) || headersLength >= ipLength)
+    {
+        return 0;
+    }
+    if ((pTcpHeader->tcp_flags & 0x0F) || !(flags & RSC_TCP_FLAG_ACK) ||
+        (flags & ~(RSC_TCP_FLAG_ACK | RSC_TCP_FLAG_PSH)))
+    {
+        return 0;
+    }
+    return ipLength - headersLength;
+}
+
+static bool RscSameFlow(const NET_PACKET_INFO &Info1, const NET_PACKET_INFO &Info2)
+{
+    if (Info1.isIP4 != Info2.isIP4 || Info1.L2HdrLen != Info2.L2HdrLen)
+    {
+        return false;
+    }
+
+    PUCHAR ip1 = (PUCHAR)RtlOffsetToPointer(Info1.headersBuffer, Info1.L2HdrLen);
+    PUCHAR ip2 = (PUCHAR)RtlOffsetToPointer(Info2.headersBuffer, Info2.L2HdrLen);
+    bool same;
+
+    if (Info1.isIP4)
+    {
+        same = RtlEqualMemory(&((IPv4Header *)ip1)->ip_src, &((IPv4Header *)ip2)->ip_src, 2 * sizeof(ULONG));
+    }
+    else
+    {
+        same = RtlEqualMemory(&((IPv6Header *)ip1)->ip6_src_address,
+                              &((IPv6Header *)ip2)->ip6_src_address,
+                              2 * sizeof(IPV6_ADDRESS));
+    }
+
+    // ports, then MAC addresses and VLAN tag
+    return same && RscTcpHeader(Info1)->tcp_src == RscTcpHeader(Info2)->tcp_src &&
+           RscTcpHeader(Info1)->tcp_dest == RscTcpHeader(Info2)->tcp_dest &&
+           RtlEqualMemory(Info1.headersBuffer, Info2.headersBuffer, Info1.L2HdrLen);
+}
+
+// Called under m_Lock, returns true when the packet is kept for the coalescing
+bool CParaNdisRX::CoalesceReceivedPacket(pRxNetDescriptor pBufferDescriptor, CCHAR nCurrCpuReceiveQueue)
+{
+    const NET_PACKET_INFO &info = pBufferDescriptor->PacketInfo;
+    UINT index;
+
+    if ((!m_Context->RSC.bIPv4Software && !m_Context->RSC.bIPv6Software) || !info.isTCP || info.isFragment)
+    {
+        return false;
+    }
+
+    for (index = 0; index < m_nCoalescingFlows; ++index)
+    {
+        if (RscSameFlow(m_CoalescingFlows[index].Head->PacketInfo, info))
+        {
+            break;
+        }
+    }
+
+    ULONG payload = RscSegmentPayload(m_Context, pBufferDescriptor);
+    TCPHeader *pTcpHeader = RscTcpHeader(info);
+
+    if (index < m_nCoalescingFlows)
+    {
+        _CoalescingFlow &flow = m_CoalescingFlows[index];
+
+        if (payload && AppendToFlow(flow, pBufferDescriptor, payload))
+        {
+            if (flow.Push || payload < flow.SegmentPayload ||
+                flow.Head->CoalescedSegments + 1 == PARANDIS_RSC_MAX_SEGMENTS)
+            {
+                FlushCoalescingFlow(index, nCurrCpuReceiveQueue);
+            }
+            return true;
+        }
+        FlushCoalescingFlow(index, nCurrCpuReceiveQueue);
+    }
+
+    if (!payload || (pTcpHeader->tcp_flags & (RSC_TCP_FLAG_PSH << 8)))
+    {
+        return false;
+    }
+
+    if (m_nCoalescingFlows == PARANDIS_RSC_MAX_FLOWS)
+    {
+        FlushCoalescingFlow(0, nCurrCpuReceiveQueue);
+    }
+
+    _CoalescingFlow &flow = m_CoalescingFlows[m_nCoalescingFlows++];
+    flow.Head = flow.Tail = pBufferDescriptor;
+    flow.NextSeq = RtlUlongByteSwap(pTcpHeader->tcp_seq) + payload;
+    flow.SegmentPayload = flow.TotalPayload = payload;
+    flow.Window = pTcpHeader->tcp_window;
+    flow.Push = false;
+
+    pBufferDescriptor->CoalescedSegments = 0;
+    pBufferDescriptor->CoalescedNext = NULL;
+    pBufferDescriptor->HolderTail = NULL;
+    return true;
+}
+
+bool CParaNdisRX::AppendToFlow(_CoalescingFlow &Flow, pRxNetDescriptor pBufferDescriptor, ULONG Payload)
+{
+    pRxNetDescriptor pHead = Flow.Head;
+    const NET_PACKET_INFO &info = pBufferDescriptor->PacketInfo;
+    TCPHeader *pTcpHeader = RscTcpHeader(info);
+    TCPHeader *pHeadTcpHeader = RscTcpHeader(pHead->PacketInfo);
+    ULONG tcpHeaderLength = TCP_HEADER_LENGTH(pTcpHeader);
+    PUCHAR ip = (PUCHAR)RtlOffsetToPointer(info.headersBuffer, info.L2HdrLen);
+    PUCHAR headIp = (PUCHAR)RtlOffsetToPointer(pHead->PacketInfo.headersBuffer, pHead->PacketInfo.L2HdrLen);
+
+    if (RtlUlongByteSwap(pTcpHeader->tcp_seq) != Flow.NextSeq || pTcpHeader->tcp_ack != pHeadTcpHeader->tcp_ack ||
+        tcpHeaderLength != TCP_HEADER_LENGTH(pHeadTcpHeader) || Payload > Flow.SegmentPayload ||
+        Flow.TotalPayload + Payload > MAX_IP4_DATAGRAM_SIZE - info.L3HdrLen - tcpHeaderLength)
+    {
+        return false;
+    }
+
+    // TCP options are compared as is, timestamps must be the same
+    if (!RtlEqualMemory(pTcpHeader + 1, pHeadTcpHeader + 1, tcpHeaderLength - sizeof(TCPHeader)))
+    {
+        return false;
+    }
+
+    if (info.isIP4)
+    {
+        IPv4Header *pIpHeader = (IPv4Header *)ip;
+        IPv4Header *pHeadIpHeader = (IPv4Header *)headIp;
+
+        if (pIpHeader->ip_tos != pHeadIpHeader->ip_tos || pIpHeader->ip_ttl != pHeadIpHeader->ip_ttl ||
+            pIpHeader->ip_offset != pHeadIpHeader->ip_offset)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        IPv6Header *pIpHeader = (IPv6Header *)ip;
+        IPv6Header *pHeadIpHeader = (IPv6Header *)headIp;
+
+        // version, traffic class and flow label
+        if (!RtlEqualMemory(pIpHeader, pHeadIpHeader, sizeof(ULONG)) ||
+            pIpHeader->ip6_hoplimit != pHeadIpHeader->ip6_hoplimit)
+        {
+            return false;
+        }
+    }
+
+    PMDL pPayloadMDL = NdisAllocateMdl(m_Context->MiniportHandle,
+                                       RtlOffsetToPointer(info.headersBuffer,
+                                                          info.L2HdrLen + info.L3HdrLen + tcpHeaderLength),
+                                       Payload);
+    if (pPayloadMDL == NULL)
+    {
+        return false;
+    }
+    NDIS_MDL_LINKAGE(pPayloadMDL) = NULL;
+
+    if (Flow.Tail == pHead)
+    {
+        // the frame of the first segment ends in its first MDL
+        pHead->HolderTail = NDIS_MDL_LINKAGE(pHead->Holder);
+        NdisAdjustMdlLength(pHead->Holder, pHead->PacketInfo.dataLength);
+        NDIS_MDL_LINKAGE(pHead->Holder) = pPayloadMDL;
+    }
+    else
+    {
+        NDIS_MDL_LINKAGE(Flow.Tail->CoalescedPayloadMDL) = pPayloadMDL;
+    }
+
+    pBufferDescriptor->CoalescedPayloadMDL = pPayloadMDL;
+    pBufferDescriptor->CoalescedNext = NULL;
+    Flow.Tail->CoalescedNext = pBufferDescriptor;
+    Flow.Tail = pBufferDescriptor;
+    pHead->CoalescedSegments++;
+
+    Flow.NextSeq += Payload;
+    Flow.TotalPayload += Payload;
+    Flow.Window = pTcpHeader->tcp_window;
+    Flow.Push = (pTcpHeader->tcp_flags & (RSC_TCP_FLAG_PSH << 8)) != 0;
+    return true;
+}
+
+// Finalizes the headers of the coalesced frame and passes it on
+void CParaNdisRX::FlushCoalescingFlow(UINT Index, CCHAR nCurrCpuReceiveQueue)
+{
+    _CoalescingFlow flow = m_CoalescingFlows[Index];
+    pRxNetDescriptor pHead = flow.Head;
+
+    m_nCoalescingFlows--;
+    for (UINT i = Index; i < m_nCoalescingFlows; ++i)
+    {
+        m_CoalescingFlows[i] = m_CoalescingFlows[i + 1];
+    }
+
+    if (pHead->CoalescedSegments)
+    {
+        PNET_PACKET_INFO pInfo = &pHead->PacketInfo;
+        PVOID ip = RtlOffsetToPointer(pInfo->headersBuffer, pInfo->L2HdrLen);
+        TCPHeader *pTcpHeader = RscTcpHeader(*pInfo);
+        ULONG added = flow.TotalPayload - flow.SegmentPayload;
+
+        if (pInfo->isIP4)
+        {
+            IPv4Header *pIpHeader = (IPv4Header *)ip;
+
+            pIpHeader->ip_length = RtlUshortByteSwap((USHORT)(RtlUshortByteSwap(pIpHeader->ip_length) + added));
+            pIpHeader->ip_xsum = 0;
+            pIpHeader->ip_xsum = CheckSumCalculator(pIpHeader, sizeof(IPv4Header));
+        }
+        else
+        {
+            IPv6Header *pIpHeader = (IPv6Header *)ip;
+
+            pIpHeader->ip6_payload_len = RtlUshortByteSwap((USHORT)(RtlUshortByteSwap(pIpHeader->ip6_payload_len) +
+                                                                    added));
+        }
+
+        // the TCP checksum is reported as not valid for coalesced frames
+        pTcpHeader->tcp_window = flow.Window;
+        if (flow.Push)
+        {
+            pTcpHeader->tcp_flags |= RSC_TCP_FLAG_PSH << 8;
+        }
+
+        pInfo->dataLength += added;
+        pInfo->L2PayloadLen += added;
+    }
+
+    DispatchReceivedPacket(pHead, nCurrCpuReceiveQueue);
+}
+
+void CParaNdisRX::FlushCoalescingFlows(CCHAR nCurrCpuReceiveQueue)
+{
+    while (m_nCoalescingFlows)
+    {
+        FlushCoalescingFlow(0, nCurrCpuReceiveQueue);
+    }
+}
+
+// Called under m_Lock when the coalesced frame is returned
+void CParaNdisRX::ReleaseCoalescedSegments(pRxNetDescriptor pBufferDescriptor)
+{
+    pRxNetDescriptor pSegment = pBufferDescriptor->CoalescedNext;
+
+    NDIS_MDL_LINKAGE(pBufferDescriptor->Holder) = pBufferDescriptor->HolderTail;
+    NdisAdjustMdlLength(pBufferDescriptor->Holder,
+                        ParaNdis_RxDataMdlCapacity(pBufferDescriptor, pBufferDescriptor->FirstRxDataPage));
+    pBufferDescriptor->HolderTail = NULL;
+    pBufferDescriptor->CoalescedNext = NULL;
+    pBufferDescriptor->CoalescedSegments = 0;
+
+    while (pSegment)
+    {
+        pRxNetDescriptor pNext = pSegment->CoalescedNext;
+
+        NdisFreeMdl(pSegment->CoalescedPayloadMDL);
+        pSegment->CoalescedPayloadMDL = NULL;
+        pSegment->CoalescedNext = NULL;
+        ReuseReceiveBufferNoLock(pSegment);
+        pSegment = pNext;
+    }
+}
+
+#endif
+
+// Returns the next buffer used by the device, the ring is read in batches.
+// ProcessRxRing runs until this returns NULL, so nothing stays cached between DPCs.
+pRxNetDescriptor CParaNdisRX::GetCompletedBuffer(UINT *pLength)
+{
+    if (m_Completed.Next == m_Completed.Count)
+    {
+        m_Completed.Next = 0;
+        m_Completed.Count = m_VirtQueue.GetBufs(m_Completed.Buffers,
+                                                m_Completed.Lengths,
+                                                CVirtQueue::CompletionBatchSize);
+        if (!m_Completed.Count)
+        {
+            return NULL;
+        }
+    }
+    *pLength = m_Completed.Lengths[m_Completed.Next];
+    return (pRxNetDescriptor)m_Completed.Buffers[m_Completed.Next++];
+}
+
 VOID CParaNdisRX::ProcessRxRing(CCHAR nCurrCpuReceiveQueue)
 {
     pRxNetDescriptor pBufferDescriptor;
     unsigned int nFullLength;
+    UINT nBuffers = 0;
+    ULONGLONG nBytes = 0;
 
     TDPCSpinLocker autoLock(m_Lock);
 
+    ReuseRecycledBuffers();
+
     if (m_Context->extraStatistics.minFreeRxBuffers > m_NetNofReceiveBuffers)
     {
         m_Context->extraStatistics.minFreeRxBuffers = m_NetNofReceiveBuffers;
     }
 
-    while (NULL != (pBufferDescriptor = (pRxNetDescriptor)m_VirtQueue.GetBuf(&nFullLength)))
+    while (NULL != (pBufferDescriptor = GetCompletedBuffer(&nFullLength)))
     {
         RemoveEntryList(&pBufferDescriptor->listEntry);
         m_NetNofReceiveBuffers--;
+        nBuffers++;
+        nBytes += nFullLength;
 
         pRxNetDescriptor pProcessBuffer = pBufferDescriptor;
 
@@ -949,6 +1581,10 @@ VOID CParaNdisRX::ProcessRxRing(CCHAR nCurrCpuReceiveQueue)
             {
                 continue; // Assembly failed, buffer already reused
             }
+            if (m_PagePool.IsActive())
+            {
+                m_PagePool.UpdateAverage(pProcessBuffer->PacketInfo.dataLength + m_Context->nVirtioHeaderSize);
+            }
         }
         else
         {
@@ -960,6 +1596,17 @@ VOID CParaNdisRX::ProcessRxRing(CCHAR nCurrCpuReceiveQueue)
         // Note: For mergeable buffers, dataLength is already set in ProcessMergedBuffers
         ProcessReceivedPacket(pProcessBuffer, nCurrCpuReceiveQueue);
     }
+
+#if PARANDIS_SUPPORT_RSC
+    FlushCoalescingFlows(nCurrCpuReceiveQueue);
+#endif
+
+    if (nBuffers && m_PagePool.IsActive())
+    {
+        m_PagePool.UpdateTargetShift();
+    }
+
+    m_VirtQueue.CoalesceSample(nBuffers, nBytes);
 }
 
 void CParaNdisRX::PopulateQueue()
@@ -967,6 +1614,7 @@ void CParaNdisRX::PopulateQueue()
     LIST_ENTRY TempList;
     TPassiveSpinLocker autoLock(m_Lock);
 
+    ReuseRecycledBuffers();
     InitializeListHead(&TempList);
 
     while (!IsListEmpty(&m_NetReceiveBuffers))
@@ -987,7 +1635,7 @@ void CParaNdisRX::PopulateQueue()
         {
             /* TODO - NetMaxReceiveBuffers should take into account all queues */
             DPrintf(0, "FAILED TO REUSE THE BUFFER!!!!");
-            ParaNdis_FreeRxBufferDescriptor(m_Context, pBufferDescriptor);
+            FreeRxDescriptor(pBufferDescriptor);
             m_NetMaxReceiveBuffers--;
         }
     }
@@ -1036,6 +1684,19 @@ pRxNetDescriptor CParaNdisRX::ProcessMergedBuffers(pRxNetDescriptor pFirstBuffer
 
     DPrintf(5, "Received packet: length=%u, num_buffers=%u", nFullLength, numBuffers);
 
+    if (numBuffers == 0 || numBuffers > VIRTIO_NET_MAX_MRG_BUFS)
+    {
+        DPrintf(0, "ERROR: num_buffers %u is out of range 1..%u", numBuffers, VIRTIO_NET_MAX_MRG_BUFS);
+        ReuseReceiveBufferNoLock(pFirstBuffer);
+        // the rest of the chain is in the ring after the first buffer,
+        // drop it as well so it is not taken for the next packets
+        if (numBuffers)
+        {
+            DropMergedBuffers(numBuffers - 1);
+        }
+        return NULL;
+    }
+
     // Fast path: single buffer packet (most common case)
     if (numBuffers == 1)
     {
@@ -1091,7 +1752,7 @@ BOOLEAN CParaNdisRX::CollectRemainingMergeBuffers()
     // Note: BufferSequence[0] already contains the first buffer from initial GetBuf
     while (m_MergeContext.CollectedBuffers < m_MergeContext.ExpectedBuffers)
     {
-        pBufferDescriptor = (pRxNetDescriptor)m_VirtQueue.GetBuf(&nFullLength);
+        pBufferDescriptor = GetCompletedBuffer(&nFullLength);
         if (!pBufferDescriptor)
         {
             DPrintf(0,
@@ -1192,3 +1853,25 @@ void CParaNdisRX::ReuseCollectedBuffers()
         ReuseReceiveBufferNoLock(m_MergeContext.BufferSequence[i]);
     }
 }
+
+// Take the remaining buffers of a rejected mergeable packet from the ring
+// and return them to the device without processing
+void CParaNdisRX::DropMergedBuffers(UINT nRemaining)
+{
+    unsigned int nFullLength;
+    pRxNetDescriptor pBufferDescriptor;
+
+    while (nRemaining--)
+    {
+        pBufferDescriptor = GetCompletedBuffer(&nFullLength);
+        if (!pBufferDescriptor)
+        {
+            DPrintf(0, "ERROR: %u buffers of the dropped packet are unavailable", nRemaining + 1);
+            return;
+        }
+
+        RemoveEntryList(&pBufferDescriptor->listEntry);
+        m_NetNofReceiveBuffers--;
+        ReuseReceiveBufferNoLock(pBufferDescriptor);
+    }
+}
@@ -0,0 +1,191 @@
+#include "ndis56common.h"
+#include "kdebugprint.h"
+#include "Trace.h"
+#ifdef NETKVM_WPP_ENABLED
+#include "ParaNdis_RxPagePool.tmh"
+#endif
+
+CRxPagePool::CRxPagePool()
+{
+    for (UINT i = 0; i < ARRAYSIZE(m_PartialPages); ++i)
+    {
+        InitializeListHead(&m_PartialPages[i]);
+    }
+    InitializeListHead(&m_UnusedPages);
+    InitializeListHead(&m_AllPages);
+}
+
+void CRxPagePool::Initialize(PPARANDIS_ADAPTER Context, ULONG MinSliceSize, ULONG MaxPages)
+{
+    m_Context = Context;
+    m_MaxPages = MaxPages;
+    m_MaxShift = 0;
+    while (m_MaxShift < RX_POOL_MAX_SHIFT && (PAGE_SIZE >> (m_MaxShift + 1)) >= MinSliceSize)
+    {
+        m_MaxShift++;
+    }
+    // start with the smallest buffers, the average grows with the traffic
+    m_TargetShift = m_MaxShift;
+    m_ScaledAverage = (PAGE_SIZE >> m_MaxShift) * RX_POOL_AVERAGE_WEIGHT;
+
+    DPrintf(0, "min slice %u, slices of %u..%u bytes", MinSliceSize, PAGE_SIZE >> m_MaxShift, PAGE_SIZE);
+}
+
+void CRxPagePool::Destroy()
+{
+    while (!IsListEmpty(&m_AllPages))
+    {
+        tRxPoolPage *page = CONTAINING_RECORD(RemoveHeadList(&m_AllPages), tRxPoolPage, PoolLink);
+
+        NETKVM_ASSERT(page->UsedSlices == 0);
+        RemoveEntryList(&page->Link);
+        FreePage(page);
+    }
+    for (UINT i = 0; i < ARRAYSIZE(m_PartialPages); ++i)
+    {
+        InitializeListHead(&m_PartialPages[i]);
+    }
+    InitializeListHead(&m_UnusedPages);
+    m_NumPages = 0;
+}
+
+tRxPoolPage *CRxPagePool::AllocatePage()
+{
+    tRxPoolPage *page = (tRxPoolPage *)ParaNdis_AllocateMemory(m_Context, sizeof(*page));
+
+    if (page == NULL)
+    {
+        return NULL;
+    }
+
+    NdisZeroMemory(page, sizeof(*page));
+    if (!ParaNdis_InitialAllocatePhysicalMemory(m_Context, PAGE_SIZE, &page->Memory))
+    {
+        NdisFreeMemory(page, 0, 0);
+        return NULL;
+    }
+    InitializeListHead(&page->Link);
+    InitializeListHead(&page->PoolLink);
+    return page;
+}
+
+void CRxPagePool::FreePage(tRxPoolPage *Page)
+{
+    ParaNdis_FreePhysicalMemory(m_Context, &Page->Memory);
+    NdisFreeMemory(Page, 0, 0);
+}
+
+void CRxPagePool::AddPage(tRxPoolPage *Page)
+{
+    Page->UsedSlices = 0;
+    InsertTailList(&m_AllPages, &Page->PoolLink);
+    InsertTailList(&m_UnusedPages, &Page->Link);
+    m_NumPages++;
+}
+
+void CRxPagePool::CarvePage(tRxPoolPage *Page, UCHAR Shift)
+{
+    RemoveEntryList(&Page->Link);
+    Page->Shift = Shift;
+    Page->FreeSlices = (ULONG)(((ULONGLONG)1 << (1 << Shift)) - 1);
+    InsertHeadList(&m_PartialPages[Shift], &Page->Link);
+}
+
+void CRxPagePool::TakeSlice(tRxPoolPage *Page, UCHAR Index)
+{
+    Page->FreeSlices &= ~(1UL << Index);
+    Page->UsedSlices++;
+    if (!Page->FreeSlices)
+    {
+        RemoveEntryList(&Page->Link);
+        InitializeListHead(&Page->Link);
+    }
+}
+
+bool CRxPagePool::GetSlice(UCHAR Shift, tRxPoolSlice &Slice)
+{
+    tRxPoolPage *page;
+    ULONG index;
+
+    if (!IsListEmpty(&m_PartialPages[Shift]))
+    {
+        page = CONTAINING_RECORD(m_PartialPages[Shift].Flink, tRxPoolPage, Link);
+    }
+    else if (!IsListEmpty(&m_UnusedPages))
+    {
+        page = CONTAINING_RECORD(m_UnusedPages.Flink, tRxPoolPage, Link);
+        CarvePage(page, Shift);
+    }
+    else
+    {
+        return false;
+    }
+
+    _BitScanForward(&index, page->FreeSlices);
+    TakeSlice(page, (UCHAR)index);
+
+    Slice.Page = page;
+    Slice.Shift = Shift;
+    Slice.Index = (UCHAR)index;
+    return true;
+}
+
+void CRxPagePool::PutSlice(const tRxPoolSlice &Slice)
+{
+    tRxPoolPage *page = Slice.Page;
+    bool wasFull = page->FreeSlices == 0;
+
+    NETKVM_ASSERT(page->Shift == Slice.Shift && !(page->FreeSlices & (1UL << Slice.Index)));
+    page->FreeSlices |= 1UL << Slice.Index;
+    page->UsedSlices--;
+
+    if (!page->UsedSlices)
+    {
+        RemoveEntryList(&page->Link);
+        InsertTailList(&m_UnusedPages, &page->Link);
+    }
+    else if (wasFull)
+    {
+        InsertHeadList(&m_PartialPages[page->Shift], &page->Link);
+    }
+}
+
+void CRxPagePool::ReclaimSlice(const tRxPoolSlice &Slice)
+{
+    tRxPoolPage *page = Slice.Page;
+
+    if (!page->UsedSlices)
+    {
+        CarvePage(page, Slice.Shift);
+    }
+    NETKVM_ASSERT(page->Shift == Slice.Shift && (page->FreeSlices & (1UL << Slice.Index)));
+    TakeSlice(page, Slice.Index);
+}
+
+void CRxPagePool::GetSliceMemory(const tRxPoolSlice &Slice, tCompletePhysicalAddress &Memory) const
+{
+    ULONG size = PAGE_SIZE >> Slice.Shift;
+    ULONG offset = size * Slice.Index;
+
+    Memory.Virtual = RtlOffsetToPointer(Slice.Page->Memory.Virtual, offset);
+    Memory.Physical.QuadPart = Slice.Page->Memory.Physical.QuadPart + offset;
+    Memory.size = size;
+}
+
+void CRxPagePool::UpdateTargetShift()
+{
+    ULONG average = m_ScaledAverage / RX_POOL_AVERAGE_WEIGHT;
+    UCHAR shift = 0;
+
+    // the smallest class that holds the average packet
+    while (shift < m_MaxShift && (PAGE_SIZE >> (shift + 1)) >= average)
+    {
+        shift++;
+    }
+
+    if (shift != m_TargetShift)
+    {
+        DPrintf(1, "average packet %u, slices of %u bytes", average, PAGE_SIZE >> shift);
+        m_TargetShift = shift;
+    }
+}
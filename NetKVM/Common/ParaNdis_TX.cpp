@@ -13,6 +13,7 @@ CNBL::CNBL(PNET_BUFFER_LIST NBL,
     : m_NBL(NBL), m_Context(Context), m_ParentTXPath(&ParentTXPath), CNdisAllocatableViaHelper<CNBL>(NBLAllocator),
       m_NBAllocator(NBAllocator)
 {
+    m_SendTime = ParaNdis_LatencyTimestamp();
     m_NBL->Scratch = this;
     m_LsoInfo.Value = NET_BUFFER_LIST_INFO(m_NBL, TcpLargeSendNetBufferListInfo);
     m_CsoInfo.Value = NET_BUFFER_LIST_INFO(m_NBL, TcpIpChecksumNetBufferListInfo);
@@ -312,7 +313,11 @@ void CNBL::StartMapping()
     AddRef();
 
     m_Buffers.ForEach([this](CNB *NB) {
-        if (!NB->ScheduleBuildSGListForTx())
+        if (NB->ScheduleInlineForTx())
+        {
+            NB->MappingDone(nullptr);
+        }
+        else if (!NB->ScheduleBuildSGListForTx())
         {
             m_HaveFailedMappings = true;
             NB->MappingDone(nullptr);
@@ -387,6 +392,7 @@ void CParaNdisTX::CompleteOutstandingNBLChain(PNET_BUFFER_LIST NBL, ULONG Flags)
 
     DPrintf(3, "completing %d nbls", NBLNum);
     ParaNdis_CompleteNBLChain(m_Context->MiniportHandle, NBL, Flags);
+    InterlockedExchangeAdd(&m_CompletedNBLs, (LONG)NBLNum);
 
     m_StateMachine.UnregisterOutstandingItems(NBLNum);
 }
@@ -396,6 +402,8 @@ void CParaNdisTX::CompleteOutstandingInternalNBL(PNET_BUFFER_LIST NBL, BOOLEAN U
     ULONG NBLNum = ParaNdis_CountNBLs(NBL);
 
     CGuestAnnouncePackets::NblCompletionCallback(NBL);
+    // the send handler queued the internal NBLs on the path like any other
+    InterlockedExchangeAdd(&m_CompletedNBLs, (LONG)NBLNum);
 
     if (UnregisterOutstanding)
     {
@@ -420,6 +428,7 @@ void CParaNdisTX::Send(PNET_BUFFER_LIST NBL)
         if (CallCompletion)
         {
             ParaNdis_CompleteNBLChainWithStatus(m_Context->MiniportHandle, NBL, RejectionStatus);
+            InterlockedExchangeAdd(&m_CompletedNBLs, (LONG)count);
         }
         else
         {
@@ -756,8 +765,12 @@ PNET_BUFFER_LIST CParaNdisTX::ProcessWaitingList(CRawCNBLList &completed)
 
         completed.ForEachDetached([&](CNBL *NBL) { m_WaitingList.PushBack(NBL); });
 
+        ULONG64 now = ParaNdis_LatencyTimestamp();
         m_WaitingList.ForEachDetachedIf([](CNBL *NBL) { return NBL->IsSendDone(); },
-                                        [&](CNBL *NBL) { completed.PushBack(NBL); });
+                                        [&](CNBL *NBL) {
+                                            ParaNdis_LatencyAdd(Latency.Complete, NBL->GetSendTime(), now);
+                                            completed.PushBack(NBL);
+                                        });
     }
     // end of locked part under waiting list lock
 
@@ -889,6 +902,8 @@ bool CParaNdisTX::SendMapped(bool IsInterrupt, CRawCNBLList &toWaitingList)
             if (NBLHolder->HaveMappedBuffers())
             {
                 auto NBHolder = NBLHolder->PopMappedNB();
+                ULONG64 now = ParaNdis_LatencyTimestamp();
+                NBHolder->SetSubmitTime(now);
                 auto result = m_VirtQueue.SubmitPacket(*NBHolder);
 
                 switch (result)
@@ -902,6 +917,7 @@ bool CParaNdisTX::SendMapped(bool IsInterrupt, CRawCNBLList &toWaitingList)
                              * sending all it's NBs, we should pop it from the queue.
                              */
                             PopMappedNBL();
+                            ParaNdis_LatencyAdd(Latency.Queue, NBLHolder->GetSendTime(), now);
                             toWaitingList.Push(NBLHolder);
                         }
                         else
@@ -1045,6 +1061,7 @@ bool CParaNdisTX::DoPendingTasks(CNBL *nblHolder)
 
         if (bFromDpc)
         {
+            m_VirtQueue.ReportCompletions();
             m_DpcWaiting.Release();
         }
 
@@ -1109,6 +1126,14 @@ bool CNB::ScheduleBuildSGListForTx()
            NDIS_STATUS_SUCCESS;
 }
 
+bool CNB::ScheduleInlineForTx()
+{
+    // Small frames are cheaper to copy than to map, LSO/USO frames are never small
+    // but their headers are rewritten in place, so they always use the SG list
+    m_Inline = GetDataLength() <= m_Context->uTxInlineThreshold && !m_ParentNBL->IsLSO() && !m_ParentNBL->IsUSO();
+    return m_Inline;
+}
+
 void CNB::PopulateIPLength(IPHeader *IpHeader, USHORT IpLength) const
 {
     if ((IpHeader->v4.ip_verlen & 0xF0) == 0x40)
@@ -1245,6 +1270,41 @@ NBMappingStatus CNB::FillDescriptorSGList(CTXDescriptor &Descriptor, ULONG Parse
     }
 }
 
+NBMappingStatus CNB::FillDescriptorInline(CTXDescriptor &Descriptor, ULONG ParsedHeadersLength)
+{
+    auto &HeadersArea = Descriptor.HeadersAreaAccessor();
+    ULONG DataLength = GetDataLength();
+
+    if (DataLength > HeadersArea.MaxEthHeadersSize())
+    {
+        return NBMappingStatus::FAILURE;
+    }
+
+    // the headers are already there, append the rest of the frame
+    if (DataLength > ParsedHeadersLength)
+    {
+        PMDL Mdl = NET_BUFFER_CURRENT_MDL(m_NB);
+        ULONG Offset = NET_BUFFER_CURRENT_MDL_OFFSET(m_NB) + ParsedHeadersLength;
+        ULONG ToCopy = DataLength - ParsedHeadersLength;
+
+        if (CopyFromMdlChain(RtlOffsetToPointer(HeadersArea.EthHeadersAreaVA(), ParsedHeadersLength),
+                             ToCopy,
+                             Mdl,
+                             Offset) != ToCopy)
+        {
+            return NBMappingStatus::FAILURE;
+        }
+    }
+
+    if (!Descriptor.SetupHeaders(DataLength))
+    {
+        return NBMappingStatus::FAILURE;
+    }
+
+    m_Context->extraStatistics.inlinedTxPackets++;
+    return NBMappingStatus::SUCCESS;
+}
+
 NBMappingStatus CNB::MapDataToVirtioSGL(CTXDescriptor &Descriptor, ULONG Offset) const
 {
     for (ULONG i = 0; i < m_SGL->NumberOfElements; i++)
@@ -1362,7 +1422,7 @@ void CNB::Report(int level, bool Success)
 
 NBMappingStatus CNB::BindToDescriptor(CTXDescriptor &Descriptor)
 {
-    if (m_SGL == nullptr)
+    if (m_SGL == nullptr && !m_Inline)
     {
         return NBMappingStatus::FAILURE;
     }
@@ -1385,6 +1445,11 @@ NBMappingStatus CNB::BindToDescriptor(CTXDescriptor &Descriptor)
                     GetDataLength() - m_Context->Offload.ipHeaderOffset,
                     L4HeaderOffset);
 
+    if (m_Inline)
+    {
+        return FillDescriptorInline(Descriptor, HeadersLength);
+    }
+
     return FillDescriptorSGList(Descriptor, HeadersLength);
 }
 
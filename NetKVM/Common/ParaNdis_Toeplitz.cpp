@@ -0,0 +1,164 @@
+/*
+ * This file contains the table driven and carry-less multiplication
+ * implementations of the Toeplitz hash used for RSS
+ *
+ * Copyright (c) 2026 Red Hat, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifdef _KERNEL_MODE
+#include "ndis56common.h"
+#else
+#include <windows.h>
+#endif
+#include "ParaNdis-Toeplitz.h"
+
+// The x86 kernel must save the FPU state before touching XMM registers, don't bother there
+#if defined(_M_AMD64) || (defined(_M_IX86) && !defined(_KERNEL_MODE))
+#define TOEPLITZ_CLMUL 1
+#include <intrin.h>
+#include <wmmintrin.h>
+#endif
+
+void CToeplitzHash::SetKey(const CCHAR *Key, ULONG KeySize)
+{
+    UCHAR key[TOEPLITZ_MAX_KEY_SIZE] = {};
+
+    for (ULONG i = 0; i < KeySize && i < TOEPLITZ_MAX_KEY_SIZE; ++i)
+    {
+        key[i] = (UCHAR)Key[i];
+    }
+
+    for (ULONG pos = 0; pos < TOEPLITZ_MAX_INPUT_SIZE; ++pos)
+    {
+        // 40 key bits starting at the first bit of the input byte, enough for the windows of all 8 bits
+        UINT64 bits = ((UINT64)key[pos] << 32) | ((UINT64)key[pos + 1] << 24) | ((UINT64)key[pos + 2] << 16) |
+                      ((UINT64)key[pos + 3] << 8) | key[pos + 4];
+        UINT32 *table = m_Table[pos];
+
+        table[0] = 0;
+        // the value with only bit 'bit' (counting from MSB) set selects the window at that bit,
+        // any other value is built from a smaller one by adding its highest bit
+        for (int bit = 7; bit >= 0; --bit)
+        {
+            ULONG highest = 0x80 >> bit;
+            UINT32 window = (UINT32)(bits >> (8 - bit));
+
+            for (ULONG lower = 0; lower < highest; ++lower)
+            {
+                table[highest | lower] = table[lower] ^ window;
+            }
+        }
+    }
+
+    for (ULONG word = 0; word < ARRAYSIZE(m_ReversedKeyWindows); ++word)
+    {
+        UINT64 reversed = 0;
+
+        for (ULONG bit = 0; bit < 64; ++bit)
+        {
+            UCHAR keyByte = key[word * sizeof(UINT32) + bit / 8];
+            reversed |= (UINT64)((keyByte >> (7 - bit % 8)) & 1) << bit;
+        }
+        m_ReversedKeyWindows[word] = reversed;
+    }
+
+    m_UseClmul = ClmulSupported();
+}
+
+UINT32 CToeplitzHash::HashTable(const TOEPLITZ_CHUNK *Chunks, ULONG NumChunks) const
+{
+    const UINT32(*table)[256] = m_Table;
+    UINT32 res = 0;
+
+    for (ULONG i = 0; i < NumChunks; ++i)
+    {
+        const UCHAR *data = (const UCHAR *)Chunks[i].chunkPtr;
+
+        for (ULONG byte = 0; byte < Chunks[i].chunkLen; ++byte, ++table)
+        {
+            res ^= (*table)[data[byte]];
+        }
+    }
+    return res;
+}
+
+#if TOEPLITZ_CLMUL
+
+static UINT32 ReverseBits32(UINT32 x)
+{
+    x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+    x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F) | ((x & 0x0F0F0F0F) << 4);
+    x = ((x >> 8) & 0x00FF00FF) | ((x & 0x00FF00FF) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// With the input word d0..d31 (d0 is the MSB) and the key bits k0..k63 starting at the word
+// placed in reversed order (k0 is bit 0), bit 31 + j of their carry-less product is the XOR of
+// di & k(i + j), that is bit 31 - j of the word's contribution to the hash. The contributions
+// of all words are accumulated unreversed and the bit order is fixed once at the end.
+UINT32 CToeplitzHash::HashClmul(const TOEPLITZ_CHUNK *Chunks, ULONG NumChunks) const
+{
+    const UINT64 *window = m_ReversedKeyWindows;
+    __m128i acc = _mm_setzero_si128();
+
+    for (ULONG i = 0; i < NumChunks; ++i)
+    {
+        const UCHAR *data = (const UCHAR *)Chunks[i].chunkPtr;
+
+        for (ULONG offset = 0; offset < Chunks[i].chunkLen; offset += sizeof(UINT32), ++window)
+        {
+            UINT32 word = _byteswap_ulong(*(const UINT32 UNALIGNED *)(data + offset));
+            __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int)word),
+                                                   _mm_loadl_epi64((const __m128i *)window),
+                                                   0x00);
+            acc = _mm_xor_si128(acc, product);
+        }
+    }
+    return ReverseBits32((UINT32)_mm_cvtsi128_si32(_mm_srli_epi64(acc, 31)));
+}
+
+bool CToeplitzHash::ClmulSupported()
+{
+    int regs[4];
+
+    __cpuid(regs, 1);
+    // ECX bit 1 - PCLMULQDQ
+    return (regs[2] & (1 << 1)) != 0;
+}
+
+#else
+
+UINT32 CToeplitzHash::HashClmul(const TOEPLITZ_CHUNK *Chunks, ULONG NumChunks) const
+{
+    return HashTable(Chunks, NumChunks);
+}
+
+bool CToeplitzHash::ClmulSupported()
+{
+    return false;
+}
+
+#endif
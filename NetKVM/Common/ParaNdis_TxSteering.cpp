@@ -0,0 +1,107 @@
+#include "ndis56common.h"
+#include "kdebugprint.h"
+#include "Trace.h"
+#ifdef NETKVM_WPP_ENABLED
+#include "ParaNdis_TxSteering.tmh"
+#endif
+
+void CTxSteering::Initialize(PPARANDIS_ADAPTER Context, bool Enable)
+{
+    m_Context = Context;
+    m_Enabled = Enable;
+    NdisZeroMemory(m_Flows, sizeof(m_Flows));
+
+    DPrintf(0, "TX steering by processor %s", Enable ? "enabled" : "disabled");
+}
+
+CPUPathBundle *CTxSteering::LocalPath() const
+{
+    return m_Context->pPathBundles + ParaNdis_GetCurrentCPUIndex() % m_Context->nPathBundles;
+}
+
+// Multiplicative hash of the addresses and, unless the packet is a fragment, the ports
+bool CTxSteering::GetFlowHash(PNET_BUFFER_LIST NBL, ULONG &Hash)
+{
+    PNET_BUFFER nb = NET_BUFFER_LIST_FIRST_NB(NBL);
+    UCHAR storage[TX_STEERING_HEADERS_SIZE];
+    ULONG length = min(NET_BUFFER_DATA_LENGTH(nb), (ULONG)sizeof(storage));
+    NET_PACKET_INFO info;
+    PUCHAR headers, ip;
+    ULONG offset, end;
+
+    headers = (PUCHAR)NdisGetDataBuffer(nb, length, storage, 1, 0);
+    if (headers == NULL || !ParaNdis_AnalyzeReceivedPacket(headers, length, &info) || !(info.isIP4 || info.isIP6))
+    {
+        return false;
+    }
+
+    ip = headers + info.L2HdrLen;
+    if (info.isIP4)
+    {
+        offset = FIELD_OFFSET(IPv4Header, ip_src);
+        end = offset + 2 * sizeof(ULONG);
+    }
+    else
+    {
+        offset = FIELD_OFFSET(IPv6Header, ip6_src_address);
+        end = offset + 2 * sizeof(IPV6_ADDRESS);
+    }
+
+    Hash = 0;
+    for (; offset < end; offset += sizeof(ULONG))
+    {
+        Hash = (Hash ^ *(const ULONG UNALIGNED *)(ip + offset)) * 0x9E3779B1;
+    }
+    if ((info.isTCP || info.isUDP) && !info.isFragment)
+    {
+        Hash = (Hash ^ *(const ULONG UNALIGNED *)(ip + info.L3HdrLen)) * 0x9E3779B1;
+    }
+    Hash ^= Hash >> 16;
+    return true;
+}
+
+CPUPathBundle *CTxSteering::SelectPath(PNET_BUFFER_LIST NBL, CPUPathBundle *const *QueueMap, ULONG HashMask)
+{
+    CPUPathBundle *path;
+    ULONG hash;
+
+    if (QueueMap != NULL && (!m_Enabled || NET_BUFFER_LIST_GET_HASH_TYPE(NBL) != 0))
+    {
+        path = QueueMap[NET_BUFFER_LIST_GET_HASH_VALUE(NBL) & HashMask];
+        path->txPath.SteeringStatistics.ByHash++;
+    }
+    else if (!GetFlowHash(NBL, hash))
+    {
+        path = LocalPath();
+        path->txPath.SteeringStatistics.ByCpu++;
+    }
+    else
+    {
+        tTxSteeringFlow &flow = m_Flows[hash % TX_STEERING_FLOWS];
+        CPUPathBundle *local = LocalPath();
+
+        path = flow.Bundle ? m_Context->pPathBundles + flow.Bundle - 1 : local;
+        if (path != local && path->txPath.CompletedUpTo(flow.LastQueued))
+        {
+            path = local;
+        }
+
+        if (path == local)
+        {
+            path->txPath.SteeringStatistics.ByCpu++;
+        }
+        else
+        {
+            path->txPath.SteeringStatistics.ByFlow++;
+        }
+        flow.Bundle = (ULONG)(path - m_Context->pPathBundles) + 1;
+        flow.LastQueued = path->txPath.QueueNBL();
+        return path;
+    }
+
+    if (m_Enabled)
+    {
+        path->txPath.QueueNBL();
+    }
+    return path;
+}
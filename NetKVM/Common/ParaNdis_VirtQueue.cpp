@@ -43,7 +43,38 @@ void CVirtQueue::Renew()
     {
         DPrintf(0, "queue setup failed for index %u with error %x", m_Index, status);
         m_VirtQueue = nullptr;
+        return;
+    }
+
+    virtqueue_attach_stats(m_VirtQueue, &m_Stats);
+    if (m_Coalescing)
+    {
+        virtqueue_attach_coalesce(m_VirtQueue, &m_Coalesce);
+    }
+}
+
+void CVirtQueue::EnableCoalescing(enum virtqueue_coalesce_policy Policy)
+{
+    struct virtqueue_coalesce_params params = {};
+
+    if (m_VirtQueue == nullptr || m_Coalescing)
+    {
+        return;
     }
+
+    params.policy = Policy;
+    virtqueue_coalesce_init(&m_Coalesce, &params);
+    virtqueue_attach_coalesce(m_VirtQueue, &m_Coalesce);
+    m_Coalescing = true;
+}
+
+void CVirtQueue::DisableCoalescing()
+{
+    if (m_VirtQueue != nullptr)
+    {
+        virtqueue_attach_coalesce(m_VirtQueue, nullptr);
+    }
+    m_Coalescing = false;
 }
 
 bool CVirtQueue::Create(UINT Index, VirtIODevice *IODevice, NDIS_HANDLE DrvHandle)
@@ -87,7 +118,8 @@ bool CTXVirtQueue::PrepareBuffers()
     auto NumBuffers = min(m_MaxBuffers, GetRingSize());
     auto SGTableCapacity = m_SGTableCapacity;
 
-    if (SGTableCapacity > NumBuffers)
+    // without indirect tables each fragment takes a ring descriptor
+    if (!m_IndirectAreaSize && SGTableCapacity > NumBuffers)
     {
         DPrintf(0, "Limit m_SGTableCapacity by %d", NumBuffers);
         SGTableCapacity = NumBuffers;
@@ -105,7 +137,7 @@ bool CTXVirtQueue::PrepareBuffers()
                              m_HeaderSize,
                              m_SGTable,
                              SGTableCapacity,
-                             m_Context->bUseIndirect ? true : false,
+                             m_IndirectAreaSize,
                              m_Context->bAnyLayout ? true : false))
         {
             CTXDescriptor::Destroy(TXDescr, m_Context->MiniportHandle);
@@ -151,8 +183,14 @@ bool CTXVirtQueue::Create(UINT Index,
     m_HeaderSize = HeaderSize;
     m_Context = Context;
 
-    m_SGTableCapacity = m_Context->bUseIndirect ? virtio_get_indirect_page_capacity() : GetRingSize();
+    m_SGTableCapacity = m_Context->bUseIndirect ? virtqueue_get_indirect_capacity(m_VirtQueue) : GetRingSize();
+    // a chain may not be longer than the ring, even through an indirect table
+    m_SGTableCapacity = min(m_SGTableCapacity, GetRingSize());
     m_SGTableCapacity = min(m_SGTableCapacity, m_Context->uMaxFragmentsInOneNB);
+    if (m_Context->bUseIndirect)
+    {
+        m_IndirectAreaSize = (ULONG)ROUND_TO_PAGES(virtio_get_indirect_table_size(m_SGTableCapacity));
+    }
 
     auto SGBuffer = ParaNdis_AllocateMemoryRaw(m_DrvHandle, m_SGTableCapacity * sizeof(m_SGTable[0]));
     m_SGTable = static_cast<struct VirtIOBufferDescriptor *>(SGBuffer);
@@ -315,17 +353,28 @@ void CTXVirtQueue::ReleaseOneBuffer(CTXDescriptor *TXDescriptor, CRawCNBList &li
 
 UINT CTXVirtQueue::ReleaseTransmitBuffers(CRawCNBList &listDone)
 {
-    UINT len, i = 0;
-    CTXDescriptor *TXDescriptor;
+    UINT i = 0, count;
+    void *completed[CompletionBatchSize];
+    UINT lengths[CompletionBatchSize];
 
     DEBUG_ENTRY(4);
 
-    while (NULL != (TXDescriptor = (CTXDescriptor *)GetBuf(&len)))
+    while (0 != (count = GetBufs(completed, lengths, CompletionBatchSize)))
     {
-        m_DescriptorsInUse.Remove(TXDescriptor);
-        ReleaseOneBuffer(TXDescriptor, listDone);
-        ++i;
+        // the whole batch is seen completed at the same time
+        ULONG64 now = ParaNdis_LatencyTimestamp();
+        for (UINT j = 0; j < count; j++)
+        {
+            CTXDescriptor *TXDescriptor = (CTXDescriptor *)completed[j];
+
+            m_CompletedBytes += TXDescriptor->GetNB()->GetDataLength();
+            ParaNdis_LatencyAdd(m_DeviceLatency, TXDescriptor->GetNB()->GetSubmitTime(), now);
+            m_DescriptorsInUse.Remove(TXDescriptor);
+            ReleaseOneBuffer(TXDescriptor, listDone);
+        }
+        i += count;
     }
+    m_CompletedBuffers += i;
     if (i)
     {
         UpdateTimestamp(m_LastTxCompletionTimestamp);
@@ -34,11 +34,10 @@
 #include <windows.h>
 #include <stdio.h>
 
-#define DoPrint(fmt, ...)        printf(fmt##"\n", __VA_ARGS__)
-#define DPrintf(a, b)            DoPrint b
-#define RtlOffsetToPointer(B, O) ((PCHAR)(((PCHAR)(B)) + ((ULONG_PTR)(O))))
+#define DoPrint(fmt, ...) printf(fmt##"\n", __VA_ARGS__)
+#define DPrintf(a, b)     DoPrint b
 
-#include "ethernetutils.h"
+#include "ParaNdis-SwOffload.h"
 #endif //+OFFLOAD_UNIT_TEST
 
 #if !defined(OFFLOAD_UNIT_TEST)
@@ -130,23 +129,28 @@ typedef struct _PARANDIS_ADAPTER PARANDIS_ADAPTER;
 
 void ParaNdisPollNotify(PARANDIS_ADAPTER *, UINT Index, const char *Origin);
 void ParaNdisPollSetAffinity(PARANDIS_ADAPTER *);
-void RxPoll(PARANDIS_ADAPTER *pContext, UINT BundleIndex, NDIS_POLL_RECEIVE_DATA &RxData);
+// RearmQueue = false leaves the interrupt of the RX queue disabled when its ring is empty
+void RxPoll(PARANDIS_ADAPTER *pContext, UINT BundleIndex, NDIS_POLL_RECEIVE_DATA &RxData, bool RearmQueue);
 
 #include "ParaNdis-SM.h"
 #include "ParaNdis-RSS.h"
 
-typedef union _tagTcpIpPacketParsingResult tTcpIpPacketParsingResult;
-
-typedef struct _tagCompletePhysicalAddress
-{
-    PHYSICAL_ADDRESS Physical;
-    PVOID Virtual;
-    ULONG size;
-} tCompletePhysicalAddress;
+#include "ParaNdis-SwOffload.h"
+#include "ParaNdis-Latency.h"
 
 struct _tagRxNetDescriptor;
 typedef struct _tagRxNetDescriptor RxNetDescriptor, *pRxNetDescriptor;
 
+struct _tagRxPoolPage;
+
+// Slice of a page of the RX page pool, see ParaNdis-RxPagePool.h
+typedef struct _tagRxPoolSlice
+{
+    struct _tagRxPoolPage *Page;
+    UCHAR Shift;
+    UCHAR Index;
+} tRxPoolSlice;
+
 static __inline BOOLEAN ParaNDIS_IsQueueInterruptEnabled(struct virtqueue *_vq);
 
 struct PARANDIS_RECEIVE_QUEUE
@@ -163,6 +167,8 @@ struct PARANDIS_RECEIVE_QUEUE
     NDIS_SPIN_LOCK Lock;
     LIST_ENTRY BuffersList;
     COwnership Ownership;
+    // time the buffers wait in the queue, updated by the consumer, see ParaNdis-Latency.h
+    tLatencyHistogram Latency = {};
 };
 typedef PARANDIS_RECEIVE_QUEUE *PPARANDIS_RECEIVE_QUEUE;
 
@@ -171,6 +177,8 @@ typedef PARANDIS_RECEIVE_QUEUE *PPARANDIS_RECEIVE_QUEUE;
 #include "ParaNdis-CX.h"
 #include "ParaNdis_GuestAnnounce.h"
 #include "ParaNdis-VirtIO.h"
+#include "ParaNdis-TxSteering.h"
+#include "ParaNdis-DeviceStats.h"
 
 struct NdisPollHandler
 {
@@ -181,11 +189,39 @@ struct NdisPollHandler
     PROCESSOR_NUMBER m_ProcessorNumber = {};
     BOOLEAN m_UpdateAffinity = false;
 
+    // Adaptive busy polling (PollBusyUsecs): when the rings go empty the handler keeps polling for
+    // the busy window before it lets the RX queue re-arm its interrupt. The window is twice the
+    // average time from an empty ring to the next packet, up to the configured maximum, and 0 when
+    // the packets come less often, so that sparse traffic does not spin the CPU. In perf counter ticks.
+    LONGLONG m_PerfFrequency = 0;
+    LONGLONG m_MaxBusyWindow = 0;
+    LONGLONG m_BusyWindow = 0;
+    LONGLONG m_AverageGap = 0;
+    // when the rings went empty, 0 while there is traffic
+    LONGLONG m_IdleSince = 0;
+
+    struct
+    {
+        ULONG Polls;
+        // the rings were empty
+        ULONG EmptyPolls;
+        // empty polls inside the busy window, with the RX interrupt disabled
+        ULONG BusyPolls;
+        // packets found by busy polling, without an interrupt
+        ULONG BusyHits;
+        // the busy window expired and the RX interrupt was enabled
+        ULONG Rearms;
+    } Statistics = {};
+
     bool Register(PPARANDIS_ADAPTER AdapterContext, int Index);
     void Unregister();
     void EnableNotification(BOOLEAN Enable);
     void HandlePoll(NDIS_POLL_DATA *PollData);
     bool UpdateAffinity(const PROCESSOR_NUMBER &);
+    ULONG TicksToUsecs(LONGLONG Ticks) const;
+
+  private:
+    void UpdateBusyWindow(LONGLONG Gap);
 };
 
 struct CPUPathBundle : public CPlacementAllocatable
@@ -198,6 +234,10 @@ struct CPUPathBundle : public CPlacementAllocatable
 
     CParaNdisCX *cxPath = NULL;
 
+    // counters of the device for the queues of the bundle, see CDeviceStatistics
+    tDeviceQueueStatistics rxDeviceStatistics = {};
+    tDeviceQueueStatistics txDeviceStatistics = {};
+
     ~CPUPathBundle()
     {
         if (rxCreated)
@@ -249,6 +289,9 @@ struct tRxLayout
 #define VIRTIO_NET_INVALID_INTERRUPT_STATUS 0xFF
 
 #define PARANDIS_MULTICAST_LIST_SIZE        32
+// slots of the multicast lookup table, a power of 2 well above the list size
+#define PARANDIS_MULTICAST_HASH_BITS        7
+#define PARANDIS_MULTICAST_HASH_SIZE        (1 << PARANDIS_MULTICAST_HASH_BITS)
 #define PARANDIS_MEMORY_TAG                 '5muQ'
 #define PARANDIS_DEFAULT_LINK_SPEED         10000000000 // 10Gbps link speed
 #define PARANDIS_MIN_LSO_SEGMENTS           2
@@ -267,6 +310,8 @@ struct tRxLayout
 
 #define PARANDIS_MIN_RX_BUFFER_PERCENT_DEFAULT 0
 
+#define PARANDIS_TX_INLINE_THRESHOLD_DEFAULT 256
+
 static const ULONG PARANDIS_PACKET_FILTERS = NDIS_PACKET_TYPE_DIRECTED | NDIS_PACKET_TYPE_MULTICAST |
                                              NDIS_PACKET_TYPE_BROADCAST | NDIS_PACKET_TYPE_PROMISCUOUS |
                                              NDIS_PACKET_TYPE_ALL_MULTICAST;
@@ -391,51 +436,41 @@ typedef struct _tagLinkProperties
 
 typedef struct _tagMulticastData
 {
+    // the count and the list are sent to the device as is (VIRTIO_NET_CTRL_MAC_TABLE_SET)
     ULONG nofMulticastEntries;
     UCHAR MulticastList[ETH_ALEN * PARANDIS_MULTICAST_LIST_SIZE];
+    // open addressing table of the list, the slot holds index of the entry + 1, 0 in free slots
+    UCHAR HashTable[PARANDIS_MULTICAST_HASH_SIZE];
 } tMulticastData;
 
-typedef struct _tagNET_PACKET_INFO
-{
-    struct
-    {
-        int isBroadcast : 1;
-        int isMulticast : 1;
-        int isUnicast : 1;
-        int hasVlanHeader : 1;
-        int isIP4 : 1;
-        int isIP6 : 1;
-        int isTCP : 1;
-        int isUDP : 1;
-        int isFragment : 1;
-    };
+C_ASSERT(PARANDIS_MULTICAST_LIST_SIZE < PARANDIS_MULTICAST_HASH_SIZE && PARANDIS_MULTICAST_LIST_SIZE < MAXUCHAR);
 
-    struct
-    {
-        UINT32 UserPriority : 3;
-        UINT32 VlanId : 12;
-    } Vlan;
+static __inline ULONG ParaNdis_MulticastHash(const UCHAR *Address)
+{
+    // the leading bytes are the same in most multicast addresses (01:00:5E, 33:33)
+    ULONG tail = *(const ULONG UNALIGNED *)(Address + 2);
+    return (tail * 0x9E3779B1) >> (32 - PARANDIS_MULTICAST_HASH_BITS);
+}
 
-#if PARANDIS_SUPPORT_RSS
-    struct
+// The table always has free slots, so the probing terminates even if the list is being replaced concurrently
+static __inline BOOLEAN ParaNdis_IsMulticastInList(const tMulticastData *Data, const UCHAR *Address)
+{
+    for (ULONG slot = ParaNdis_MulticastHash(Address);; slot = (slot + 1) & (PARANDIS_MULTICAST_HASH_SIZE - 1))
     {
-        ULONG Value;
-        ULONG Type;
-        ULONG Function;
-    } RSSHash;
-#endif
+        ULONG entry = Data->HashTable[slot];
+        ULONG Res;
 
-    ULONG L2HdrLen;
-    ULONG L3HdrLen;
-    ULONG L2PayloadLen;
-    ULONG ip6HomeAddrOffset;
-    ULONG ip6DestAddrOffset;
-
-    PUCHAR ethDestAddr;
-
-    PVOID headersBuffer;
-    ULONG dataLength;
-} NET_PACKET_INFO, *PNET_PACKET_INFO;
+        if (!entry)
+        {
+            return FALSE;
+        }
+        ETH_COMPARE_NETWORK_ADDRESSES_EQ_SAFE(Address, &Data->MulticastList[(entry - 1) * ETH_ALEN], &Res);
+        if (!Res)
+        {
+            return TRUE;
+        }
+    }
+}
 
 struct _tagRxNetDescriptor
 {
@@ -462,6 +497,8 @@ struct _tagRxNetDescriptor
     tPacketHolderType Holder;
 
     NET_PACKET_INFO PacketInfo;
+    // when the packet was placed to a receive queue, see ParaNdis-Latency.h
+    ULONG64 QueuedTime;
 
     CParaNdisRX *Queue;
 
@@ -473,16 +510,31 @@ struct _tagRxNetDescriptor
 
     // Mergeable buffer support - inline storage for merged buffers (eliminates dynamic allocation)
     // Maximum mergeable packet size per VirtIO spec: 65562 bytes (including 12-byte header)
-    // Required buffers: ceil(65562 / 4096) = 17 PAGE-sized buffers maximum
+    // Required buffers: ceil(65562 / 2048) = 33 buffers maximum, the RX page pool does not
+    // use slices smaller than 2048 bytes when the device may deliver such a packet
     //
     // Field semantics:
     //   MergedBufferCount: Number of ADDITIONAL buffers (NOT including this descriptor)
-    //                      Range: 0 (single buffer) to 16 (max merged packet)
-    //   MergedBuffersInline: Array storing pointers to the 16 additional buffers
+    //                      Range: 0 (single buffer) to 32 (max merged packet)
+    //   MergedBuffersInline: Array storing pointers to the 32 additional buffers
     //                        (this descriptor itself is not stored in the array)
-#define MAX_MERGED_BUFFERS 16
+#define MAX_MERGED_BUFFERS 32
     USHORT MergedBufferCount;
     pRxNetDescriptor MergedBuffers[MAX_MERGED_BUFFERS];
+
+    // Software receive segment coalescing: the TCP payloads of the segments merged
+    // into this one follow its frame in the Holder chain, the Holder MDLs beyond the
+    // frame are kept in HolderTail. The merged descriptors are linked by CoalescedNext,
+    // each one owns the MDL describing its payload.
+    USHORT CoalescedSegments;
+    PMDL HolderTail;
+    pRxNetDescriptor CoalescedNext;
+    PMDL CoalescedPayloadMDL;
+
+    // Mergeable buffer in a slice of the RX page pool, Page is NULL when the descriptor owns its page
+    tRxPoolSlice PoolSlice;
+    // Link in the list of buffers returned to the queue without taking its lock
+    SLIST_ENTRY RecycleEntry;
 };
 
 struct _PARANDIS_ADAPTER : public CNdisAllocatable<_PARANDIS_ADAPTER, 'DCTX'>
@@ -523,6 +575,7 @@ struct _PARANDIS_ADAPTER : public CNdisAllocatable<_PARANDIS_ADAPTER, 'DCTX'>
     BOOLEAN bControlQueueSupported = false;
     BOOLEAN bUseMergedBuffers = false;
     BOOLEAN bMergeableBuffersConfigured = true;
+    BOOLEAN bRxPagePool = true;
     BOOLEAN bFastInit = false;
     BOOLEAN bSurprizeRemoved = false;
     BOOLEAN bUsingMSIX = false;
@@ -536,7 +589,15 @@ struct _PARANDIS_ADAPTER : public CNdisAllocatable<_PARANDIS_ADAPTER, 'DCTX'>
     BOOLEAN bMultiQueue = false;
     BOOLEAN bPollModeTry = false;
     BOOLEAN bPollModeEnabled = false;
+    // maximal busy polling window of the poll handlers, 0 disables busy polling
+    ULONG uPollBusyUsecs = 0;
     BOOLEAN bRxSeparateTail = false;
+    // adaptive interrupt coalescing on the RX and TX queues
+    BOOLEAN bInterruptModeration = false;
+    // device side notification coalescing, for all queues or per queue
+    BOOLEAN bNotifyCoalescingSupported = false;
+    BOOLEAN bVQNotifyCoalescingSupported = false;
+    BOOLEAN bDeviceStatsSupported = false;
     USHORT nHardwareQueues = false;
     ULONG ulCurrentVlansFilterSet = false;
     tMulticastData MulticastData = {};
@@ -575,6 +636,7 @@ struct _PARANDIS_ADAPTER : public CNdisAllocatable<_PARANDIS_ADAPTER, 'DCTX'>
         ULONG framesFilteredOut;
         ULONG framesCoalescedHost;
         ULONG framesCoalescedWindows;
+        ULONG framesCoalescedSoftware;
         ULONG framesRSSHits;
         ULONG framesRSSMisses;
         ULONG framesRSSUnclassified;
@@ -582,6 +644,7 @@ struct _PARANDIS_ADAPTER : public CNdisAllocatable<_PARANDIS_ADAPTER, 'DCTX'>
         ULONG minFreeTxBuffers;
         ULONG droppedTxPackets;
         ULONG copiedTxPackets;
+        ULONG inlinedTxPackets;
         ULONG minFreeRxBuffers;
         ULONG allocatedSharedMemory;
         LARGE_INTEGER totalRxIndicates;
@@ -619,8 +682,14 @@ struct _PARANDIS_ADAPTER : public CNdisAllocatable<_PARANDIS_ADAPTER, 'DCTX'>
     CPUPathBundle *pPathBundles = NULL;
     UINT nPathBundles = 0;
 
-    CPUPathBundle **RSS2QueueMap = NULL;
-    USHORT RSS2QueueLength = 0;
+    // TX path of the NBLs without an RSS hash
+    CTxSteering TxSteering;
+
+    // counters of the device, queried periodically
+    CDeviceStatistics DeviceStatistics;
+
+    // converts the ticks of the latency histograms to time
+    CLatencyClock LatencyClock;
 
     PIO_INTERRUPT_MESSAGE_INFO pMSIXInfoTable = NULL;
     NDIS_HANDLE DmaHandle = NULL;
@@ -661,6 +730,10 @@ struct _PARANDIS_ADAPTER : public CNdisAllocatable<_PARANDIS_ADAPTER, 'DCTX'>
         BOOLEAN bIPv6Enabled;
         BOOLEAN bQemuSupported;
         BOOLEAN bHasDynamicConfig;
+        // the device does not coalesce, the driver merges the segments itself
+        BOOLEAN bSoftwareAllowed;
+        BOOLEAN bIPv4Software;
+        BOOLEAN bIPv6Software;
         struct
         {
             LARGE_INTEGER CoalescedPkts;
@@ -671,6 +744,16 @@ struct _PARANDIS_ADAPTER : public CNdisAllocatable<_PARANDIS_ADAPTER, 'DCTX'>
 #endif
 
     ULONG uMaxFragmentsInOneNB;
+    ULONG uTxInlineThreshold;
+
+    // notification coalescing parameters passed to the device when interrupt moderation is enabled
+    struct
+    {
+        ULONG RxUsecs;
+        ULONG RxFrames;
+        ULONG TxUsecs;
+        ULONG TxFrames;
+    } NotifyCoalescing = {};
 
     VOID RaiseUnrecoverableError(PCSTR Message);
 
@@ -742,6 +825,7 @@ NDIS_STATUS ParaNdis_PowerOn(PARANDIS_ADAPTER *pContext);
 VOID ParaNdis_PowerOff(PARANDIS_ADAPTER *pContext);
 
 void ParaNdis_DeviceConfigureRSC(PARANDIS_ADAPTER *pContext);
+void ParaNdis_DeviceConfigureNotifyCoalescing(PARANDIS_ADAPTER *pContext);
 
 void ParaNdis_ResetOffloadSettings(PARANDIS_ADAPTER *pContext, tOffloadSettingsFlags *pDest, PULONG from);
 
@@ -798,6 +882,8 @@ void ParaNdis_RestoreDeviceConfigurationAfterReset(PARANDIS_ADAPTER *pContext);
 
 VOID ParaNdis_UpdateDeviceFilters(PARANDIS_ADAPTER *pContext);
 
+VOID ParaNdis_SetInterruptModeration(PARANDIS_ADAPTER *pContext, BOOLEAN bEnable);
+
 VOID ParaNdis_DeviceFiltersUpdateVlanId(PARANDIS_ADAPTER *pContext);
 
 VOID ParaNdis_SynchronizeLinkState(PARANDIS_ADAPTER *pContext, bool bReport = true);
@@ -808,126 +894,6 @@ VOID ParaNdis_SetLinkState(PARANDIS_ADAPTER *pContext, NDIS_MEDIA_CONNECT_STATE
 
 #endif //-OFFLOAD_UNIT_TEST
 
-typedef enum class _tagppResult
-{
-    ppresNotTested = 0,
-    ppresNotIP = 1,
-    ppresIPV4 = 2,
-    ppresIPV6 = 3,
-    ppresIPTooShort = 1,
-    ppresPCSOK = 1,
-    ppresCSOK = 2,
-    ppresCSBad = 3,
-    ppresXxpOther = 1,
-    ppresXxpKnown = 2,
-    ppresXxpIncomplete = 3,
-    ppresIsTCP = 0,
-    ppresIsUDP = 1,
-} ppResult;
-
-inline bool operator==(ULONG a, ppResult b)
-{
-    return a == static_cast<ULONG>(b);
-}
-
-inline bool operator!=(ULONG a, ppResult b)
-{
-    return a != static_cast<ULONG>(b);
-}
-
-typedef union _tagTcpIpPacketParsingResult {
-    struct
-    {
-        /* 0 - not tested, 1 - not IP, 2 - IPV4, 3 - IPV6 */
-        ULONG ipStatus : 2;
-        /* 0 - not tested, 1 - n/a, 2 - CS, 3 - bad */
-        ULONG ipCheckSum : 2;
-        /* 0 - not tested, 1 - PCS, 2 - CS, 3 - bad */
-        ULONG xxpCheckSum : 2;
-        /* 0 - not tested, 1 - other, 2 - known(contains basic TCP or UDP header), 3 - known incomplete */
-        ULONG xxpStatus : 2;
-        /* 1 - contains complete payload */
-        ULONG xxpFull : 1;
-        ULONG TcpUdp : 1;
-        ULONG fixedIpCS : 1;
-        ULONG fixedXxpCS : 1;
-        ULONG IsFragment : 1;
-        ULONG reserved : 3;
-        ULONG ipHeaderSize : 8;
-        ULONG XxpIpHeaderSize : 8;
-    };
-    ULONG value;
-} tTcpIpPacketParsingResult;
-
-typedef enum class _tagPacketOffloadRequest
-{
-    pcrIpChecksum = (1 << 0),
-    pcrTcpV4Checksum = (1 << 1),
-    pcrUdpV4Checksum = (1 << 2),
-    pcrTcpV6Checksum = (1 << 3),
-    pcrUdpV6Checksum = (1 << 4),
-    pcrTcpChecksum = (pcrTcpV4Checksum | pcrTcpV6Checksum),
-    pcrUdpChecksum = (pcrUdpV4Checksum | pcrUdpV6Checksum),
-    pcrAnyChecksum = (pcrIpChecksum | pcrTcpV4Checksum | pcrUdpV4Checksum | pcrTcpV6Checksum | pcrUdpV6Checksum),
-    pcrLSO = (1 << 5),
-    pcrIsIP = (1 << 6),
-    pcrFixIPChecksum = (1 << 7),
-    pcrFixPHChecksum = (1 << 8),
-    pcrFixTcpV4Checksum = (1 << 9),
-    pcrFixUdpV4Checksum = (1 << 10),
-    pcrFixTcpV6Checksum = (1 << 11),
-    pcrFixUdpV6Checksum = (1 << 12),
-    pcrFixXxpChecksum = (pcrFixTcpV4Checksum | pcrFixUdpV4Checksum | pcrFixTcpV6Checksum | pcrFixUdpV6Checksum),
-    pcrPriorityTag = (1 << 13),
-    pcrNoIndirect = (1 << 14)
-} tPacketOffloadRequest;
-
-inline ULONG operator|(tPacketOffloadRequest a, tPacketOffloadRequest b)
-{
-    return static_cast<ULONG>(a) | static_cast<ULONG>(b);
-}
-
-inline ULONG operator|(ULONG a, tPacketOffloadRequest b)
-{
-    return a | static_cast<ULONG>(b);
-}
-
-inline ULONG &operator|=(ULONG &a, tPacketOffloadRequest b)
-{
-    return a |= static_cast<ULONG>(b);
-}
-
-inline ULONG operator&(tPacketOffloadRequest a, tPacketOffloadRequest b)
-{
-    return static_cast<ULONG>(a) & static_cast<ULONG>(b);
-}
-
-inline ULONG operator&(ULONG a, tPacketOffloadRequest b)
-{
-    return a & static_cast<ULONG>(b);
-}
-
-// sw offload
-
-tTcpIpPacketParsingResult ParaNdis_CheckSumVerify(tCompletePhysicalAddress *pDataPages,
-                                                  ULONG ulDataLength,
-                                                  ULONG ulStartOffset,
-                                                  ULONG flags,
-                                                  BOOLEAN verifyLength,
-                                                  LPCSTR caller);
-
-static __inline tTcpIpPacketParsingResult ParaNdis_CheckSumVerifyFlat(PVOID pBuffer,
-                                                                      ULONG ulDataLength,
-                                                                      ULONG flags,
-                                                                      BOOLEAN verifyLength,
-                                                                      LPCSTR caller)
-{
-    tCompletePhysicalAddress SGBuffer;
-    SGBuffer.Virtual = pBuffer;
-    SGBuffer.size = ulDataLength;
-    return ParaNdis_CheckSumVerify(&SGBuffer, ulDataLength, 0, flags, verifyLength, caller);
-}
-
 VOID _Function_class_(KDEFERRED_ROUTINE) MiniportMSIInterruptCXDpc(struct _KDPC *Dpc,
                                                                    IN PVOID MiniportInterruptContext,
                                                                    IN PVOID NdisReserved1,
@@ -935,13 +901,6 @@ VOID _Function_class_(KDEFERRED_ROUTINE) MiniportMSIInterruptCXDpc(struct _KDPC
 
 bool ParaNdis_RXTXDPCWorkBody(PARANDIS_ADAPTER *pContext, ULONG ulMaxPacketsToIndicate);
 
-USHORT CheckSumCalculator(PVOID buffer, ULONG len);
-
-tTcpIpPacketParsingResult ParaNdis_ReviewIPPacket(PVOID buffer, ULONG size, BOOLEAN verityLength, LPCSTR caller);
-
-BOOLEAN ParaNdis_AnalyzeReceivedPacket(PVOID headersBuffer, ULONG dataLength, PNET_PACKET_INFO packetInfo);
-ULONG ParaNdis_StripVlanHeaderMoveHead(PNET_PACKET_INFO packetInfo);
-VOID ParaNdis_PadPacketToMinimalLength(PNET_PACKET_INFO packetInfo);
 BOOLEAN ParaNdis_IsTxRxPossible(PARANDIS_ADAPTER *pContext);
 NDIS_STATUS ParaNdis_ExactSendFailureStatus(PARANDIS_ADAPTER *pContext);
 
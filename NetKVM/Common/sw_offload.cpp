@@ -26,12 +26,17 @@
  * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
  * SUCH DAMAGE.
  */
+#ifdef _KERNEL_MODE
 #include "ndis56common.h"
 #include "kdebugprint.h"
 #include "Trace.h"
 #ifdef NETKVM_WPP_ENABLED
 #include "sw_offload.tmh"
 #endif
+#else
+#include <windows.h>
+#include "ParaNdis-SwOffload.h"
+#endif
 
 // IPv6 Header RFC 2460 (n*8 bytes)
 typedef struct _tagIPv6ExtHeader
@@ -111,10 +116,74 @@ typedef struct _tagIP6_TYPE2_ROUTING_HEADER
 
 #define IP6_EXT_HDR_GRANULARITY         (8)
 
+#if defined(_WIN64) && !defined(_ARM64_)
+#include <emmintrin.h>
+#define CHECKSUM_SIMD_BLOCK (32)
+#elif defined(_ARM64_)
+#include <arm64_neon.h>
+#define CHECKSUM_SIMD_BLOCK (32)
+// each block adds at most 4 words to a 32-bit lane
+#define CHECKSUM_NEON_FLUSH_BLOCKS (0x10000 / 4)
+#endif
+
+#ifdef CHECKSUM_SIMD_BLOCK
+/* Sums 'blocks' blocks of CHECKSUM_SIMD_BLOCK bytes,
+   the result is a raw sum of the same kind RawCheckSumCalculator returns */
+static UINT_PTR RawCheckSumBlocks(const UCHAR *src, ULONG blocks)
+{
+#if defined(_WIN64) && !defined(_ARM64_)
+    // 32-bit words are summed into 64-bit lanes, same as the scalar loop does
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = zero, acc1 = zero;
+
+    while (blocks--)
+    {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)src);
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(src + 16));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v0, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v0, zero));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v1, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v1, zero));
+        src += CHECKSUM_SIMD_BLOCK;
+    }
+    acc0 = _mm_add_epi64(acc0, acc1);
+    acc0 = _mm_add_epi64(acc0, _mm_unpackhi_epi64(acc0, acc0));
+    return (UINT_PTR)_mm_cvtsi128_si64(acc0);
+#else
+    // 16-bit words are pairwise added into 32-bit lanes, flushed to 64-bit lanes before they may overflow
+    uint64x2_t acc64 = vdupq_n_u64(0);
+
+    while (blocks)
+    {
+        ULONG now = min(blocks, CHECKSUM_NEON_FLUSH_BLOCKS);
+        uint32x4_t acc32 = vdupq_n_u32(0);
+
+        blocks -= now;
+        while (now--)
+        {
+            uint8x16_t v0 = vld1q_u8(src);
+            uint8x16_t v1 = vld1q_u8(src + 16);
+            acc32 = vpadalq_u16(acc32, vreinterpretq_u16_u8(v0));
+            acc32 = vpadalq_u16(acc32, vreinterpretq_u16_u8(v1));
+            src += CHECKSUM_SIMD_BLOCK;
+        }
+        acc64 = vpadalq_u32(acc64, acc32);
+    }
+    return (UINT_PTR)(vgetq_lane_u64(acc64, 0) + vgetq_lane_u64(acc64, 1));
+#endif
+}
+#endif
+
 static UINT_PTR RawCheckSumCalculator(PVOID buffer, ULONG len)
 {
     UINT_PTR val = 0;
     PUCHAR ptr = (PUCHAR)buffer;
+#ifdef CHECKSUM_SIMD_BLOCK
+    ULONG blocks = len / CHECKSUM_SIMD_BLOCK;
+    val = RawCheckSumBlocks(ptr, blocks);
+    ptr += blocks * CHECKSUM_SIMD_BLOCK;
+    len -= blocks * CHECKSUM_SIMD_BLOCK;
+#endif
 #if defined(_WIN64) && !defined(_ARM64_)
     ULONG count = len >> 2;
     while (count--)
@@ -150,18 +219,22 @@ static UINT_PTR RawCheckSumCalculator(PVOID buffer, ULONG len)
     return val;
 }
 
-static __inline USHORT RawCheckSumFinalize(UINT_PTR sum)
+/* Folds the raw sum to 16 bits without complementing it */
+static __inline UINT16 RawCheckSumFold(UINT_PTR sum)
 {
     UINT32 sum32;
-    UINT16 sum16;
 
 #ifdef _WIN64
     sum32 = (((sum >> 32) | (sum << 32)) + sum) >> 32;
 #else
     sum32 = sum;
 #endif
-    sum16 = (((sum32 >> 16) | (sum32 << 16)) + sum32) >> 16;
-    return ~sum16;
+    return (UINT16)((((sum32 >> 16) | (sum32 << 16)) + sum32) >> 16);
+}
+
+static __inline USHORT RawCheckSumFinalize(UINT_PTR sum)
+{
+    return (USHORT)~RawCheckSumFold(sum);
 }
 
 static __inline USHORT CheckSumCalculatorFlat(PVOID buffer, ULONG len)
@@ -173,6 +246,7 @@ static __inline USHORT CheckSumCalculator(tCompletePhysicalAddress *pDataPages,
 {
     tCompletePhysicalAddress *pCurrentPage = &pDataPages[0];
     ULONG ulCurrPageOffset = 0;
+    ULONG ulDone = 0;
     UINT_PTR uRawCSum = 0;
 
     while (ulStartOffset > 0)
@@ -191,8 +265,11 @@ static __inline USHORT CheckSumCalculator(tCompletePhysicalAddress *pDataPages,
     {
         PVOID pCurrentPageDataStart = RtlOffsetToPointer(pCurrentPage->Virtual, ulCurrPageOffset);
         ULONG ulCurrentPageDataLength = min(len, pCurrentPage->size - ulCurrPageOffset);
+        UINT16 uPageCSum = RawCheckSumFold(RawCheckSumCalculator(pCurrentPageDataStart, ulCurrentPageDataLength));
 
-        uRawCSum += RawCheckSumCalculator(pCurrentPageDataStart, ulCurrentPageDataLength);
+        // the words of a chunk starting at an odd offset are byte swapped relatively to the packet
+        uRawCSum += (ulDone & 1) ? RtlUshortByteSwap(uPageCSum) : uPageCSum;
+        ulDone += ulCurrentPageDataLength;
         pCurrentPage++;
         ulCurrPageOffset = 0;
         len -= ulCurrentPageDataLength;
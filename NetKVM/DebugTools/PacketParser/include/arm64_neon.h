@@ -0,0 +1,3 @@
+/* The MSVC name of <arm_neon.h> */
+#pragma once
+#include <arm_neon.h>
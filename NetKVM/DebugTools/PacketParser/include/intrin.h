@@ -0,0 +1,15 @@
+/*
+ * Stand-in for the MSVC <intrin.h>, the Toeplitz hash needs __cpuid only.
+ */
+#pragma once
+
+#include <cpuid.h>
+#include <x86intrin.h>
+
+/* cpuid.h has a macro of the same name with other arguments */
+#undef __cpuid
+
+static inline void __cpuid(int regs[4], int leaf)
+{
+    __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+}
@@ -0,0 +1,69 @@
+/*
+ * Minimal stand-in for <windows.h>, just enough to build the NetKVM packet
+ * parsing (sw_offload.cpp) and Toeplitz hash (ParaNdis_Toeplitz.cpp) code
+ * with gcc or clang.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/* the driver code selects its 64-bit and SIMD paths by these */
+#if defined(__x86_64__)
+#define _WIN64
+#define _M_AMD64
+#elif defined(__aarch64__)
+#define _WIN64
+#define _ARM64_
+#endif
+
+#define VOID void
+typedef void *PVOID;
+typedef char CHAR, CCHAR, *PCHAR;
+typedef const char *LPCSTR;
+typedef uint8_t UCHAR, *PUCHAR, BYTE, BOOLEAN, UINT8;
+typedef uint16_t USHORT, *PUSHORT, UINT16, *PUINT16;
+typedef int16_t SHORT;
+typedef uint32_t ULONG, *PULONG, UINT32, *PUINT32, UINT, *PUINT;
+typedef int32_t LONG, INT32;
+typedef uint64_t ULONGLONG, ULONG64, UINT64;
+typedef int64_t LONGLONG;
+typedef uintptr_t ULONG_PTR, UINT_PTR;
+typedef intptr_t LONG_PTR;
+
+typedef union {
+    struct {
+        ULONG LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+#define TRUE  1
+#define FALSE 0
+
+#define FORCEINLINE   inline __attribute__((always_inline))
+#define UNALIGNED
+#define __fallthrough
+
+/* not macros, the C++ library headers pulled by the intrinsics undefine them */
+template <typename A, typename B> static inline auto min(A a, B b) -> decltype(a + b)
+{
+    return a < b ? a : b;
+}
+template <typename A, typename B> static inline auto max(A a, B b) -> decltype(a + b)
+{
+    return a > b ? a : b;
+}
+
+#define ARRAYSIZE(a)                           (sizeof(a) / sizeof((a)[0]))
+#define FIELD_OFFSET(type, field)              offsetof(type, field)
+#define RTL_FIELD_SIZE(type, field)            (sizeof(((type *)0)->field))
+#define RTL_SIZEOF_THROUGH_FIELD(type, field)  (FIELD_OFFSET(type, field) + RTL_FIELD_SIZE(type, field))
+#define RtlCopyMemory(Destination, Source, Length) memcpy((Destination), (Source), (Length))
+#define RtlMoveMemory(Destination, Source, Length) memmove((Destination), (Source), (Length))
+#define RtlZeroMemory(Destination, Length)     memset((Destination), 0, (Length))
+
+#define _byteswap_ushort(x) __builtin_bswap16(x)
+#define _byteswap_ulong(x)  __builtin_bswap32(x)
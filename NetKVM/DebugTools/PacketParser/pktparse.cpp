@@ -0,0 +1,1155 @@
+/*
+ * Host test and microbenchmark of the NetKVM packet parsing
+ *
+ * sw_offload.cpp and ParaNdis_Toeplitz.cpp are built unmodified against the
+ * stand-in Windows headers in include/. The packets come from pcap files or
+ * from generators of common traffic mixes. Every packet is run through the
+ * driver code and through the reference implementation in reference.cpp and
+ * the results are compared field by field, then the driver code is timed over
+ * each set of packets and the cost is reported in nanoseconds per packet.
+ */
+#include <windows.h>
+#include "ParaNdis-SwOffload.h"
+#include "ParaNdis-Toeplitz.h"
+#include "reference.h"
+
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define IPPROTO_ICMP   1
+#define IPPROTO_TCP    6
+#define IPPROTO_UDP    17
+#define IPPROTO_GRE    47
+#define IPPROTO_ICMPV6 58
+#define IPPROTO_NONE   59
+
+/* the parsers may look at a few bytes past the end of a short packet */
+#define PKT_SLACK 64
+#define MAX_FRAME 65535
+
+struct pkt {
+    uint8_t *data;
+    uint32_t len;
+    /* from the driver's analysis, for the benchmarks */
+    uint32_t l2_len;
+    TOEPLITZ_CHUNK tuple[3];
+    ULONG tuple_chunks;
+};
+
+struct pkt_set {
+    char name[64];
+    struct pkt *pkts;
+    unsigned int count;
+    unsigned int cap;
+    uint64_t bytes;
+    /* verification */
+    unsigned long errors;
+    unsigned long csum_checked;
+    unsigned long csum_skipped;
+    unsigned long hashed;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+/* xorshift64*, the sets are the same for the same seed */
+static uint32_t rnd(uint32_t n)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 0x2545F4914F6CDD1DULL) >> 32) % n;
+}
+
+static bool chance(unsigned int percent)
+{
+    return rnd(100) < percent;
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    put16(p, (uint16_t)(v >> 16));
+    put16(p + 2, (uint16_t)v);
+}
+
+static void fill_random(uint8_t *p, uint32_t len)
+{
+    while (len--) {
+        *p++ = (uint8_t)rnd(256);
+    }
+}
+
+static void set_add(struct pkt_set *set, const uint8_t *data, uint32_t len)
+{
+    struct pkt *p;
+
+    if (set->count == set->cap) {
+        set->cap = set->cap ? set->cap * 2 : 256;
+        set->pkts = (struct pkt *)realloc(set->pkts, set->cap * sizeof(*set->pkts));
+        if (!set->pkts) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    p = &set->pkts[set->count++];
+    memset(p, 0, sizeof(*p));
+    p->data = (uint8_t *)calloc(1, len + PKT_SLACK);
+    if (!p->data) {
+        perror("calloc");
+        exit(1);
+    }
+    memcpy(p->data, data, len);
+    p->len = len;
+    set->bytes += len;
+}
+
+static void set_free(struct pkt_set *set)
+{
+    for (unsigned int i = 0; i < set->count; ++i) {
+        free(set->pkts[i].data);
+    }
+    free(set->pkts);
+    memset(set, 0, sizeof(*set));
+}
+
+/*
+ * Traffic generator
+ */
+
+enum { CSUM_FULL, CSUM_PSEUDO, CSUM_BAD };
+enum { DST_UNICAST, DST_MULTICAST, DST_BROADCAST };
+
+/* IPv6 extension headers, in the order of RFC 8200 and RFC 6275 */
+#define EXT_HOPOPTS  1
+#define EXT_ROUTING  2 /* type 2 with the care-of address */
+#define EXT_DSTOPTS  4 /* with the home address option */
+#define EXT_FRAGMENT 8
+
+struct gen_params {
+    /* 4, 6 or 0 for an ARP frame */
+    unsigned int ip;
+    uint8_t l4;
+    uint32_t payload;
+    bool vlan;
+    int dst;
+    /* bytes of IPv4 and TCP options, multiples of 4 */
+    unsigned int ip4_options;
+    unsigned int tcp_options;
+    unsigned int ip6_ext;
+    /* IPv4 fragment that is not the first one */
+    bool fragment;
+    int csum;
+    /* bytes cut from the end of the frame after the checksums are filled */
+    uint32_t cut;
+    /* overrides the version field (or the IPv4 header length) when not zero */
+    uint8_t bad_version;
+    uint8_t bad_ihl;
+};
+
+static uint8_t *put_ip6_address(uint8_t *p, uint16_t net, bool multicast)
+{
+    memset(p, 0, 16);
+    if (multicast) {
+        p[0] = 0xFF;
+        p[1] = 0x02;
+        p[15] = 0xFB;
+    } else {
+        put16(p, 0x2001);
+        put16(p + 2, 0x0DB8);
+        put16(p + 4, net);
+        fill_random(p + 8, 8);
+    }
+    return p + 16;
+}
+
+static uint32_t build_frame(const struct gen_params *g, uint8_t *frame)
+{
+    uint8_t *p = frame;
+    uint8_t *ip, *l4;
+    uint8_t *next_header = NULL;
+    uint32_t l4_len, len;
+
+    /* L2 */
+    if (g->dst == DST_BROADCAST) {
+        memset(p, 0xFF, 6);
+    } else if (g->dst == DST_MULTICAST) {
+        memcpy(p, g->ip == 6 ? "\x33\x33\x00\x00\x00\xfb" : "\x01\x00\x5e\x00\x00\xfb", 6);
+    } else {
+        memcpy(p, "\x52\x54\x00\x12\x34\x56", 6);
+    }
+    memcpy(p + 6, "\x52\x54\x00\xab\xcd", 5);
+    p[11] = (uint8_t)rnd(256);
+    p += 12;
+    if (g->vlan) {
+        put16(p, 0x8100);
+        put16(p + 2, (uint16_t)(rnd(8) << 13 | (1 + rnd(4094))));
+        p += 4;
+    }
+    put16(p, g->ip == 4 ? 0x0800 : g->ip == 6 ? 0x86DD : 0x0806);
+    p += 2;
+
+    if (!g->ip) {
+        /* ARP request */
+        put16(p, 1);
+        put16(p + 2, 0x0800);
+        p[4] = 6;
+        p[5] = 4;
+        put16(p + 6, 1);
+        fill_random(p + 8, 20);
+        return (uint32_t)(p + 28 - frame);
+    }
+
+    /* L3 */
+    ip = p;
+    if (g->ip == 4) {
+        unsigned int hdr = 20 + g->ip4_options;
+        p[0] = (uint8_t)(0x40 | (g->bad_ihl ? g->bad_ihl : hdr / 4));
+        p[1] = 0;
+        put16(p + 4, (uint16_t)rnd(0x10000));
+        /* don't fragment, or more fragments and some offset */
+        put16(p + 6, g->fragment ? (uint16_t)((rnd(2) << 13) | (1 + rnd(0x1FFF))) : 0x4000);
+        p[8] = 64;
+        p[9] = g->l4;
+        put32(p + 12, 0x0A000000 | rnd(0x10000));
+        put32(p + 16, g->dst == DST_UNICAST ? 0x0A010000 | rnd(0x10000) : 0xE00000FB);
+        /* NOPs and the end of the options */
+        memset(p + 20, 1, g->ip4_options);
+        if (g->ip4_options) {
+            p[hdr - 1] = 0;
+        }
+        p += hdr;
+    } else {
+        p[0] = 0x60;
+        put16(p + 2, (uint16_t)rnd(0x10000));
+        next_header = p + 6;
+        p[7] = 64;
+        put_ip6_address(p + 8, 0, false);
+        put_ip6_address(p + 24, 1, g->dst != DST_UNICAST);
+        p += 40;
+        if (g->ip6_ext & EXT_HOPOPTS) {
+            *next_header = 0;
+            next_header = p;
+            /* PadN */
+            memcpy(p + 1, "\x00\x01\x04\x00\x00\x00\x00", 7);
+            p += 8;
+        }
+        if (g->ip6_ext & EXT_ROUTING) {
+            *next_header = 43;
+            next_header = p;
+            memcpy(p + 1, "\x02\x02\x01\x00\x00\x00\x00", 7);
+            put_ip6_address(p + 8, 2, false);
+            p += 24;
+        }
+        if (g->ip6_ext & EXT_DSTOPTS) {
+            *next_header = 60;
+            next_header = p;
+            /* PadN to place the home address option at 8n+6 */
+            memcpy(p + 1, "\x02\x01\x02\x00\x00\xc9\x10", 7);
+            put_ip6_address(p + 8, 3, false);
+            p += 24;
+        }
+        if (g->ip6_ext & EXT_FRAGMENT) {
+            *next_header = 44;
+            next_header = p;
+            memset(p + 1, 0, 7);
+            /* the first fragment: offset 0, more fragments */
+            p[3] = 1;
+            put32(p + 4, rnd(0xFFFFFFFF));
+            p += 8;
+        }
+        *next_header = g->l4;
+    }
+
+    /* L4 */
+    l4 = p;
+    switch (g->l4) {
+    case IPPROTO_TCP:
+        put16(p, (uint16_t)(1024 + rnd(64512)));
+        put16(p + 2, rnd(2) ? 443 : 5201);
+        put32(p + 4, rnd(0xFFFFFFFF));
+        put32(p + 8, rnd(0xFFFFFFFF));
+        p[12] = (uint8_t)(((20 + g->tcp_options) / 4) << 4);
+        p[13] = g->payload ? 0x18 : 0x10;
+        put16(p + 14, (uint16_t)rnd(0x10000));
+        memset(p + 16, 0, 4);
+        p += 20;
+        /* NOP NOP timestamps, as Linux and Windows send them */
+        for (unsigned int i = 0; i + 12 <= g->tcp_options; i += 12, p += 12) {
+            memcpy(p, "\x01\x01\x08\x0a", 4);
+            fill_random(p + 4, 8);
+        }
+        memset(p, 1, g->tcp_options % 12);
+        p += g->tcp_options % 12;
+        break;
+    case IPPROTO_UDP:
+        put16(p, (uint16_t)(1024 + rnd(64512)));
+        put16(p + 2, rnd(2) ? 53 : 4789);
+        put16(p + 4, (uint16_t)(8 + g->payload));
+        memset(p + 6, 0, 2);
+        p += 8;
+        break;
+    case IPPROTO_ICMP:
+    case IPPROTO_ICMPV6:
+        /* echo request, the parsers do not look inside */
+        p[0] = g->l4 == IPPROTO_ICMP ? 8 : 128;
+        memset(p + 1, 0, 3);
+        p += 4;
+        break;
+    default:
+        break;
+    }
+    fill_random(p, g->payload);
+    p += g->payload;
+    len = (uint32_t)(p - frame);
+    l4_len = (uint32_t)(p - l4);
+
+    if (g->ip == 4) {
+        put16(ip + 2, (uint16_t)(p - ip));
+    } else {
+        put16(ip + 4, (uint16_t)(p - ip - 40));
+    }
+    ref_fill_checksums(ip, g->csum == CSUM_PSEUDO);
+    if (g->csum == CSUM_BAD) {
+        /* the TCP/UDP checksum, sometimes the IPv4 one as well */
+        if (g->l4 == IPPROTO_TCP && l4_len >= 18) {
+            l4[16 + rnd(2)] ^= (uint8_t)(1 + rnd(255));
+        } else if (g->l4 == IPPROTO_UDP && l4_len >= 8) {
+            l4[6 + rnd(2)] ^= (uint8_t)(1 + rnd(255));
+        }
+        if (g->ip == 4 && chance(30)) {
+            ip[10] ^= (uint8_t)(1 + rnd(255));
+        }
+    }
+    if (g->bad_version) {
+        ip[0] = (uint8_t)((g->bad_version << 4) | (ip[0] & 0xF));
+    }
+    return len - min(g->cut, len);
+}
+
+static void base_params(struct gen_params *g, unsigned int ip, uint8_t l4, uint32_t payload)
+{
+    memset(g, 0, sizeof(*g));
+    g->ip = ip;
+    g->l4 = l4;
+    g->payload = payload;
+    g->tcp_options = l4 == IPPROTO_TCP ? 12 : 0;
+}
+
+/* L2, L3 and L4 header bytes of the parameters, to size the payload for a frame size */
+static uint32_t header_bytes(const struct gen_params *g)
+{
+    uint32_t len = 14 + (g->vlan ? 4 : 0);
+
+    if (g->ip == 4) {
+        len += 20 + g->ip4_options;
+    } else {
+        len += 40;
+        len += (g->ip6_ext & EXT_HOPOPTS) ? 8 : 0;
+        len += (g->ip6_ext & EXT_ROUTING) ? 24 : 0;
+        len += (g->ip6_ext & EXT_DSTOPTS) ? 24 : 0;
+        len += (g->ip6_ext & EXT_FRAGMENT) ? 8 : 0;
+    }
+    return len + (g->l4 == IPPROTO_TCP ? 20 + g->tcp_options : 8);
+}
+
+static void mix_tcp4_ack(struct gen_params *g)
+{
+    base_params(g, 4, IPPROTO_TCP, 0);
+}
+
+static void mix_tcp4_bulk(struct gen_params *g)
+{
+    base_params(g, 4, IPPROTO_TCP, 1448);
+}
+
+static void mix_udp4(struct gen_params *g)
+{
+    base_params(g, 4, IPPROTO_UDP, 18 + rnd(1455));
+}
+
+static void mix_tcp6_bulk(struct gen_params *g)
+{
+    base_params(g, 6, IPPROTO_TCP, 1428);
+}
+
+/* the classic 7:4:1 mix of 60, 590 and 1514 byte frames */
+static void mix_imix(struct gen_params *g)
+{
+    static const uint32_t sizes[12] = {60, 60, 60, 60, 60, 60, 60, 590, 590, 590, 590, 1514};
+    uint32_t size = sizes[rnd(12)];
+    uint32_t headers;
+
+    base_params(g, chance(70) ? 4 : 6, chance(80) ? IPPROTO_TCP : IPPROTO_UDP, 0);
+    g->vlan = chance(10);
+    headers = header_bytes(g);
+    g->payload = size > headers ? size - headers : 0;
+}
+
+static void mix_ip6ext(struct gen_params *g)
+{
+    base_params(g, 6, chance(50) ? IPPROTO_TCP : IPPROTO_UDP, rnd(1200));
+    g->ip6_ext = 1 + rnd(7);
+    if (chance(20)) {
+        g->ip6_ext |= EXT_FRAGMENT;
+    }
+}
+
+/* the unusual and the malformed */
+static void mix_edge(struct gen_params *g)
+{
+    uint32_t len;
+
+    base_params(g, chance(60) ? 4 : 6, chance(60) ? IPPROTO_TCP : IPPROTO_UDP, rnd(600));
+    switch (rnd(14)) {
+    case 0:
+        g->ip = 4;
+        g->fragment = true;
+        break;
+    case 1:
+        g->ip = 6;
+        g->ip6_ext = EXT_FRAGMENT;
+        break;
+    case 2:
+        g->ip = 4;
+        g->ip4_options = 4 * (1 + rnd(10));
+        break;
+    case 3:
+        /* shorter than the IP length says */
+        len = header_bytes(g) + g->payload;
+        g->cut = 1 + rnd(len - 14);
+        break;
+    case 4:
+        /* a few bytes of a frame */
+        g->cut = header_bytes(g) + g->payload - rnd(40);
+        break;
+    case 5:
+        g->csum = CSUM_BAD;
+        break;
+    case 6:
+        g->csum = CSUM_PSEUDO;
+        break;
+    case 7:
+        g->l4 = g->ip == 4 ? (chance(50) ? IPPROTO_ICMP : IPPROTO_GRE) : IPPROTO_ICMPV6;
+        g->tcp_options = 0;
+        break;
+    case 8:
+        g->ip = 0;
+        g->dst = DST_BROADCAST;
+        break;
+    case 9:
+        g->dst = chance(50) ? DST_BROADCAST : DST_MULTICAST;
+        break;
+    case 10:
+        g->bad_version = (uint8_t)(g->ip == 4 ? 6 : 4);
+        break;
+    case 11:
+        g->ip = 4;
+        g->bad_ihl = (uint8_t)(1 + rnd(4));
+        break;
+    case 12:
+        g->vlan = true;
+        g->tcp_options = 4 * rnd(11);
+        break;
+    case 13:
+        g->ip = 6;
+        g->l4 = IPPROTO_NONE;
+        g->payload = 0;
+        break;
+    }
+    if (g->l4 == IPPROTO_TCP && g->csum == CSUM_FULL && chance(10)) {
+        g->csum = CSUM_PSEUDO;
+    }
+}
+
+static const struct mix {
+    const char *name;
+    const char *description;
+    void (*params)(struct gen_params *g);
+} mixes[] = {
+    {"tcp4-ack", "TCP/IPv4 ACKs with timestamps, 66 bytes", mix_tcp4_ack},
+    {"tcp4-bulk", "TCP/IPv4 full size segments, 1514 bytes", mix_tcp4_bulk},
+    {"udp4", "UDP/IPv4 datagrams of 60 to 1514 bytes", mix_udp4},
+    {"tcp6-bulk", "TCP/IPv6 full size segments, 1514 bytes", mix_tcp6_bulk},
+    {"imix", "7:4:1 mix of 60, 590 and 1514 bytes, TCP and UDP, IPv4 and IPv6, some VLAN tagged", mix_imix},
+    {"ip6ext", "TCP and UDP over IPv6 with extension headers (mobility, fragments)", mix_ip6ext},
+    {"edge", "fragments, options, truncated and bad packets, non-IP, multicast, VLAN", mix_edge},
+};
+
+static void generate(struct pkt_set *set, const struct mix *mix, unsigned int count)
+{
+    static uint8_t frame[MAX_FRAME];
+    struct gen_params g;
+
+    snprintf(set->name, sizeof(set->name), "%s", mix->name);
+    while (count--) {
+        mix->params(&g);
+        set_add(set, frame, build_frame(&g, frame));
+    }
+}
+
+/*
+ * pcap files, the classic format with Ethernet frames
+ */
+
+struct pcap_file_header {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_record_header {
+    uint32_t ts_sec;
+    uint32_t ts_frac;
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+#define PCAP_MAGIC          0xA1B2C3D4
+#define PCAP_MAGIC_NSEC     0xA1B23C4D
+#define PCAP_LINKTYPE_ETHER 1
+
+static int read_pcap(struct pkt_set *set, const char *path)
+{
+    static uint8_t frame[MAX_FRAME];
+    struct pcap_file_header fh;
+    struct pcap_record_header rh;
+    bool swapped;
+    FILE *f = fopen(path, "rb");
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    if (fread(&fh, sizeof(fh), 1, f) != 1) {
+        fprintf(stderr, "%s: not a pcap file\n", path);
+        fclose(f);
+        return -1;
+    }
+    swapped = fh.magic == __builtin_bswap32(PCAP_MAGIC) || fh.magic == __builtin_bswap32(PCAP_MAGIC_NSEC);
+    if (!swapped && fh.magic != PCAP_MAGIC && fh.magic != PCAP_MAGIC_NSEC) {
+        fprintf(stderr, "%s: not a pcap file (pcapng files must be converted with editcap -F pcap)\n", path);
+        fclose(f);
+        return -1;
+    }
+    if ((swapped ? __builtin_bswap32(fh.linktype) : fh.linktype) != PCAP_LINKTYPE_ETHER) {
+        fprintf(stderr, "%s: only Ethernet captures are supported\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    const char *base = strrchr(path, '/');
+    snprintf(set->name, sizeof(set->name), "%s", base ? base + 1 : path);
+    while (fread(&rh, sizeof(rh), 1, f) == 1) {
+        uint32_t len = swapped ? __builtin_bswap32(rh.incl_len) : rh.incl_len;
+
+        if (len > MAX_FRAME || fread(frame, 1, len, f) != len) {
+            fprintf(stderr, "%s: bad record %u\n", path, set->count + 1);
+            fclose(f);
+            return -1;
+        }
+        set_add(set, frame, len);
+    }
+    fclose(f);
+    return 0;
+}
+
+static int write_pcap(const struct pkt_set *set, const char *path)
+{
+    struct pcap_file_header fh = {PCAP_MAGIC, 2, 4, 0, 0, MAX_FRAME, PCAP_LINKTYPE_ETHER};
+    FILE *f = fopen(path, "wb");
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    fwrite(&fh, sizeof(fh), 1, f);
+    for (unsigned int i = 0; i < set->count; ++i) {
+        struct pcap_record_header rh = {i / 1000000, i % 1000000, set->pkts[i].len, set->pkts[i].len};
+        fwrite(&rh, sizeof(rh), 1, f);
+        fwrite(set->pkts[i].data, 1, set->pkts[i].len, f);
+    }
+    if (fclose(f)) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Verification
+ */
+
+static const UCHAR ms_key[TOEPLITZ_MAX_KEY_SIZE] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3,
+    0x8f, 0xb0, 0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3,
+    0x80, 0x30, 0xf2, 0x0c, 0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa};
+
+static CToeplitzHash toeplitz;
+static bool clmul;
+
+static unsigned long max_reports = 10;
+static unsigned long reports;
+
+static void mismatch(struct pkt_set *set, unsigned int index, const char *what, unsigned long lib, unsigned long ref)
+{
+    set->errors++;
+    if (reports++ < max_reports) {
+        fprintf(stderr, "%s packet %u: %s: driver %lu (0x%lx), reference %lu (0x%lx)\n", set->name, index + 1, what,
+                lib, lib, ref, ref);
+    }
+}
+
+#define CHECK(what, lib, ref)                                                                                          \
+    do {                                                                                                               \
+        if ((unsigned long)(lib) != (unsigned long)(ref)) {                                                            \
+            mismatch(set, index, what, (unsigned long)(lib), (unsigned long)(ref));                                   \
+        }                                                                                                              \
+    } while (0)
+
+/* the hash input of RSS: addresses and ports, the IPv6 mobility addresses instead of the fixed ones */
+static ULONG lib_tuple(const struct pkt *p, const NET_PACKET_INFO *info, TOEPLITZ_CHUNK *chunks)
+{
+    PCHAR ip = (PCHAR)p->data + info->L2HdrLen;
+    ULONG n = 0;
+
+    if (info->isIP4) {
+        chunks[n].chunkPtr = ip + 12;
+        chunks[n++].chunkLen = 8;
+    } else {
+        chunks[n].chunkPtr = info->ip6HomeAddrOffset ? (PCHAR)p->data + info->ip6HomeAddrOffset : ip + 8;
+        chunks[n++].chunkLen = 16;
+        chunks[n].chunkPtr = info->ip6DestAddrOffset ? (PCHAR)p->data + info->ip6DestAddrOffset : ip + 24;
+        chunks[n++].chunkLen = 16;
+    }
+    if (info->isTCP || info->isUDP) {
+        chunks[n].chunkPtr = ip + info->L3HdrLen;
+        chunks[n++].chunkLen = 4;
+    }
+    return n;
+}
+
+static uint32_t ref_tuple(const struct pkt *p, const struct ref_frame_info *info, uint8_t *tuple)
+{
+    const uint8_t *ip = p->data + info->l2_len;
+    uint32_t len;
+
+    if (info->ip4) {
+        memcpy(tuple, ip + 12, 8);
+        len = 8;
+    } else {
+        memcpy(tuple, info->ip6_home_addr_offset ? p->data + info->ip6_home_addr_offset : ip + 8, 16);
+        memcpy(tuple + 16, info->ip6_dest_addr_offset ? p->data + info->ip6_dest_addr_offset : ip + 24, 16);
+        len = 32;
+    }
+    if (info->tcp || info->udp) {
+        memcpy(tuple + len, ip + info->l3_len, 4);
+        len += 4;
+    }
+    return len;
+}
+
+static void verify_analysis(struct pkt_set *set, unsigned int index, const struct ref_frame_info *ref,
+                            NET_PACKET_INFO *info)
+{
+    struct pkt *p = &set->pkts[index];
+    BOOLEAN valid = ParaNdis_AnalyzeReceivedPacket(p->data, p->len, info);
+
+    CHECK("analysis", !!valid, ref->valid);
+    if (!valid || !ref->valid) {
+        return;
+    }
+    CHECK("broadcast", !!info->isBroadcast, ref->broadcast);
+    CHECK("multicast", !!info->isMulticast, ref->multicast);
+    CHECK("unicast", !!info->isUnicast, ref->unicast);
+    CHECK("VLAN", !!info->hasVlanHeader, ref->vlan);
+    if (ref->vlan) {
+        CHECK("priority", info->Vlan.UserPriority, ref->priority);
+        CHECK("VLAN id", info->Vlan.VlanId, ref->vlan_id);
+    }
+    CHECK("L2 header", info->L2HdrLen, ref->l2_len);
+    CHECK("L2 payload", info->L2PayloadLen, p->len - ref->l2_len);
+    CHECK("IPv4", !!info->isIP4, ref->ip4);
+    CHECK("IPv6", !!info->isIP6, ref->ip6);
+    if (ref->ip4 || ref->ip6) {
+        CHECK("L3 header", info->L3HdrLen, ref->l3_len);
+        CHECK("fragment", !!info->isFragment, ref->fragment);
+        CHECK("TCP", !!info->isTCP, ref->tcp);
+        CHECK("UDP", !!info->isUDP, ref->udp);
+    }
+    if (ref->ip6) {
+        CHECK("home address", info->ip6HomeAddrOffset, ref->ip6_home_addr_offset);
+        CHECK("destination address", info->ip6DestAddrOffset, ref->ip6_dest_addr_offset);
+    }
+}
+
+static void verify_vlan_and_padding(struct pkt_set *set, unsigned int index, const struct ref_frame_info *ref)
+{
+    static uint8_t copy[MAX_FRAME + PKT_SLACK];
+    struct pkt *p = &set->pkts[index];
+    NET_PACKET_INFO info;
+    ULONG stripped = 0;
+
+    memcpy(copy, p->data, p->len);
+    ParaNdis_AnalyzeReceivedPacket(copy, p->len, &info);
+    if (ref->vlan) {
+        stripped = ParaNdis_StripVlanHeaderMoveHead(&info);
+        CHECK("stripped", stripped, 4);
+        CHECK("stripped frame", (PUCHAR)info.headersBuffer - copy, 4);
+        CHECK("stripped length", info.dataLength, p->len - 4);
+        CHECK("stripped L2 header", info.L2HdrLen, 14);
+        CHECK("stripped addresses", memcmp(copy + 4, p->data, 12), 0);
+        CHECK("stripped payload", memcmp(copy + 16, p->data + 16, p->len - 16), 0);
+    }
+    ParaNdis_PadPacketToMinimalLength(&info);
+    CHECK("padded length", info.dataLength, max(p->len - stripped, 60u));
+    if (p->len - stripped < 60) {
+        static const uint8_t zeros[60] = {};
+        CHECK("padding", memcmp(copy + p->len, zeros, 60 - (p->len - stripped)), 0);
+    }
+}
+
+static void verify_review(struct pkt_set *set, unsigned int index, const uint8_t *ip, uint32_t len,
+                          const struct ref_ip_info *ref)
+{
+    tTcpIpPacketParsingResult res = ParaNdis_ReviewIPPacket((PVOID)ip, len, TRUE, __FUNCTION__);
+
+    CHECK("IP status", res.ipStatus, ref->ip_status);
+    if (ref->ip_status == REF_IP_V4) {
+        CHECK("IP too short", res.ipCheckSum == ppResult::ppresIPTooShort, ref->too_short);
+    }
+    if (res.ipStatus != ref->ip_status || ref->ip_status == REF_IP_NOT_IP || ref->too_short) {
+        return;
+    }
+    CHECK("IP headers", res.ipHeaderSize, ref->ip_hdr_len);
+    CHECK("L4 status", res.xxpStatus, ref->l4_status);
+    if (ref->ip_status == REF_IP_V4) {
+        CHECK("IP fragment", res.IsFragment, ref->fragment);
+    }
+    if (ref->l4_status == REF_L4_KNOWN || ref->l4_status == REF_L4_INCOMPLETE) {
+        CHECK("TCP/UDP", res.TcpUdp, ref->tcp ? ppResult::ppresIsTCP : ppResult::ppresIsUDP);
+        CHECK("L4 full", res.xxpFull, ref->l4_status == REF_L4_KNOWN);
+    }
+    if (ref->l4_status == REF_L4_KNOWN) {
+        CHECK("IP and L4 headers", res.XxpIpHeaderSize, ref->l4_hdr_end);
+    }
+}
+
+static ULONG expected_l4_csum(const struct ref_csum_info *csum)
+{
+    return csum->l4_ok ? 2 : csum->l4_pseudo_ok ? 1 : 3;
+}
+
+/* verification only, over the flat packet and over odd sized pieces of it */
+static void verify_checksums(struct pkt_set *set, unsigned int index, uint32_t l2_len, const struct ref_ip_info *ref,
+                             const struct ref_csum_info *csum)
+{
+    static uint8_t copy[MAX_FRAME + PKT_SLACK];
+    static tCompletePhysicalAddress pages[MAX_FRAME / 61 + 2];
+    struct pkt *p = &set->pkts[index];
+    uint32_t len = p->len - l2_len;
+    tTcpIpPacketParsingResult flat, split;
+    ULONG n = 0, done = 0;
+
+    memcpy(copy, p->data, p->len);
+    flat = ParaNdis_CheckSumVerifyFlat(copy + l2_len, len, static_cast<ULONG>(tPacketOffloadRequest::pcrAnyChecksum),
+                                       TRUE, __FUNCTION__);
+    CHECK("verification changed the packet", memcmp(copy, p->data, p->len), 0);
+    if (ref->ip_status == REF_IP_V4) {
+        CHECK("IP checksum", flat.ipCheckSum, csum->ip_ok ? 2 : 3);
+    }
+    CHECK("L4 checksum", flat.xxpCheckSum, expected_l4_csum(csum));
+
+    /* the headers must be in the first piece, the rest is cut at odd lengths */
+    while (done < p->len) {
+        ULONG piece = n ? 61 : l2_len + ref->l4_hdr_end + 1;
+        pages[n].Virtual = copy + done;
+        pages[n].size = min(piece, p->len - done);
+        done += pages[n++].size;
+    }
+    split = ParaNdis_CheckSumVerify(pages, len, l2_len, static_cast<ULONG>(tPacketOffloadRequest::pcrAnyChecksum),
+                                    TRUE, __FUNCTION__);
+    CHECK("pieces", split.value, flat.value);
+}
+
+static void verify_fixes(struct pkt_set *set, unsigned int index, uint32_t l2_len, const struct ref_ip_info *ref,
+                         const struct ref_csum_info *csum)
+{
+    static uint8_t copy[MAX_FRAME + PKT_SLACK];
+    struct pkt *p = &set->pkts[index];
+    uint8_t *ip = copy + l2_len;
+    uint32_t len = p->len - l2_len;
+    struct ref_csum_info after;
+    tTcpIpPacketParsingResult res;
+    USHORT field;
+
+    /* complete checksums, like the TX path does for the host */
+    memcpy(copy, p->data, p->len);
+    res = ParaNdis_CheckSumVerifyFlat(ip, len,
+                                      tPacketOffloadRequest::pcrAnyChecksum | tPacketOffloadRequest::pcrFixIPChecksum |
+                                          tPacketOffloadRequest::pcrFixXxpChecksum,
+                                      TRUE, __FUNCTION__);
+    ref_checksums(ip, ref, &after);
+    if (ref->ip_status == REF_IP_V4) {
+        CHECK("fixed IP checksum", res.fixedIpCS, !csum->ip_ok);
+        CHECK("IP checksum after the fix", after.ip_ok, true);
+    }
+    CHECK("fixed L4 checksum", res.fixedXxpCS, !csum->l4_ok);
+    CHECK("L4 checksum with the fix", res.xxpCheckSum, expected_l4_csum(csum));
+    CHECK("L4 checksum after the fix", after.l4_ok, true);
+
+    /* pseudo header checksums, like the RX path does for the OS */
+    memcpy(copy, p->data, p->len);
+    res = ParaNdis_CheckSumVerifyFlat(ip, len,
+                                      tPacketOffloadRequest::pcrAnyChecksum | tPacketOffloadRequest::pcrFixPHChecksum,
+                                      TRUE, __FUNCTION__);
+    memcpy(&field, ip + csum->l4_csum_offset, sizeof(field));
+    CHECK("fixed pseudo header checksum", res.fixedXxpCS, !csum->l4_pseudo_ok);
+    CHECK("L4 checksum with the pseudo header fix", res.xxpCheckSum, csum->l4_pseudo_ok ? 1 : 3);
+    CHECK("pseudo header checksum after the fix", field, csum->pseudo);
+}
+
+static void verify_raw_checksums(struct pkt_set *set, unsigned int index)
+{
+    struct pkt *p = &set->pkts[index];
+
+    CHECK("checksum", CheckSumCalculator(p->data, p->len), ref_checksum(p->data, p->len));
+    if (p->len > 1) {
+        /* odd address */
+        CHECK("checksum at odd address", CheckSumCalculator(p->data + 1, p->len - 1),
+              ref_checksum(p->data + 1, p->len - 1));
+    }
+}
+
+static void verify_hash(struct pkt_set *set, unsigned int index, const NET_PACKET_INFO *info,
+                        const struct ref_frame_info *ref)
+{
+    struct pkt *p = &set->pkts[index];
+    TOEPLITZ_CHUNK chunks[3];
+    uint8_t tuple[36];
+    ULONG n = lib_tuple(p, info, chunks);
+    uint32_t expected = ref_toeplitz(ms_key, sizeof(ms_key), tuple, ref_tuple(p, ref, tuple));
+
+    set->hashed++;
+    CHECK("Toeplitz hash", toeplitz.Hash(chunks, n), expected);
+    CHECK("Toeplitz hash (table)", toeplitz.HashTable(chunks, n), expected);
+    if (clmul) {
+        CHECK("Toeplitz hash (clmul)", toeplitz.HashClmul(chunks, n), expected);
+    }
+}
+
+static void verify_set(struct pkt_set *set)
+{
+    for (unsigned int index = 0; index < set->count; ++index) {
+        struct pkt *p = &set->pkts[index];
+        struct ref_frame_info frame;
+        struct ref_ip_info ip;
+        struct ref_csum_info csum;
+        NET_PACKET_INFO info;
+
+        ref_analyze_frame(p->data, p->len, &frame);
+        verify_analysis(set, index, &frame, &info);
+        verify_raw_checksums(set, index);
+        if (!frame.valid) {
+            continue;
+        }
+        verify_vlan_and_padding(set, index, &frame);
+        if (!frame.ip4 && !frame.ip6) {
+            continue;
+        }
+        if (!frame.fragment) {
+            verify_hash(set, index, &info, &frame);
+        }
+
+        ref_review_ip(p->data + frame.l2_len, p->len - frame.l2_len, &ip);
+        verify_review(set, index, p->data + frame.l2_len, p->len - frame.l2_len, &ip);
+        if (ip.l4_status != REF_L4_KNOWN) {
+            continue;
+        }
+        if (ip.ip6_ext) {
+            /* the driver builds the pseudo header from the fixed IPv6 header only */
+            set->csum_skipped++;
+            continue;
+        }
+        set->csum_checked++;
+        ref_checksums(p->data + frame.l2_len, &ip, &csum);
+        verify_checksums(set, index, frame.l2_len, &ip, &csum);
+        verify_fixes(set, index, frame.l2_len, &ip, &csum);
+    }
+}
+
+/* the examples of "Verifying the RSS Hash Calculation" in the WDK documentation */
+static int verify_toeplitz_vectors(void)
+{
+    static const struct {
+        uint32_t ip_hash;
+        uint32_t tcp_hash;
+        uint8_t tuple[12];
+    } vectors[] = {
+        {0x323e8fc2, 0x51ccc178, {66, 9, 149, 187, 161, 142, 100, 80, 2794 >> 8, 2794 & 0xFF, 1766 >> 8, 1766 & 0xFF}},
+        {0xd718262a, 0xc626b0ea, {199, 92, 111, 2, 65, 69, 140, 83, 14230 >> 8, 14230 & 0xFF, 4739 >> 8, 4739 & 0xFF}},
+        {0xd2d0a5de, 0x5c2b394a, {24, 19, 198, 95, 12, 22, 207, 184, 12898 >> 8, 12898 & 0xFF, 38024 >> 8, 38024 & 0xFF}},
+        {0x82989176, 0xafc7327f, {38, 27, 205, 30, 209, 142, 163, 6, 48228 >> 8, 48228 & 0xFF, 2217 >> 8, 2217 & 0xFF}},
+        {0x5d1809c5, 0x10e828a2, {153, 39, 163, 191, 202, 188, 127, 2, 44251 >> 8, 44251 & 0xFF, 1303 >> 8, 1303 & 0xFF}},
+    };
+    int errors = 0;
+
+    for (unsigned int i = 0; i < ARRAYSIZE(vectors); ++i) {
+        TOEPLITZ_CHUNK chunk = {(PCHAR)vectors[i].tuple, 8};
+        uint32_t ip_ref = ref_toeplitz(ms_key, sizeof(ms_key), vectors[i].tuple, 8);
+        uint32_t tcp_ref = ref_toeplitz(ms_key, sizeof(ms_key), vectors[i].tuple, 12);
+        uint32_t ip_lib = toeplitz.HashTable(&chunk, 1);
+        uint32_t tcp_lib;
+
+        chunk.chunkLen = 12;
+        tcp_lib = toeplitz.HashTable(&chunk, 1);
+        if (ip_ref != vectors[i].ip_hash || tcp_ref != vectors[i].tcp_hash || ip_lib != ip_ref ||
+            tcp_lib != tcp_ref) {
+            fprintf(stderr, "Toeplitz vector %u: expected %08x/%08x, reference %08x/%08x, driver %08x/%08x\n", i,
+                    vectors[i].ip_hash, vectors[i].tcp_hash, ip_ref, tcp_ref, ip_lib, tcp_lib);
+            errors++;
+        }
+    }
+    return errors;
+}
+
+/*
+ * Benchmarks
+ */
+
+static volatile uint64_t sink;
+
+/* the set is processed until 'ops' packets are done, returns ns per packet */
+template <typename F> static double bench(struct pkt_set *set, unsigned long ops, F f)
+{
+    unsigned long done = 0;
+    uint64_t acc = 0;
+    uint64_t start = now_ns();
+
+    while (done < ops) {
+        for (unsigned int i = 0; i < set->count; ++i) {
+            acc += f(&set->pkts[i]);
+        }
+        done += set->count;
+    }
+    sink += acc;
+    return (double)(now_ns() - start) / done;
+}
+
+static void prepare_bench(struct pkt_set *set)
+{
+    for (unsigned int i = 0; i < set->count; ++i) {
+        struct pkt *p = &set->pkts[i];
+        NET_PACKET_INFO info;
+
+        p->l2_len = 14;
+        p->tuple_chunks = 0;
+        if (ParaNdis_AnalyzeReceivedPacket(p->data, p->len, &info)) {
+            p->l2_len = info.L2HdrLen;
+            if ((info.isIP4 || info.isIP6) && !info.isFragment) {
+                p->tuple_chunks = lib_tuple(p, &info, p->tuple);
+            }
+        }
+        p->l2_len = min(p->l2_len, p->len);
+    }
+}
+
+static void bench_header(void)
+{
+    printf("%-16s %6s %7s %8s %8s %8s %8s %8s %8s %8s\n", "ns/packet", "pkts", "avg-len", "analyze", "review",
+           "verify", "checksum", "toeplitz", "clmul", "ref");
+}
+
+static void bench_set(struct pkt_set *set, unsigned long ops)
+{
+    double analyze, review, verify, checksum, table, clmul_ns = 0, ref;
+
+    prepare_bench(set);
+    analyze = bench(set, ops, [](struct pkt *p) {
+        NET_PACKET_INFO info;
+        return (uint64_t)ParaNdis_AnalyzeReceivedPacket(p->data, p->len, &info) + info.L3HdrLen;
+    });
+    review = bench(set, ops, [](struct pkt *p) {
+        return (uint64_t)ParaNdis_ReviewIPPacket(p->data + p->l2_len, p->len - p->l2_len, TRUE, NULL).value;
+    });
+    verify = bench(set, ops, [](struct pkt *p) {
+        return (uint64_t)ParaNdis_CheckSumVerifyFlat(p->data + p->l2_len, p->len - p->l2_len,
+                                                     static_cast<ULONG>(tPacketOffloadRequest::pcrAnyChecksum), TRUE,
+                                                     NULL)
+            .value;
+    });
+    checksum = bench(set, ops, [](struct pkt *p) {
+        return (uint64_t)CheckSumCalculator(p->data + p->l2_len, p->len - p->l2_len);
+    });
+    table = bench(set, ops, [](struct pkt *p) {
+        return p->tuple_chunks ? (uint64_t)toeplitz.HashTable(p->tuple, p->tuple_chunks) : 0;
+    });
+    if (clmul) {
+        clmul_ns = bench(set, ops, [](struct pkt *p) {
+            return p->tuple_chunks ? (uint64_t)toeplitz.HashClmul(p->tuple, p->tuple_chunks) : 0;
+        });
+    }
+    ref = bench(set, ops, [](struct pkt *p) {
+        struct ref_frame_info info;
+        ref_analyze_frame(p->data, p->len, &info);
+        return (uint64_t)info.l3_len;
+    });
+
+    printf("%-16s %6u %7lu %8.1f %8.1f %8.1f %8.1f %8.1f ", set->name, set->count,
+           (unsigned long)(set->count ? set->bytes / set->count : 0), analyze, review, verify, checksum, table);
+    if (clmul) {
+        printf("%8.1f ", clmul_ns);
+    } else {
+        printf("%8s ", "-");
+    }
+    printf("%8.1f\n", ref);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -m mix     generate this traffic mix (default: all of them)\n"
+            "  -r file    replay the Ethernet frames of a pcap file instead\n"
+            "  -w file    write the packets of the (single) mix or file to a pcap file\n"
+            "  -c count   packets generated per mix (default 1000)\n"
+            "  -n count   packets processed per benchmark (default 1000000)\n"
+            "  -s seed    seed of the generator\n"
+            "  -t         verification only, no benchmarks\n"
+            "  -b         benchmarks only, no verification\n"
+            "  -v         report all the mismatches, not only the first 10\n"
+            "  -h         this help\n"
+            "Mixes:\n",
+            name);
+    for (unsigned int i = 0; i < ARRAYSIZE(mixes); ++i) {
+        fprintf(stderr, "  %-10s %s\n", mixes[i].name, mixes[i].description);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *mix_name = NULL, *read_path = NULL, *write_path = NULL;
+    unsigned int count = 1000;
+    unsigned long ops = 1000000;
+    bool verify = true, benchmark = true;
+    struct pkt_set sets[ARRAYSIZE(mixes)] = {};
+    unsigned int nsets = 0;
+    unsigned long errors = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:r:w:c:n:s:tbvh")) != -1) {
+        switch (opt) {
+        case 'm':
+            mix_name = optarg;
+            break;
+        case 'r':
+            read_path = optarg;
+            break;
+        case 'w':
+            write_path = optarg;
+            break;
+        case 'c':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            ops = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            /* the state must not be 0 */
+            rng_state = (strtoull(optarg, NULL, 0) + 1) * 0x9E3779B97F4A7C15ULL;
+            break;
+        case 't':
+            benchmark = false;
+            break;
+        case 'b':
+            verify = false;
+            break;
+        case 'v':
+            max_reports = ULONG_MAX;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc || !count || !ops || (mix_name && read_path)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    toeplitz.SetKey((const CCHAR *)ms_key, sizeof(ms_key));
+    clmul = CToeplitzHash::ClmulSupported();
+
+    if (read_path) {
+        if (read_pcap(&sets[nsets++], read_path)) {
+            return 1;
+        }
+    } else {
+        for (unsigned int i = 0; i < ARRAYSIZE(mixes); ++i) {
+            if (!mix_name || !strcmp(mix_name, mixes[i].name)) {
+                generate(&sets[nsets++], &mixes[i], count);
+            }
+        }
+        if (!nsets) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (write_path) {
+        if (nsets != 1) {
+            fprintf(stderr, "-w needs a single mix\n");
+            return 1;
+        }
+        if (write_pcap(&sets[0], write_path)) {
+            return 1;
+        }
+    }
+
+    if (verify) {
+        errors += verify_toeplitz_vectors();
+        for (unsigned int i = 0; i < nsets; ++i) {
+            verify_set(&sets[i]);
+            printf("%-16s %6u packets, %lu mismatches, checksums of %lu compared", sets[i].name, sets[i].count,
+                   sets[i].errors, sets[i].csum_checked);
+            if (sets[i].csum_skipped) {
+                printf(" (%lu with IPv6 extension headers not)", sets[i].csum_skipped);
+            }
+            printf(", %lu hashed\n", sets[i].hashed);
+            errors += sets[i].errors;
+        }
+        if (errors) {
+            printf("FAILED: %lu mismatches\n", errors);
+        }
+    }
+    if (benchmark) {
+        printf("\n");
+        bench_header();
+        for (unsigned int i = 0; i < nsets; ++i) {
+            bench_set(&sets[i], ops);
+        }
+        printf("(clmul: %s)\n", clmul ? "PCLMULQDQ" : "not supported");
+    }
+
+    for (unsigned int i = 0; i < nsets; ++i) {
+        set_free(&sets[i]);
+    }
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,386 @@
+/*
+ * Reference implementation of the NetKVM packet parsing, see reference.h
+ */
+#include "reference.h"
+
+#include <string.h>
+
+#define ETH_P_IPV4 0x0800
+#define ETH_P_IPV6 0x86DD
+#define ETH_P_VLAN 0x8100
+
+#define IPPROTO_HOPOPTS  0
+#define IPPROTO_TCP      6
+#define IPPROTO_UDP      17
+#define IPPROTO_ROUTING  43
+#define IPPROTO_FRAGMENT 44
+#define IPPROTO_ESP      50
+#define IPPROTO_AH       51
+#define IPPROTO_NONE     59
+#define IPPROTO_DSTOPTS  60
+#define IPPROTO_MH       135
+
+#define IP6OPT_PAD1      0
+#define IP6OPT_HOME_ADDR 201
+
+/* IPv6 headers the driver handles, the header size must fit in 8 bits */
+#define MAX_IP6_HEADERS 252
+
+static uint16_t get16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+/*
+ * Walks the IPv6 extension headers of 'len' bytes at 'ip', stops at the first
+ * header that is not an extension header or is a fragment or ESP header.
+ * Fills the header length, the protocol the walk stopped at and, for the
+ * frame analysis, the offsets of the home address option and of the type 2
+ * routing header address. Returns false for truncated or malformed headers.
+ */
+static bool walk_ip6(const uint8_t *ip, uint32_t len, bool frame_analysis, uint32_t *hdr_len, uint8_t *proto,
+                     uint32_t *home_addr, uint32_t *dest_addr)
+{
+    uint32_t off = 40;
+    uint8_t next = ip[6];
+
+    *home_addr = *dest_addr = 0;
+    for (;;) {
+        uint32_t ext_len;
+
+        switch (next) {
+        case IPPROTO_HOPOPTS:
+        case IPPROTO_ROUTING:
+        case IPPROTO_DSTOPTS:
+        case IPPROTO_MH:
+            if (off + 2 > len) {
+                return false;
+            }
+            ext_len = (ip[off + 1] + 1) * 8;
+            break;
+        case IPPROTO_AH:
+            if (off + 2 > len) {
+                return false;
+            }
+            ext_len = (ip[off + 1] + 2) * 4;
+            break;
+        case IPPROTO_FRAGMENT:
+            if (frame_analysis) {
+                /* the analysis reports fragments and does not look further */
+                *hdr_len = off;
+                *proto = next;
+                return true;
+            }
+            ext_len = 8;
+            break;
+        default:
+            *hdr_len = off;
+            *proto = next;
+            return true;
+        }
+        if (off + ext_len > len) {
+            return false;
+        }
+
+        if (frame_analysis && next == IPPROTO_DSTOPTS) {
+            uint32_t opt = off + 2;
+            while (opt < off + ext_len) {
+                uint32_t opt_len;
+                if (ip[opt] == IP6OPT_PAD1) {
+                    opt++;
+                    continue;
+                }
+                if (opt + 2 > off + ext_len) {
+                    return false;
+                }
+                opt_len = 2 + ip[opt + 1];
+                if (opt + opt_len > off + ext_len) {
+                    return false;
+                }
+                if (ip[opt] == IP6OPT_HOME_ADDR) {
+                    if (ip[opt + 1] != 16) {
+                        return false;
+                    }
+                    *home_addr = opt + 2;
+                }
+                opt += opt_len;
+            }
+        } else if (frame_analysis && next == IPPROTO_ROUTING && ip[off + 2] == 2) {
+            /* type 2 routing header (RFC 6275) carries exactly one address */
+            if (ext_len != 24 || ip[off + 3] != 1) {
+                return false;
+            }
+            *dest_addr = off + 8;
+        }
+
+        next = ip[off];
+        off += ext_len;
+    }
+}
+
+void ref_analyze_frame(const uint8_t *frame, uint32_t len, struct ref_frame_info *info)
+{
+    uint16_t type;
+    uint32_t l2;
+
+    memset(info, 0, sizeof(*info));
+    if (len < 14) {
+        return;
+    }
+    if (!memcmp(frame, "\xff\xff\xff\xff\xff\xff", 6)) {
+        info->broadcast = true;
+    } else if (frame[0] & 1) {
+        info->multicast = true;
+    } else {
+        info->unicast = true;
+    }
+
+    if (get16(frame + 12) == ETH_P_VLAN) {
+        if (len < 18) {
+            return;
+        }
+        info->vlan = true;
+        info->priority = frame[14] >> 5;
+        info->vlan_id = get16(frame + 14) & 0xFFF;
+        type = get16(frame + 16);
+        l2 = 18;
+    } else {
+        type = get16(frame + 12);
+        l2 = 14;
+    }
+    info->l2_len = l2;
+
+    const uint8_t *ip = frame + l2;
+    uint32_t ip_len = len - l2;
+
+    if (type == ETH_P_IPV4) {
+        info->ip4 = true;
+        if (ip_len < 20) {
+            return;
+        }
+        info->l3_len = (ip[0] & 0xF) * 4;
+        if ((ip[0] >> 4) != 4 || info->l3_len < 20 || info->l3_len > ip_len) {
+            return;
+        }
+        /* more fragments or a fragment offset */
+        info->fragment = (get16(ip + 6) & 0x3FFF) != 0;
+        if (!info->fragment) {
+            info->tcp = ip[9] == IPPROTO_TCP;
+            info->udp = ip[9] == IPPROTO_UDP;
+        }
+    } else if (type == ETH_P_IPV6) {
+        uint32_t home, dest;
+        uint8_t proto;
+
+        info->ip6 = true;
+        if (ip_len < 40 || (ip[0] >> 4) != 6) {
+            return;
+        }
+        if (!walk_ip6(ip, ip_len, true, &info->l3_len, &proto, &home, &dest) || info->l3_len > MAX_IP6_HEADERS) {
+            return;
+        }
+        info->ip6_home_addr_offset = home ? l2 + home : 0;
+        info->ip6_dest_addr_offset = dest ? l2 + dest : 0;
+        info->fragment = proto == IPPROTO_FRAGMENT;
+        if (!info->fragment) {
+            info->tcp = proto == IPPROTO_TCP;
+            info->udp = proto == IPPROTO_UDP;
+        }
+    }
+    info->valid = true;
+}
+
+static void review_l4(const uint8_t *ip, uint32_t len, struct ref_ip_info *info)
+{
+    uint32_t hdr = info->ip_hdr_len;
+
+    switch (info->l4_proto) {
+    case IPPROTO_TCP:
+        info->tcp = true;
+        if (len >= hdr + 20) {
+            info->l4_status = REF_L4_KNOWN;
+            info->l4_hdr_end = hdr + (ip[hdr + 12] >> 4) * 4;
+        } else {
+            info->l4_status = REF_L4_INCOMPLETE;
+        }
+        break;
+    case IPPROTO_UDP:
+        if (len >= hdr + 8) {
+            info->l4_status = REF_L4_KNOWN;
+            info->l4_hdr_end = hdr + 8;
+        } else {
+            info->l4_status = REF_L4_INCOMPLETE;
+        }
+        break;
+    case IPPROTO_NONE:
+        break;
+    default:
+        info->l4_status = REF_L4_OTHER;
+        break;
+    }
+}
+
+void ref_review_ip(const uint8_t *ip, uint32_t len, struct ref_ip_info *info)
+{
+    memset(info, 0, sizeof(*info));
+    info->ip_status = REF_IP_NOT_IP;
+    if (len < 20) {
+        return;
+    }
+
+    if ((ip[0] >> 4) == 4) {
+        uint32_t hdr = (ip[0] & 0xF) * 4;
+        uint32_t total = get16(ip + 2);
+
+        if (hdr < 20) {
+            return;
+        }
+        info->ip_status = REF_IP_V4;
+        if (hdr >= total || len < total) {
+            info->too_short = true;
+            return;
+        }
+        info->ip_hdr_len = hdr;
+        info->fragment = (get16(ip + 6) & 0x3FFF) != 0;
+        info->l4_proto = ip[9];
+        review_l4(ip, len, info);
+    } else if ((ip[0] >> 4) == 6) {
+        uint32_t total, home, dest;
+
+        if (len < 40) {
+            return;
+        }
+        total = 40 + get16(ip + 4);
+        if (len < total) {
+            return;
+        }
+        if (!walk_ip6(ip, total, false, &info->ip_hdr_len, &info->l4_proto, &home, &dest) ||
+            info->ip_hdr_len > MAX_IP6_HEADERS) {
+            info->ip_hdr_len = 0;
+            return;
+        }
+        info->ip_status = REF_IP_V6;
+        info->ip6_ext = info->ip_hdr_len > 40;
+        review_l4(ip, len, info);
+    }
+}
+
+uint64_t ref_sum(const uint8_t *data, uint32_t len)
+{
+    uint64_t sum = 0;
+    uint32_t i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += get16(data + i);
+    }
+    if (len & 1) {
+        sum += data[len - 1] << 8;
+    }
+    return sum;
+}
+
+uint16_t ref_fold(uint64_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return (uint16_t)sum;
+}
+
+static uint16_t to_host(uint16_t be)
+{
+    uint8_t b[2] = {(uint8_t)(be >> 8), (uint8_t)be};
+    uint16_t h;
+    memcpy(&h, b, 2);
+    return h;
+}
+
+uint16_t ref_checksum(const uint8_t *data, uint32_t len)
+{
+    return to_host((uint16_t)~ref_fold(ref_sum(data, len)));
+}
+
+static uint64_t pseudo_sum(const uint8_t *ip, const struct ref_ip_info *info, uint32_t l4_len)
+{
+    if (info->ip_status == REF_IP_V4) {
+        return ref_sum(ip + 12, 8) + info->l4_proto + l4_len;
+    }
+    return ref_sum(ip + 8, 32) + info->l4_proto + (l4_len >> 16) + (l4_len & 0xFFFF);
+}
+
+static uint32_t l4_length(const uint8_t *ip, const struct ref_ip_info *info)
+{
+    if (info->ip_status == REF_IP_V4) {
+        return get16(ip + 2) - info->ip_hdr_len;
+    }
+    return 40 + get16(ip + 4) - info->ip_hdr_len;
+}
+
+void ref_checksums(const uint8_t *ip, const struct ref_ip_info *info, struct ref_csum_info *csum)
+{
+    uint32_t l4_len = l4_length(ip, info);
+    uint64_t pseudo = pseudo_sum(ip, info, l4_len);
+    uint16_t stored;
+
+    memset(csum, 0, sizeof(*csum));
+    if (info->ip_status == REF_IP_V4) {
+        csum->ip_ok = ref_fold(ref_sum(ip, info->ip_hdr_len)) == 0xFFFF;
+    }
+    csum->l4_csum_offset = info->ip_hdr_len + (info->tcp ? 16 : 6);
+    csum->l4_ok = ref_fold(pseudo + ref_sum(ip + info->ip_hdr_len, l4_len)) == 0xFFFF;
+    csum->pseudo = to_host(ref_fold(pseudo));
+    /* 0xFFFF and 0 are the same number in one's complement (RFC 1624) */
+    stored = get16(ip + csum->l4_csum_offset);
+    csum->l4_pseudo_ok = (stored == 0xFFFF ? 0 : stored) == ref_fold(pseudo);
+}
+
+void ref_fill_checksums(uint8_t *ip, bool pseudo_only)
+{
+    struct ref_ip_info info;
+    struct ref_csum_info csum;
+    uint16_t value;
+
+    ref_review_ip(ip, 0xFFFF, &info);
+    if (info.ip_status == REF_IP_V4 && !info.too_short) {
+        memset(ip + 10, 0, 2);
+        value = ref_checksum(ip, info.ip_hdr_len);
+        memcpy(ip + 10, &value, 2);
+    }
+    if (info.l4_status != REF_L4_KNOWN) {
+        return;
+    }
+    ref_checksums(ip, &info, &csum);
+    memset(ip + csum.l4_csum_offset, 0, 2);
+    if (pseudo_only) {
+        value = csum.pseudo;
+    } else {
+        uint32_t l4_len = l4_length(ip, &info);
+        value = to_host((uint16_t)~ref_fold(pseudo_sum(ip, &info, l4_len) + ref_sum(ip + info.ip_hdr_len, l4_len)));
+    }
+    memcpy(ip + csum.l4_csum_offset, &value, 2);
+}
+
+uint32_t ref_toeplitz(const uint8_t *key, uint32_t key_len, const uint8_t *input, uint32_t len)
+{
+    uint32_t result = 0;
+    uint32_t bit;
+
+    for (bit = 0; bit < len * 8; bit++) {
+        uint32_t window = 0;
+        uint32_t k;
+
+        if (!(input[bit / 8] & (0x80 >> (bit % 8)))) {
+            continue;
+        }
+        /* the 32 key bits starting at the input bit, zero beyond the key */
+        for (k = 0; k < 32; k++) {
+            uint32_t key_bit = bit + k;
+            window <<= 1;
+            if (key_bit / 8 < key_len && (key[key_bit / 8] & (0x80 >> (key_bit % 8)))) {
+                window |= 1;
+            }
+        }
+        result ^= window;
+    }
+    return result;
+}
@@ -0,0 +1,89 @@
+/*
+ * Reference implementation of the NetKVM packet parsing
+ *
+ * Written from the RFCs and from the contracts of sw_offload.cpp, not from its
+ * code: plain byte accesses in network order, bounds checked against the data,
+ * no attempt to be fast. The harness compares the driver code with it.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum ref_ip_status {
+    REF_IP_NOT_TESTED,
+    REF_IP_NOT_IP,
+    REF_IP_V4,
+    REF_IP_V6,
+};
+
+enum ref_l4_status {
+    REF_L4_NOT_TESTED,
+    REF_L4_OTHER,
+    REF_L4_KNOWN,
+    REF_L4_INCOMPLETE,
+};
+
+/* what ParaNdis_AnalyzeReceivedPacket should find in an Ethernet frame */
+struct ref_frame_info {
+    bool valid;
+    bool broadcast;
+    bool multicast;
+    bool unicast;
+    bool vlan;
+    uint8_t priority;
+    uint16_t vlan_id;
+    bool ip4;
+    bool ip6;
+    bool tcp;
+    bool udp;
+    bool fragment;
+    uint32_t l2_len;
+    uint32_t l3_len;
+    /* offsets in the frame, 0 when there is no such address */
+    uint32_t ip6_home_addr_offset;
+    uint32_t ip6_dest_addr_offset;
+};
+
+/* what ParaNdis_ReviewIPPacket should find in an IP packet (length verified) */
+struct ref_ip_info {
+    enum ref_ip_status ip_status;
+    /* IPv4 only, the header or the packet is shorter than the length fields say */
+    bool too_short;
+    bool fragment;
+    /* at least one IPv6 extension header */
+    bool ip6_ext;
+    uint8_t l4_proto;
+    enum ref_l4_status l4_status;
+    bool tcp;
+    uint32_t ip_hdr_len;
+    /* IP headers and the TCP or UDP header, when complete */
+    uint32_t l4_hdr_end;
+};
+
+/* checksums of a packet with a complete TCP or UDP header */
+struct ref_csum_info {
+    bool ip_ok;
+    bool l4_ok;
+    /* the L4 checksum field holds the pseudo header checksum */
+    bool l4_pseudo_ok;
+    /* folded, not complemented, sum of the pseudo header, in host order */
+    uint16_t pseudo;
+    uint32_t l4_csum_offset;
+};
+
+void ref_analyze_frame(const uint8_t *frame, uint32_t len, struct ref_frame_info *info);
+void ref_review_ip(const uint8_t *ip, uint32_t len, struct ref_ip_info *info);
+/* 'ip' is reviewed with ref_review_ip, l4_status must be REF_L4_KNOWN */
+void ref_checksums(const uint8_t *ip, const struct ref_ip_info *ipinfo, struct ref_csum_info *csum);
+
+/* RFC 1071 sum of the data as big endian words, not folded */
+uint64_t ref_sum(const uint8_t *data, uint32_t len);
+uint16_t ref_fold(uint64_t sum);
+/* the Internet checksum of the data, as it is stored in a header (host order) */
+uint16_t ref_checksum(const uint8_t *data, uint32_t len);
+/* fills the IPv4 header checksum and the TCP or UDP one (full or pseudo header only) */
+void ref_fill_checksums(uint8_t *ip, bool pseudo_only);
+
+/* Toeplitz hash by the definition, one input bit at a time */
+uint32_t ref_toeplitz(const uint8_t *key, uint32_t key_len, const uint8_t *input, uint32_t len);
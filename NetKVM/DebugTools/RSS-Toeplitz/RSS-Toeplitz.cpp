@@ -1,8 +1,10 @@
-// RSS-Toeplitz.cpp : Little-endian test for RSS Toeplitz hash
+// RSS-Toeplitz.cpp : Little-endian test and benchmark for RSS Toeplitz hash
 //
 
 #include "stdafx.h"
+#include <stdlib.h>
 #include "WinToeplitz.h"
+#include "..\..\Common\ParaNdis-Toeplitz.h"
 
 static uint8_t testKey[WTEP_MAX_KEY_SIZE] = {0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67,
                                              0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0, 0xd0, 0xca, 0x2b, 0xcb,
@@ -28,81 +30,214 @@ static struct
 };
 // clang-format on
 
-#define ITERATIONS_NUMBER (1000000UL)
+#define ITERATIONS_NUMBER        (1000000UL)
+#define RANDOM_ITERATIONS_NUMBER (100000UL)
+
+// chunk layouts the driver hashes: IPv4 + ports, IPv4, IPv6 + ports, IPv6
+static const ULONG sgLayouts[][3] = {{8, 4, 0}, {8, 0, 0}, {16, 16, 4}, {16, 16, 0}};
+
+static CToeplitzHash toeplitz;
+
+static void FillTestVector(int i, uint8_t *vector)
+{
+    vector[0] = testData[i].sourceIP[0];
+    vector[1] = testData[i].sourceIP[1];
+    vector[2] = testData[i].sourceIP[2];
+    vector[3] = testData[i].sourceIP[3];
+    vector[4] = testData[i].destIP[0];
+    vector[5] = testData[i].destIP[1];
+    vector[6] = testData[i].destIP[2];
+    vector[7] = testData[i].destIP[3];
+    vector[8] = testData[i].sourcePort >> 8;
+    vector[9] = testData[i].sourcePort & 0xff;
+    vector[10] = testData[i].destPort >> 8;
+    vector[11] = testData[i].destPort & 0xff;
+}
+
+// Compares the table driven and CLMUL implementations with the bit-serial one,
+// returns the number of mismatches
+static unsigned long CompareRandom(bool clmul)
+{
+    unsigned long numFailed = 0;
+    uint8_t key[WTEP_MAX_KEY_SIZE];
+    uint8_t data[TOEPLITZ_MAX_INPUT_SIZE];
+
+    srand(1);
+    for (unsigned long it = 0; it < RANDOM_ITERATIONS_NUMBER; ++it)
+    {
+        HASH_CALC_SG_BUF_ENTRY sgBuffer[3];
+        TOEPLITZ_CHUNK chunks[3];
+        ULONG lengths[3];
+        ULONG offset = 0;
+        uint32_t expected;
+
+        if (it % 1000 == 0)
+        {
+            for (int i = 0; i < sizeof(key); ++i)
+            {
+                key[i] = (uint8_t)rand();
+            }
+            toeplitzw_initialize(key, sizeof(key));
+            toeplitz.SetKey((CCHAR *)key, sizeof(key));
+        }
+        for (int i = 0; i < sizeof(data); ++i)
+        {
+            data[i] = (uint8_t)rand();
+        }
+
+        if (it % 2)
+        {
+            const ULONG *layout = sgLayouts[(it / 2) % ARRAYSIZE(sgLayouts)];
+            lengths[0] = layout[0];
+            lengths[1] = layout[1];
+            lengths[2] = layout[2];
+        }
+        else
+        {
+            // arbitrary lengths, the table driven variant only
+            lengths[0] = rand() % 13;
+            lengths[1] = rand() % 13;
+            lengths[2] = rand() % 11;
+        }
+
+        for (int i = 0; i < 3; ++i)
+        {
+            sgBuffer[i].chunkPtr = data + offset;
+            sgBuffer[i].chunkLen = lengths[i];
+            chunks[i].chunkPtr = (PCHAR)data + offset;
+            chunks[i].chunkLen = lengths[i];
+            offset += lengths[i];
+        }
+
+        expected = ToeplitzHash(sgBuffer, 3, workingkey);
+        if (toeplitz.HashTable(chunks, 3) != expected || toeplitz.Hash(chunks, 3) != expected ||
+            (clmul && (it % 2) && toeplitz.HashClmul(chunks, 3) != expected))
+        {
+            ++numFailed;
+            printf("Random calculation failed at iteration %lu\n", it);
+        }
+    }
+    return numFailed;
+}
+
+template <typename THash> static ULONGLONG Measure(const char *name, THash hash)
+{
+    ULONGLONG StartTickCount, FinishTickCount;
+    uint8_t vectors[ARRAYSIZE(testData)][12];
+    volatile uint32_t sink = 0;
+
+    for (int i = 0; i < ARRAYSIZE(testData); ++i)
+    {
+        FillTestVector(i, vectors[i]);
+    }
+
+    StartTickCount = GetTickCount64();
+    for (unsigned long it = 0; it < ITERATIONS_NUMBER; ++it)
+    {
+        for (int i = 0; i < ARRAYSIZE(testData); ++i)
+        {
+            sink = sink ^ hash(vectors[i]);
+        }
+    }
+    FinishTickCount = GetTickCount64();
+
+    printf("%-27s %lu Ms\n", name, (ULONG)(FinishTickCount - StartTickCount));
+    return FinishTickCount - StartTickCount;
+}
 
 int _tmain(int argc, _TCHAR *argv[])
 {
     int i;
     uint8_t vector[12];
+    bool clmul = CToeplitzHash::ClmulSupported();
 
     unsigned long numSuccessfulTCP = 0;
     unsigned long numFailedTCP = 0;
     unsigned long numSuccessfulIP = 0;
     unsigned long numFailedIP = 0;
-    ULONGLONG StartTickCount, FinishTickCount;
+    unsigned long numFailedRandom;
 
     toeplitzw_initialize(testKey, sizeof(testKey));
+    toeplitz.SetKey((CCHAR *)testKey, sizeof(testKey));
 
-    StartTickCount = GetTickCount64();
-
-    for (unsigned long it = 0; it < ITERATIONS_NUMBER; ++it)
+    for (i = 0; i < sizeof(testData) / sizeof(testData[0]); ++i)
     {
-        for (i = 0; i < sizeof(testData) / sizeof(testData[0]); ++i)
+        uint32_t res[3];
+        HASH_CALC_SG_BUF_ENTRY sgBuffer[2];
+        TOEPLITZ_CHUNK chunks[2];
+
+        FillTestVector(i, vector);
+
+        sgBuffer[0].chunkPtr = vector;
+        sgBuffer[0].chunkLen = 8;
+        sgBuffer[1].chunkPtr = vector + 8;
+        sgBuffer[1].chunkLen = 4;
+        chunks[0].chunkPtr = (PCHAR)vector;
+        chunks[0].chunkLen = 8;
+        chunks[1].chunkPtr = (PCHAR)vector + 8;
+        chunks[1].chunkLen = 4;
+
+        for (ULONG n = 1; n <= 2; ++n)
         {
-            uint32_t res;
-            HASH_CALC_SG_BUF_ENTRY sgBuffer[2];
-
-            vector[0] = testData[i].sourceIP[0];
-            vector[1] = testData[i].sourceIP[1];
-            vector[2] = testData[i].sourceIP[2];
-            vector[3] = testData[i].sourceIP[3];
-            vector[4] = testData[i].destIP[0];
-            vector[5] = testData[i].destIP[1];
-            vector[6] = testData[i].destIP[2];
-            vector[7] = testData[i].destIP[3];
-            vector[8] = testData[i].sourcePort >> 8;
-            vector[9] = testData[i].sourcePort & 0xff;
-            vector[10] = testData[i].destPort >> 8;
-            vector[11] = testData[i].destPort & 0xff;
-
-            sgBuffer[0].chunkPtr = vector;
-            sgBuffer[0].chunkLen = 8;
-            sgBuffer[1].chunkPtr = vector + 8;
-            sgBuffer[1].chunkLen = 4;
-
-            res = ToeplitzHash(sgBuffer, 1, workingkey);
-            if (res == testData[i].resultIP)
+            uint32_t expected = n == 1 ? testData[i].resultIP : testData[i].resultTCP;
+
+            res[0] = ToeplitzHash(sgBuffer, n, workingkey);
+            res[1] = toeplitz.HashTable(chunks, n);
+            res[2] = clmul ? toeplitz.HashClmul(chunks, n) : expected;
+            bool ok = res[0] == expected && res[1] == expected && res[2] == expected;
+
+            if (n == 1)
             {
-                ++numSuccessfulIP;
+                ok ? ++numSuccessfulIP : ++numFailedIP;
             }
             else
             {
-                ++numFailedIP;
-                printf("IP calculation failed for data sample %d\n", i);
-            }
-            res = ToeplitzHash(sgBuffer, 2, workingkey);
-            if (res == testData[i].resultTCP)
-            {
-                ++numSuccessfulTCP;
+                ok ? ++numSuccessfulTCP : ++numFailedTCP;
             }
-            else
+            if (!ok)
             {
-                ++numFailedTCP;
-                printf("TCP calculation failed for data sample %d\n", i);
+                printf("%s calculation failed for data sample %d: %08lx %08lx %08lx\n",
+                       n == 1 ? "IP" : "TCP",
+                       i,
+                       (unsigned long)res[0],
+                       (unsigned long)res[1],
+                       (unsigned long)res[2]);
             }
         }
     }
 
-    FinishTickCount = GetTickCount64();
+    numFailedRandom = CompareRandom(clmul);
 
     printf("Correct IP calculations     %lu\n", numSuccessfulIP);
     printf("Correct TCP calculations    %lu\n", numSuccessfulTCP);
     printf("Wrong IP calculations       %lu\n", numFailedIP);
     printf("Wrong TCP calculations      %lu\n", numFailedTCP);
-    printf("Total test time             %lu Ms\n", FinishTickCount - StartTickCount);
+    printf("Wrong random calculations   %lu of %lu\n", numFailedRandom, RANDOM_ITERATIONS_NUMBER);
+    printf("CLMUL supported             %s\n", clmul ? "yes" : "no");
+    printf("\n");
+
+    toeplitzw_initialize(testKey, sizeof(testKey));
+    toeplitz.SetKey((CCHAR *)testKey, sizeof(testKey));
+
+    printf("Time of %lu x %u TCP hashes\n", ITERATIONS_NUMBER, (ULONG)ARRAYSIZE(testData));
+    Measure("  bit-serial", [](uint8_t *v) {
+        HASH_CALC_SG_BUF_ENTRY sgBuffer[2] = {{v, 8}, {v + 8, 4}};
+        return (uint32_t)ToeplitzHash(sgBuffer, 2, workingkey);
+    });
+    Measure("  table", [](uint8_t *v) {
+        TOEPLITZ_CHUNK chunks[2] = {{(PCHAR)v, 8}, {(PCHAR)v + 8, 4}};
+        return (uint32_t)toeplitz.HashTable(chunks, 2);
+    });
+    if (clmul)
+    {
+        Measure("  clmul", [](uint8_t *v) {
+            TOEPLITZ_CHUNK chunks[2] = {{(PCHAR)v, 8}, {(PCHAR)v + 8, 4}};
+            return (uint32_t)toeplitz.HashClmul(chunks, 2);
+        });
+    }
     printf("\n\n");
 
-    if (numFailedIP || numFailedTCP)
+    if (numFailedIP || numFailedTCP || numFailedRandom)
     {
         printf("Test FAILED\n");
         return -1;
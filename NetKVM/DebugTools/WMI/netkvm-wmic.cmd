@@ -11,6 +11,11 @@ if /i "%1"=="rss" goto rss_set
 if /i "%1"=="tx" goto tx
 if /i "%1"=="rx" goto rx
 if /i "%1"=="cx" goto cx
+if /i "%1"=="txq" goto txq
+if /i "%1"=="poll" goto poll
+if /i "%1"=="devrx" goto devrx
+if /i "%1"=="devtx" goto devtx
+if /i "%1"=="latency" goto latency
 
 goto help
 :debug
@@ -44,11 +49,34 @@ goto :eof
 call :diag ctrl
 goto :eof
 
+:txq
+call :dowmic netkvm_txqueues get /value
+goto :eof
+
+:poll
+call :dowmic netkvm_poll get /value
+goto :eof
+
+:devrx
+call :dowmic netkvm_devicerx get /value
+goto :eof
+
+:devtx
+call :dowmic netkvm_devicetx get /value
+goto :eof
+
+:latency
+call :dowmic netkvm_latency get /value
+goto :eof
+
 :reset
-set resettype=7
+set resettype=63
 if "%2"=="rx" set resettype=1
 if "%2"=="tx" set resettype=2
 if "%2"=="rss" set resettype=4
+if "%2"=="txq" set resettype=8
+if "%2"=="poll" set resettype=16
+if "%2"=="latency" set resettype=32
 echo resetting type %resettype%...
 call :dowmic netkvm_diagreset set type=%resettype%
 goto :eof
@@ -87,7 +115,12 @@ echo tx                     Retrieves internal statistics for transmit
 echo rx                     Retrieves internal statistics for receive
 echo rss                    Retrieves internal statistics for RSS
 echo cx                     Retrieves internal statistics for controls
+echo txq                    Retrieves the number of packets sent on each Tx queue
+echo poll                   Retrieves the busy polling statistics of each poll handler
+echo devrx                  Retrieves the statistics of the device for each Rx queue
+echo devtx                  Retrieves the statistics of the device for each Tx queue
+echo latency                Retrieves the latency histograms of each Tx and Rx queue
 echo rss 0/1                Disable/enable RSS device support
-echo reset [tx^|rs^|rss]      Resets internal statistics(default=all)
+echo reset [tx^|rs^|rss^|txq^|poll^|latency] Resets internal statistics(default=all)
 goto :eof
 
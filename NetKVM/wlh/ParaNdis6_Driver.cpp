@@ -451,27 +451,28 @@ static VOID ParaNdis6_SendNetBufferLists(NDIS_HANDLE miniportAdapterContext,
         return;
     }
 #ifdef PARANDIS_SUPPORT_RSS
-    CNdisPassiveReadAutoLock autoLock(pContext->RSSParameters.rwLock);
-    auto queueMap = pContext->RSS2QueueMap;
-    if (pContext->nPathBundles > 1 && queueMap != nullptr)
+    CRSSSnapshotReader reader(pContext->RSSParameters);
+    const PARANDIS_RSS_SNAPSHOT *snapshot = reader.Get();
+    CPUPathBundle *const *queueMap = (snapshot != NULL && snapshot->QueueMapLength) ? snapshot->QueueMap : nullptr;
+    if (pContext->nPathBundles > 1 && (queueMap != nullptr || pContext->TxSteering.IsEnabled()))
     {
         PNET_BUFFER_LIST head = NULL, *tail = &head;
-        ULONG index = 0, mask = pContext->RSSParameters.ActiveRSSScalingSettings.RSSHashMask;
+        CPUPathBundle *path = NULL;
+        ULONG mask = queueMap != nullptr ? snapshot->Scaling.RSSHashMask : 0;
         while (pNBL)
         {
-            ULONG RSSHashValue = NET_BUFFER_LIST_GET_HASH_VALUE(pNBL);
-            ULONG indirectionIndex = RSSHashValue & mask;
-            if (indirectionIndex != index)
+            CPUPathBundle *target = pContext->TxSteering.SelectPath(pNBL, queueMap, mask);
+            if (target != path)
             {
                 // flush collected chain, if any
                 if (head)
                 {
-                    queueMap[index]->txPath.Send(head);
+                    path->txPath.Send(head);
                     head = NULL;
                     tail = &head;
                 }
-                // update index
-                index = indirectionIndex;
+                // update path
+                path = target;
             }
             // collect current NBL into per-queue chain
             *tail = pNBL;
@@ -482,7 +483,7 @@ static VOID ParaNdis6_SendNetBufferLists(NDIS_HANDLE miniportAdapterContext,
         // flush last chain, if any
         if (head)
         {
-            queueMap[index]->txPath.Send(head);
+            path->txPath.Send(head);
         }
     }
     else
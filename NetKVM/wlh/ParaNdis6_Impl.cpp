@@ -820,10 +820,10 @@ static __inline VOID NBLSetRSSInfo(PPARANDIS_ADAPTER pContext,
                                    PVOID virtioHeader)
 {
 #if PARANDIS_SUPPORT_RSS
-    CNdisRWLockState lockState;
+    CRSSSnapshotReader reader(pContext->RSSParameters);
+    const PARANDIS_RSS_SNAPSHOT *snapshot = reader.Get();
 
-    pContext->RSSParameters.rwLock.acquireReadDpr(lockState);
-    if (pContext->RSSParameters.RSSMode != PARANDIS_RSS_MODE::PARANDIS_RSS_DISABLED)
+    if (snapshot != NULL && snapshot->RSSMode != PARANDIS_RSS_MODE::PARANDIS_RSS_DISABLED)
     {
         NET_BUFFER_LIST_SET_HASH_TYPE(pNBL, PacketInfo->RSSHash.Type);
         NET_BUFFER_LIST_SET_HASH_FUNCTION(pNBL, PacketInfo->RSSHash.Function);
@@ -843,7 +843,6 @@ static __inline VOID NBLSetRSSInfo(PPARANDIS_ADAPTER pContext,
             }
         }
     }
-    pContext->RSSParameters.rwLock.releaseDpr(lockState);
 #else
     UNREFERENCED_PARAMETER(pContext);
     UNREFERENCED_PARAMETER(pNBL);
@@ -1000,7 +999,11 @@ tPacketIndicationType ParaNdis_PrepareReceivedPacket(PARANDIS_ADAPTER *pContext,
 
         // Traditional multi-page only; no-op for mergeable (FullPageMDL set).
         // ulDataOffset: NB DataOffset still skips stripped VLAN at MDL start.
-        ParaNdis_AdjustRxBufferHolderLength(pBuffersDesc, nBytesStripped);
+        // The chain of a coalesced frame is already built by the RX path.
+        if (!pBuffersDesc->CoalescedSegments)
+        {
+            ParaNdis_AdjustRxBufferHolderLength(pBuffersDesc, nBytesStripped);
+        }
 
         pNBL = NdisAllocateNetBufferAndNetBufferList(pContext->BufferListsPool,
                                                      0,
@@ -1025,7 +1028,16 @@ tPacketIndicationType ParaNdis_PrepareReceivedPacket(PARANDIS_ADAPTER *pContext,
             csRes.value = 0;
             csRes.flags.IpOK = true;
             csRes.flags.TcpOK = true;
-            if (pHeader->hdr.gso_type != VIRTIO_NET_HDR_GSO_NONE)
+            if (pBuffersDesc->CoalescedSegments)
+            {
+                *pnCoalescedSegmentsCount = pBuffersDesc->CoalescedSegments + 1;
+                pContext->extraStatistics.framesCoalescedSoftware++;
+                NBLSetRSCInfo(pContext, pNBL, pPacketInfo, *pnCoalescedSegmentsCount, 0);
+                // the TCP checksum of the coalesced frame is not updated
+                qCSInfo.Receive.IpChecksumValueInvalid = true;
+                qCSInfo.Receive.TcpChecksumValueInvalid = true;
+            }
+            else if (pHeader->hdr.gso_type != VIRTIO_NET_HDR_GSO_NONE)
             {
                 USHORT nDupAcks = 0;
                 if (pHeader->hdr.flags & VIRTIO_NET_HDR_F_RSC_INFO)
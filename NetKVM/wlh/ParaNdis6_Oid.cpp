@@ -50,19 +50,42 @@ static NDIS_IO_WORKITEM_FUNCTION OnSetPowerWorkItem;
     }
 
 /**********************************************************
-Just fail the request for unsupported OID
+Enables or disables the adaptive interrupt coalescing
 Parameters:
     context
     tOidDesc *pOid      descriptor of OID request
 Return value:
-    whatever
+    NDIS_STATUS_INVALID_DATA for unknown moderation values
 ***********************************************************/
 static NDIS_STATUS OnSetInterruptModeration(PARANDIS_ADAPTER *pContext, tOidDesc *pOid)
 {
-    UNREFERENCED_PARAMETER(pContext);
-    UNREFERENCED_PARAMETER(pOid);
+    NDIS_INTERRUPT_MODERATION_PARAMETERS params;
+    NDIS_STATUS status = ParaNdis_OidSetCopy(pOid, &params, sizeof(params));
 
-    return NDIS_STATUS_INVALID_DATA;
+    if (status != NDIS_STATUS_SUCCESS)
+    {
+        return status;
+    }
+    if (params.Header.Type != NDIS_OBJECT_TYPE_DEFAULT ||
+        params.Header.Revision < NDIS_INTERRUPT_MODERATION_PARAMETERS_REVISION_1)
+    {
+        return NDIS_STATUS_INVALID_DATA;
+    }
+
+    switch (params.InterruptModeration)
+    {
+        case NdisInterruptModerationEnabled:
+            ParaNdis_SetInterruptModeration(pContext, TRUE);
+            break;
+        case NdisInterruptModerationDisabled:
+            ParaNdis_SetInterruptModeration(pContext, FALSE);
+            break;
+        default:
+            return NDIS_STATUS_INVALID_DATA;
+    }
+    ParaNdis_DeviceConfigureNotifyCoalescing(pContext);
+    DPrintf(0, "Interrupt moderation %sabled", pContext->bInterruptModeration ? "en" : "dis");
+    return NDIS_STATUS_SUCCESS;
 }
 
 static NDIS_STATUS OnSetOffloadParameters(PARANDIS_ADAPTER *pContext, tOidDesc *pOid);
@@ -72,11 +95,16 @@ static NDIS_STATUS OnSetVendorSpecific1(PARANDIS_ADAPTER *pContext, tOidDesc *pO
 static NDIS_STATUS OnSetVendorSpecific4(PARANDIS_ADAPTER *pContext, tOidDesc *pOid);
 static NDIS_STATUS OnSetVendorSpecific5(PARANDIS_ADAPTER *pContext, tOidDesc *pOid);
 
-#define OID_VENDOR_1 0xff010201
-#define OID_VENDOR_2 0xff010202
-#define OID_VENDOR_3 0xff010203
-#define OID_VENDOR_4 0xff010204
-#define OID_VENDOR_5 0xff010205
+#define OID_VENDOR_1  0xff010201
+#define OID_VENDOR_2  0xff010202
+#define OID_VENDOR_3  0xff010203
+#define OID_VENDOR_4  0xff010204
+#define OID_VENDOR_5  0xff010205
+#define OID_VENDOR_6  0xff010206
+#define OID_VENDOR_7  0xff010207
+#define OID_VENDOR_8  0xff010208
+#define OID_VENDOR_9  0xff010209
+#define OID_VENDOR_10 0xff01020A
 
 #if PARANDIS_SUPPORT_RSS
 
@@ -213,6 +241,11 @@ OIDENTRY(OID_VENDOR_2,                          0,0,0, ohfQueryStat),
 OIDENTRY(OID_VENDOR_3,                          0,0,0, ohfQueryStat),
 OIDENTRYPROC(OID_VENDOR_4,                      0,0,0, ohfQueryStat | ohfSet | ohfSetMoreOK, OnSetVendorSpecific4),
 OIDENTRYPROC(OID_VENDOR_5,                      0,0,0, ohfQueryStat | ohfSet | ohfSetMoreOK, OnSetVendorSpecific5),
+OIDENTRY(OID_VENDOR_6,                          0,0,0, ohfQueryStat),
+OIDENTRY(OID_VENDOR_7,                          0,0,0, ohfQueryStat),
+OIDENTRY(OID_VENDOR_8,                          0,0,0, ohfQueryStat),
+OIDENTRY(OID_VENDOR_9,                          0,0,0, ohfQueryStat),
+OIDENTRY(OID_VENDOR_10,                         0,0,0, ohfQueryStat),
 
 #if PARANDIS_SUPPORT_RSS
     OIDENTRYPROC(OID_GEN_RECEIVE_SCALE_PARAMETERS,  0,0,0, ohfSet | ohfSetPropagatePost | ohfSetMoreOK, RSSSetParameters),
@@ -298,6 +331,11 @@ static const NDIS_GUID supportedGUIDs[] =
     { NetKvm_DiagGuid,       OID_VENDOR_3, NetKvm_Diag_SIZE, fNDIS_GUID_TO_OID | fNDIS_GUID_ALLOW_READ },
     { NetKvm_DiagResetGuid,  OID_VENDOR_4, NetKvm_DiagReset_SIZE, fNDIS_GUID_TO_OID | fNDIS_GUID_ALLOW_WRITE | fNDIS_GUID_ALLOW_READ },
     { NetKvm_DeviceRssGuid,  OID_VENDOR_5, NetKvm_DeviceRss_SIZE, fNDIS_GUID_TO_OID | fNDIS_GUID_ALLOW_WRITE | fNDIS_GUID_ALLOW_READ},
+    { NetKvm_TxQueuesGuid,   OID_VENDOR_6, NetKvm_TxQueues_SIZE, fNDIS_GUID_TO_OID | fNDIS_GUID_ALLOW_READ },
+    { NetKvm_PollGuid,       OID_VENDOR_7, NetKvm_Poll_SIZE, fNDIS_GUID_TO_OID | fNDIS_GUID_ALLOW_READ },
+    { NetKvm_DeviceRxGuid,   OID_VENDOR_8, NetKvm_DeviceRx_SIZE, fNDIS_GUID_TO_OID | fNDIS_GUID_ALLOW_READ },
+    { NetKvm_DeviceTxGuid,   OID_VENDOR_9, NetKvm_DeviceTx_SIZE, fNDIS_GUID_TO_OID | fNDIS_GUID_ALLOW_READ },
+    { NetKvm_LatencyGuid,    OID_VENDOR_10, NetKvm_Latency_SIZE, fNDIS_GUID_TO_OID | fNDIS_GUID_ALLOW_READ },
 };
 // clang-format on
 
@@ -408,6 +446,7 @@ static NDIS_STATUS OnSetVendorSpecific4(PARANDIS_ADAPTER *pContext, tOidDesc *pO
         pContext->extraStatistics.framesRxCSHwOK = 0;
         pContext->extraStatistics.framesCoalescedHost = 0;
         pContext->extraStatistics.framesCoalescedWindows = 0;
+        pContext->extraStatistics.framesCoalescedSoftware = 0;
         pContext->extraStatistics.framesRxPriority = 0;
         pContext->extraStatistics.rxIndicatesWithResourcesFlag.QuadPart = 0;
         // keep this one
@@ -421,6 +460,7 @@ static NDIS_STATUS OnSetVendorSpecific4(PARANDIS_ADAPTER *pContext, tOidDesc *pO
         pContext->extraStatistics.framesCSOffload = 0;
         pContext->extraStatistics.droppedTxPackets = 0;
         pContext->extraStatistics.copiedTxPackets = 0;
+        pContext->extraStatistics.inlinedTxPackets = 0;
         // keep this one
         pContext->extraStatistics.minFreeTxBuffers;
     }
@@ -428,6 +468,39 @@ static NDIS_STATUS OnSetVendorSpecific4(PARANDIS_ADAPTER *pContext, tOidDesc *pO
     {
         ResetRssStatistics(pContext);
     }
+    if (temp & 8)
+    {
+        // reset Tx queue selection stats
+        for (UINT i = 0; i < pContext->nPathBundles; ++i)
+        {
+            NdisZeroMemory(&pContext->pPathBundles[i].txPath.SteeringStatistics,
+                           sizeof(pContext->pPathBundles[i].txPath.SteeringStatistics));
+        }
+    }
+    if (temp & 16)
+    {
+        // reset poll handler stats
+        for (UINT i = 0; i < ARRAYSIZE(pContext->PollHandlers); ++i)
+        {
+            NdisZeroMemory(&pContext->PollHandlers[i].Statistics, sizeof(pContext->PollHandlers[i].Statistics));
+        }
+    }
+    if (temp & 32)
+    {
+        // reset latency histograms
+        for (UINT i = 0; i < pContext->nPathBundles; ++i)
+        {
+            pContext->pPathBundles[i].txPath.ResetLatency();
+            NdisZeroMemory(&pContext->pPathBundles[i].rxPath.UnclassifiedPacketsQueue().Latency,
+                           sizeof(tLatencyHistogram));
+        }
+#if PARANDIS_SUPPORT_RSS
+        for (UINT i = 0; i < ARRAYSIZE(pContext->ReceiveQueues); ++i)
+        {
+            NdisZeroMemory(&pContext->ReceiveQueues[i].Latency, sizeof(pContext->ReceiveQueues[i].Latency));
+        }
+#endif
+    }
     return status;
 }
 
@@ -453,6 +526,105 @@ static NDIS_STATUS OnSetVendorSpecific5(PARANDIS_ADAPTER *pContext, tOidDesc *pO
     return status;
 }
 
+// the counters of the device for each RX queue, too large for the stack
+static PVOID QueryDeviceRx(PARANDIS_ADAPTER *pContext)
+{
+    NetKvm_DeviceRx *info = (NetKvm_DeviceRx *)ParaNdis_AllocateMemory(pContext, sizeof(NetKvm_DeviceRx));
+    if (!info)
+    {
+        return NULL;
+    }
+    NdisZeroMemory(info, sizeof(*info));
+    if (pContext->DeviceStatistics.IsActive())
+    {
+        info->NumOfQueues = min(pContext->nPathBundles, (UINT)ARRAYSIZE(info->Packets));
+    }
+    for (UINT i = 0; i < info->NumOfQueues; ++i)
+    {
+        const ULONG64 *counters = pContext->pPathBundles[i].rxDeviceStatistics.Counters;
+        info->Notifications[i] = counters[dqcNotifications];
+        info->Packets[i] = counters[dqcPackets];
+        info->Bytes[i] = counters[dqcBytes];
+        info->Interrupts[i] = counters[dqcInterrupts];
+        info->Drops[i] = counters[dqcDrops];
+        info->Overruns[i] = counters[dqcOverruns];
+        info->ChecksumBad[i] = counters[dqcChecksumBad];
+        info->RateLimited[i] = counters[dqcRateLimited];
+    }
+    return info;
+}
+
+// the counters of the device for each TX queue
+static PVOID QueryDeviceTx(PARANDIS_ADAPTER *pContext)
+{
+    NetKvm_DeviceTx *info = (NetKvm_DeviceTx *)ParaNdis_AllocateMemory(pContext, sizeof(NetKvm_DeviceTx));
+    if (!info)
+    {
+        return NULL;
+    }
+    NdisZeroMemory(info, sizeof(*info));
+    if (pContext->DeviceStatistics.IsActive())
+    {
+        info->NumOfQueues = min(pContext->nPathBundles, (UINT)ARRAYSIZE(info->Packets));
+    }
+    for (UINT i = 0; i < info->NumOfQueues; ++i)
+    {
+        const ULONG64 *counters = pContext->pPathBundles[i].txDeviceStatistics.Counters;
+        info->Notifications[i] = counters[dqcNotifications];
+        info->Packets[i] = counters[dqcPackets];
+        info->Bytes[i] = counters[dqcBytes];
+        info->Interrupts[i] = counters[dqcInterrupts];
+        info->Drops[i] = counters[dqcDrops];
+        info->Malformed[i] = counters[dqcMalformed];
+        info->RateLimited[i] = counters[dqcRateLimited];
+    }
+    return info;
+}
+
+static void CopyLatency(ULONG64 *Destination, const tLatencyHistogram &Histogram)
+{
+    NdisMoveMemory(Destination, Histogram.Buckets, sizeof(Histogram.Buckets));
+}
+
+static void AddLatency(ULONG64 *Destination, const tLatencyHistogram &Histogram)
+{
+    for (UINT i = 0; i < LATENCY_BUCKETS; ++i)
+    {
+        Destination[i] += Histogram.Buckets[i];
+    }
+}
+
+// the latency histograms of each queue
+static PVOID QueryLatency(PARANDIS_ADAPTER *pContext)
+{
+    NetKvm_Latency *info = (NetKvm_Latency *)ParaNdis_AllocateMemory(pContext, sizeof(NetKvm_Latency));
+    if (!info)
+    {
+        return NULL;
+    }
+    NdisZeroMemory(info, sizeof(*info));
+    info->TicksPerMs = pContext->LatencyClock.TicksPerMs();
+    info->NumOfBuckets = LATENCY_BUCKETS;
+    info->NumOfQueues = min(pContext->nPathBundles, (UINT)(ARRAYSIZE(info->TxQueue) / LATENCY_BUCKETS));
+    for (UINT i = 0; i < info->NumOfQueues; ++i)
+    {
+        CPUPathBundle &bundle = pContext->pPathBundles[i];
+        UINT offset = i * LATENCY_BUCKETS;
+        CopyLatency(info->TxQueue + offset, bundle.txPath.Latency.Queue);
+        CopyLatency(info->TxDevice + offset, bundle.txPath.DeviceLatency());
+        CopyLatency(info->TxComplete + offset, bundle.txPath.Latency.Complete);
+        // the packets of the bundle wait either in its unclassified queue or in the RSS queue
+        CopyLatency(info->RxQueue + offset, bundle.rxPath.UnclassifiedPacketsQueue().Latency);
+#if PARANDIS_SUPPORT_RSS
+        if (i < ARRAYSIZE(pContext->ReceiveQueues))
+        {
+            AddLatency(info->RxQueue + offset, pContext->ReceiveQueues[i].Latency);
+        }
+#endif
+    }
+    return info;
+}
+
 /*****************************************************************
 Handles NDIS6 specific OID, all the rest handled by common handler
 *****************************************************************/
@@ -472,6 +644,9 @@ static NDIS_STATUS ParaNdis_OidQuery(PARANDIS_ADAPTER *pContext, tOidDesc *pOid)
         NetKvm_Config WmiConfig;
         NetKvm_DeviceRss WmiDevRss;
         NetKvm_DiagReset WmiReset;
+        NetKvm_TxQueues WmiTxQueues;
+        NetKvm_Poll WmiPoll;
+        NDIS_STATISTICS_INFO Statistics;
     } u;
     NDIS_STATUS status = NDIS_STATUS_SUCCESS;
     PVOID pInfo = NULL;
@@ -485,8 +660,12 @@ static NDIS_STATUS ParaNdis_OidQuery(PARANDIS_ADAPTER *pContext, tOidDesc *pOid)
     switch (pOid->Oid)
     {
         case OID_GEN_STATISTICS:
-            pInfo = &pContext->Statistics;
-            ulSize = sizeof(pContext->Statistics);
+            pInfo = &u.Statistics;
+            ulSize = sizeof(u.Statistics);
+            u.Statistics = pContext->Statistics;
+            // the packets dropped by the device never reach the driver
+            u.Statistics.ifInDiscards += pContext->DeviceStatistics.Total(dqcDrops, true);
+            u.Statistics.ifOutDiscards += pContext->DeviceStatistics.Total(dqcDrops, false);
             break;
         case OID_GEN_SUPPORTED_GUIDS:
 #if NDIS_SUPPORT_NDIS61
@@ -553,12 +732,63 @@ static NDIS_STATUS ParaNdis_OidQuery(PARANDIS_ADAPTER *pContext, tOidDesc *pOid)
             ulSize = sizeof(u.WmiDevRss);
             u.WmiDevRss.value = 2;
             break;
+        case OID_VENDOR_6:
+            pInfo = &u.WmiTxQueues;
+            ulSize = sizeof(u.WmiTxQueues);
+            NdisZeroMemory(&u.WmiTxQueues, sizeof(u.WmiTxQueues));
+            u.WmiTxQueues.NumOfQueues = min(pContext->nPathBundles, (UINT)ARRAYSIZE(u.WmiTxQueues.ByHash));
+            for (UINT i = 0; i < u.WmiTxQueues.NumOfQueues; ++i)
+            {
+                u.WmiTxQueues.ByHash[i] = pContext->pPathBundles[i].txPath.SteeringStatistics.ByHash;
+                u.WmiTxQueues.ByCpu[i] = pContext->pPathBundles[i].txPath.SteeringStatistics.ByCpu;
+                u.WmiTxQueues.ByFlow[i] = pContext->pPathBundles[i].txPath.SteeringStatistics.ByFlow;
+            }
+            break;
+        case OID_VENDOR_7:
+            pInfo = &u.WmiPoll;
+            ulSize = sizeof(u.WmiPoll);
+            NdisZeroMemory(&u.WmiPoll, sizeof(u.WmiPoll));
+            if (pContext->bPollModeEnabled)
+            {
+                u.WmiPoll.NumOfHandlers = min((UINT)pContext->RSSMaxQueuesNumber, (UINT)ARRAYSIZE(u.WmiPoll.Polls));
+            }
+            for (UINT i = 0; i < u.WmiPoll.NumOfHandlers; ++i)
+            {
+                const NdisPollHandler &poll = pContext->PollHandlers[i];
+                u.WmiPoll.Polls[i] = poll.Statistics.Polls;
+                u.WmiPoll.EmptyPolls[i] = poll.Statistics.EmptyPolls;
+                u.WmiPoll.BusyPolls[i] = poll.Statistics.BusyPolls;
+                u.WmiPoll.BusyHits[i] = poll.Statistics.BusyHits;
+                u.WmiPoll.Rearms[i] = poll.Statistics.Rearms;
+                u.WmiPoll.WindowUsecs[i] = poll.TicksToUsecs(poll.m_BusyWindow);
+            }
+            break;
+        case OID_VENDOR_8:
+            pInfo = QueryDeviceRx(pContext);
+            ulSize = sizeof(NetKvm_DeviceRx);
+            bFreeInfo = TRUE;
+            status = pInfo ? NDIS_STATUS_SUCCESS : NDIS_STATUS_RESOURCES;
+            break;
+        case OID_VENDOR_9:
+            pInfo = QueryDeviceTx(pContext);
+            ulSize = sizeof(NetKvm_DeviceTx);
+            bFreeInfo = TRUE;
+            status = pInfo ? NDIS_STATUS_SUCCESS : NDIS_STATUS_RESOURCES;
+            break;
+        case OID_VENDOR_10:
+            pInfo = QueryLatency(pContext);
+            ulSize = sizeof(NetKvm_Latency);
+            bFreeInfo = TRUE;
+            status = pInfo ? NDIS_STATUS_SUCCESS : NDIS_STATUS_RESOURCES;
+            break;
         case OID_GEN_INTERRUPT_MODERATION:
             u.InterruptModeration.Header.Type = NDIS_OBJECT_TYPE_DEFAULT;
             u.InterruptModeration.Header.Size = NDIS_SIZEOF_INTERRUPT_MODERATION_PARAMETERS_REVISION_1;
             u.InterruptModeration.Header.Revision = NDIS_INTERRUPT_MODERATION_PARAMETERS_REVISION_1;
             u.InterruptModeration.Flags = 0;
-            u.InterruptModeration.InterruptModeration = NdisInterruptModerationNotSupported;
+            u.InterruptModeration.InterruptModeration = pContext->bInterruptModeration ?
+                                                            NdisInterruptModerationEnabled :
+                                                            NdisInterruptModerationDisabled;
             pInfo = &u.InterruptModeration;
             ulSize = sizeof(u.InterruptModeration);
             break;
@@ -611,9 +841,13 @@ NDIS_STATUS ParaNdis6_OidRequest(NDIS_HANDLE miniportAdapterContext, PNDIS_OID_R
     NDIS_STATUS status = NDIS_STATUS_NOT_SUPPORTED;
     tOidWhatToDo Rules;
     PARANDIS_ADAPTER *pContext = (PARANDIS_ADAPTER *)miniportAdapterContext;
+    // the request may be completed by the CX DPC as soon as EndOidRequest returns
+    // NDIS_STATUS_PENDING, it is not touched after that
+    NDIS_OID oid = pNdisRequest->DATA.SET_INFORMATION.Oid;
+    NDIS_REQUEST_TYPE requestType = pNdisRequest->RequestType;
     tOidDesc _oid;
     _oid.Reserved = pNdisRequest;
-    ParaNdis_GetOidSupportRules(pNdisRequest->DATA.SET_INFORMATION.Oid, &Rules, OidsDB);
+    ParaNdis_GetOidSupportRules(oid, &Rules, OidsDB);
     _oid.ulToDoFlags = Rules.Flags;
 
     ParaNdis_DebugHistory(pContext,
@@ -680,11 +914,14 @@ NDIS_STATUS ParaNdis6_OidRequest(NDIS_HANDLE miniportAdapterContext, PNDIS_OID_R
                                                   _oid.InformationBuffer,
                                                   _oid.InformationBufferLength);
                         }
+                        // control commands posted by the handler may complete the request later
+                        pContext->CXPath.BeginOidRequest();
                         status = Rules.OidSetProc(pContext, &_oid);
                         if (Rules.Flags & ohfSetPropagatePost && status == STATUS_SUCCESS)
                         {
                             ParaNdis_PropagateOid(pContext, _oid.Oid, NULL, 0);
                         }
+                        status = pContext->CXPath.EndOidRequest(pNdisRequest, status);
                     }
                     else
                     {
@@ -702,17 +939,12 @@ NDIS_STATUS ParaNdis6_OidRequest(NDIS_HANDLE miniportAdapterContext, PNDIS_OID_R
                 break;
         }
     }
-    ParaNdis_DebugHistory(pContext,
-                          _etagHistoryLogOperation::hopOidRequest,
-                          NULL,
-                          pNdisRequest->DATA.SET_INFORMATION.Oid,
-                          status,
-                          0);
+    ParaNdis_DebugHistory(pContext, _etagHistoryLogOperation::hopOidRequest, NULL, oid, status, 0);
     if (status != NDIS_STATUS_PENDING)
     {
         DPrintf(((status != NDIS_STATUS_SUCCESS) ? Rules.nExitFailLevel : Rules.nExitOKLevel),
                 "OID type %d, id 0x%X(%s) (%X)",
-                pNdisRequest->RequestType,
+                requestType,
                 Rules.oid,
                 Rules.name,
                 status);
@@ -13,7 +13,7 @@ static void PrintIndirectionTable(const NDIS_RECEIVE_SCALE_PARAMETERS *Params);
 static void PrintIndirectionTable(const PARANDIS_SCALING_SETTINGS *RSSScalingSetting);
 
 static void PrintRSSSettings(PPARANDIS_RSS_PARAMS RSSParameters);
-static NDIS_STATUS ParaNdis_SetupRSSQueueMap(PARANDIS_ADAPTER *pContext);
+static NDIS_STATUS ParaNdis_SetupRSSQueueMap(PARANDIS_ADAPTER *pContext, PARANDIS_RSS_SNAPSHOT *Snapshot);
 
 static VOID ApplySettings(PPARANDIS_RSS_PARAMS RSSParameters,
                           PARANDIS_RSS_MODE NewRSSMode,
@@ -28,7 +28,18 @@ static VOID ApplySettings(PPARANDIS_RSS_PARAMS RSSParameters,
     {
         if (ReceiveHashingSettings != NULL)
         {
+            bool keyChanged = ReceiveHashingSettings->HashSecretKeySize !=
+                                  RSSParameters->ActiveHashingSettings.HashSecretKeySize ||
+                              !NdisEqualMemory(ReceiveHashingSettings->HashSecretKey,
+                                               RSSParameters->ActiveHashingSettings.HashSecretKey,
+                                               ReceiveHashingSettings->HashSecretKeySize);
+
             RSSParameters->ActiveHashingSettings = *ReceiveHashingSettings;
+            if (keyChanged)
+            {
+                RSSParameters->ActiveToeplitzHash.SetKey(RSSParameters->ActiveHashingSettings.HashSecretKey,
+                                                         RSSParameters->ActiveHashingSettings.HashSecretKeySize);
+            }
         }
 
         if (NewRSSMode == PARANDIS_RSS_MODE::PARANDIS_RSS_FULL && ReceiveScalingSettings != NULL)
@@ -64,6 +75,127 @@ static VOID CleanupRSSParameters(PARANDIS_RSS_PARAMS *RSSParameters)
     {
         NdisFreeMemory(RSSParameters->RSSScalingSettings.CPUIndexMapping, 0, 0);
     }
+
+    if (RSSParameters->Snapshot != NULL)
+    {
+        NdisFreeMemory(RSSParameters->Snapshot, 0, 0);
+    }
+}
+
+// Replacement of the snapshot used by the data path. The new snapshot is allocated before the write
+// lock is taken and published under it. The replaced one is freed when the object goes out of scope,
+// after the lock is released: the readers hold the snapshot at DISPATCH_LEVEL, so once this thread
+// has run on every processor none of them can still use it.
+class CRSSSnapshotUpdate
+{
+  public:
+    CRSSSnapshotUpdate(PARANDIS_ADAPTER *pContext) : m_Context(pContext)
+    {
+        m_MappingSize = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+        m_Snapshot = (PARANDIS_RSS_SNAPSHOT *)ParaNdis_AllocateMemory(
+            pContext,
+            FIELD_OFFSET(PARANDIS_RSS_SNAPSHOT, CPUIndexMappingData) + m_MappingSize * sizeof(CCHAR));
+    }
+
+    ~CRSSSnapshotUpdate()
+    {
+        if (m_Snapshot != NULL)
+        {
+            NdisFreeMemory(m_Snapshot, 0, 0);
+        }
+        if (m_Replaced != NULL)
+        {
+            WaitForReaders();
+            NdisFreeMemory(m_Replaced, 0, 0);
+        }
+    }
+
+    bool IsValid() const
+    {
+        return m_Snapshot != NULL;
+    }
+
+    // Copies the active settings and the TX queue map of the current snapshot, under the write lock
+    PARANDIS_RSS_SNAPSHOT *Build();
+    // Under the write lock, after Build()
+    void Publish();
+
+  private:
+    static void WaitForReaders();
+
+    PARANDIS_ADAPTER *m_Context;
+    PARANDIS_RSS_SNAPSHOT *m_Snapshot;
+    PARANDIS_RSS_SNAPSHOT *m_Replaced = NULL;
+    ULONG m_MappingSize;
+};
+
+PARANDIS_RSS_SNAPSHOT *CRSSSnapshotUpdate::Build()
+{
+    const PARANDIS_RSS_PARAMS *RSSParameters = &m_Context->RSSParameters;
+    const PARANDIS_RSS_SNAPSHOT *current = RSSParameters->Snapshot;
+    PARANDIS_RSS_SNAPSHOT *snapshot = m_Snapshot;
+
+    NdisZeroMemory(snapshot, FIELD_OFFSET(PARANDIS_RSS_SNAPSHOT, CPUIndexMappingData));
+
+    snapshot->RSSMode = RSSParameters->RSSMode;
+    snapshot->HashInformation = RSSParameters->ActiveHashingSettings.HashInformation;
+    snapshot->ToeplitzHash = RSSParameters->ActiveToeplitzHash;
+
+    snapshot->Scaling = RSSParameters->ActiveRSSScalingSettings;
+    snapshot->Scaling.CPUIndexMapping = snapshot->CPUIndexMappingData;
+    snapshot->Scaling.CPUIndexMappingSize = min(snapshot->Scaling.CPUIndexMappingSize, m_MappingSize);
+    if (snapshot->Scaling.CPUIndexMappingSize)
+    {
+        NdisMoveMemory(snapshot->CPUIndexMappingData,
+                       RSSParameters->ActiveRSSScalingSettings.CPUIndexMapping,
+                       snapshot->Scaling.CPUIndexMappingSize);
+    }
+
+    if (current != NULL)
+    {
+        snapshot->QueueMapLength = current->QueueMapLength;
+        NdisMoveMemory(snapshot->QueueMap, current->QueueMap, sizeof(snapshot->QueueMap));
+    }
+
+    return snapshot;
+}
+
+void CRSSSnapshotUpdate::Publish()
+{
+    PVOID volatile *published = (PVOID volatile *)&m_Context->RSSParameters.Snapshot;
+
+    m_Replaced = (PARANDIS_RSS_SNAPSHOT *)InterlockedExchangePointer(published, m_Snapshot);
+    m_Snapshot = NULL;
+}
+
+void CRSSSnapshotUpdate::WaitForReaders()
+{
+    ULONG count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    GROUP_AFFINITY original = {};
+    bool switched = false;
+
+    NETKVM_ASSERT(ParaNdis_IsPassive());
+
+    for (ULONG i = 0; i < count; ++i)
+    {
+        PROCESSOR_NUMBER number;
+        GROUP_AFFINITY affinity = {};
+
+        if (!NT_SUCCESS(KeGetProcessorNumberFromIndex(i, &number)))
+        {
+            continue;
+        }
+        affinity.Group = number.Group;
+        affinity.Mask = AFFINITY_MASK(number.Number);
+        // returns when the thread runs on that processor
+        KeSetSystemGroupAffinityThread(&affinity, switched ? NULL : &original);
+        switched = true;
+    }
+
+    if (switched)
+    {
+        KeRevertToUserGroupAffinityThread(&original);
+    }
 }
 
 static VOID InitRSSCapabilities(PARANDIS_ADAPTER *pContext)
@@ -213,7 +345,7 @@ static void SetDeviceRSSSettings(PARANDIS_ADAPTER *pContext, bool bForceOff = fa
     {
         virtio_net_rss_config cfg = {};
         cfg.max_tx_vq = (USHORT)pContext->nPathBundles;
-        pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_MQ, command, &cfg, sizeof(cfg), NULL, 0, 2);
+        pContext->CXPath.PostControlMessage(VIRTIO_NET_CTRL_MQ, command, &cfg, sizeof(cfg), NULL, 0, 2);
     }
     else
     {
@@ -260,7 +392,7 @@ static void SetDeviceRSSSettings(PARANDIS_ADAPTER *pContext, bool bForceOff = fa
 
         cfg->hash_types = TranslateHashTypes(pContext->RSSParameters.ActiveHashingSettings.HashInformation);
 
-        pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_MQ, command, cfg, config_size, NULL, 0, 2);
+        pContext->CXPath.PostControlMessage(VIRTIO_NET_CTRL_MQ, command, cfg, config_size, NULL, 0, 2);
 
         NdisFreeMemory(cfg, NULL, 0);
     }
@@ -295,7 +427,7 @@ static __inline BOOLEAN IsCompatibleAffinities(PGROUP_AFFINITY a1, PGROUP_AFFINI
     return (a1->Group == a2->Group) && (a1->Mask & a2->Mask);
 }
 
-static CCHAR FindReceiveQueueForCurrentCpu(PPARANDIS_SCALING_SETTINGS RSSScalingSettings)
+static CCHAR FindReceiveQueueForCurrentCpu(const PARANDIS_SCALING_SETTINGS *RSSScalingSettings)
 {
     ULONG CurrProcIdx;
 
@@ -464,6 +596,13 @@ NDIS_STATUS ParaNdis6_RSSSetParameters(PARANDIS_ADAPTER *pContext,
         return NDIS_STATUS_INVALID_PARAMETER;
     }
 
+    // frees the replaced snapshot after the lock is released
+    CRSSSnapshotUpdate update(pContext);
+    if (!update.IsValid())
+    {
+        return NDIS_STATUS_RESOURCES;
+    }
+
     CNdisPassiveWriteAutoLock autoLock(RSSParameters->rwLock);
 
     if (Params->Flags & NDIS_RSS_PARAM_FLAG_DISABLE_RSS || (Params->HashInformation == 0))
@@ -581,9 +720,11 @@ NDIS_STATUS ParaNdis6_RSSSetParameters(PARANDIS_ADAPTER *pContext,
         *ParamsBytesRead = ParamsLength;
     }
 #endif
-    ParaNdis_ResetRxClassification(pContext);
+    NDIS_STATUS status = ParaNdis_SetupRSSQueueMap(pContext, update.Build());
 
-    NDIS_STATUS status = ParaNdis_SetupRSSQueueMap(pContext);
+    update.Publish();
+
+    ParaNdis_ResetRxClassification(pContext);
 
     if (NT_SUCCESS(status))
     {
@@ -632,6 +773,13 @@ NDIS_STATUS ParaNdis6_RSSSetReceiveHash(PARANDIS_ADAPTER *pContext,
                                         PUINT ParamsBytesRead)
 {
     PARANDIS_RSS_PARAMS *RSSParameters = &pContext->RSSParameters;
+    // frees the replaced snapshot after the lock is released
+    CRSSSnapshotUpdate update(pContext);
+    if (!update.IsValid())
+    {
+        return NDIS_STATUS_RESOURCES;
+    }
+
     CNdisPassiveWriteAutoLock autoLock(RSSParameters->rwLock);
 
     if (ParamsLength < sizeof(NDIS_RECEIVE_HASH_PARAMETERS))
@@ -696,6 +844,9 @@ NDIS_STATUS ParaNdis6_RSSSetReceiveHash(PARANDIS_ADAPTER *pContext,
                       NULL);
     }
 
+    update.Build();
+    update.Publish();
+
     ParaNdis_ResetRxClassification(pContext);
 
     SetDeviceRSSSettings(pContext);
@@ -703,46 +854,7 @@ NDIS_STATUS ParaNdis6_RSSSetReceiveHash(PARANDIS_ADAPTER *pContext,
     return NDIS_STATUS_SUCCESS;
 }
 
-typedef struct _tagHASH_CALC_SG_BUF_ENTRY
-{
-    PCHAR chunkPtr;
-    ULONG chunkLen;
-} HASH_CALC_SG_BUF_ENTRY, *PHASH_CALC_SG_BUF_ENTRY;
-
-// Little Endian version ONLY
-static UINT32 ToeplitzHash(const PHASH_CALC_SG_BUF_ENTRY sgBuff, int sgEntriesNum, PCCHAR fullKey)
-{
-#define TOEPLITZ_MAX_BIT_NUM               (7)
-#define TOEPLITZ_BYTE_HAS_BIT(byte, bit)   ((byte) & (1 << (TOEPLITZ_MAX_BIT_NUM - (bit))))
-#define TOEPLITZ_BYTE_BIT_STATE(byte, bit) (((byte) >> (TOEPLITZ_MAX_BIT_NUM - (bit))) & 1)
-
-    UINT32 firstKeyWord, res = 0;
-    UINT byte, bit;
-    PHASH_CALC_SG_BUF_ENTRY sgEntry;
-    PCCHAR next_key_byte = fullKey + sizeof(firstKeyWord);
-    firstKeyWord = RtlUlongByteSwap(*(UINT32 *)fullKey);
-
-    for (sgEntry = sgBuff; sgEntry < sgBuff + sgEntriesNum; ++sgEntry)
-    {
-        for (byte = 0; byte < sgEntry->chunkLen; ++byte)
-        {
-            for (bit = 0; bit <= TOEPLITZ_MAX_BIT_NUM; ++bit)
-            {
-                if (TOEPLITZ_BYTE_HAS_BIT(sgEntry->chunkPtr[byte], bit))
-                {
-                    res ^= firstKeyWord;
-                }
-                firstKeyWord = (firstKeyWord << 1) | TOEPLITZ_BYTE_BIT_STATE(*next_key_byte, bit);
-            }
-            ++next_key_byte;
-        }
-    }
-    return res;
-
-#undef TOEPLITZ_BYTE_HAS_BIT
-#undef TOEPLITZ_BYTE_BIT_STATE
-#undef TOEPLITZ_MAX_BIT_NUM
-}
+typedef TOEPLITZ_CHUNK HASH_CALC_SG_BUF_ENTRY, *PHASH_CALC_SG_BUF_ENTRY;
 
 static __inline IPV6_ADDRESS *GetIP6SrcAddrForHash(PVOID dataBuffer, PNET_PACKET_INFO packetInfo, bool xEnabled)
 {
@@ -762,10 +874,10 @@ static __inline IPV6_ADDRESS *GetIP6DstAddrForHash(PVOID dataBuffer, PNET_PACKET
                                                        : (IPV6_ADDRESS *)RtlOffsetToPointer(dataBuffer, offset);
 }
 
-static VOID RSSCalcHash_Unsafe(PARANDIS_RSS_PARAMS *RSSParameters, PVOID dataBuffer, PNET_PACKET_INFO packetInfo)
+static VOID RSSCalcHash_Unsafe(const PARANDIS_RSS_SNAPSHOT *Snapshot, PVOID dataBuffer, PNET_PACKET_INFO packetInfo)
 {
     HASH_CALC_SG_BUF_ENTRY sgBuff[3];
-    ULONG hashTypes = NDIS_RSS_HASH_TYPE_FROM_HASH_INFO(RSSParameters->ActiveHashingSettings.HashInformation);
+    ULONG hashTypes = NDIS_RSS_HASH_TYPE_FROM_HASH_INFO(Snapshot->HashInformation);
 
     if (packetInfo->isIP4)
     {
@@ -779,7 +891,7 @@ static VOID RSSCalcHash_Unsafe(PARANDIS_RSS_PARAMS *RSSParameters, PVOID dataBuf
             sgBuff[1].chunkPtr = RtlOffsetToPointer(pTCPHeader, FIELD_OFFSET(TCPHeader, tcp_src));
             sgBuff[1].chunkLen = RTL_FIELD_SIZE(TCPHeader, tcp_src) + RTL_FIELD_SIZE(TCPHeader, tcp_dest);
 
-            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, &RSSParameters->ActiveHashingSettings.HashSecretKey[0]);
+            packetInfo->RSSHash.Value = Snapshot->ToeplitzHash.Hash(sgBuff, 2);
             packetInfo->RSSHash.Type = NDIS_HASH_TCP_IPV4;
             packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
             return;
@@ -796,7 +908,7 @@ static VOID RSSCalcHash_Unsafe(PARANDIS_RSS_PARAMS *RSSParameters, PVOID dataBuf
             sgBuff[1].chunkPtr = RtlOffsetToPointer(pUDPHeader, FIELD_OFFSET(UDPHeader, udp_src));
             sgBuff[1].chunkLen = RTL_FIELD_SIZE(UDPHeader, udp_src) + RTL_FIELD_SIZE(UDPHeader, udp_dest);
 
-            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, RSSParameters->ActiveHashingSettings.HashSecretKey);
+            packetInfo->RSSHash.Value = Snapshot->ToeplitzHash.Hash(sgBuff, 2);
             packetInfo->RSSHash.Type = NDIS_HASH_UDP_IPV4;
             packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
             return;
@@ -810,7 +922,7 @@ static VOID RSSCalcHash_Unsafe(PARANDIS_RSS_PARAMS *RSSParameters, PVOID dataBuf
             sgBuff[0].chunkPtr = RtlOffsetToPointer(dataBuffer, chunkOffset);
             sgBuff[0].chunkLen = RTL_FIELD_SIZE(IPv4Header, ip_src) + RTL_FIELD_SIZE(IPv4Header, ip_dest);
 
-            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 1, RSSParameters->ActiveHashingSettings.HashSecretKey);
+            packetInfo->RSSHash.Value = Snapshot->ToeplitzHash.Hash(sgBuff, 1);
             packetInfo->RSSHash.Type = NDIS_HASH_IPV4;
             packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
             return;
@@ -833,7 +945,7 @@ static VOID RSSCalcHash_Unsafe(PARANDIS_RSS_PARAMS *RSSParameters, PVOID dataBuf
                 sgBuff[2].chunkPtr = RtlOffsetToPointer(pTCPHeader, FIELD_OFFSET(TCPHeader, tcp_src));
                 sgBuff[2].chunkLen = RTL_FIELD_SIZE(TCPHeader, tcp_src) + RTL_FIELD_SIZE(TCPHeader, tcp_dest);
 
-                packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 3, RSSParameters->ActiveHashingSettings.HashSecretKey);
+                packetInfo->RSSHash.Value = Snapshot->ToeplitzHash.Hash(sgBuff, 3);
                 packetInfo->RSSHash.Type = xEnabled ? NDIS_HASH_TCP_IPV6_EX : NDIS_HASH_TCP_IPV6;
                 packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
                 return;
@@ -854,7 +966,7 @@ static VOID RSSCalcHash_Unsafe(PARANDIS_RSS_PARAMS *RSSParameters, PVOID dataBuf
             sgBuff[2].chunkPtr = RtlOffsetToPointer(pUDPHeader, FIELD_OFFSET(UDPHeader, udp_src));
             sgBuff[2].chunkLen = RTL_FIELD_SIZE(UDPHeader, udp_src) + RTL_FIELD_SIZE(UDPHeader, udp_dest);
 
-            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 3, RSSParameters->ActiveHashingSettings.HashSecretKey);
+            packetInfo->RSSHash.Value = Snapshot->ToeplitzHash.Hash(sgBuff, 3);
             packetInfo->RSSHash.Type = xEnabled ? NDIS_HASH_UDP_IPV6_EX : NDIS_HASH_UDP_IPV6;
             packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
             return;
@@ -870,7 +982,7 @@ static VOID RSSCalcHash_Unsafe(PARANDIS_RSS_PARAMS *RSSParameters, PVOID dataBuf
             sgBuff[1].chunkPtr = (PCHAR)GetIP6DstAddrForHash(dataBuffer, packetInfo, xEnabled);
             sgBuff[1].chunkLen = RTL_FIELD_SIZE(IPv6Header, ip6_dst_address);
 
-            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, RSSParameters->ActiveHashingSettings.HashSecretKey);
+            packetInfo->RSSHash.Value = Snapshot->ToeplitzHash.Hash(sgBuff, 2);
             packetInfo->RSSHash.Type = xEnabled ? NDIS_HASH_IPV6_EX : NDIS_HASH_IPV6;
             packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
             return;
@@ -886,11 +998,12 @@ VOID ParaNdis6_RSSAnalyzeReceivedPacket(PARANDIS_RSS_PARAMS *RSSParameters,
                                         PVOID dataBuffer,
                                         PNET_PACKET_INFO packetInfo)
 {
-    CNdisDispatchReadAutoLock autoLock(RSSParameters->rwLock);
+    CRSSSnapshotReader reader(*RSSParameters);
+    const PARANDIS_RSS_SNAPSHOT *snapshot = reader.Get();
 
-    if (RSSParameters->RSSMode != PARANDIS_RSS_MODE::PARANDIS_RSS_DISABLED)
+    if (snapshot != NULL && snapshot->RSSMode != PARANDIS_RSS_MODE::PARANDIS_RSS_DISABLED)
     {
-        RSSCalcHash_Unsafe(RSSParameters, dataBuffer, packetInfo);
+        RSSCalcHash_Unsafe(snapshot, dataBuffer, packetInfo);
     }
 }
 
@@ -899,23 +1012,24 @@ CCHAR ParaNdis6_RSSGetScalingDataForPacket(PARANDIS_RSS_PARAMS *RSSParameters,
                                            PPROCESSOR_NUMBER targetProcessor)
 {
     CCHAR targetQueue;
-    CNdisDispatchReadAutoLock autoLock(RSSParameters->rwLock);
+    CRSSSnapshotReader reader(*RSSParameters);
+    const PARANDIS_RSS_SNAPSHOT *snapshot = reader.Get();
 
-    if (RSSParameters->RSSMode != PARANDIS_RSS_MODE::PARANDIS_RSS_FULL ||
-        RSSParameters->ActiveRSSScalingSettings.FirstQueueIndirectionIndex == INVALID_INDIRECTION_INDEX)
+    if (snapshot == NULL || snapshot->RSSMode != PARANDIS_RSS_MODE::PARANDIS_RSS_FULL ||
+        snapshot->Scaling.FirstQueueIndirectionIndex == INVALID_INDIRECTION_INDEX)
     {
         targetQueue = PARANDIS_RECEIVE_UNCLASSIFIED_PACKET;
     }
     else if (packetInfo->RSSHash.Type == 0)
     {
-        targetQueue = RSSParameters->ActiveRSSScalingSettings.DefaultQueue;
-        *targetProcessor = RSSParameters->ActiveRSSScalingSettings.DefaultProcessor;
+        targetQueue = snapshot->Scaling.DefaultQueue;
+        *targetProcessor = snapshot->Scaling.DefaultProcessor;
     }
     else
     {
-        ULONG indirectionIndex = packetInfo->RSSHash.Value & RSSParameters->ActiveRSSScalingSettings.RSSHashMask;
+        ULONG indirectionIndex = packetInfo->RSSHash.Value & snapshot->Scaling.RSSHashMask;
 
-        targetQueue = RSSParameters->ActiveRSSScalingSettings.QueueIndirectionTable[indirectionIndex];
+        targetQueue = snapshot->Scaling.QueueIndirectionTable[indirectionIndex];
 
         if (targetQueue == PARANDIS_RECEIVE_NO_QUEUE)
         {
@@ -923,7 +1037,7 @@ CCHAR ParaNdis6_RSSGetScalingDataForPacket(PARANDIS_RSS_PARAMS *RSSParameters,
         }
         else
         {
-            *targetProcessor = RSSParameters->ActiveRSSScalingSettings.IndirectionTable[indirectionIndex];
+            *targetProcessor = snapshot->Scaling.IndirectionTable[indirectionIndex];
         }
     }
 
@@ -933,15 +1047,16 @@ CCHAR ParaNdis6_RSSGetScalingDataForPacket(PARANDIS_RSS_PARAMS *RSSParameters,
 CCHAR ParaNdis6_RSSGetCurrentCpuReceiveQueue(PARANDIS_RSS_PARAMS *RSSParameters)
 {
     CCHAR res;
-    CNdisDispatchReadAutoLock autoLock(RSSParameters->rwLock);
+    CRSSSnapshotReader reader(*RSSParameters);
+    const PARANDIS_RSS_SNAPSHOT *snapshot = reader.Get();
 
-    if (RSSParameters->RSSMode != PARANDIS_RSS_MODE::PARANDIS_RSS_FULL)
+    if (snapshot == NULL || snapshot->RSSMode != PARANDIS_RSS_MODE::PARANDIS_RSS_FULL)
     {
         res = PARANDIS_RECEIVE_NO_QUEUE;
     }
     else
     {
-        res = FindReceiveQueueForCurrentCpu(&RSSParameters->ActiveRSSScalingSettings);
+        res = FindReceiveQueueForCurrentCpu(&snapshot->Scaling);
     }
 
     return res;
@@ -995,12 +1110,12 @@ static void PrintRSSSettings(const PPARANDIS_RSS_PARAMS RSSParameters)
     ParaNdis_PrintCharArray(RSS_PRINT_LEVEL, scaling->QueueIndirectionTable, RSSParameters->ReceiveQueuesNumber);
 }
 
-NDIS_STATUS ParaNdis_SetupRSSQueueMap(PARANDIS_ADAPTER *pContext)
+NDIS_STATUS ParaNdis_SetupRSSQueueMap(PARANDIS_ADAPTER *pContext, PARANDIS_RSS_SNAPSHOT *Snapshot)
 {
     ULONG rssIndex;
     UINT bundleIndex;
     ULONG cpuIndex;
-    ULONG rssTableSize = pContext->RSSParameters.RSSScalingSettings.IndirectionTableSize / sizeof(PROCESSOR_NUMBER);
+    ULONG rssTableSize = Snapshot->Scaling.IndirectionTableSize / sizeof(PROCESSOR_NUMBER);
 
     rssIndex = 0;
     bundleIndex = 0;
@@ -1043,55 +1158,33 @@ NDIS_STATUS ParaNdis_SetupRSSQueueMap(PARANDIS_ADAPTER *pContext)
     }
 
     DPrintf(0,
-            "Entering, RSS table size = %lu, # of path bundles = %u. RSS2QueueLength = %u, RSS2QueueMap =0x%p",
+            "Entering, RSS table size = %lu, # of path bundles = %u, previous map length = %lu",
             rssTableSize,
             pContext->nPathBundles,
-            pContext->RSS2QueueLength,
-            pContext->RSS2QueueMap);
-
-    if (pContext->RSS2QueueLength && pContext->RSS2QueueLength < rssTableSize)
-    {
-        DPrintf(0, "Freeing RSS2Queue Map");
-        NdisFreeMemoryWithTagPriority(pContext->MiniportHandle, pContext->RSS2QueueMap, PARANDIS_MEMORY_TAG);
-        pContext->RSS2QueueLength = 0;
-    }
+            Snapshot->QueueMapLength);
 
-    if (!pContext->RSS2QueueLength)
-    {
-        pContext->RSS2QueueLength = USHORT(rssTableSize);
-        pContext->RSS2QueueMap = (CPUPathBundle **)NdisAllocateMemoryWithTagPriority(pContext->MiniportHandle,
-                                                                                     rssTableSize * sizeof(*pContext->RSS2QueueMap),
-                                                                                     PARANDIS_MEMORY_TAG,
-                                                                                     NormalPoolPriority);
-        if (pContext->RSS2QueueMap == nullptr)
-        {
-            DPrintf(0, "Allocating RSS to queue mapping failed");
-            NdisFreeMemoryWithTagPriority(pContext->MiniportHandle, cpuIndexTable, PARANDIS_MEMORY_TAG);
-            return NDIS_STATUS_RESOURCES;
-        }
-
-        NdisZeroMemory(pContext->RSS2QueueMap, sizeof(*pContext->RSS2QueueMap) * pContext->RSS2QueueLength);
-    }
+    // the table size is verified against the size of the indirection table, so it fits the map
+    Snapshot->QueueMapLength = rssTableSize;
 
     for (rssIndex = 0; rssIndex < rssTableSize; rssIndex++)
     {
-        pContext->RSS2QueueMap[rssIndex] = pContext->pPathBundles;
+        Snapshot->QueueMap[rssIndex] = pContext->pPathBundles;
     }
 
     for (rssIndex = 0; rssIndex < rssTableSize; rssIndex++)
     {
-        cpuIndex = NdisProcessorNumberToIndex(pContext->RSSParameters.RSSScalingSettings.IndirectionTable[rssIndex]);
+        cpuIndex = NdisProcessorNumberToIndex(Snapshot->Scaling.IndirectionTable[rssIndex]);
         bundleIndex = cpuIndexTable[cpuIndex];
 
         DPrintf(3, "filling the relationship, rssIndex = %u, bundleIndex = %u", rssIndex, bundleIndex);
         DPrintf(3,
                 "RSS proc number %u/%u, bundle affinity %u/%llu",
-                pContext->RSSParameters.RSSScalingSettings.IndirectionTable[rssIndex].Group,
-                pContext->RSSParameters.RSSScalingSettings.IndirectionTable[rssIndex].Number,
+                Snapshot->Scaling.IndirectionTable[rssIndex].Group,
+                Snapshot->Scaling.IndirectionTable[rssIndex].Number,
                 pContext->pPathBundles[bundleIndex].txPath.DPCAffinity.Group,
                 pContext->pPathBundles[bundleIndex].txPath.DPCAffinity.Mask);
 
-        pContext->RSS2QueueMap[rssIndex] = pContext->pPathBundles + bundleIndex;
+        Snapshot->QueueMap[rssIndex] = pContext->pPathBundles + bundleIndex;
     }
 
     NdisFreeMemoryWithTagPriority(pContext->MiniportHandle, cpuIndexTable, PARANDIS_MEMORY_TAG);
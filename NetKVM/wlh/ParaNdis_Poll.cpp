@@ -104,6 +104,28 @@ void NdisPollHandler::EnableNotification(BOOLEAN Enable)
     }
 }
 
+ULONG NdisPollHandler::TicksToUsecs(LONGLONG Ticks) const
+{
+    return m_PerfFrequency ? (ULONG)(Ticks * 1000000 / m_PerfFrequency) : 0;
+}
+
+// Gap is the time from the empty rings to the next packet
+void NdisPollHandler::UpdateBusyWindow(LONGLONG Gap)
+{
+    // a long pause only says the traffic is sparse, it must not delay the recovery when it resumes
+    Gap = min(Gap, m_MaxBusyWindow * 4);
+    // moving average over ~8 gaps
+    m_AverageGap += (Gap - m_AverageGap) / 8;
+    if (m_AverageGap * 2 <= m_MaxBusyWindow)
+    {
+        m_BusyWindow = max(m_AverageGap * 2, m_MaxBusyWindow / 16);
+    }
+    else
+    {
+        m_BusyWindow = 0;
+    }
+}
+
 // normal cycle of polling is (<= is callback, => is call):
 // <= enable notification
 // notify ... trigger ... => request poll
@@ -115,9 +137,14 @@ void NdisPollHandler::HandlePoll(NDIS_POLL_DATA *PollData)
 {
     DPrintf(POLL_PRINT_LEVEL, "#%d", m_Index);
     CDpcIrqlRaiser raise;
+    LONGLONG now = m_MaxBusyWindow ? KeQueryPerformanceCounter(NULL).QuadPart : 0;
+    // inside the busy window the RX interrupt stays disabled and the handler polls again
+    bool busy = m_BusyWindow && (!m_IdleSince || now - m_IdleSince < m_BusyWindow);
+
+    Statistics.Polls++;
 
     // RX
-    RxPoll(m_AdapterContext, m_Index, PollData->Receive);
+    RxPoll(m_AdapterContext, m_Index, PollData->Receive, !busy);
     if (PollData->Receive.NumberOfIndicatedNbls || PollData->Receive.NumberOfRemainingNbls)
     {
         DPrintf(POLL_PRINT_LEVEL,
@@ -138,6 +165,33 @@ void NdisPollHandler::HandlePoll(NDIS_POLL_DATA *PollData)
             DPrintf(POLL_PRINT_LEVEL, "TX #%d requests attention", bundle->txPath.getQueueIndex());
         }
     }
+    bool indicated = PollData->Receive.NumberOfIndicatedNbls != 0;
+    if (indicated && m_IdleSince)
+    {
+        // the packets came after the rings went empty
+        Statistics.BusyHits += busy;
+        UpdateBusyWindow(now - m_IdleSince);
+        m_IdleSince = 0;
+    }
+    if (!PollData->Receive.NumberOfRemainingNbls && !PollData->Transmit.NumberOfRemainingNbls)
+    {
+        Statistics.EmptyPolls += !indicated;
+        if (!m_IdleSince)
+        {
+            m_IdleSince = now;
+        }
+        if (busy)
+        {
+            // the RX interrupt was not enabled, the handler must be called again
+            Statistics.BusyPolls += !indicated;
+            PollData->Receive.NumberOfRemainingNbls = NDIS_ANY_NUMBER_OF_NBLS;
+        }
+        else if (m_MaxBusyWindow)
+        {
+            Statistics.Rearms++;
+        }
+    }
+
     // There are various cases when RX returns 0 NBLs and NumberOfRemainingNbls != 0.
     // TX currently always returns 0 NBLs and sometimes NumberOfRemainingNbls != 0.
     // In these cases poll thread still may decide that there is no progress and then
@@ -172,6 +226,13 @@ bool NdisPollHandler::Register(PPARANDIS_ADAPTER AdapterContext, int Index)
     m_ProcessorNumber.Number = 0xff;
 
 #if PARANDIS_SUPPORT_POLL
+    LARGE_INTEGER frequency;
+    KeQueryPerformanceCounter(&frequency);
+    m_PerfFrequency = frequency.QuadPart;
+    m_MaxBusyWindow = (LONGLONG)AdapterContext->uPollBusyUsecs * m_PerfFrequency / 1000000;
+    // start busy polling, the traffic shrinks the window when the packets are sparse
+    m_BusyWindow = m_MaxBusyWindow;
+
     NDIS_POLL_CHARACTERISTICS chars;
     chars.Header.Type = NDIS_OBJECT_TYPE_DEFAULT;
     chars.Header.Revision = NDIS_POLL_CHARACTERISTICS_REVISION_1;
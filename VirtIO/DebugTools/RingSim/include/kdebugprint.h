@@ -0,0 +1,15 @@
+/*
+ * Replaces VirtIO/kdebugprint.h, gcc needs ##__VA_ARGS__ to drop the comma
+ * when DPrintf is called without arguments after the format.
+ */
+#pragma once
+
+extern int virtioDebugLevel;
+extern int bDebugPrint;
+typedef void (*tDebugPrintFunc)(const char *format, ...);
+extern tDebugPrintFunc VirtioDebugPrintProc;
+
+#define DPrintf(Level, MSG, ...)                      \
+    if ((!bDebugPrint) || Level > virtioDebugLevel) { \
+    } else                                            \
+        VirtioDebugPrintProc(MSG, ##__VA_ARGS__)
@@ -0,0 +1,87 @@
+/*
+ * Minimal stand-in for the Windows kernel headers, just enough to build the
+ * VirtioLib ring engine (VirtIORing.c, VirtIORing-Packed.c) with gcc or clang.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+/* linux/types.h maps u32 to unsigned long which is 64-bit on LP64 targets,
+ * define the fixed-width types here and keep that header out */
+#define _LINUX_TYPES_H
+#define __bitwise__
+#define u8     uint8_t
+#define u16    uint16_t
+#define u32    uint32_t
+#define u64    uint64_t
+#define __u8   uint8_t
+#define __u16  uint16_t
+#define __le16 uint16_t
+#define __u32  uint32_t
+#define __le32 uint32_t
+#define __u64  uint64_t
+
+typedef uint8_t UCHAR, BOOLEAN;
+typedef uint16_t USHORT;
+typedef uint32_t ULONG;
+typedef int32_t LONG, NTSTATUS;
+typedef uint64_t ULONGLONG;
+typedef int64_t LONGLONG;
+typedef uintptr_t ULONG_PTR;
+typedef void *PVOID;
+
+typedef union {
+    struct {
+        ULONG LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, PHYSICAL_ADDRESS;
+
+typedef struct _PCI_COMMON_HEADER *PPCI_COMMON_HEADER;
+
+#define TRUE  1
+#define FALSE 0
+
+#define __forceinline __inline__
+#define __FUNCTION__  __func__
+
+#define PAGE_SIZE    4096
+#define ARRAYSIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define ASSERT(x)              assert(x)
+#define RtlZeroMemory(p, n)    memset((p), 0, (n))
+#define RtlCopyMemory(d, s, n) memcpy((d), (s), (n))
+#define KeMemoryBarrier()      __sync_synchronize()
+#define KeBugCheck(code)       abort()
+
+#define STATUS_SUCCESS ((NTSTATUS)0)
+#define NT_SUCCESS(s)  ((NTSTATUS)(s) >= 0)
+
+#define UNREFERENCED_PARAMETER(p) ((void)(p))
+
+/* 100ns units, like the kernel's interrupt time */
+static inline ULONGLONG KeQueryInterruptTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ULONGLONG)ts.tv_sec * 10000000ULL + ts.tv_nsec / 100;
+}
+
+/* nanoseconds */
+static inline LARGE_INTEGER KeQueryPerformanceCounter(LARGE_INTEGER *frequency)
+{
+    struct timespec ts;
+    LARGE_INTEGER counter;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    counter.QuadPart = (LONGLONG)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    if (frequency) {
+        frequency->QuadPart = 1000000000LL;
+    }
+    return counter;
+}
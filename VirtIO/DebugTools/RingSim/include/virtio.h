@@ -0,0 +1,3 @@
+/* The ring sources include "virtio.h", the header is VirtIO.h */
+#pragma once
+#include "../../../VirtIO.h"
@@ -0,0 +1,1174 @@
+/*
+ * Userspace simulator and microbenchmark of the VirtioLib ring engine
+ *
+ * VirtIORing.c and VirtIORing-Packed.c are built unmodified against the stub
+ * Windows headers in include/. The main thread plays the driver and uses the
+ * regular virtqueue API, a second thread plays the device and consumes the
+ * split or packed ring the way a vhost backend would, honoring both kick and
+ * interrupt suppression. Buffer order and returned lengths are verified, so
+ * the simulator doubles as a functional test of the ring engine.
+ */
+#include "osdep.h"
+#include "virtio_pci.h"
+#include "virtio.h"
+#include "kdebugprint.h"
+#include "virtio_ring.h"
+#include "windows/virtio_ring_allocation.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+
+int virtioDebugLevel;
+int bDebugPrint;
+
+static void DebugPrint(const char *format, ...)
+{
+    va_list list;
+    va_start(list, format);
+    vfprintf(stderr, format, list);
+    va_end(list);
+}
+
+tDebugPrintFunc VirtioDebugPrintProc = DebugPrint;
+
+/* ring layout definitions as seen by the device */
+#define DESC_F_NEXT     1
+#define DESC_F_WRITE    2
+#define DESC_F_INDIRECT 4
+#define DESC_F_AVAIL    (1 << 7)
+#define DESC_F_USED     (1 << 15)
+
+#define AVAIL_F_NO_INTERRUPT 1
+#define USED_F_NO_NOTIFY     1
+
+#define EVENT_FLAG_ENABLE  0
+#define EVENT_FLAG_DISABLE 1
+#define EVENT_FLAG_DESC    2
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((uintptr_t)(a) - 1))
+
+struct sim_split_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct sim_packed_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+};
+
+struct sim_event {
+    uint16_t off_wrap;
+    uint16_t flags;
+};
+
+struct sim_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+#define LOAD(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+#define TIMEOUT_NS 1000000000ULL
+
+/* -T: the pause after a burst, long enough for any coalescing delay to run out, and the
+ * longest wait allowed for the buffer completed after it, the default max_usec */
+#define TRAIL_GAP_NS 1000000ULL
+#define TRAIL_MAX_NS 100000ULL
+
+struct sim_config {
+    bool packed;
+    bool indirect;
+    bool event_idx;
+    bool in_order;
+    bool bulk_api;
+    bool delayed_cb;
+    bool vq_stats;
+    int coalesce;
+    unsigned int qsize;
+    unsigned int sg;
+    unsigned int seg_len;
+    unsigned int drv_batch;
+    unsigned int dev_batch;
+    unsigned int trail;
+    unsigned long count;
+};
+
+struct sim_stats {
+    /* driver side */
+    unsigned long adds;
+    unsigned long add_calls;
+    unsigned long ring_full;
+    unsigned long gets;
+    unsigned long get_calls;
+    unsigned long kick_checks;
+    unsigned long kicks;
+    unsigned long waits;
+    unsigned long lost_interrupts;
+    unsigned long trails;
+    unsigned long late_trails;
+    uint64_t trail_median_ns;
+    uint64_t trail_max_ns;
+    uint64_t add_ns;
+    uint64_t get_ns;
+    uint64_t kick_ns;
+    /* device side */
+    unsigned long doorbells;
+    unsigned long lost_kicks;
+    unsigned long used_batches;
+    unsigned long interrupts;
+    unsigned long descs;
+    /* descriptor reuse, indexed by head id */
+    unsigned long distinct_heads;
+    unsigned long distinct_descs;
+    unsigned long reuse[5];
+    /* verification */
+    unsigned long errors;
+};
+
+/* per buffer driver context, passed to the ring as the opaque value */
+struct sim_buf {
+    unsigned long seq;
+    uint32_t in_len;
+    struct sim_buf *next_free;
+    void *indirect;
+};
+
+struct sim {
+    struct sim_config cfg;
+    struct sim_stats stats;
+    VirtIODevice vdev;
+    struct virtqueue *vq;
+    void *ring;
+    void *control;
+    struct sim_buf *bufs;
+    struct sim_buf *free_bufs;
+    struct virtqueue_coalesce coalesce;
+    struct virtqueue_stats vq_stats;
+    bool woken;
+    struct scatterlist *sg;
+    void *data;
+
+    /* driver to device and device to driver signals */
+    volatile unsigned long doorbell;
+    volatile unsigned long interrupt;
+    volatile int stop;
+    /* -T: the buffer completed after a burst, when it was completed and reaped */
+    volatile uint64_t trail_seq;
+    volatile uint64_t trail_ns;
+    volatile uint64_t trail_reaped;
+    uint64_t *trail_lat;
+
+    /* device state */
+    unsigned int dev_limit;
+    uint16_t last_avail;
+    uint16_t used_idx;
+    uint16_t avail_pos;
+    bool avail_wrap;
+    uint16_t used_pos;
+    bool used_wrap;
+    uint64_t used_total;
+    uint64_t dev_seq;
+    uint64_t *head_seen;
+    uint8_t *desc_seen;
+};
+
+static u64 SimGetFeatures(VirtIODevice *vdev)
+{
+    UNREFERENCED_PARAMETER(vdev);
+    return (1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_F_IN_ORDER);
+}
+
+static const struct virtio_device_ops sim_device_ops = {
+    .get_features = SimGetFeatures,
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct sim *sim_from_vq;
+
+static void SimNotify(struct virtqueue *vq)
+{
+    UNREFERENCED_PARAMETER(vq);
+    __atomic_add_fetch(&sim_from_vq->doorbell, 1, __ATOMIC_RELEASE);
+}
+
+/* normally provided by VirtIOPCICommon.c */
+void virtqueue_notify(struct virtqueue *vq)
+{
+    if (vq->stats) {
+        vq->stats->notifications++;
+    }
+    vq->notification_cb(vq);
+}
+
+void virtqueue_attach_stats(struct virtqueue *vq, struct virtqueue_stats *stats)
+{
+    if (stats) {
+        RtlZeroMemory(stats, sizeof(*stats));
+    }
+    vq->stats = stats;
+}
+
+void virtqueue_query_stats(struct virtqueue *vq, struct virtqueue_stats *stats)
+{
+    if (vq->stats) {
+        *stats = *vq->stats;
+    } else {
+        RtlZeroMemory(stats, sizeof(*stats));
+    }
+    stats->ring_size = sim_from_vq->cfg.qsize;
+}
+
+/*
+ * Device side
+ */
+
+static void dev_account_head(struct sim *s, unsigned int id)
+{
+    uint64_t seen = s->head_seen[id];
+    uint64_t distance;
+    unsigned int qsize = s->cfg.qsize;
+
+    s->dev_seq++;
+    s->head_seen[id] = s->dev_seq;
+    if (!seen) {
+        s->stats.distinct_heads++;
+        return;
+    }
+    distance = s->dev_seq - seen;
+    if (distance <= qsize / 8) {
+        s->stats.reuse[0]++;
+    } else if (distance <= qsize / 4) {
+        s->stats.reuse[1]++;
+    } else if (distance <= qsize / 2) {
+        s->stats.reuse[2]++;
+    } else if (distance <= qsize) {
+        s->stats.reuse[3]++;
+    } else {
+        s->stats.reuse[4]++;
+    }
+}
+
+static void dev_account_desc(struct sim *s, unsigned int index)
+{
+    if (!s->desc_seen[index]) {
+        s->desc_seen[index] = 1;
+        s->stats.distinct_descs++;
+    }
+    s->stats.descs++;
+}
+
+/* Sums up the device-writable length of an indirect descriptor table */
+static uint32_t dev_walk_indirect(struct sim *s, uint64_t addr, uint32_t len)
+{
+    uint32_t i, written = 0;
+
+    if (s->cfg.packed) {
+        struct sim_packed_desc *table = (struct sim_packed_desc *)(uintptr_t)addr;
+        for (i = 0; i < len / sizeof(*table); i++) {
+            if (table[i].flags & DESC_F_WRITE) {
+                written += table[i].len;
+            }
+        }
+    } else {
+        struct sim_split_desc *table = (struct sim_split_desc *)(uintptr_t)addr;
+        for (i = 0; i < len / sizeof(*table); i++) {
+            if (table[i].flags & DESC_F_WRITE) {
+                written += table[i].len;
+            }
+        }
+    }
+    return written;
+}
+
+static struct vring_avail_sim {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+} *split_avail(struct sim *s)
+{
+    return (struct vring_avail_sim *)((uint8_t *)s->ring +
+                                      s->cfg.qsize * sizeof(struct sim_split_desc));
+}
+
+static struct vring_used_sim {
+    uint16_t flags;
+    uint16_t idx;
+    struct sim_used_elem ring[];
+} *split_used(struct sim *s)
+{
+    struct vring_avail_sim *avail = split_avail(s);
+    return (struct vring_used_sim *)ALIGN_UP((uintptr_t)&avail->ring[s->cfg.qsize] +
+                                                 sizeof(uint16_t),
+                                             SMP_CACHE_BYTES);
+}
+
+static bool split_avail_pending(struct sim *s)
+{
+    return LOAD(&split_avail(s)->idx) != s->last_avail;
+}
+
+static void split_enable_notify(struct sim *s, bool enable)
+{
+    struct vring_used_sim *used = split_used(s);
+
+    if (s->cfg.event_idx) {
+        /* the avail event index lives right after the used ring */
+        if (enable) {
+            STORE((uint16_t *)&used->ring[s->cfg.qsize], s->last_avail);
+        }
+    } else {
+        STORE(&used->flags, enable ? 0 : USED_F_NO_NOTIFY);
+    }
+}
+
+static unsigned int split_process(struct sim *s)
+{
+    struct sim_split_desc *desc = s->ring;
+    struct vring_avail_sim *avail = split_avail(s);
+    struct vring_used_sim *used = split_used(s);
+    uint16_t avail_idx = LOAD(&avail->idx);
+    uint16_t old_used = s->used_idx;
+    unsigned int n = 0, qsize = s->cfg.qsize;
+    uint16_t head = 0, batch_descs = 0;
+    uint32_t written = 0;
+
+    while (avail_idx != s->last_avail && n < s->dev_limit) {
+        uint16_t i;
+
+        head = avail->ring[s->last_avail % qsize];
+        s->last_avail++;
+        dev_account_head(s, head);
+        written = 0;
+        i = head;
+        for (;;) {
+            dev_account_desc(s, i);
+            batch_descs++;
+            if (desc[i].flags & DESC_F_INDIRECT) {
+                written += dev_walk_indirect(s, desc[i].addr, desc[i].len);
+            } else if (desc[i].flags & DESC_F_WRITE) {
+                written += desc[i].len;
+            }
+            if (!(desc[i].flags & DESC_F_NEXT)) {
+                break;
+            }
+            i = desc[i].next;
+        }
+        if (!s->cfg.in_order) {
+            used->ring[s->used_idx % qsize].id = head;
+            used->ring[s->used_idx % qsize].len = written;
+            s->used_idx++;
+        }
+        n++;
+    }
+    if (!n) {
+        return 0;
+    }
+    if (s->cfg.in_order) {
+        /* one used entry at the start of the batch describes the whole batch, the ring
+         * skips forward by the number of descriptors the batch occupied */
+        used->ring[s->used_idx % qsize].id = head;
+        used->ring[s->used_idx % qsize].len = written;
+        s->used_idx += batch_descs;
+    }
+    STORE(&used->idx, s->used_idx);
+    s->stats.used_batches++;
+
+    /* the used index must be visible before the driver's event index is read */
+    __sync_synchronize();
+    if (s->cfg.event_idx) {
+        uint16_t used_event = LOAD(&avail->ring[qsize]);
+        if ((uint16_t)(s->used_idx - used_event - 1) < (uint16_t)(s->used_idx - old_used)) {
+            s->stats.interrupts++;
+            __atomic_add_fetch(&s->interrupt, 1, __ATOMIC_RELEASE);
+        }
+    } else if (!(LOAD(&avail->flags) & AVAIL_F_NO_INTERRUPT)) {
+        s->stats.interrupts++;
+        __atomic_add_fetch(&s->interrupt, 1, __ATOMIC_RELEASE);
+    }
+    return n;
+}
+
+static struct sim_event *packed_driver_event(struct sim *s)
+{
+    return (struct sim_event *)((uint8_t *)s->ring +
+                                s->cfg.qsize * sizeof(struct sim_packed_desc));
+}
+
+static bool packed_avail_pending(struct sim *s)
+{
+    struct sim_packed_desc *desc = s->ring;
+    uint16_t flags = LOAD(&desc[s->avail_pos].flags);
+    bool avail = !!(flags & DESC_F_AVAIL), used = !!(flags & DESC_F_USED);
+
+    return avail == s->avail_wrap && used != s->avail_wrap;
+}
+
+static void packed_enable_notify(struct sim *s, bool enable)
+{
+    struct sim_event *device_event = packed_driver_event(s) + 1;
+
+    if (!enable) {
+        STORE(&device_event->flags, EVENT_FLAG_DISABLE);
+    } else if (s->cfg.event_idx) {
+        STORE(&device_event->off_wrap, s->avail_pos | (uint16_t)(s->avail_wrap << 15));
+        STORE(&device_event->flags, EVENT_FLAG_DESC);
+    } else {
+        STORE(&device_event->flags, EVENT_FLAG_ENABLE);
+    }
+}
+
+static void packed_write_used(struct sim *s, uint16_t id, uint32_t len, uint16_t ndescs)
+{
+    struct sim_packed_desc *desc = s->ring;
+    uint16_t pos = s->used_pos;
+
+    desc[pos].id = id;
+    desc[pos].len = len;
+    STORE(&desc[pos].flags, s->used_wrap ? DESC_F_AVAIL | DESC_F_USED : 0);
+
+    s->used_total += ndescs;
+    s->used_pos += ndescs;
+    if (s->used_pos >= s->cfg.qsize) {
+        s->used_pos -= s->cfg.qsize;
+        s->used_wrap = !s->used_wrap;
+    }
+}
+
+static unsigned int packed_process(struct sim *s)
+{
+    struct sim_packed_desc *desc = s->ring;
+    struct sim_event *driver_event = packed_driver_event(s);
+    uint64_t old_used = s->used_total;
+    unsigned int n = 0, qsize = s->cfg.qsize;
+    uint16_t id = 0, batch_descs = 0;
+    uint32_t written = 0;
+    bool interrupt;
+
+    while (n < s->dev_limit && packed_avail_pending(s)) {
+        uint16_t ndescs = 0, pos = s->avail_pos;
+
+        written = 0;
+        for (;;) {
+            uint16_t flags = desc[pos].flags;
+
+            dev_account_desc(s, pos);
+            id = desc[pos].id;
+            if (flags & DESC_F_INDIRECT) {
+                written += dev_walk_indirect(s, desc[pos].addr, desc[pos].len);
+            } else if (flags & DESC_F_WRITE) {
+                written += desc[pos].len;
+            }
+            ndescs++;
+            if (++pos >= qsize) {
+                pos = 0;
+            }
+            if (!(flags & DESC_F_NEXT)) {
+                break;
+            }
+        }
+        dev_account_head(s, id);
+        s->avail_pos += ndescs;
+        if (s->avail_pos >= qsize) {
+            s->avail_pos -= qsize;
+            s->avail_wrap = !s->avail_wrap;
+        }
+        if (s->cfg.in_order) {
+            batch_descs += ndescs;
+        } else {
+            packed_write_used(s, id, written, ndescs);
+        }
+        n++;
+    }
+    if (!n) {
+        return 0;
+    }
+    if (s->cfg.in_order) {
+        /* one used descriptor describes the whole batch */
+        packed_write_used(s, id, written, batch_descs);
+    }
+    s->stats.used_batches++;
+
+    __sync_synchronize();
+    switch (LOAD(&driver_event->flags)) {
+    case EVENT_FLAG_DISABLE:
+        interrupt = false;
+        break;
+    case EVENT_FLAG_DESC: {
+        /* translate off_wrap to the running count of used descriptors */
+        uint16_t off_wrap = LOAD(&driver_event->off_wrap);
+        uint64_t base = old_used - old_used % qsize;
+        bool wrap = !((old_used / qsize) & 1);
+        uint64_t event = base + (off_wrap & 0x7FFF);
+
+        if (!!(off_wrap >> 15) != wrap) {
+            event += qsize;
+        }
+        interrupt = event >= old_used && event < s->used_total;
+        break;
+    }
+    default:
+        interrupt = true;
+        break;
+    }
+    if (interrupt) {
+        s->stats.interrupts++;
+        __atomic_add_fetch(&s->interrupt, 1, __ATOMIC_RELEASE);
+    }
+    return n;
+}
+
+static void *device_thread(void *context)
+{
+    struct sim *s = context;
+    bool (*pending)(struct sim *) = s->cfg.packed ? packed_avail_pending : split_avail_pending;
+    void (*enable_notify)(struct sim *, bool) =
+        s->cfg.packed ? packed_enable_notify : split_enable_notify;
+    unsigned int (*process)(struct sim *) = s->cfg.packed ? packed_process : split_process;
+    unsigned long doorbell = 0;
+
+    enable_notify(s, false);
+    while (!LOAD(&s->stop)) {
+        uint64_t start;
+
+        if (process(s)) {
+            continue;
+        }
+
+        /* going idle: ask for a kick, then re-check to close the race with the driver */
+        enable_notify(s, true);
+        __sync_synchronize();
+        if (pending(s)) {
+            enable_notify(s, false);
+            continue;
+        }
+        start = now_ns();
+        while (LOAD(&s->doorbell) == doorbell && !LOAD(&s->stop)) {
+            if (now_ns() - start > TIMEOUT_NS && pending(s)) {
+                s->stats.lost_kicks++;
+                break;
+            }
+            sched_yield();
+        }
+        doorbell = LOAD(&s->doorbell);
+        enable_notify(s, false);
+    }
+    s->stats.doorbells = LOAD(&s->doorbell);
+    return NULL;
+}
+
+/* -T: the device completes bursts of cfg.trail buffers and after a pause a single buffer,
+ * the way a receive queue sees the last packet of a flow arrive after a burst. The device
+ * polls the ring and waits for the driver to reap the single buffer before the next burst */
+static void *device_thread_trail(void *context)
+{
+    struct sim *s = context;
+    bool (*pending)(struct sim *) = s->cfg.packed ? packed_avail_pending : split_avail_pending;
+    void (*enable_notify)(struct sim *, bool) =
+        s->cfg.packed ? packed_enable_notify : split_enable_notify;
+    unsigned int (*process)(struct sim *) = s->cfg.packed ? packed_process : split_process;
+    struct timespec gap = {0, TRAIL_GAP_NS};
+
+    enable_notify(s, false);
+    while (!LOAD(&s->stop)) {
+        unsigned int left = s->cfg.trail;
+        uint64_t seq, start;
+
+        while (left && !LOAD(&s->stop)) {
+            unsigned int n;
+
+            s->dev_limit = left < s->cfg.dev_batch ? left : s->cfg.dev_batch;
+            n = process(s);
+            if (!n) {
+                sched_yield();
+            }
+            left -= n;
+        }
+        nanosleep(&gap, NULL);
+        while (!pending(s) && !LOAD(&s->stop)) {
+            sched_yield();
+        }
+        if (LOAD(&s->stop)) {
+            break;
+        }
+
+        /* published before the buffer is used, the driver may reap it at once */
+        seq = s->dev_seq + 1;
+        STORE(&s->trail_ns, now_ns());
+        STORE(&s->trail_seq, seq);
+        s->dev_limit = 1;
+        process(s);
+
+        start = now_ns();
+        while (LOAD(&s->trail_reaped) != seq && !LOAD(&s->stop)) {
+            if (now_ns() - start > TIMEOUT_NS) {
+                /* the driver counts the lost interrupt */
+                break;
+            }
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Driver side
+ */
+
+static void driver_complete(struct sim *s, struct sim_buf *buf, unsigned int len,
+                            unsigned long *expected)
+{
+    if (buf->seq != *expected) {
+        fprintf(stderr, "buffer %lu returned, expected %lu\n", buf->seq, *expected);
+        s->stats.errors++;
+    }
+    if (len != buf->in_len) {
+        fprintf(stderr, "buffer %lu returned with length %u, expected %u\n", buf->seq, len,
+                buf->in_len);
+        s->stats.errors++;
+    }
+    (*expected)++;
+    buf->next_free = s->free_bufs;
+    s->free_bufs = buf;
+}
+
+static unsigned int driver_submit(struct sim *s, unsigned long *next_seq)
+{
+    struct virtqueue_buf bufs[256];
+    struct sim_buf *pending[256];
+    unsigned int n = 0, added = 0, i;
+    unsigned int batch = s->cfg.drv_batch;
+    uint64_t start;
+
+    while (n < batch && *next_seq + n < s->cfg.count && s->free_bufs) {
+        struct sim_buf *buf = s->free_bufs;
+        s->free_bufs = buf->next_free;
+        buf->seq = *next_seq + n;
+        pending[n] = buf;
+        bufs[n].sg = s->sg;
+        bufs[n].out_num = 1;
+        bufs[n].in_num = s->cfg.sg - 1;
+        bufs[n].opaque = buf;
+        bufs[n].va_indirect = buf->indirect;
+        bufs[n].phys_indirect = (uintptr_t)buf->indirect;
+        n++;
+    }
+    if (!n) {
+        return 0;
+    }
+
+    start = now_ns();
+    if (s->cfg.bulk_api) {
+        added = virtqueue_add_bufs(s->vq, bufs, n);
+        s->stats.add_calls++;
+    } else {
+        for (i = 0; i < n; i++) {
+            s->stats.add_calls++;
+            if (virtqueue_add_buf(s->vq, bufs[i].sg, bufs[i].out_num, bufs[i].in_num,
+                                  bufs[i].opaque, bufs[i].va_indirect,
+                                  bufs[i].phys_indirect) != VQ_ADD_BUFFER_SUCCESS) {
+                break;
+            }
+            added++;
+        }
+    }
+    s->stats.add_ns += now_ns() - start;
+
+    /* give back what did not fit */
+    for (i = n; i > added; i--) {
+        pending[i - 1]->next_free = s->free_bufs;
+        s->free_bufs = pending[i - 1];
+    }
+    if (added < n) {
+        s->stats.ring_full++;
+    }
+    s->stats.adds += added;
+    *next_seq += added;
+
+    if (added) {
+        bool kick;
+        start = now_ns();
+        kick = virtqueue_kick_prepare(s->vq);
+        s->stats.kick_ns += now_ns() - start;
+        s->stats.kick_checks++;
+        if (kick) {
+            s->stats.kicks++;
+            virtqueue_notify(s->vq);
+        }
+    }
+    return added;
+}
+
+static unsigned int driver_reap(struct sim *s, unsigned long *expected)
+{
+    void *opaque[256];
+    unsigned int len[256];
+    unsigned int n, i, total = 0;
+    uint64_t start = now_ns();
+
+    if (s->cfg.bulk_api) {
+        while ((n = virtqueue_get_bufs(s->vq, opaque, len, ARRAYSIZE(opaque))) != 0) {
+            s->stats.get_calls++;
+            for (i = 0; i < n; i++) {
+                driver_complete(s, opaque[i], len[i], expected);
+            }
+            total += n;
+        }
+    } else {
+        void *buf;
+        unsigned int buf_len;
+        while ((buf = virtqueue_get_buf(s->vq, &buf_len)) != NULL) {
+            s->stats.get_calls++;
+            driver_complete(s, buf, buf_len, expected);
+            total++;
+        }
+    }
+    s->stats.get_calls++;
+    s->stats.get_ns += now_ns() - start;
+    s->stats.gets += total;
+    return total;
+}
+
+static void driver_check_trail(struct sim *s, unsigned long expected)
+{
+    uint64_t seq = LOAD(&s->trail_seq);
+
+    if (seq && seq != s->trail_reaped && expected >= seq) {
+        s->trail_lat[s->stats.trails++] = now_ns() - LOAD(&s->trail_ns);
+        STORE(&s->trail_reaped, seq);
+    }
+}
+
+static void driver_wait(struct sim *s)
+{
+    unsigned long interrupt = LOAD(&s->interrupt);
+    bool enabled;
+    uint64_t start;
+
+    enabled = s->cfg.delayed_cb || s->cfg.coalesce >= 0 ? virtqueue_enable_cb_delayed(s->vq) :
+                                                          virtqueue_enable_cb(s->vq);
+    if (!enabled) {
+        /* buffers arrived in the meantime */
+        virtqueue_disable_cb(s->vq);
+        return;
+    }
+    s->stats.waits++;
+    start = now_ns();
+    while (LOAD(&s->interrupt) == interrupt) {
+        if (now_ns() - start > TIMEOUT_NS && virtqueue_has_buf(s->vq)) {
+            s->stats.lost_interrupts++;
+            break;
+        }
+        sched_yield();
+    }
+    virtqueue_disable_cb(s->vq);
+    s->woken = true;
+}
+
+static int sim_setup(struct sim *s)
+{
+    unsigned int i, qsize = s->cfg.qsize;
+    unsigned long ring_size = vring_size(qsize, SMP_CACHE_BYTES, s->cfg.packed);
+
+    s->vdev.device = &sim_device_ops;
+    s->vdev.packed_ring = s->cfg.packed;
+    s->vdev.event_suppression_enabled = s->cfg.event_idx;
+    s->vdev.in_order = s->cfg.in_order;
+
+    s->ring = aligned_alloc(PAGE_SIZE, ALIGN_UP(ring_size, PAGE_SIZE));
+    s->control = calloc(1, vring_control_block_size((u16)qsize, s->cfg.packed));
+    s->bufs = calloc(qsize, sizeof(*s->bufs));
+    s->sg = calloc(s->cfg.sg, sizeof(*s->sg));
+    s->data = calloc(s->cfg.sg, s->cfg.seg_len);
+    s->head_seen = calloc(qsize, sizeof(*s->head_seen));
+    s->desc_seen = calloc(qsize, sizeof(*s->desc_seen));
+    if (s->cfg.trail) {
+        s->trail_lat = calloc(s->cfg.count / s->cfg.trail + 1, sizeof(*s->trail_lat));
+    }
+    if (!s->ring || !s->control || !s->bufs || !s->sg || !s->data || !s->head_seen ||
+        !s->desc_seen || (s->cfg.trail && !s->trail_lat)) {
+        return -1;
+    }
+    memset(s->ring, 0, ALIGN_UP(ring_size, PAGE_SIZE));
+
+    if (s->cfg.packed) {
+        s->vq = vring_new_virtqueue_packed(0, qsize, SMP_CACHE_BYTES, &s->vdev, s->ring,
+                                           SimNotify, s->control);
+    } else {
+        s->vq = vring_new_virtqueue_split(0, qsize, SMP_CACHE_BYTES, &s->vdev, s->ring,
+                                          SimNotify, s->control);
+    }
+    if (!s->vq) {
+        return -1;
+    }
+    sim_from_vq = s;
+
+    for (i = 0; i < s->cfg.sg; i++) {
+        s->sg[i].physAddr.QuadPart = (uintptr_t)s->data + i * s->cfg.seg_len;
+        s->sg[i].length = s->cfg.seg_len;
+    }
+    for (i = 0; i < qsize; i++) {
+        struct sim_buf *buf = &s->bufs[i];
+        buf->in_len = (s->cfg.sg - 1) * s->cfg.seg_len;
+        if (s->cfg.indirect) {
+            buf->indirect = calloc(s->cfg.sg, sizeof(struct sim_packed_desc));
+            if (!buf->indirect) {
+                return -1;
+            }
+        }
+        buf->next_free = s->free_bufs;
+        s->free_bufs = buf;
+    }
+
+    s->dev_limit = s->cfg.dev_batch;
+    s->last_avail = s->used_idx = 0;
+    s->avail_pos = s->used_pos = 0;
+    s->avail_wrap = s->used_wrap = true;
+    return 0;
+}
+
+static void sim_cleanup(struct sim *s)
+{
+    unsigned int i;
+
+    if (s->bufs) {
+        for (i = 0; i < s->cfg.qsize; i++) {
+            free(s->bufs[i].indirect);
+        }
+    }
+    free(s->bufs);
+    free(s->ring);
+    free(s->control);
+    free(s->sg);
+    free(s->data);
+    free(s->head_seen);
+    free(s->desc_seen);
+    free(s->trail_lat);
+}
+
+static const char *const coalesce_policies[] = {"fixed", "rate", "bytes", "adaptive"};
+
+static double percent(unsigned long part, unsigned long total)
+{
+    return total ? 100.0 * part / total : 0.0;
+}
+
+static double per_op(uint64_t ns, unsigned long ops)
+{
+    return ops ? (double)ns / ops : 0.0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* A buffer completed after a burst must not wait for the next one, a few late ones are
+ * scheduling noise of the two threads, a late median is a delayed interrupt */
+static void sim_check_trail(struct sim *s)
+{
+    unsigned long i;
+
+    if (!s->stats.trails) {
+        return;
+    }
+    qsort(s->trail_lat, s->stats.trails, sizeof(*s->trail_lat), compare_u64);
+    s->stats.trail_median_ns = s->trail_lat[s->stats.trails / 2];
+    s->stats.trail_max_ns = s->trail_lat[s->stats.trails - 1];
+    for (i = 0; i < s->stats.trails; i++) {
+        if (s->trail_lat[i] > TRAIL_MAX_NS) {
+            s->stats.late_trails++;
+        }
+    }
+    if (s->stats.trail_median_ns > TRAIL_MAX_NS) {
+        fprintf(stderr, "the buffer after a burst waited %.1f us, more than %llu us\n",
+                s->stats.trail_median_ns / 1e3, TRAIL_MAX_NS / 1000);
+        s->stats.errors++;
+    }
+}
+
+static void sim_report(const struct sim *s, uint64_t elapsed)
+{
+    const struct sim_config *c = &s->cfg;
+    const struct sim_stats *st = &s->stats;
+    unsigned long reused = 0;
+    unsigned int i;
+
+    for (i = 0; i < ARRAYSIZE(st->reuse); i++) {
+        reused += st->reuse[i];
+    }
+
+    printf("%s ring, qsize %u, sg %u, indirect %s, event_idx %s, in_order %s, "
+           "%s api, %s cb, driver batch %u, device batch %u\n",
+           c->packed ? "packed" : "split", c->qsize, c->sg, c->indirect ? "on" : "off",
+           c->event_idx ? "on" : "off", c->in_order ? "on" : "off",
+           c->bulk_api ? "bulk" : "single",
+           c->delayed_cb || c->coalesce >= 0 ? "delayed" : "immediate",
+           c->drv_batch, c->dev_batch);
+    printf("  throughput   %lu buffers in %.3f s, %.2f Mbuf/s\n", st->gets, elapsed / 1e9,
+           st->gets * 1e3 / (elapsed ? elapsed : 1));
+    printf("  driver       add %.1f ns/buf, get %.1f ns/buf, kick_prepare %.1f ns/call, "
+           "ring full %lu times\n",
+           per_op(st->add_ns, st->adds), per_op(st->get_ns, st->gets),
+           per_op(st->kick_ns, st->kick_checks), st->ring_full);
+    printf("  kicks        %lu of %lu checks sent (%.1f%% suppressed), %lu doorbells seen\n",
+           st->kicks, st->kick_checks, percent(st->kick_checks - st->kicks, st->kick_checks),
+           st->doorbells);
+    printf("  interrupts   %lu for %lu used batches (%.1f%% suppressed), driver waited %lu times\n",
+           st->interrupts, st->used_batches,
+           percent(st->used_batches - st->interrupts, st->used_batches), st->waits);
+    printf("  reuse        %lu head ids, %lu of %u ring descriptors touched, %.2f descs/buf\n",
+           st->distinct_heads, st->distinct_descs, c->qsize,
+           st->gets ? (double)st->descs / st->gets : 0.0);
+    printf("  reuse dist   <=1/8 ring %.1f%%, <=1/4 %.1f%%, <=1/2 %.1f%%, <=1 %.1f%%, "
+           ">1 %.1f%%\n",
+           percent(st->reuse[0], reused), percent(st->reuse[1], reused),
+           percent(st->reuse[2], reused), percent(st->reuse[3], reused),
+           percent(st->reuse[4], reused));
+    if (c->coalesce >= 0) {
+        const struct virtqueue_coalesce_stats *cs = &s->coalesce.stats;
+        printf("  coalescing   %s policy: %llu interrupts delivered, %llu suppressed, "
+               "%llu late, %u buffers per interrupt at the end\n",
+               coalesce_policies[c->coalesce], (unsigned long long)cs->interrupts,
+               (unsigned long long)cs->suppressed, (unsigned long long)cs->late,
+               cs->bufs_per_interrupt);
+    }
+    if (c->trail) {
+        printf("  trailing     %lu bursts of %u, the next buffer reaped in %.1f us median, "
+               "%.1f us max, %lu over %llu us\n",
+               st->trails, c->trail, st->trail_median_ns / 1e3, st->trail_max_ns / 1e3,
+               st->late_trails, TRAIL_MAX_NS / 1000);
+    }
+    if (c->vq_stats) {
+        struct virtqueue_stats vs;
+        virtqueue_query_stats(s->vq, &vs);
+        printf("  vq stats     %llu added (%llu indirect), %.2f sg/buf, %llu ring full, "
+               "%llu of %llu kicks, %llu used, %llu empty gets, occupancy %.1f avg %u max "
+               "of %u\n",
+               (unsigned long long)vs.added, (unsigned long long)vs.added_indirect,
+               vs.added ? (double)vs.sg_elements / vs.added : 0.0,
+               (unsigned long long)vs.add_no_space, (unsigned long long)vs.kicks,
+               (unsigned long long)vs.kick_checks, (unsigned long long)vs.used,
+               (unsigned long long)vs.get_empty,
+               vs.added ? (double)vs.occupancy_sum / vs.added : 0.0, vs.occupancy_max,
+               vs.ring_size);
+    }
+    if (st->errors || st->lost_kicks || st->lost_interrupts) {
+        printf("  FAILED       %lu errors, %lu lost kicks, %lu lost interrupts\n", st->errors,
+               st->lost_kicks, st->lost_interrupts);
+    }
+}
+
+/* The ring's own counters must agree with what the driver side has seen */
+static void sim_check_vq_stats(struct sim *s)
+{
+    const struct virtqueue_stats *vs = &s->vq_stats;
+    const struct sim_stats *st = &s->stats;
+    /* the split ring puts single element buffers straight into the descriptor table */
+    ULONGLONG indirect = s->cfg.indirect && (s->cfg.packed || s->cfg.sg > 1) ? st->adds : 0;
+
+    if (vs->added != st->adds || vs->sg_elements != (ULONGLONG)st->adds * s->cfg.sg ||
+        vs->add_no_space != st->ring_full || vs->kick_checks != st->kick_checks ||
+        vs->kicks != st->kicks || vs->notifications != st->kicks || vs->used != st->gets ||
+        vs->added_indirect != indirect || vs->occupancy_max > s->cfg.qsize) {
+        fprintf(stderr, "virtqueue statistics do not match the driver's counters\n");
+        s->stats.errors++;
+    }
+}
+
+static int sim_run(const struct sim_config *cfg)
+{
+    struct sim *s = calloc(1, sizeof(*s));
+    unsigned long next_seq = 0, expected = 0;
+    pthread_t device;
+    uint64_t start, elapsed;
+    int ret = 1;
+
+    if (!s) {
+        return 1;
+    }
+    s->cfg = *cfg;
+    if (sim_setup(s)) {
+        fprintf(stderr, "failed to set up the virtqueue\n");
+        goto out;
+    }
+    if (cfg->coalesce >= 0) {
+        struct virtqueue_coalesce_params params = {
+            .policy = cfg->coalesce,
+            .rate_limit = 20000,
+            .byte_target = 64 * 1024,
+        };
+        virtqueue_coalesce_init(&s->coalesce, &params);
+        virtqueue_attach_coalesce(s->vq, &s->coalesce);
+    }
+    if (cfg->vq_stats) {
+        virtqueue_attach_stats(s->vq, &s->vq_stats);
+    }
+    virtqueue_disable_cb(s->vq);
+    if (pthread_create(&device, NULL, cfg->trail ? device_thread_trail : device_thread, s)) {
+        goto out;
+    }
+
+    start = now_ns();
+    while (expected < cfg->count && !s->stats.errors) {
+        unsigned int added = driver_submit(s, &next_seq);
+        unsigned int reaped = driver_reap(s, &expected);
+        if (reaped && s->woken) {
+            /* the completions the interrupt was raised for */
+            virtqueue_coalesce_sample(s->vq, reaped, (ULONGLONG)reaped * s->bufs[0].in_len);
+            s->woken = false;
+        }
+        if (reaped && cfg->trail) {
+            driver_check_trail(s, expected);
+        }
+        if (!added && !reaped) {
+            driver_wait(s);
+        }
+    }
+    elapsed = now_ns() - start;
+
+    STORE(&s->stop, 1);
+    pthread_join(device, NULL);
+    if (cfg->vq_stats) {
+        sim_check_vq_stats(s);
+    }
+    if (cfg->trail) {
+        sim_check_trail(s);
+    }
+    sim_report(s, elapsed);
+    ret = (s->stats.errors || s->stats.lost_kicks || s->stats.lost_interrupts) ? 1 : 0;
+
+out:
+    sim_cleanup(s);
+    free(s);
+    return ret;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [options]\n"
+           "  -p         use the packed ring layout (default split)\n"
+           "  -q SIZE    queue size, a power of 2 (default 256)\n"
+           "  -s COUNT   scatter-gather elements per buffer, 1 out + COUNT-1 in (default 2)\n"
+           "  -l BYTES   length of each scatter-gather element (default 1024)\n"
+           "  -i         use indirect descriptors\n"
+           "  -E         do not negotiate VIRTIO_RING_F_EVENT_IDX\n"
+           "  -o         negotiate VIRTIO_F_IN_ORDER, the device then returns batches\n"
+           "  -B         use virtqueue_add_bufs/virtqueue_get_bufs\n"
+           "  -d         wait with virtqueue_enable_cb_delayed\n"
+           "  -S         attach a statistics block and check it against the driver's counters\n"
+           "  -C POLICY  attach interrupt coalescing: fixed, rate (20000 interrupts/s),\n"
+           "             bytes (64KB per interrupt) or adaptive, implies -d\n"
+           "  -b COUNT   buffers added by the driver per kick, up to 256 (default 32)\n"
+           "  -D COUNT   buffers consumed by the device per used index update (default 16)\n"
+           "  -T COUNT   the device completes bursts of COUNT buffers, each followed by a pause\n"
+           "             and a single buffer that must be reaped within 100 us\n"
+           "  -n COUNT   number of buffers to pass through the ring (default 1000000)\n"
+           "  -v LEVEL   VirtioLib debug print level\n",
+           name);
+}
+
+int main(int argc, char **argv)
+{
+    struct sim_config cfg = {
+        .event_idx = true,
+        .qsize = 256,
+        .sg = 2,
+        .seg_len = 1024,
+        .drv_batch = 32,
+        .dev_batch = 16,
+        .count = 1000000,
+        .coalesce = -1,
+    };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "pq:s:l:iEoBdSC:b:D:T:n:v:h")) != -1) {
+        switch (opt) {
+        case 'p':
+            cfg.packed = true;
+            break;
+        case 'q':
+            cfg.qsize = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            cfg.sg = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            cfg.seg_len = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            cfg.indirect = true;
+            break;
+        case 'E':
+            cfg.event_idx = false;
+            break;
+        case 'o':
+            cfg.in_order = true;
+            break;
+        case 'B':
+            cfg.bulk_api = true;
+            break;
+        case 'd':
+            cfg.delayed_cb = true;
+            break;
+        case 'S':
+            cfg.vq_stats = true;
+            break;
+        case 'C':
+            for (cfg.coalesce = 0; cfg.coalesce < (int)ARRAYSIZE(coalesce_policies);
+                 cfg.coalesce++) {
+                if (!strcmp(optarg, coalesce_policies[cfg.coalesce])) {
+                    break;
+                }
+            }
+            if (cfg.coalesce == (int)ARRAYSIZE(coalesce_policies)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'b':
+            cfg.drv_batch = strtoul(optarg, NULL, 0);
+            break;
+        case 'D':
+            cfg.dev_batch = strtoul(optarg, NULL, 0);
+            break;
+        case 'T':
+            cfg.trail = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            cfg.count = strtoul(optarg, NULL, 0);
+            break;
+        case 'v':
+            bDebugPrint = 1;
+            virtioDebugLevel = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (!cfg.qsize || (cfg.qsize & (cfg.qsize - 1)) || cfg.qsize > 32768 || !cfg.sg ||
+        (!cfg.indirect && cfg.sg > cfg.qsize) || !cfg.drv_batch || cfg.drv_batch > 256 ||
+        !cfg.dev_batch) {
+        usage(argv[0]);
+        return 1;
+    }
+    return sim_run(&cfg);
+}
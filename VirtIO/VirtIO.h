@@ -10,16 +10,33 @@ struct VirtIOBufferDescriptor {
     ULONG length;
 };
 
+/* Describes one buffer passed to virtqueue_add_bufs, the fields have the same meaning
+ * as the corresponding arguments of virtqueue_add_buf */
+struct virtqueue_buf {
+    struct scatterlist *sg;
+    unsigned int out_num;
+    unsigned int in_num;
+    void *opaque;
+    void *va_indirect;
+    ULONGLONG phys_indirect;
+};
+
 typedef int (*proc_virtqueue_add_buf)(struct virtqueue *vq, struct scatterlist sg[],
                                       unsigned int out_num, unsigned int in_num, void *opaque,
                                       void *va_indirect, ULONGLONG phys_indirect);
 
+typedef unsigned int (*proc_virtqueue_add_bufs)(struct virtqueue *vq, struct virtqueue_buf bufs[],
+                                                unsigned int num);
+
 typedef bool (*proc_virtqueue_kick_prepare)(struct virtqueue *vq);
 
 typedef void (*proc_virtqueue_kick_always)(struct virtqueue *vq);
 
 typedef void *(*proc_virtqueue_get_buf)(struct virtqueue *vq, unsigned int *len);
 
+typedef unsigned int (*proc_virtqueue_get_bufs)(struct virtqueue *vq, void *opaque[],
+                                                unsigned int len[], unsigned int num);
+
 typedef void (*proc_virtqueue_disable_cb)(struct virtqueue *vq);
 
 typedef bool (*proc_virtqueue_enable_cb)(struct virtqueue *vq);
@@ -34,18 +51,28 @@ typedef BOOLEAN (*proc_virtqueue_has_buf)(struct virtqueue *vq);
 
 typedef void (*proc_virtqueue_shutdown)(struct virtqueue *vq);
 
+typedef u16 (*proc_virtqueue_next_avail)(struct virtqueue *vq);
+
+struct virtqueue_coalesce;
+struct virtqueue_stats;
+
 /* Represents one virtqueue; only data pointed to by the vring structure is exposed to the host */
 struct virtqueue {
     VirtIODevice *vdev;
     unsigned int index;
+    /* identifies the queue in device notifications, this is the queue index unless
+     * VIRTIO_F_NOTIF_CONFIG_DATA has been negotiated */
+    u16 notification_id;
     void (*notification_cb)(struct virtqueue *vq);
     void *notification_addr;
     void *avail_va;
     void *used_va;
     proc_virtqueue_add_buf add_buf;
+    proc_virtqueue_add_bufs add_bufs;
     proc_virtqueue_kick_prepare kick_prepare;
     proc_virtqueue_kick_always kick_always;
     proc_virtqueue_get_buf get_buf;
+    proc_virtqueue_get_bufs get_bufs;
     proc_virtqueue_disable_cb disable_cb;
     proc_virtqueue_enable_cb enable_cb;
     proc_virtqueue_enable_cb_delayed enable_cb_delayed;
@@ -53,6 +80,11 @@ struct virtqueue {
     proc_virtqueue_is_interrupt_enabled is_interrupt_enabled;
     proc_virtqueue_has_buf has_buf;
     proc_virtqueue_shutdown shutdown;
+    proc_virtqueue_next_avail next_avail;
+    /* interrupt coalescing used by enable_cb_delayed, see virtqueue_attach_coalesce */
+    struct virtqueue_coalesce *coalesce;
+    /* optional counters, see virtqueue_attach_stats */
+    struct virtqueue_stats *stats;
 };
 
 static inline int virtqueue_add_buf(struct virtqueue *vq, struct scatterlist sg[],
@@ -62,6 +94,14 @@ static inline int virtqueue_add_buf(struct virtqueue *vq, struct scatterlist sg[
     return vq->add_buf(vq, sg, out_num, in_num, opaque, va_indirect, phys_indirect);
 }
 
+/* Adds up to num buffers and makes them visible to the device at once, returns the number
+ * of buffers added which is less than num if the ring has run out of descriptors */
+static inline unsigned int virtqueue_add_bufs(struct virtqueue *vq, struct virtqueue_buf bufs[],
+                                              unsigned int num)
+{
+    return vq->add_bufs(vq, bufs, num);
+}
+
 static inline bool virtqueue_kick_prepare(struct virtqueue *vq)
 {
     return vq->kick_prepare(vq);
@@ -77,6 +117,13 @@ static inline void *virtqueue_get_buf(struct virtqueue *vq, unsigned int *len)
     return vq->get_buf(vq, len);
 }
 
+/* Fetches up to num returned buffers, returns the number of entries filled in opaque and len */
+static inline unsigned int virtqueue_get_bufs(struct virtqueue *vq, void *opaque[],
+                                              unsigned int len[], unsigned int num)
+{
+    return vq->get_bufs(vq, opaque, len, num);
+}
+
 static inline void virtqueue_disable_cb(struct virtqueue *vq)
 {
     vq->disable_cb(vq);
@@ -112,7 +159,155 @@ static inline void virtqueue_shutdown(struct virtqueue *vq)
     vq->shutdown(vq);
 }
 
+/* Returns the position in the ring where the device will find the next available buffer,
+ * encoded as the upper half of a VIRTIO_F_NOTIFICATION_DATA notification: the avail index
+ * for split rings, the descriptor offset with the wrap counter in bit 15 for packed rings */
+static inline u16 virtqueue_next_avail(struct virtqueue *vq)
+{
+    return vq->next_avail(vq);
+}
+
 void virtqueue_notify(struct virtqueue *vq);
 void virtqueue_kick(struct virtqueue *vq);
 
+/* Per-queue counters. They are plain increments done by whoever owns the respective side of
+ * the queue, i.e. under the locks the driver already takes around add_buf and get_buf, so a
+ * snapshot taken by virtqueue_query_stats may be slightly inconsistent but needs no locking.
+ * Each field is written by one side only, the producer (add_buf, kick) or the consumer
+ * (get_buf), and a cache line between the two groups keeps the sides from sharing a line
+ * whatever the alignment of the block */
+struct virtqueue_stats {
+    /* producer: buffers added and how many of them went through an indirect table */
+    ULONGLONG added;
+    ULONGLONG added_indirect;
+    /* add_buf calls failed because the ring was full */
+    ULONGLONG add_no_space;
+    /* scatter-gather elements of the added buffers, sg_elements / added is the average
+     * chain length */
+    ULONGLONG sg_elements;
+    /* kick_prepare calls and how many of them asked for a notification, the difference
+     * is the number of notifications suppressed by the device */
+    ULONGLONG kick_checks;
+    ULONGLONG kicks;
+    /* notifications written to the device, including virtqueue_kick_always */
+    ULONGLONG notifications;
+    /* descriptors in use sampled on each add, occupancy_sum / added is the average */
+    ULONGLONG occupancy_sum;
+    u32 occupancy_max;
+
+    u8 separator[64]; /* a cache line */
+
+    /* consumer: buffers returned by the device, get_buf and get_bufs calls that found none.
+     * added - used is the number of buffers currently owned by the device */
+    ULONGLONG used;
+    ULONGLONG get_empty;
+
+    /* filled in by virtqueue_query_stats */
+    u32 ring_size;
+};
+
+static inline void virtqueue_stats_add(struct virtqueue *vq, unsigned int sg_elements,
+                                       bool indirect, unsigned int occupancy)
+{
+    struct virtqueue_stats *stats = vq->stats;
+
+    stats->added++;
+    if (indirect) {
+        stats->added_indirect++;
+    }
+    stats->sg_elements += sg_elements;
+    stats->occupancy_sum += occupancy;
+    if (occupancy > stats->occupancy_max) {
+        stats->occupancy_max = occupancy;
+    }
+}
+
+static inline void virtqueue_stats_used(struct virtqueue *vq, unsigned int bufs)
+{
+    struct virtqueue_stats *stats = vq->stats;
+
+    stats->used += bufs;
+    if (!bufs) {
+        stats->get_empty++;
+    }
+}
+
+void virtqueue_attach_stats(struct virtqueue *vq, struct virtqueue_stats *stats);
+void virtqueue_query_stats(struct virtqueue *vq, struct virtqueue_stats *stats);
+
+/* Policies deciding how many used buffers virtqueue_enable_cb_delayed lets the device
+ * return before it interrupts */
+enum virtqueue_coalesce_policy {
+    /* 3/4 of the outstanding buffers, same as without coalescing */
+    VIRTQ_COALESCE_FIXED,
+    /* keep the interrupt rate below rate_limit interrupts per second */
+    VIRTQ_COALESCE_RATE,
+    /* interrupt once per byte_target bytes of completed buffers */
+    VIRTQ_COALESCE_BYTES,
+    /* search for the smallest batch size with the best throughput, in the style of the
+     * Linux dynamic interrupt moderation (DIM) */
+    VIRTQ_COALESCE_ADAPTIVE,
+};
+
+struct virtqueue_coalesce_params {
+    enum virtqueue_coalesce_policy policy;
+    /* upper bound of buffers per interrupt, 0 for the default of 128 */
+    u16 max_bufs;
+    /* VIRTQ_COALESCE_RATE: interrupts per second */
+    u32 rate_limit;
+    /* VIRTQ_COALESCE_BYTES: bytes per interrupt */
+    u32 byte_target;
+    /* length of a sampling window in microseconds, 0 for the default of 2 ms */
+    u32 sample_usec;
+    /* the policies other than VIRTQ_COALESCE_FIXED never wait for more buffers than the
+     * queue completes in this time, in microseconds, 0 for the default of 100 us */
+    u32 max_usec;
+};
+
+/* Counters of a coalescing state, readable at any time */
+struct virtqueue_coalesce_stats {
+    /* interrupts delivered */
+    ULONGLONG interrupts;
+    /* buffers and bytes completed in response to them */
+    ULONGLONG buffers;
+    ULONGLONG bytes;
+    /* interrupts saved, i.e. buffers completed beyond the first one of each interrupt */
+    ULONGLONG suppressed;
+    /* interrupts that came later than max_usec allows, each one stopped the delay */
+    ULONGLONG late;
+    /* the current target of the policy, limited by max_usec */
+    u16 bufs_per_interrupt;
+};
+
+/* Interrupt coalescing state, allocated by the driver and attached to one virtqueue */
+struct virtqueue_coalesce {
+    struct virtqueue_coalesce_params params;
+    struct virtqueue_coalesce_stats stats;
+    /* sampling window in progress, in 100 ns units */
+    ULONGLONG window_start;
+    ULONGLONG window_interrupts;
+    ULONGLONG window_buffers;
+    ULONGLONG window_bytes;
+    /* when virtqueue_enable_cb_delayed last placed the used event, in 100 ns units */
+    ULONGLONG armed;
+    /* buffers per interrupt as the policy wants them and as max_usec allows them */
+    u16 target;
+    u16 cap;
+    /* VIRTQ_COALESCE_ADAPTIVE search state */
+    struct {
+        ULONGLONG buffer_rate;
+        int level;
+        int step;
+        /* direction of the next probe out of the parked state */
+        int probe;
+        unsigned int parked;
+        u8 valid;
+    } dim;
+};
+
+void virtqueue_coalesce_init(struct virtqueue_coalesce *coalesce,
+                             const struct virtqueue_coalesce_params *params);
+void virtqueue_attach_coalesce(struct virtqueue *vq, struct virtqueue_coalesce *coalesce);
+void virtqueue_coalesce_sample(struct virtqueue *vq, unsigned int bufs, ULONGLONG bytes);
+
 #endif /* _LINUX_VIRTIO_H */
@@ -0,0 +1,296 @@
+/*
+ * Adaptive interrupt coalescing for virtqueues
+ *
+ * Copyright Red Hat, Inc. 2026
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "osdep.h"
+#include "virtio_pci.h"
+#include "virtio.h"
+#include "kdebugprint.h"
+#include "virtio_ring.h"
+
+/* Time units per second, 100 ns like the interrupt time */
+#define COALESCE_TICKS_PER_SEC      10000000ULL
+
+#define COALESCE_DEFAULT_SAMPLE_USEC 2000
+#define COALESCE_DEFAULT_MAX_USEC   100
+/* windows with fewer interrupts than this are too noisy to act upon */
+#define COALESCE_MIN_SAMPLE_IRQS    4
+/* relative change in percent considered significant by the adaptive policy */
+#define COALESCE_SIGNIFICANT_PCT    10
+/* number of windows the adaptive policy stays parked before probing again */
+#define COALESCE_PARKED_WINDOWS     16
+/* an interrupt is late when it comes this many times max_usec after the used event was
+ * placed, the margin covers the interrupt and DPC latency */
+#define COALESCE_LATE_FACTOR        2
+
+/* Buffers per interrupt for each level of the adaptive policy */
+static const u16 coalesce_levels[] = {1, 2, 4, 8, 16, 32, 64, 128};
+
+enum coalesce_compare {
+    COALESCE_WORSE,
+    COALESCE_SAME,
+    COALESCE_BETTER,
+};
+
+/* The interrupt time advances once per clock tick, too coarse for the delays the policies
+ * deal with, so the performance counter is converted to 100 ns units */
+static ULONGLONG coalesce_now(void)
+{
+    LARGE_INTEGER freq, now = KeQueryPerformanceCounter(&freq);
+
+    return (ULONGLONG)(now.QuadPart / freq.QuadPart) * COALESCE_TICKS_PER_SEC +
+           (ULONGLONG)(now.QuadPart % freq.QuadPart) * COALESCE_TICKS_PER_SEC /
+               (ULONGLONG)freq.QuadPart;
+}
+
+static u16 coalesce_clamp(const struct virtqueue_coalesce *coalesce, ULONGLONG bufs)
+{
+    if (bufs < 1) {
+        return 1;
+    }
+    if (bufs > coalesce->params.max_bufs) {
+        return coalesce->params.max_bufs;
+    }
+    return (u16)bufs;
+}
+
+/* The device is asked for the target of the policy, but never for more buffers than
+ * the queue completes in max_usec */
+static void coalesce_set_target(struct virtqueue_coalesce *coalesce, u16 target)
+{
+    coalesce->target = target;
+    coalesce->stats.bufs_per_interrupt = target < coalesce->cap ? target : coalesce->cap;
+}
+
+static bool coalesce_significant(ULONGLONG prev, ULONGLONG curr)
+{
+    ULONGLONG delta = prev > curr ? prev - curr : curr - prev;
+    return delta * 100 > prev * COALESCE_SIGNIFICANT_PCT;
+}
+
+/* Only the throughput counts. Fewer interrupts at the same throughput only add latency,
+ * so a larger batch must pay off in completed buffers per second to be kept */
+static enum coalesce_compare coalesce_compare(const struct virtqueue_coalesce *coalesce,
+                                              ULONGLONG buffer_rate)
+{
+    if (coalesce_significant(coalesce->dim.buffer_rate, buffer_rate)) {
+        return buffer_rate > coalesce->dim.buffer_rate ? COALESCE_BETTER : COALESCE_WORSE;
+    }
+    return COALESCE_SAME;
+}
+
+/* One step of a DIM-like search: keep moving while the throughput improves, step back
+ * and park when it gets worse. A step up that gains nothing is undone, a step down that
+ * loses nothing is kept and the search goes on down, so the search settles on the
+ * smallest batch with the best throughput. When parked it probes up and down in turn,
+ * after a while or when the throughput changes */
+static void coalesce_adapt(struct virtqueue_coalesce *coalesce, ULONGLONG buffer_rate)
+{
+    int top = 0;
+
+    while (top + 1 < (int)ARRAYSIZE(coalesce_levels) &&
+           coalesce_levels[top + 1] <= coalesce->params.max_bufs) {
+        top++;
+    }
+
+    if (!coalesce->dim.valid) {
+        coalesce->dim.valid = true;
+        coalesce->dim.step = 1;
+        coalesce->dim.probe = -1;
+    } else if (coalesce->dim.step == 0) {
+        if (coalesce_compare(coalesce, buffer_rate) != COALESCE_SAME ||
+            ++coalesce->dim.parked >= COALESCE_PARKED_WINDOWS) {
+            coalesce->dim.step = coalesce->dim.probe;
+            coalesce->dim.probe = -coalesce->dim.probe;
+            coalesce->dim.parked = 0;
+        }
+    } else {
+        switch (coalesce_compare(coalesce, buffer_rate)) {
+        case COALESCE_BETTER:
+            break;
+        case COALESCE_WORSE:
+            /* undo the last step and stay there */
+            coalesce->dim.level -= coalesce->dim.step;
+            coalesce->dim.step = 0;
+            break;
+        default:
+            if (coalesce->dim.step > 0) {
+                coalesce->dim.level -= coalesce->dim.step;
+                coalesce->dim.step = 0;
+            }
+            break;
+        }
+    }
+
+    coalesce->dim.level += coalesce->dim.step;
+    if (coalesce->dim.level <= 0) {
+        coalesce->dim.level = 0;
+        coalesce->dim.step = 0;
+    } else if (coalesce->dim.level >= top) {
+        coalesce->dim.level = top;
+        coalesce->dim.step = 0;
+    }
+    coalesce->dim.buffer_rate = buffer_rate;
+    coalesce_set_target(coalesce, coalesce_levels[coalesce->dim.level]);
+}
+
+/* Recomputes the target number of buffers per interrupt at the end of a sampling window */
+static void coalesce_end_window(struct virtqueue_coalesce *coalesce, ULONGLONG elapsed)
+{
+    ULONGLONG buffer_rate = coalesce->window_buffers * COALESCE_TICKS_PER_SEC / elapsed;
+
+    coalesce->cap = coalesce_clamp(coalesce, buffer_rate * coalesce->params.max_usec / 1000000);
+
+    switch (coalesce->params.policy) {
+    case VIRTQ_COALESCE_RATE:
+        coalesce_set_target(coalesce,
+                            coalesce_clamp(coalesce, (buffer_rate + coalesce->params.rate_limit - 1) /
+                                                         coalesce->params.rate_limit));
+        break;
+    case VIRTQ_COALESCE_BYTES:
+        if (coalesce->window_bytes) {
+            coalesce_set_target(coalesce, coalesce_clamp(coalesce, coalesce->params.byte_target *
+                                                                       coalesce->window_buffers /
+                                                                       coalesce->window_bytes));
+        } else {
+            coalesce_set_target(coalesce, 1);
+        }
+        break;
+    case VIRTQ_COALESCE_ADAPTIVE:
+        coalesce_adapt(coalesce, buffer_rate);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Initializes the coalescing state, the memory is owned by the caller and must stay valid
+ * while the state is attached to a virtqueue */
+void virtqueue_coalesce_init(struct virtqueue_coalesce *coalesce,
+                             const struct virtqueue_coalesce_params *params)
+{
+    RtlZeroMemory(coalesce, sizeof(*coalesce));
+    coalesce->params = *params;
+    if (!coalesce->params.max_bufs) {
+        coalesce->params.max_bufs = coalesce_levels[ARRAYSIZE(coalesce_levels) - 1];
+    }
+    if (!coalesce->params.sample_usec) {
+        coalesce->params.sample_usec = COALESCE_DEFAULT_SAMPLE_USEC;
+    }
+    if (!coalesce->params.max_usec) {
+        coalesce->params.max_usec = COALESCE_DEFAULT_MAX_USEC;
+    }
+    if (!coalesce->params.rate_limit) {
+        coalesce->params.rate_limit = 1;
+    }
+    /* nothing is known about the rate until the first window ends */
+    coalesce->cap = 1;
+    coalesce_set_target(coalesce, 1);
+}
+
+/* Attaches the coalescing state to a virtqueue, virtqueue_enable_cb_delayed then places the
+ * used event according to the policy. Passing NULL restores the fixed 3/4 heuristic */
+void virtqueue_attach_coalesce(struct virtqueue *vq, struct virtqueue_coalesce *coalesce)
+{
+    if (coalesce) {
+        coalesce->window_start = coalesce_now();
+        coalesce->armed = 0;
+    }
+    vq->coalesce = coalesce;
+}
+
+/* Accounts one interrupt and the buffers and bytes completed in response to it. Must be
+ * serialized with virtqueue_enable_cb_delayed, typically both are called from the DPC */
+void virtqueue_coalesce_sample(struct virtqueue *vq, unsigned int bufs, ULONGLONG bytes)
+{
+    struct virtqueue_coalesce *coalesce = vq->coalesce;
+    ULONGLONG now, elapsed;
+
+    if (!coalesce) {
+        return;
+    }
+
+    coalesce->stats.interrupts++;
+    coalesce->stats.buffers += bufs;
+    coalesce->stats.bytes += bytes;
+    if (bufs > 1) {
+        coalesce->stats.suppressed += bufs - 1;
+    }
+
+    coalesce->window_interrupts++;
+    coalesce->window_buffers += bufs;
+    coalesce->window_bytes += bytes;
+
+    now = coalesce_now();
+
+    /* The completions slowed down since the rate was measured, e.g. a TX flow dropped to
+     * a trickle, and the device made this interrupt wait too long. Stop the delay at once,
+     * the end of the window measures the new rate */
+    if (coalesce->armed && coalesce->stats.bufs_per_interrupt > 1 &&
+        (now - coalesce->armed) * 1000000 >
+            (ULONGLONG)coalesce->params.max_usec * COALESCE_LATE_FACTOR * COALESCE_TICKS_PER_SEC) {
+        coalesce->stats.late++;
+        coalesce->cap = 1;
+        coalesce_set_target(coalesce, coalesce->target);
+    }
+    coalesce->armed = 0;
+
+    elapsed = now - coalesce->window_start;
+    if (elapsed * 1000000 < (ULONGLONG)coalesce->params.sample_usec * COALESCE_TICKS_PER_SEC ||
+        coalesce->window_interrupts < COALESCE_MIN_SAMPLE_IRQS) {
+        return;
+    }
+
+    coalesce_end_window(coalesce, elapsed);
+    DPrintf(5, "%s: queue %d: %u buffers per interrupt\n", __FUNCTION__, vq->index,
+            coalesce->stats.bufs_per_interrupt);
+
+    coalesce->window_start = now;
+    coalesce->window_interrupts = 0;
+    coalesce->window_buffers = 0;
+    coalesce->window_bytes = 0;
+}
+
+/* Returns how many of the outstanding buffers may be used before the device interrupts,
+ * this is the distance of the used event from the last seen used index. The delay only
+ * holds back completions the device already makes, like TX buffers of a queue that keeps
+ * sending. The buffers of an RX queue are waiting for packets that may never come, a
+ * driver that coalesces an RX queue this way must flush it with a timer of max_usec */
+u16 virtqueue_coalesce_delay(struct virtqueue_coalesce *coalesce, u16 outstanding)
+{
+    u16 bufs;
+
+    if (coalesce->params.policy == VIRTQ_COALESCE_FIXED) {
+        return outstanding * 3 / 4;
+    }
+    /* never wait for more buffers than the device holds or the interrupt is lost */
+    bufs = coalesce->stats.bufs_per_interrupt < outstanding ? coalesce->stats.bufs_per_interrupt :
+                                                              outstanding;
+    coalesce->armed = bufs > 1 ? coalesce_now() : 0;
+    return bufs ? bufs - 1 : 0;
+}
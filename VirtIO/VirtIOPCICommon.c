@@ -318,6 +318,13 @@ u32 virtio_get_queue_size(struct virtqueue *vq)
     return vq->vdev->info[vq->index].num;
 }
 
+/* Returns the max number of scatter-gather elements of a buffer added to this queue through
+ * an indirect table, see virtio_get_indirect_capacity */
+unsigned long virtqueue_get_indirect_capacity(struct virtqueue *vq)
+{
+    return virtio_get_indirect_capacity(virtio_get_queue_size(vq));
+}
+
 u16 virtio_set_config_vector(VirtIODevice *vdev, u16 vector)
 {
     return vdev->device->set_config_vector(vdev, vector);
@@ -371,15 +378,26 @@ int virtio_get_bar_index(PPCI_COMMON_HEADER pPCIHeader, PHYSICAL_ADDRESS BasePA)
  */
 bool vp_notify(struct virtqueue *vq)
 {
-    /* we write the queue's selector into the notification register to
-     * signal the other end */
-    iowrite16(vq->vdev, (unsigned short)vq->index, vq->notification_addr);
-    DPrintf(6, "virtio: vp_notify vq->index = %x\n", vq->index);
+    if (vq->vdev->notification_data) {
+        /* with VIRTIO_F_NOTIFICATION_DATA the device is also told where the
+         * available buffers end so it does not have to fetch the avail index */
+        u32 data = vq->notification_id | ((u32)virtqueue_next_avail(vq) << 16);
+        iowrite32(vq->vdev, data, vq->notification_addr);
+        DPrintf(6, "virtio: vp_notify vq->index = %x data = %x\n", vq->index, data);
+    } else {
+        /* we write the queue's selector into the notification register to
+         * signal the other end */
+        iowrite16(vq->vdev, vq->notification_id, vq->notification_addr);
+        DPrintf(6, "virtio: vp_notify vq->index = %x\n", vq->index);
+    }
     return true;
 }
 
 void virtqueue_notify(struct virtqueue *vq)
 {
+    if (vq->stats) {
+        vq->stats->notifications++;
+    }
     vq->notification_cb(vq);
 }
 
@@ -389,3 +407,25 @@ void virtqueue_kick(struct virtqueue *vq)
         virtqueue_notify(vq);
     }
 }
+
+/* Starts counting into a zeroed stats block owned by the caller, which must stay valid while
+ * attached. Passing NULL stops counting. The block survives virtqueue_shutdown */
+void virtqueue_attach_stats(struct virtqueue *vq, struct virtqueue_stats *stats)
+{
+    if (stats) {
+        RtlZeroMemory(stats, sizeof(*stats));
+    }
+    vq->stats = stats;
+}
+
+/* Copies the counters of a virtqueue, all zero if no stats block is attached. Meant for
+ * drivers exposing the counters through WMI or an IOCTL, may be called from any context */
+void virtqueue_query_stats(struct virtqueue *vq, struct virtqueue_stats *stats)
+{
+    if (vq->stats) {
+        *stats = *vq->stats;
+    } else {
+        RtlZeroMemory(stats, sizeof(*stats));
+    }
+    stats->ring_size = virtio_get_queue_size(vq);
+}
@@ -206,6 +206,8 @@ static u64 vio_modern_get_features(VirtIODevice *vdev)
 
 static NTSTATUS vio_modern_set_features(VirtIODevice *vdev, u64 features)
 {
+    u64 device_features = vio_modern_get_features(vdev);
+
     /* Give virtio_ring a chance to accept features. */
     vring_transport_features(vdev, &features);
 
@@ -214,6 +216,21 @@ static NTSTATUS vio_modern_set_features(VirtIODevice *vdev, u64 features)
         return STATUS_INVALID_PARAMETER;
     }
 
+    /* Notification data only changes what vp_notify writes to the doorbell, so it is
+     * accepted on behalf of every driver whenever the device offers it */
+    if (virtio_is_feature_enabled(device_features, VIRTIO_F_NOTIFICATION_DATA)) {
+        virtio_feature_enable(features, VIRTIO_F_NOTIFICATION_DATA);
+    }
+    /* queue_notify_data is only usable if the common capability is large enough */
+    if (virtio_is_feature_enabled(device_features, VIRTIO_F_NOTIF_CONFIG_DATA) &&
+        vdev->common_len >= sizeof(struct virtio_pci_modern_common_cfg)) {
+        virtio_feature_enable(features, VIRTIO_F_NOTIF_CONFIG_DATA);
+    } else {
+        virtio_feature_disable(features, VIRTIO_F_NOTIF_CONFIG_DATA);
+    }
+    vdev->notification_data = virtio_is_feature_enabled(features, VIRTIO_F_NOTIFICATION_DATA);
+    vdev->notif_config_data = virtio_is_feature_enabled(features, VIRTIO_F_NOTIF_CONFIG_DATA);
+
     iowrite32(vdev, 0, &vdev->common->guest_feature_select);
     iowrite32(vdev, (u32)features, &vdev->common->guest_feature);
     iowrite32(vdev, 1, &vdev->common->guest_feature_select);
@@ -288,7 +305,8 @@ static NTSTATUS vio_modern_setup_vq(struct virtqueue **queue, VirtIODevice *vdev
     volatile struct virtio_pci_common_cfg *cfg = vdev->common;
     struct virtqueue *vq;
     void *vq_addr;
-    u16 off;
+    u16 off, notify_data;
+    u32 notify_width = vdev->notification_data ? 4 : 2;
     unsigned long ring_size, heap_size;
     NTSTATUS status;
 
@@ -301,6 +319,14 @@ static NTSTATUS vio_modern_setup_vq(struct virtqueue **queue, VirtIODevice *vdev
     /* get offset of notification word for this vq */
     off = ioread16(vdev, &cfg->queue_notify_off);
 
+    /* get the value identifying this vq in notifications */
+    if (vdev->notif_config_data) {
+        notify_data = ioread16(
+            vdev, &((volatile struct virtio_pci_modern_common_cfg *)cfg)->queue_notify_data);
+    } else {
+        notify_data = (u16)index;
+    }
+
     /* try to allocate contiguous pages, scale down on failure */
     while (!(info->queue =
                  mem_alloc_contiguous_pages(vdev, vring_pci_size(info->num, vdev->packed_ring)))) {
@@ -339,9 +365,11 @@ static NTSTATUS vio_modern_setup_vq(struct virtqueue **queue, VirtIODevice *vdev
     iowrite64_twopart(vdev, mem_get_physical_address(vdev, vq->used_va), &cfg->queue_used_lo,
                       &cfg->queue_used_hi);
 
+    vq->notification_id = notify_data;
+
     if (vdev->notify_base) {
         /* offset should not wrap */
-        if ((u64)off * vdev->notify_offset_multiplier + 2 > vdev->notify_len) {
+        if ((u64)off * vdev->notify_offset_multiplier + notify_width > vdev->notify_len) {
             DPrintf(0,
                     "%p: bad notification offset %u (x %u) "
                     "for queue %u > %zd",
@@ -351,8 +379,9 @@ static NTSTATUS vio_modern_setup_vq(struct virtqueue **queue, VirtIODevice *vdev
         }
         vq->notification_addr = (void *)(vdev->notify_base + off * vdev->notify_offset_multiplier);
     } else {
-        vq->notification_addr = vio_modern_map_capability(
-            vdev, vdev->notify_map_cap, 2, 2, off * vdev->notify_offset_multiplier, 2, NULL);
+        vq->notification_addr =
+            vio_modern_map_capability(vdev, vdev->notify_map_cap, notify_width, 2,
+                                      off * vdev->notify_offset_multiplier, notify_width, NULL);
     }
 
     if (!vq->notification_addr) {
@@ -524,9 +553,12 @@ NTSTATUS vio_modern_initialize(VirtIODevice *vdev)
         return STATUS_INVALID_PARAMETER;
     }
 
-    /* Map bars according to the capabilities */
-    vdev->common = vio_modern_map_simple_capability(vdev, capabilities[VIRTIO_PCI_CAP_COMMON_CFG],
-                                                    sizeof(struct virtio_pci_common_cfg), 4);
+    /* Map bars according to the capabilities, the common capability is mapped including
+     * the fields added after virtio 1.0 if the device implements them */
+    vdev->common = vio_modern_map_capability(vdev, capabilities[VIRTIO_PCI_CAP_COMMON_CFG],
+                                             sizeof(struct virtio_pci_common_cfg), 4, 0,
+                                             sizeof(struct virtio_pci_modern_common_cfg),
+                                             &vdev->common_len);
     if (!vdev->common) {
         return STATUS_INVALID_PARAMETER;
     }
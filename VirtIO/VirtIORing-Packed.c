@@ -117,6 +117,7 @@ static inline bool vring_need_event(__u16 event_idx, __u16 new_idx, __u16 old)
 
 struct vring_desc_state_packed {
     void *data; /* Data for callback. */
+    u32 len;    /* Device-writable length, reported for in-order batches. */
     u16 num;    /* Descriptor list length. */
     u16 next;   /* The next desc state in a list. */
     u16 last;   /* The last desc state in a list. */
@@ -130,10 +131,18 @@ struct virtqueue_packed {
     unsigned int free_head;
     /* Number of free descriptors */
     unsigned int num_free;
+    /* Number of buffers added and not yet detached */
+    unsigned int num_bufs;
     /* Last used index we've seen. */
     u16 last_used_idx;
     /* Avail used flags. */
     u16 avail_used_flags;
+    /* VIRTIO_F_IN_ORDER: the last buffer of the used batch being consumed. */
+    struct {
+        bool pending;
+        u16 id;
+        u32 len;
+    } batch_last;
     struct {
         /* Driver ring wrap counter. */
         bool avail_wrap_counter;
@@ -174,27 +183,31 @@ unsigned long vring_size_packed(unsigned int num, unsigned long align)
     return res;
 }
 
-static int
-virtqueue_add_buf_packed(struct virtqueue *_vq,   /* the queue */
-                         struct scatterlist sg[], /* sg array of length out + in */
-                         unsigned int out,  /* number of driver->device buffer descriptors in sg */
-                         unsigned int in,   /* number of device->driver buffer descriptors in sg */
-                         void *opaque,      /* later returned from virtqueue_get_buf */
-                         void *va_indirect, /* VA of the indirect page or NULL */
-                         ULONGLONG phys_indirect) /* PA of the indirect page or 0 */
+/* Writes a buffer to the descriptor ring except for the flags of its head descriptor,
+ * which are returned in head_flags for the caller to make the buffer available.
+ * Returns 0 on success, negative number on error */
+static int virtqueue_add_desc_packed(struct virtqueue_packed *vq, struct scatterlist sg[],
+                                     unsigned int out, unsigned int in, void *opaque,
+                                     void *va_indirect, ULONGLONG phys_indirect, u16 *head_flags)
 {
-    struct virtqueue_packed *vq = packedvq(_vq);
     unsigned int descs_used;
     struct vring_packed_desc *desc;
+    u32 in_len = 0;
     u16 head, id, i;
 
     descs_used = out + in;
     head = vq->packed.next_avail_idx;
-    id = (u16)vq->free_head;
+    /* With in-order completion the buffer id is the ring position of its head,
+     * so the device's batches can be walked without a free list */
+    id = vq->vq.vdev->in_order ? head : (u16)vq->free_head;
 
     BUG_ON(descs_used == 0);
     BUG_ON(id >= vq->packed.vring.num);
 
+    for (i = (u16)out; i < descs_used; i++) {
+        in_len += sg[i].length;
+    }
+
     if (va_indirect && vq->num_free > 0) {
         desc = va_indirect;
         for (i = 0; i < descs_used; i++) {
@@ -205,18 +218,16 @@ virtqueue_add_buf_packed(struct virtqueue *_vq,   /* the queue */
         vq->packed.vring.desc[head].addr = phys_indirect;
         vq->packed.vring.desc[head].len = descs_used * sizeof(struct vring_packed_desc);
         vq->packed.vring.desc[head].id = id;
-
-        KeMemoryBarrier();
-        vq->packed.vring.desc[head].flags = VRING_DESC_F_INDIRECT | vq->avail_used_flags;
+        *head_flags = VRING_DESC_F_INDIRECT | vq->avail_used_flags;
 
         DPrintf(5, "Added buffer head %i to Q%d\n", head, vq->vq.index);
-        head++;
-        if (head >= vq->packed.vring.num) {
-            head = 0;
+        i = head + 1;
+        if (i >= vq->packed.vring.num) {
+            i = 0;
             vq->packed.avail_wrap_counter ^= 1;
             vq->avail_used_flags ^= 1 << VRING_PACKED_DESC_F_AVAIL | 1 << VRING_PACKED_DESC_F_USED;
         }
-        vq->packed.next_avail_idx = head;
+        vq->packed.next_avail_idx = i;
         /* We're using some buffers from the free list. */
         vq->num_free -= 1;
         vq->num_added += 1;
@@ -227,12 +238,17 @@ virtqueue_add_buf_packed(struct virtqueue *_vq,   /* the queue */
         vq->packed.desc_state[id].num = 1;
         vq->packed.desc_state[id].data = opaque;
         vq->packed.desc_state[id].last = id;
+        vq->packed.desc_state[id].len = in_len;
+        vq->num_bufs++;
 
     } else {
         unsigned int n;
-        u16 curr, prev, head_flags;
+        u16 curr, prev;
         if (vq->num_free < descs_used) {
             DPrintf(6, "Can't add buffer to Q%d\n", vq->vq.index);
+            if (vq->vq.stats) {
+                vq->vq.stats->add_no_space++;
+            }
             return -ENOSPC;
         }
         desc = vq->packed.vring.desc;
@@ -248,7 +264,7 @@ virtqueue_add_buf_packed(struct virtqueue *_vq,   /* the queue */
             desc[i].len = sg[n].length;
             desc[i].id = id;
             if (n == 0) {
-                head_flags = flags;
+                *head_flags = flags;
             } else {
                 desc[i].flags = flags;
             }
@@ -278,20 +294,81 @@ virtqueue_add_buf_packed(struct virtqueue *_vq,   /* the queue */
         vq->packed.desc_state[id].num = (u16)descs_used;
         vq->packed.desc_state[id].data = opaque;
         vq->packed.desc_state[id].last = prev;
+        vq->packed.desc_state[id].len = in_len;
+
+        vq->num_added += descs_used;
+        vq->num_bufs++;
 
+        DPrintf(5, "Added buffer head @%i+%d to Q%d\n", head, descs_used, vq->vq.index);
+    }
+
+    if (vq->vq.stats) {
+        virtqueue_stats_add(&vq->vq, descs_used, !!(*head_flags & VRING_DESC_F_INDIRECT),
+                            vq->packed.vring.num - vq->num_free);
+    }
+    return VQ_ADD_BUFFER_SUCCESS;
+}
+
+static int
+virtqueue_add_buf_packed(struct virtqueue *_vq,   /* the queue */
+                         struct scatterlist sg[], /* sg array of length out + in */
+                         unsigned int out,  /* number of driver->device buffer descriptors in sg */
+                         unsigned int in,   /* number of device->driver buffer descriptors in sg */
+                         void *opaque,      /* later returned from virtqueue_get_buf */
+                         void *va_indirect, /* VA of the indirect page or NULL */
+                         ULONGLONG phys_indirect) /* PA of the indirect page or 0 */
+{
+    struct virtqueue_packed *vq = packedvq(_vq);
+    u16 head = vq->packed.next_avail_idx;
+    u16 head_flags;
+    int ret;
+
+    ret = virtqueue_add_desc_packed(vq, sg, out, in, opaque, va_indirect, phys_indirect,
+                                    &head_flags);
+    if (ret == VQ_ADD_BUFFER_SUCCESS) {
         /*
          * A driver MUST NOT make the first descriptor in the list
          * available before all subsequent descriptors comprising
          * the list are made available.
          */
-        KeMemoryBarrier();
+        virtio_wmb();
         vq->packed.vring.desc[head].flags = head_flags;
-        vq->num_added += descs_used;
-
-        DPrintf(5, "Added buffer head @%i+%d to Q%d\n", head, descs_used, vq->vq.index);
     }
+    return ret;
+}
 
-    return VQ_ADD_BUFFER_SUCCESS;
+/* Adds up to num buffers to a virtqueue. The device processes the ring in order and cannot
+ * look past the first buffer before it is available, so the heads of all subsequent buffers
+ * are written right away and a single barrier precedes the write of the very first head.
+ * Returns the number of buffers added, which is less than num if the ring is full */
+static unsigned int
+virtqueue_add_bufs_packed(struct virtqueue *_vq,       /* the queue */
+                          struct virtqueue_buf bufs[], /* buffers to add */
+                          unsigned int num)            /* number of entries in bufs */
+{
+    struct virtqueue_packed *vq = packedvq(_vq);
+    u16 first = vq->packed.next_avail_idx;
+    u16 first_flags = 0, head, head_flags;
+    unsigned int n;
+
+    for (n = 0; n < num; n++) {
+        head = vq->packed.next_avail_idx;
+        if (virtqueue_add_desc_packed(vq, bufs[n].sg, bufs[n].out_num, bufs[n].in_num,
+                                      bufs[n].opaque, bufs[n].va_indirect, bufs[n].phys_indirect,
+                                      &head_flags) != VQ_ADD_BUFFER_SUCCESS) {
+            break;
+        }
+        if (n == 0) {
+            first_flags = head_flags;
+        } else {
+            vq->packed.vring.desc[head].flags = head_flags;
+        }
+    }
+    if (n) {
+        virtio_wmb();
+        vq->packed.vring.desc[first].flags = first_flags;
+    }
+    return n;
 }
 
 static void detach_buf_packed(struct virtqueue_packed *vq, unsigned int id)
@@ -300,18 +377,43 @@ static void detach_buf_packed(struct virtqueue_packed *vq, unsigned int id)
 
     /* Clear data ptr. */
     state->data = NULL;
+    vq->num_bufs--;
+
+    if (vq->vq.vdev->in_order) {
+        /* Buffer ids follow the ring positions, no free list */
+        vq->num_free += state->num;
+        return;
+    }
 
     vq->packed.desc_state[state->last].next = (u16)vq->free_head;
     vq->free_head = id;
     vq->num_free += state->num;
 }
 
+static inline void advance_last_used_packed(struct virtqueue_packed *vq, u16 num)
+{
+    vq->last_used_idx += num;
+    if (vq->last_used_idx >= vq->packed.vring.num) {
+        vq->last_used_idx -= (u16)vq->packed.vring.num;
+        vq->packed.used_wrap_counter ^= 1;
+    }
+}
+
 static void *virtqueue_detach_unused_buf_packed(struct virtqueue *_vq)
 {
     struct virtqueue_packed *vq = packedvq(_vq);
     unsigned int i;
     void *buf;
 
+    if (_vq->vdev->in_order && vq->num_free < vq->packed.vring.num) {
+        /* Release the oldest buffer so the ring positions stay contiguous */
+        i = vq->last_used_idx;
+        buf = vq->packed.desc_state[i].data;
+        advance_last_used_packed(vq, vq->packed.desc_state[i].num);
+        detach_buf_packed(vq, i);
+        return buf;
+    }
+
     for (i = 0; i < vq->packed.vring.num; i++) {
         if (!vq->packed.desc_state[i].data) {
             continue;
@@ -394,6 +496,9 @@ static bool virtqueue_enable_cb_packed(struct virtqueue *_vq)
     struct virtqueue_packed *vq = packedvq(_vq);
     unsigned last_used_idx = virtqueue_enable_cb_prepare_packed(vq);
 
+    if (vq->batch_last.pending) {
+        return false;
+    }
     return !virtqueue_poll_packed(vq, (u16)last_used_idx);
 }
 
@@ -410,8 +515,14 @@ static bool virtqueue_enable_cb_delayed_packed(struct virtqueue *_vq)
      */
 
     if (event_suppression_enabled) {
-        /* TODO: tune this threshold */
-        bufs = (vq->packed.vring.num - vq->num_free) * 3 / 4;
+        if (_vq->coalesce && vq->num_bufs) {
+            /* the event offset counts descriptors, assume chains of the average length */
+            bufs = virtqueue_coalesce_delay(_vq->coalesce, (u16)vq->num_bufs);
+            bufs = (u16)(bufs * (vq->packed.vring.num - vq->num_free) / vq->num_bufs);
+        } else {
+            /* TODO: tune this threshold */
+            bufs = (vq->packed.vring.num - vq->num_free) * 3 / 4;
+        }
         wrap_counter = vq->packed.used_wrap_counter;
 
         used_idx = vq->last_used_idx + bufs;
@@ -442,7 +553,8 @@ static bool virtqueue_enable_cb_delayed_packed(struct virtqueue *_vq)
      */
     KeMemoryBarrier();
 
-    if (is_used_desc_packed(vq, vq->last_used_idx, vq->packed.used_wrap_counter)) {
+    if (vq->batch_last.pending ||
+        is_used_desc_packed(vq, vq->last_used_idx, vq->packed.used_wrap_counter)) {
         return false;
     }
 
@@ -461,32 +573,74 @@ static void virtqueue_shutdown_packed(struct virtqueue *_vq)
     unsigned int num = vq->packed.vring.num;
     void *pages = vq->packed.vring.desc;
     unsigned int vring_align = _vq->vdev->addr ? PAGE_SIZE : SMP_CACHE_BYTES;
+    struct virtqueue_coalesce *coalesce = _vq->coalesce;
+    struct virtqueue_stats *stats = _vq->stats;
 
     RtlZeroMemory(pages, vring_size_packed(num, vring_align));
     vring_new_virtqueue_packed(_vq->index, num, vring_align, _vq->vdev, pages, _vq->notification_cb,
                                _vq);
+    /* the coalescing state and the counters belong to the driver and survive the reset */
+    _vq->coalesce = coalesce;
+    _vq->stats = stats;
 }
 
 static inline bool more_used_packed(const struct virtqueue_packed *vq)
 {
-    return is_used_desc_packed(vq, vq->last_used_idx, vq->packed.used_wrap_counter);
+    return vq->batch_last.pending ||
+           is_used_desc_packed(vq, vq->last_used_idx, vq->packed.used_wrap_counter);
 }
 
-static void *
-virtqueue_get_buf_packed(struct virtqueue *_vq, /* the queue */
-                         unsigned int *len)     /* number of bytes returned by the device */
+/* VIRTIO_F_IN_ORDER flavor of detach_used_buf_packed. The device may write a single used
+ * descriptor for a batch of buffers, carrying the id of the last one, and skip the
+ * ring forward past the whole batch. Buffer ids equal the ring position of their
+ * heads, so the batch is walked from last_used_idx without touching the ring. */
+static void *detach_used_buf_packed_in_order(struct virtqueue_packed *vq, unsigned int *len)
 {
-    struct virtqueue_packed *vq = packedvq(_vq);
-    u16 last_used, id;
+    u16 id;
     void *ret;
 
-    if (!more_used_packed(vq)) {
-        DPrintf(6, "%s: No more buffers in queue\n", __FUNCTION__);
+    if (!vq->batch_last.pending) {
+        vq->batch_last.id = vq->packed.vring.desc[vq->last_used_idx].id;
+        vq->batch_last.len = vq->packed.vring.desc[vq->last_used_idx].len;
+        vq->batch_last.pending = true;
+
+        if (vq->batch_last.id >= vq->packed.vring.num) {
+            BAD_RING(vq, "id %u out of range\n", vq->batch_last.id);
+            return NULL;
+        }
+    }
+
+    id = vq->last_used_idx;
+    if (!vq->packed.desc_state[id].data) {
+        BAD_RING(vq, "id %u is not a head!\n", id);
         return NULL;
     }
 
-    /* Only get used elements after they have been exposed by host. */
-    KeMemoryBarrier();
+    if (id == vq->batch_last.id) {
+        *len = vq->batch_last.len;
+        vq->batch_last.pending = false;
+    } else {
+        /* The device does not report the length of skipped buffers, assume fully written */
+        *len = vq->packed.desc_state[id].len;
+    }
+
+    ret = vq->packed.desc_state[id].data;
+    advance_last_used_packed(vq, vq->packed.desc_state[id].num);
+    detach_buf_packed(vq, id);
+
+    return ret;
+}
+
+/* Consumes the next used buffer, the caller has checked that one is available
+ * and issued a barrier after reading its flags */
+static void *detach_used_buf_packed(struct virtqueue_packed *vq, unsigned int *len)
+{
+    u16 last_used, id;
+    void *ret;
+
+    if (vq->vq.vdev->in_order) {
+        return detach_used_buf_packed_in_order(vq, len);
+    }
 
     last_used = vq->last_used_idx;
     id = vq->packed.vring.desc[last_used].id;
@@ -505,26 +659,86 @@ virtqueue_get_buf_packed(struct virtqueue *_vq, /* the queue */
     ret = vq->packed.desc_state[id].data;
     detach_buf_packed(vq, id);
 
-    vq->last_used_idx += vq->packed.desc_state[id].num;
-    if (vq->last_used_idx >= vq->packed.vring.num) {
-        vq->last_used_idx -= (u16)vq->packed.vring.num;
-        vq->packed.used_wrap_counter ^= 1;
-    }
+    advance_last_used_packed(vq, vq->packed.desc_state[id].num);
+
+    return ret;
+}
 
+static inline void virtqueue_update_used_event_packed(struct virtqueue_packed *vq)
+{
     /*
      * If we expect an interrupt for the next entry, tell host
      * by writing event index and flush out the write before
-     * the read in the next get_buf call.
+     * the read in the next get_buf call. With in-order batches
+     * the device position is known only once the batch is consumed.
      */
-    if (vq->packed.event_flags_shadow == VRING_PACKED_EVENT_FLAG_DESC) {
+    if (!vq->batch_last.pending && vq->packed.event_flags_shadow == VRING_PACKED_EVENT_FLAG_DESC) {
         vq->packed.vring.driver->off_wrap = vq->last_used_idx | ((u16)vq->packed.used_wrap_counter
                                                                  << VRING_PACKED_EVENT_F_WRAP_CTR);
         KeMemoryBarrier();
     }
+}
+
+static void *
+virtqueue_get_buf_packed(struct virtqueue *_vq, /* the queue */
+                         unsigned int *len)     /* number of bytes returned by the device */
+{
+    struct virtqueue_packed *vq = packedvq(_vq);
+    void *ret;
+
+    if (!more_used_packed(vq)) {
+        DPrintf(6, "%s: No more buffers in queue\n", __FUNCTION__);
+        if (_vq->stats) {
+            virtqueue_stats_used(_vq, 0);
+        }
+        return NULL;
+    }
+
+    /* Only get used elements after they have been exposed by host. */
+    virtio_rmb();
+
+    ret = detach_used_buf_packed(vq, len);
+    virtqueue_update_used_event_packed(vq);
+    if (_vq->stats) {
+        virtqueue_stats_used(_vq, ret != NULL);
+    }
 
     return ret;
 }
 
+/* Gets up to num used buffers. The flags and the wrap counter are checked once per used
+ * descriptor, which with VIRTIO_F_IN_ORDER covers a whole batch of buffers, and the event
+ * offset is published once for the whole call. Returns the number of entries filled in
+ * opaque and len */
+static unsigned int
+virtqueue_get_bufs_packed(struct virtqueue *_vq, /* the queue */
+                          void *opaque[],        /* receives the opaque pointers */
+                          unsigned int len[],    /* receives the numbers of bytes returned */
+                          unsigned int num)      /* number of entries in opaque and len */
+{
+    struct virtqueue_packed *vq = packedvq(_vq);
+    unsigned int n;
+
+    for (n = 0; n < num; n++) {
+        if (!vq->batch_last.pending) {
+            if (!is_used_desc_packed(vq, vq->last_used_idx, vq->packed.used_wrap_counter)) {
+                break;
+            }
+            /* Only get used elements after they have been exposed by host. */
+            virtio_rmb();
+        }
+        opaque[n] = detach_used_buf_packed(vq, &len[n]);
+    }
+    if (n) {
+        virtqueue_update_used_event_packed(vq);
+    }
+    if (_vq->stats) {
+        virtqueue_stats_used(_vq, n);
+    }
+
+    return n;
+}
+
 static BOOLEAN virtqueue_has_buf_packed(struct virtqueue *_vq)
 {
     struct virtqueue_packed *vq = packedvq(_vq);
@@ -572,6 +786,12 @@ static bool virtqueue_kick_prepare_packed(struct virtqueue *_vq)
 
     needs_kick = vring_need_event(event_idx, new, old);
 out:
+    if (_vq->stats) {
+        _vq->stats->kick_checks++;
+        if (needs_kick) {
+            _vq->stats->kicks++;
+        }
+    }
     return needs_kick;
 }
 
@@ -583,6 +803,14 @@ static void virtqueue_kick_always_packed(struct virtqueue *_vq)
     virtqueue_notify(_vq);
 }
 
+/* Returns the next avail descriptor offset together with the avail wrap counter */
+static u16 virtqueue_next_avail_packed(struct virtqueue *_vq)
+{
+    struct virtqueue_packed *vq = packedvq(_vq);
+    return vq->packed.next_avail_idx |
+           ((u16)vq->packed.avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR);
+}
+
 /* Initializes a new virtqueue using already allocated memory */
 struct virtqueue *
 vring_new_virtqueue_packed(unsigned int index,       /* virtqueue index */
@@ -599,6 +827,9 @@ vring_new_virtqueue_packed(unsigned int index,       /* virtqueue index */
     vq->vq.vdev = vdev;
     vq->vq.notification_cb = notify;
     vq->vq.index = index;
+    vq->vq.notification_id = (u16)index;
+    vq->vq.coalesce = NULL;
+    vq->vq.stats = NULL;
 
     vq->vq.avail_va = (u8 *)pages + num * sizeof(struct vring_packed_desc);
     vq->vq.used_va = (u8 *)vq->vq.avail_va + sizeof(struct vring_packed_desc_event);
@@ -610,6 +841,7 @@ vring_new_virtqueue_packed(unsigned int index,       /* virtqueue index */
     vq->packed.vring.device = vq->vq.used_va;
 
     vq->num_free = num;
+    vq->num_bufs = 0;
     vq->free_head = 0;
     vq->num_added = 0;
     vq->packed.avail_wrap_counter = 1;
@@ -619,6 +851,7 @@ vring_new_virtqueue_packed(unsigned int index,       /* virtqueue index */
     vq->packed.next_avail_idx = 0;
     vq->packed.event_flags_shadow = 0;
     vq->packed.desc_state = vq->desc_states;
+    vq->batch_last.pending = false;
 
     RtlZeroMemory(vq->packed.desc_state, num * sizeof(*vq->packed.desc_state));
     for (i = 0; i < num - 1; i++) {
@@ -626,15 +859,18 @@ vring_new_virtqueue_packed(unsigned int index,       /* virtqueue index */
     }
 
     vq->vq.add_buf = virtqueue_add_buf_packed;
+    vq->vq.add_bufs = virtqueue_add_bufs_packed;
     vq->vq.detach_unused_buf = virtqueue_detach_unused_buf_packed;
     vq->vq.disable_cb = virtqueue_disable_cb_packed;
     vq->vq.enable_cb = virtqueue_enable_cb_packed;
     vq->vq.enable_cb_delayed = virtqueue_enable_cb_delayed_packed;
     vq->vq.get_buf = virtqueue_get_buf_packed;
+    vq->vq.get_bufs = virtqueue_get_bufs_packed;
     vq->vq.has_buf = virtqueue_has_buf_packed;
     vq->vq.is_interrupt_enabled = virtqueue_is_interrupt_enabled_packed;
     vq->vq.kick_always = virtqueue_kick_always_packed;
     vq->vq.kick_prepare = virtqueue_kick_prepare_packed;
     vq->vq.shutdown = virtqueue_shutdown_packed;
+    vq->vq.next_avail = virtqueue_next_avail_packed;
     return &vq->vq;
 }
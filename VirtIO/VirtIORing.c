@@ -38,6 +38,9 @@
 
 #define DESC_INDEX(num, i)         ((i) & ((num)-1))
 
+/* The longest chain QEMU (VIRTQUEUE_MAX_SIZE) and vhost (UIO_MAXIOV) accept */
+#define VIRTIO_MAX_INDIRECT_DESCS  1024
+
 /* This marks a buffer as continuing via the next field. */
 #define VIRTQ_DESC_F_NEXT          1
 /* This marks a buffer as write-only (otherwise read-only). */
@@ -174,6 +177,14 @@ static inline int vring_need_event(__u16 event_idx, __u16 new_idx, __u16 old)
     return (__u16)(new_idx - event_idx - 1) < (__u16)(new_idx - old);
 }
 
+/* Per-descriptor state, only maintained for chain heads */
+struct vring_desc_state_split {
+    /* Total length of the device-writable part of the chain */
+    u32 len;
+    /* Number of ring descriptors occupied by the chain */
+    u16 num;
+};
+
 struct virtqueue_split {
     struct virtqueue vq;
     struct vring vring;
@@ -184,7 +195,16 @@ struct virtqueue_split {
     unsigned int num_unused;
     unsigned int num_added_since_kick;
     u16 first_unused;
+    /* With VIRTIO_F_IN_ORDER the used index counts descriptors, not buffers */
     u16 last_used;
+    /* VIRTIO_F_IN_ORDER: the last buffer of the used batch being consumed */
+    struct {
+        bool pending;
+        u16 id;
+        u32 len;
+    } batch_last;
+    /* Points right behind the opaque array */
+    struct vring_desc_state_split *desc_state;
     void *opaque[];
 };
 
@@ -198,17 +218,33 @@ static inline u16 get_unused_desc(struct virtqueue_split *vq)
     u16 idx = vq->first_unused;
     ASSERT(vq->num_unused > 0);
 
-    vq->first_unused = vq->vring.desc[idx].next;
+    if (vq->vq.vdev->in_order) {
+        /* Descriptors are allocated contiguously and used in the same order */
+        vq->first_unused = DESC_INDEX(vq->vring.num, idx + 1);
+    } else {
+        vq->first_unused = vq->vring.desc[idx].next;
+    }
     vq->num_unused--;
     return idx;
 }
 
+/* Returns the head of the oldest descriptor chain not yet returned by the device */
+static inline u16 get_oldest_desc_chain_in_order(struct virtqueue_split *vq)
+{
+    return DESC_INDEX(vq->vring.num, vq->first_unused + vq->num_unused);
+}
+
 /* Marks the descriptor chain starting at index idx as unused */
 static inline void put_unused_desc_chain(struct virtqueue_split *vq, u16 idx)
 {
     u16 start = idx;
 
     vq->opaque[idx] = NULL;
+    if (vq->vq.vdev->in_order) {
+        /* No free list to maintain, the chain length is known from the add */
+        vq->num_unused += vq->desc_state[idx].num;
+        return;
+    }
     while (vq->vring.desc[idx].flags & VIRTQ_DESC_F_NEXT) {
         idx = vq->vring.desc[idx].next;
         vq->num_unused++;
@@ -221,19 +257,15 @@ static inline void put_unused_desc_chain(struct virtqueue_split *vq, u16 idx)
     vq->first_unused = start;
 }
 
-/* Adds a buffer to a virtqueue, returns 0 on success, negative number on error */
-static int
-virtqueue_add_buf_split(struct virtqueue *_vq,   /* the queue */
-                        struct scatterlist sg[], /* sg array of length out + in */
-                        unsigned int out,  /* number of driver->device buffer descriptors in sg */
-                        unsigned int in,   /* number of device->driver buffer descriptors in sg */
-                        void *opaque,      /* later returned from virtqueue_get_buf */
-                        void *va_indirect, /* VA of the indirect page or NULL */
-                        ULONGLONG phys_indirect) /* PA of the indirect page or 0 */
+/* Writes a buffer to the descriptor table and the available ring without making it
+ * visible to the device, returns 0 on success, negative number on error */
+static int virtqueue_add_desc_split(struct virtqueue_split *vq, struct scatterlist sg[],
+                                    unsigned int out, unsigned int in, void *opaque,
+                                    void *va_indirect, ULONGLONG phys_indirect)
 {
-    struct virtqueue_split *vq = splitvq(_vq);
     struct vring *vring = &vq->vring;
     unsigned int i;
+    u32 in_len = 0;
     u16 idx;
 
     if (va_indirect && (out + in) > 1 && vq->num_unused > 0) {
@@ -255,11 +287,15 @@ virtqueue_add_buf_split(struct virtqueue *_vq,   /* the queue */
         vq->vring.desc[idx].len = i * sizeof(struct vring_desc);
 
         vq->opaque[idx] = opaque;
+        vq->desc_state[idx].num = 1;
     } else {
         u16 last_idx;
 
         /* Use out + in regular descriptors */
         if (out + in > vq->num_unused) {
+            if (vq->vq.stats) {
+                vq->vq.stats->add_no_space++;
+            }
             return -ENOSPC;
         }
 
@@ -288,30 +324,124 @@ virtqueue_add_buf_split(struct virtqueue *_vq,   /* the queue */
             vring->desc[last_idx].next = vq->first_unused;
         }
         vring->desc[last_idx].flags &= ~VIRTQ_DESC_F_NEXT;
+        vq->desc_state[idx].num = (u16)(out + in);
     }
 
+    for (i = out; i < out + in; i++) {
+        in_len += sg[i].length;
+    }
+    vq->desc_state[idx].len = in_len;
+
     /* Write the first descriptor into the available ring */
     vring->avail->ring[DESC_INDEX(vring->num, vq->master_vring_avail.idx)] = idx;
-    KeMemoryBarrier();
-    vring->avail->idx = ++vq->master_vring_avail.idx;
+    vq->master_vring_avail.idx++;
     vq->num_added_since_kick++;
 
+    if (vq->vq.stats) {
+        virtqueue_stats_add(&vq->vq, out + in, vq->desc_state[idx].num != out + in,
+                            vring->num - vq->num_unused);
+    }
     return VQ_ADD_BUFFER_SUCCESS;
 }
 
-/* Gets the opaque pointer associated with a returned buffer, or NULL if no buffer is available */
-static void *virtqueue_get_buf_split(struct virtqueue *_vq, /* the queue */
-                                     unsigned int *len) /* number of bytes returned by the device */
+/* Makes all buffers written by virtqueue_add_desc_split visible to the device */
+static inline void virtqueue_publish_avail_split(struct virtqueue_split *vq)
+{
+    KeMemoryBarrier();
+    vq->vring.avail->idx = vq->master_vring_avail.idx;
+}
+
+/* Adds a buffer to a virtqueue, returns 0 on success, negative number on error */
+static int
+virtqueue_add_buf_split(struct virtqueue *_vq,   /* the queue */
+                        struct scatterlist sg[], /* sg array of length out + in */
+                        unsigned int out,  /* number of driver->device buffer descriptors in sg */
+                        unsigned int in,   /* number of device->driver buffer descriptors in sg */
+                        void *opaque,      /* later returned from virtqueue_get_buf */
+                        void *va_indirect, /* VA of the indirect page or NULL */
+                        ULONGLONG phys_indirect) /* PA of the indirect page or 0 */
 {
     struct virtqueue_split *vq = splitvq(_vq);
+    int ret;
+
+    ret = virtqueue_add_desc_split(vq, sg, out, in, opaque, va_indirect, phys_indirect);
+    if (ret == VQ_ADD_BUFFER_SUCCESS) {
+        virtqueue_publish_avail_split(vq);
+    }
+    return ret;
+}
+
+/* Adds up to num buffers to a virtqueue, publishing them with a single avail index update.
+ * Returns the number of buffers added, which is less than num if the ring is full */
+static unsigned int
+virtqueue_add_bufs_split(struct virtqueue *_vq,       /* the queue */
+                         struct virtqueue_buf bufs[], /* buffers to add */
+                         unsigned int num)            /* number of entries in bufs */
+{
+    struct virtqueue_split *vq = splitvq(_vq);
+    unsigned int n;
+
+    for (n = 0; n < num; n++) {
+        if (virtqueue_add_desc_split(vq, bufs[n].sg, bufs[n].out_num, bufs[n].in_num,
+                                     bufs[n].opaque, bufs[n].va_indirect,
+                                     bufs[n].phys_indirect) != VQ_ADD_BUFFER_SUCCESS) {
+            break;
+        }
+    }
+    if (n) {
+        virtqueue_publish_avail_split(vq);
+    }
+    return n;
+}
+
+/* Returns true if a returned buffer can be fetched without re-reading the used index */
+static inline bool virtqueue_more_used_split(struct virtqueue_split *vq, u16 used_idx)
+{
+    return vq->batch_last.pending || (vq->last_used != used_idx);
+}
+
+/* VIRTIO_F_IN_ORDER flavor of detach_used_buf_split. The device may return a batch of buffers
+ * with a single used ring entry, written at the start of the batch and carrying the id of the
+ * last buffer in the batch, and skip the used ring forward by the number of descriptors the
+ * batch occupied. All buffers preceding the last one are implicitly used and are returned one
+ * by one, oldest first. The head of the oldest chain is always at last_used in the ring. */
+static void *detach_used_buf_split_in_order(struct virtqueue_split *vq, unsigned int *len)
+{
+    void *opaque;
+    u16 idx = DESC_INDEX(vq->vring.num, vq->last_used);
+
+    ASSERT(idx == get_oldest_desc_chain_in_order(vq));
+    if (!vq->batch_last.pending) {
+        vq->batch_last.id = (u16)vq->vring.used->ring[idx].id;
+        vq->batch_last.len = vq->vring.used->ring[idx].len;
+        vq->batch_last.pending = true;
+    }
+
+    if (idx == vq->batch_last.id) {
+        *len = vq->batch_last.len;
+        vq->batch_last.pending = false;
+    } else {
+        /* The device does not report the length of skipped buffers, assume fully written */
+        *len = vq->desc_state[idx].len;
+    }
+    opaque = vq->opaque[idx];
+    vq->last_used += vq->desc_state[idx].num;
+    put_unused_desc_chain(vq, idx);
+
+    ASSERT(opaque != NULL);
+    return opaque;
+}
+
+/* Consumes the next returned buffer, the caller has checked that one is available
+ * and issued a barrier after reading the used index */
+static void *detach_used_buf_split(struct virtqueue_split *vq, unsigned int *len)
+{
     void *opaque;
     u16 idx;
 
-    if (vq->last_used == (int)vq->vring.used->idx) {
-        /* No descriptor index in the used ring */
-        return NULL;
+    if (vq->vq.vdev->in_order) {
+        return detach_used_buf_split_in_order(vq, len);
     }
-    KeMemoryBarrier();
 
     idx = DESC_INDEX(vq->vring.num, vq->last_used);
     *len = vq->vring.used->ring[idx].len;
@@ -324,27 +454,88 @@ static void *virtqueue_get_buf_split(struct virtqueue *_vq, /* the queue */
     put_unused_desc_chain(vq, idx);
 
     vq->last_used++;
-    if (_vq->vdev->event_suppression_enabled && virtqueue_is_interrupt_enabled(_vq)) {
+
+    ASSERT(opaque != NULL);
+    return opaque;
+}
+
+/* Tells the device where we expect the next interrupt */
+static inline void virtqueue_update_used_event_split(struct virtqueue_split *vq)
+{
+    if (vq->vq.vdev->event_suppression_enabled && virtqueue_is_interrupt_enabled(&vq->vq)) {
         vring_used_event(&vq->vring) = vq->last_used;
         KeMemoryBarrier();
     }
+}
+
+/* Gets the opaque pointer associated with a returned buffer, or NULL if no buffer is available */
+static void *virtqueue_get_buf_split(struct virtqueue *_vq, /* the queue */
+                                     unsigned int *len) /* number of bytes returned by the device */
+{
+    struct virtqueue_split *vq = splitvq(_vq);
+    void *opaque;
+
+    if (!virtqueue_more_used_split(vq, vq->vring.used->idx)) {
+        /* No descriptor index in the used ring */
+        if (_vq->stats) {
+            virtqueue_stats_used(_vq, 0);
+        }
+        return NULL;
+    }
+    KeMemoryBarrier();
+
+    opaque = detach_used_buf_split(vq, len);
+    virtqueue_update_used_event_split(vq);
+    if (_vq->stats) {
+        virtqueue_stats_used(_vq, 1);
+    }
 
-    ASSERT(opaque != NULL);
     return opaque;
 }
 
+/* Gets the opaque pointers associated with up to num returned buffers, reading the used
+ * index once. Returns the number of entries filled in opaque and len */
+static unsigned int
+virtqueue_get_bufs_split(struct virtqueue *_vq, /* the queue */
+                         void *opaque[],        /* receives the opaque pointers */
+                         unsigned int len[],    /* receives the numbers of bytes returned */
+                         unsigned int num)      /* number of entries in opaque and len */
+{
+    struct virtqueue_split *vq = splitvq(_vq);
+    u16 used_idx = vq->vring.used->idx;
+    unsigned int n;
+
+    if (!virtqueue_more_used_split(vq, used_idx)) {
+        if (_vq->stats) {
+            virtqueue_stats_used(_vq, 0);
+        }
+        return 0;
+    }
+    KeMemoryBarrier();
+
+    for (n = 0; n < num && virtqueue_more_used_split(vq, used_idx); n++) {
+        opaque[n] = detach_used_buf_split(vq, &len[n]);
+    }
+    virtqueue_update_used_event_split(vq);
+    if (_vq->stats) {
+        virtqueue_stats_used(_vq, n);
+    }
+
+    return n;
+}
+
 /* Returns true if at least one returned buffer is available, false otherwise */
 static BOOLEAN virtqueue_has_buf_split(struct virtqueue *_vq)
 {
     struct virtqueue_split *vq = splitvq(_vq);
-    return (vq->last_used != vq->vring.used->idx);
+    return virtqueue_more_used_split(vq, vq->vring.used->idx);
 }
 
 /* Returns true if the device should be notified, false otherwise */
 static bool virtqueue_kick_prepare_split(struct virtqueue *_vq)
 {
     struct virtqueue_split *vq = splitvq(_vq);
-    bool wrap_around;
+    bool wrap_around, needs_kick;
     u16 old, new;
     KeMemoryBarrier();
 
@@ -355,10 +546,18 @@ static bool virtqueue_kick_prepare_split(struct virtqueue *_vq)
     vq->num_added_since_kick = 0;
 
     if (_vq->vdev->event_suppression_enabled) {
-        return wrap_around || (bool)vring_need_event(vring_avail_event(&vq->vring), new, old);
+        needs_kick = wrap_around ||
+                     (bool)vring_need_event(vring_avail_event(&vq->vring), new, old);
     } else {
-        return !(vq->vring.used->flags & VIRTQ_USED_F_NO_NOTIFY);
+        needs_kick = !(vq->vring.used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    }
+    if (_vq->stats) {
+        _vq->stats->kick_checks++;
+        if (needs_kick) {
+            _vq->stats->kicks++;
+        }
     }
+    return needs_kick;
 }
 
 /* Notifies the device even if it's not necessary according to the event suppression logic */
@@ -384,15 +583,16 @@ static bool virtqueue_enable_cb_split(struct virtqueue *_vq)
 
     vring_used_event(&vq->vring) = vq->last_used;
     KeMemoryBarrier();
-    return (vq->last_used == vq->vring.used->idx);
+    return !vq->batch_last.pending && (vq->last_used == vq->vring.used->idx);
 }
 
-/* Enables interrupts on a virtqueue after ~3/4 of the currently pushed buffers have been
- * returned, returns false if this condition currently holds, false otherwise */
+/* Enables interrupts on a virtqueue after ~3/4 of the currently pushed buffers, or as many as
+ * the attached coalescing policy asks for, have been returned. Returns false if this condition
+ * currently holds, true otherwise */
 static bool virtqueue_enable_cb_delayed_split(struct virtqueue *_vq)
 {
     struct virtqueue_split *vq = splitvq(_vq);
-    u16 bufs;
+    u16 outstanding, bufs;
 
     if (!virtqueue_is_interrupt_enabled(_vq)) {
         vq->master_vring_avail.flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
@@ -401,11 +601,22 @@ static bool virtqueue_enable_cb_delayed_split(struct virtqueue *_vq)
         }
     }
 
-    /* Note that 3/4 is an arbitrary threshold */
-    bufs = (u16)(vq->master_vring_avail.idx - vq->last_used) * 3 / 4;
+    if (_vq->vdev->in_order) {
+        /* The used index counts descriptors, so the threshold is in descriptors as well: the
+         * coalescing policy sees buffers only when each of them takes one descriptor */
+        outstanding = (u16)(vq->vring.num - vq->num_unused);
+    } else {
+        outstanding = (u16)(vq->master_vring_avail.idx - vq->last_used);
+    }
+    if (_vq->coalesce) {
+        bufs = virtqueue_coalesce_delay(_vq->coalesce, outstanding);
+    } else {
+        /* Note that 3/4 is an arbitrary threshold */
+        bufs = outstanding * 3 / 4;
+    }
     vring_used_event(&vq->vring) = vq->last_used + bufs;
     KeMemoryBarrier();
-    return ((vq->vring.used->idx - vq->last_used) <= bufs);
+    return !vq->batch_last.pending && ((vq->vring.used->idx - vq->last_used) <= bufs);
 }
 
 /* Disables interrupts on a virtqueue */
@@ -427,6 +638,13 @@ static BOOLEAN virtqueue_is_interrupt_enabled_split(struct virtqueue *_vq)
     return !(vq->master_vring_avail.flags & VIRTQ_AVAIL_F_NO_INTERRUPT);
 }
 
+/* Returns the avail index the device will see after the last publish */
+static u16 virtqueue_next_avail_split(struct virtqueue *_vq)
+{
+    struct virtqueue_split *vq = splitvq(_vq);
+    return vq->master_vring_avail.idx;
+}
+
 /* Re-initializes an already initialized virtqueue */
 static void virtqueue_shutdown_split(struct virtqueue *_vq)
 {
@@ -434,10 +652,15 @@ static void virtqueue_shutdown_split(struct virtqueue *_vq)
     unsigned int num = vq->vring.num;
     void *pages = vq->vring.desc;
     unsigned int vring_align = _vq->vdev->addr ? PAGE_SIZE : SMP_CACHE_BYTES;
+    struct virtqueue_coalesce *coalesce = _vq->coalesce;
+    struct virtqueue_stats *stats = _vq->stats;
 
     RtlZeroMemory(pages, vring_size_split(num, vring_align));
     (void)vring_new_virtqueue_split(_vq->index, vq->vring.num, vring_align, _vq->vdev, pages,
                                     _vq->notification_cb, vq);
+    /* the coalescing state and the counters belong to the driver and survive the reset */
+    _vq->coalesce = coalesce;
+    _vq->stats = stats;
 }
 
 /* Gets the opaque pointer associated with a not-yet-returned buffer, or NULL if no buffer is available
@@ -448,6 +671,17 @@ static void *virtqueue_detach_unused_buf_split(struct virtqueue *_vq)
     u16 idx;
     void *opaque = NULL;
 
+    if (_vq->vdev->in_order) {
+        /* Release the chains in the order they were added to keep the allocation contiguous */
+        if (vq->num_unused < vq->vring.num) {
+            idx = get_oldest_desc_chain_in_order(vq);
+            opaque = vq->opaque[idx];
+            put_unused_desc_chain(vq, idx);
+            vq->vring.avail->idx = --vq->master_vring_avail.idx;
+        }
+        return opaque;
+    }
+
     for (idx = 0; idx < (u16)vq->vring.num; idx++) {
         opaque = vq->opaque[idx];
         if (opaque) {
@@ -469,6 +703,7 @@ unsigned int vring_control_block_size(u16 qsize, bool packed)
     }
     res = sizeof(struct virtqueue_split);
     res += sizeof(void *) * qsize;
+    res += sizeof(struct vring_desc_state_split) * qsize;
     return res;
 }
 
@@ -490,12 +725,14 @@ vring_new_virtqueue_split(unsigned int index,       /* virtqueue index */
         return NULL;
     }
 
-    RtlZeroMemory(vq, sizeof(*vq) + num * sizeof(void *));
+    RtlZeroMemory(vq, vring_control_block_size((u16)num, false));
 
     vring_init(&vq->vring, num, pages, vring_align);
     vq->vq.vdev = vdev;
     vq->vq.notification_cb = notify;
     vq->vq.index = index;
+    vq->vq.notification_id = (u16)index;
+    vq->desc_state = (struct vring_desc_state_split *)&vq->opaque[num];
 
     /* Build a linked list of unused descriptors */
     vq->num_unused = num;
@@ -507,16 +744,19 @@ vring_new_virtqueue_split(unsigned int index,       /* virtqueue index */
     vq->vq.avail_va = vq->vring.avail;
     vq->vq.used_va = vq->vring.used;
     vq->vq.add_buf = virtqueue_add_buf_split;
+    vq->vq.add_bufs = virtqueue_add_bufs_split;
     vq->vq.detach_unused_buf = virtqueue_detach_unused_buf_split;
     vq->vq.disable_cb = virtqueue_disable_cb_split;
     vq->vq.enable_cb = virtqueue_enable_cb_split;
     vq->vq.enable_cb_delayed = virtqueue_enable_cb_delayed_split;
     vq->vq.get_buf = virtqueue_get_buf_split;
+    vq->vq.get_bufs = virtqueue_get_bufs_split;
     vq->vq.has_buf = virtqueue_has_buf_split;
     vq->vq.is_interrupt_enabled = virtqueue_is_interrupt_enabled_split;
     vq->vq.kick_always = virtqueue_kick_always_split;
     vq->vq.kick_prepare = virtqueue_kick_prepare_split;
     vq->vq.shutdown = virtqueue_shutdown_split;
+    vq->vq.next_avail = virtqueue_next_avail_split;
     return &vq->vq;
 }
 
@@ -533,14 +773,38 @@ void vring_transport_features(
             virtio_feature_disable(*features, i);
         }
     }
+
+    /* In-order completion changes the order in which the driver sees its buffers and the
+     * meaning of the used index, so it is negotiated only when the driver asks for it.
+     * Legacy devices have no feature bits above 31 */
+    if (!virtio_is_feature_enabled(*features, VIRTIO_F_VERSION_1)) {
+        virtio_feature_disable(*features, VIRTIO_F_IN_ORDER);
+    }
+    vdev->in_order = virtio_is_feature_enabled(*features, VIRTIO_F_IN_ORDER);
 }
 
 /* Returns the max number of scatter-gather elements that fit in an indirect pages */
-u32 virtio_get_indirect_page_capacity()
+unsigned long virtio_get_indirect_page_capacity()
 {
     return PAGE_SIZE / sizeof(struct vring_desc);
 }
 
+/* Returns the max number of scatter-gather elements of a buffer added through an indirect
+ * table to a queue of queue_size descriptors. The spec forbids chains longer than the queue
+ * size, indirect or not, and QEMU and vhost accept no more than 1024 elements */
+unsigned long virtio_get_indirect_capacity(unsigned int queue_size)
+{
+    return queue_size < VIRTIO_MAX_INDIRECT_DESCS ? queue_size : VIRTIO_MAX_INDIRECT_DESCS;
+}
+
+/* Returns the size of an indirect table for num scatter-gather elements. The table must be
+ * physically contiguous but may span several pages. Split and packed descriptors have the
+ * same size */
+unsigned long virtio_get_indirect_table_size(unsigned long num)
+{
+    return num * sizeof(struct vring_desc);
+}
+
 unsigned long vring_size(unsigned int num, unsigned long align, bool packed)
 {
     if (packed) {
@@ -38,12 +38,78 @@
 static EVT_WDF_OBJECT_CONTEXT_DESTROY OnDmaTransactionDestroy;
 static EVT_WDF_PROGRAM_DMA OnDmaTransactionProgramDma;
 
+/* MemoryBlockTable elements are pointers to memory block contexts. Two elements compare
+ * equal if their virtual address ranges overlap, so looking up a range of length 1 finds
+ * the block containing the address. */
+static RTL_GENERIC_COMPARE_RESULTS NTAPI CompareMemoryBlocks(PRTL_AVL_TABLE Table, PVOID First,
+                                                             PVOID Second)
+{
+    PVIRTIO_WDF_MEMORY_BLOCK_CONTEXT first = *(PVIRTIO_WDF_MEMORY_BLOCK_CONTEXT *)First;
+    PVIRTIO_WDF_MEMORY_BLOCK_CONTEXT second = *(PVIRTIO_WDF_MEMORY_BLOCK_CONTEXT *)Second;
+    ULONG_PTR firstStart = (ULONG_PTR)first->pVirtualAddress;
+    ULONG_PTR secondStart = (ULONG_PTR)second->pVirtualAddress;
+
+    UNREFERENCED_PARAMETER(Table);
+
+    if (firstStart + first->Length <= secondStart) {
+        return GenericLessThan;
+    }
+    if (secondStart + second->Length <= firstStart) {
+        return GenericGreaterThan;
+    }
+    return GenericEqual;
+}
+
+/* Table nodes are embedded in the memory block context, so inserting never allocates
+ * and the node goes away together with the common buffer */
+static PVOID NTAPI AllocateTableNode(PRTL_AVL_TABLE Table, CLONG ByteSize)
+{
+    PVIRTIO_WDF_DRIVER pWdfDriver = Table->TableContext;
+    PVOID node = pWdfDriver->MemoryBlockTableNode;
+
+    if (ByteSize > RTL_FIELD_SIZE(VIRTIO_WDF_MEMORY_BLOCK_CONTEXT, TableNode)) {
+        DPrintf(0, "%s node size %d is not supported\n", __FUNCTION__, ByteSize);
+        return NULL;
+    }
+    pWdfDriver->MemoryBlockTableNode = NULL;
+    return node;
+}
+
+static VOID NTAPI FreeTableNode(PRTL_AVL_TABLE Table, PVOID Buffer)
+{
+    UNREFERENCED_PARAMETER(Table);
+    UNREFERENCED_PARAMETER(Buffer);
+}
+
+void DmaInitializeMemoryBlockTable(PVIRTIO_WDF_DRIVER pWdfDriver)
+{
+    RtlInitializeGenericTableAvl(&pWdfDriver->MemoryBlockTable, CompareMemoryBlocks,
+                                 AllocateTableNode, FreeTableNode, pWdfDriver);
+    pWdfDriver->MemoryBlockTableNode = NULL;
+    pWdfDriver->DmaSpinlock = 0;
+}
+
+/* Called with DmaSpinlock held, shared or exclusive */
+static PVIRTIO_WDF_MEMORY_BLOCK_CONTEXT LookupMemoryBlock(PVIRTIO_WDF_DRIVER pWdfDriver,
+                                                          ULONG_PTR va)
+{
+    VIRTIO_WDF_MEMORY_BLOCK_CONTEXT key;
+    PVIRTIO_WDF_MEMORY_BLOCK_CONTEXT pKey = &key, *ppFound;
+
+    key.pVirtualAddress = (PVOID)va;
+    key.Length = 1;
+    ppFound = RtlLookupElementGenericTableAvl(&pWdfDriver->MemoryBlockTable, &pKey);
+    return ppFound ? *ppFound : NULL;
+}
+
 static void *AllocateCommonBuffer(PVIRTIO_WDF_DRIVER pWdfDriver, size_t size, ULONG groupTag)
 {
     NTSTATUS status;
     WDFCOMMONBUFFER commonBuffer;
     PVIRTIO_WDF_MEMORY_BLOCK_CONTEXT context;
     WDF_OBJECT_ATTRIBUTES attr;
+    KIRQL irql;
+    BOOLEAN bNew = FALSE;
     WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attr, VIRTIO_WDF_MEMORY_BLOCK_CONTEXT);
 
     if (KeGetCurrentIrql() > PASSIVE_LEVEL) {
@@ -54,13 +120,6 @@ static void *AllocateCommonBuffer(PVIRTIO_WDF_DRIVER pWdfDriver, size_t size, UL
     if (!NT_SUCCESS(status)) {
         return NULL;
     }
-    WdfSpinLockAcquire(pWdfDriver->DmaSpinlock);
-    status = WdfCollectionAdd(pWdfDriver->MemoryBlockCollection, commonBuffer);
-    if (!NT_SUCCESS(status)) {
-        WdfObjectDelete(commonBuffer);
-        WdfSpinLockRelease(pWdfDriver->DmaSpinlock);
-        return NULL;
-    }
     context = GetMemoryBlockContext(commonBuffer);
     context->WdfBuffer = commonBuffer;
     context->Length = size;
@@ -68,7 +127,17 @@ static void *AllocateCommonBuffer(PVIRTIO_WDF_DRIVER pWdfDriver, size_t size, UL
     context->pVirtualAddress = WdfCommonBufferGetAlignedVirtualAddress(commonBuffer);
     context->groupTag = groupTag;
     context->bToBeDeleted = FALSE;
-    WdfSpinLockRelease(pWdfDriver->DmaSpinlock);
+
+    irql = ExAcquireSpinLockExclusive(&pWdfDriver->DmaSpinlock);
+    pWdfDriver->MemoryBlockTableNode = &context->TableNode;
+    RtlInsertElementGenericTableAvl(&pWdfDriver->MemoryBlockTable, &context, sizeof(context),
+                                    &bNew);
+    pWdfDriver->MemoryBlockTableNode = NULL;
+    ExReleaseSpinLockExclusive(&pWdfDriver->DmaSpinlock, irql);
+    if (!bNew) {
+        WdfObjectDelete(commonBuffer);
+        return NULL;
+    }
     RtlZeroMemory(context->pVirtualAddress, size);
 
     DPrintf(1, "%s done %p@%I64x(tag %08X), size 0x%x\n", __FUNCTION__, context->pVirtualAddress,
@@ -87,44 +156,45 @@ static BOOLEAN FindCommonBuffer(PVIRTIO_WDF_DRIVER pWdfDriver, void *p, PHYSICAL
 {
     BOOLEAN b = FALSE;
     ULONG_PTR va = (ULONG_PTR)p;
-    ULONG i, n;
+    ULONG n = 0;
     WDFOBJECT obj = NULL;
-    WdfSpinLockAcquire(pWdfDriver->DmaSpinlock);
-    n = WdfCollectionGetCount(pWdfDriver->MemoryBlockCollection);
-    for (i = 0; i < n; ++i) {
-        obj = WdfCollectionGetItem(pWdfDriver->MemoryBlockCollection, i);
-        if (!obj) {
-            break;
-        }
-        PVIRTIO_WDF_MEMORY_BLOCK_CONTEXT context = GetMemoryBlockContext(obj);
-        if (context->bToBeDeleted && !bRemoval) {
-            continue;
-        }
-        ULONG_PTR currentVaStart = (ULONG_PTR)context->pVirtualAddress;
-        if (va >= currentVaStart && va < (currentVaStart + context->Length)) {
-            *ppa = context->PhysicalAddress;
-            *pOffset = va - currentVaStart;
-            b = TRUE;
-            if (bRemoval) {
-                b = *pOffset == 0;
-                if (b) {
-                    context->bToBeDeleted = TRUE;
-                }
+    PVIRTIO_WDF_MEMORY_BLOCK_CONTEXT context;
+    KIRQL irql;
+    BOOLEAN bPassive = KeGetCurrentIrql() == PASSIVE_LEVEL;
+
+    if (bRemoval) {
+        irql = ExAcquireSpinLockExclusive(&pWdfDriver->DmaSpinlock);
+    } else {
+        irql = ExAcquireSpinLockShared(&pWdfDriver->DmaSpinlock);
+    }
+    context = LookupMemoryBlock(pWdfDriver, va);
+    if (context && (!context->bToBeDeleted || bRemoval)) {
+        *ppa = context->PhysicalAddress;
+        *pOffset = va - (ULONG_PTR)context->pVirtualAddress;
+        b = TRUE;
+        if (bRemoval) {
+            b = *pOffset == 0;
+            if (b) {
+                context->bToBeDeleted = TRUE;
             }
-            break;
         }
     }
-    WdfSpinLockRelease(pWdfDriver->DmaSpinlock);
+    if (bRemoval) {
+        if (b && bPassive) {
+            obj = context->WdfBuffer;
+            RtlDeleteElementGenericTableAvl(&pWdfDriver->MemoryBlockTable, &context);
+            n = RtlNumberGenericTableElementsAvl(&pWdfDriver->MemoryBlockTable);
+        }
+        ExReleaseSpinLockExclusive(&pWdfDriver->DmaSpinlock, irql);
+    } else {
+        ExReleaseSpinLockShared(&pWdfDriver->DmaSpinlock, irql);
+    }
     if (!b) {
         DPrintf(0, "%s(%s) FAILED!\n", __FUNCTION__, bRemoval ? "Remove" : "Locate");
     } else if (bRemoval) {
-        if (KeGetCurrentIrql() == PASSIVE_LEVEL) {
-            WdfSpinLockAcquire(pWdfDriver->DmaSpinlock);
-            WdfCollectionRemove(pWdfDriver->MemoryBlockCollection, obj);
-            WdfSpinLockRelease(pWdfDriver->DmaSpinlock);
-
+        if (obj) {
             WdfObjectDelete(obj);
-            DPrintf(1, "%s %p freed (%d common buffers)\n", __FUNCTION__, va, n - 1);
+            DPrintf(1, "%s %p freed (%d common buffers)\n", __FUNCTION__, va, n);
         } else {
             DPrintf(0, "%s %p marked for deletion\n", __FUNCTION__, va);
         }
@@ -158,29 +228,31 @@ void VirtIOWdfDeviceFreeDmaMemory(VirtIODevice *vdev, void *va)
 static BOOLEAN FindCommonBufferByTag(PVIRTIO_WDF_DRIVER pWdfDriver, ULONG tag)
 {
     BOOLEAN b = FALSE;
-    ULONG i, n;
+    ULONG n = 0;
     WDFOBJECT obj = NULL;
-    PVIRTIO_WDF_MEMORY_BLOCK_CONTEXT context = NULL;
-    WdfSpinLockAcquire(pWdfDriver->DmaSpinlock);
-    n = WdfCollectionGetCount(pWdfDriver->MemoryBlockCollection);
-    for (i = 0; i < n; ++i) {
-        obj = WdfCollectionGetItem(pWdfDriver->MemoryBlockCollection, i);
-        if (!obj) {
-            break;
-        }
-        context = GetMemoryBlockContext(obj);
+    PVIRTIO_WDF_MEMORY_BLOCK_CONTEXT context = NULL, *ppContext;
+    PRTL_AVL_TABLE table = &pWdfDriver->MemoryBlockTable;
+    KIRQL irql;
+
+    /* enumeration updates the restart key kept in the table, hence the exclusive lock */
+    irql = ExAcquireSpinLockExclusive(&pWdfDriver->DmaSpinlock);
+    for (ppContext = RtlEnumerateGenericTableAvl(table, TRUE); ppContext != NULL;
+         ppContext = RtlEnumerateGenericTableAvl(table, FALSE)) {
+        context = *ppContext;
         if (context->groupTag == tag) {
             b = TRUE;
             break;
         }
     }
-    WdfSpinLockRelease(pWdfDriver->DmaSpinlock);
+    if (b) {
+        obj = context->WdfBuffer;
+        RtlDeleteElementGenericTableAvl(table, &context);
+        n = RtlNumberGenericTableElementsAvl(table);
+    }
+    ExReleaseSpinLockExclusive(&pWdfDriver->DmaSpinlock, irql);
     if (b) {
         DPrintf(1, "%s %p (tag %08X) freed (%d common buffers)\n", __FUNCTION__,
-                context->pVirtualAddress, tag, n - 1);
-        WdfSpinLockAcquire(pWdfDriver->DmaSpinlock);
-        WdfCollectionRemove(pWdfDriver->MemoryBlockCollection, obj);
-        WdfSpinLockRelease(pWdfDriver->DmaSpinlock);
+                context->pVirtualAddress, tag, n);
         WdfObjectDelete(obj);
     }
     return b;
@@ -204,19 +276,93 @@ void VirtIOWdfDeviceFreeDmaMemoryByTag(VirtIODevice *vdev, ULONG groupTag)
         ;
 }
 
+#ifdef VIRTIO_WDF_DMA_BENCHMARK
+/* Measures the cost of VA to PA translation with a growing number of common buffers.
+ * Only built when VIRTIO_WDF_DMA_BENCHMARK is defined, runs once on initialization. */
+void DmaBenchmarkLookup(PVIRTIO_WDF_DRIVER pWdfDriver)
+{
+    static const ULONG blockCounts[] = { 10, 100, 1000 };
+    const ULONG tag = 'hcnB', lookups = 100000;
+    PVOID *blocks;
+    ULONG i, n, count = 0;
+    LARGE_INTEGER freq, start, stop;
+    ULONG seed = 1;
+
+    blocks = ExAllocatePoolUninitialized(NonPagedPool, sizeof(PVOID) * 1000,
+                                         pWdfDriver->MemoryTag);
+    if (!blocks) {
+        return;
+    }
+    for (n = 0; n < ARRAYSIZE(blockCounts); ++n) {
+        for (; count < blockCounts[n]; ++count) {
+            blocks[count] = AllocateCommonBuffer(pWdfDriver, PAGE_SIZE, tag);
+            if (!blocks[count]) {
+                DPrintf(0, "%s: allocation of block %d failed\n", __FUNCTION__, count);
+                goto done;
+            }
+        }
+        start = KeQueryPerformanceCounter(&freq);
+        for (i = 0; i < lookups; ++i) {
+            PUCHAR va = blocks[RtlRandomEx(&seed) % count];
+            GetPhysicalAddress(pWdfDriver, va + (i % PAGE_SIZE));
+        }
+        stop = KeQueryPerformanceCounter(NULL);
+        DPrintf(0, "%s: %d blocks, %I64d ns per lookup\n", __FUNCTION__, count,
+                (stop.QuadPart - start.QuadPart) * 1000000000 / (freq.QuadPart * lookups));
+    }
+done:
+    VirtIOWdfDeviceFreeDmaMemoryByTag(&pWdfDriver->VIODevice, tag);
+    ExFreePoolWithTag(blocks, pWdfDriver->MemoryTag);
+}
+#endif
+
 static void FreeSlicedBlock(PVIRTIO_DMA_MEMORY_SLICED p)
 {
     size_t offset;
     FindCommonBuffer(p->drv, p->va, &p->pa, &offset, TRUE);
+    ExFreePoolWithTag(p->pool, p->drv->MemoryTag);
     ExFreePoolWithTag(p, p->drv->MemoryTag);
 }
 
+static PSLIST_ENTRY PopFreeSlice(PVIRTIO_DMA_SLICE_POOL pool)
+{
+    ULONG cpu = KeGetCurrentProcessorNumberEx(NULL) % pool->nMagazines;
+    PSLIST_ENTRY entry = InterlockedPopEntrySList(&pool->Magazines[cpu].Free);
+    ULONG i;
+
+    if (!entry) {
+        entry = InterlockedPopEntrySList(&pool->Shared.Free);
+    }
+    /* the remaining free slices, if any, are cached by other processors */
+    for (i = 1; !entry && i < pool->nMagazines; ++i) {
+        entry = InterlockedPopEntrySList(&pool->Magazines[(cpu + i) % pool->nMagazines].Free);
+    }
+    return entry;
+}
+
+static void PushFreeSlice(PVIRTIO_DMA_SLICE_POOL pool, PSLIST_ENTRY entry)
+{
+    ULONG cpu = KeGetCurrentProcessorNumberEx(NULL) % pool->nMagazines;
+    PSLIST_HEADER head = &pool->Magazines[cpu].Free;
+
+    if (QueryDepthSList(head) >= pool->MagazineDepth) {
+        head = &pool->Shared.Free;
+    }
+    InterlockedPushEntrySList(head, entry);
+}
+
 static PVOID AllocateSlice(PVIRTIO_DMA_MEMORY_SLICED p, PHYSICAL_ADDRESS *ppa)
 {
-    ULONG offset, index = RtlFindClearBitsAndSet(&p->bitmap, 1, 0);
-    if (index >= p->bitmap.SizeOfBitMap) {
+    PVIRTIO_DMA_SLICE_POOL pool = p->pool;
+    PSLIST_ENTRY entry = PopFreeSlice(pool);
+    ULONG offset, index;
+    if (!entry) {
         return NULL;
     }
+    index = (ULONG)(entry - pool->pEntries);
+    if (InterlockedBitTestAndSet(pool->pInUse + index / 32, index % 32)) {
+        DPrintf(0, "%s: bit %d is already set\n", __FUNCTION__, index);
+    }
     offset = p->slice * index;
     ppa->QuadPart = p->pa.QuadPart + offset;
     return (PUCHAR)p->va + offset;
@@ -224,9 +370,9 @@ static PVOID AllocateSlice(PVIRTIO_DMA_MEMORY_SLICED p, PHYSICAL_ADDRESS *ppa)
 
 static void FreeSlice(PVIRTIO_DMA_MEMORY_SLICED p, PVOID va)
 {
-    PHYSICAL_ADDRESS pa;
-    size_t offset;
-    if (!FindCommonBuffer(p->drv, va, &pa, &offset, FALSE)) {
+    PVIRTIO_DMA_SLICE_POOL pool = p->pool;
+    ULONG_PTR offset = (ULONG_PTR)va - (ULONG_PTR)p->va;
+    if ((ULONG_PTR)va < (ULONG_PTR)p->va || offset >= (ULONG_PTR)p->slice * p->nSlices) {
         DPrintf(0, "%s: block with va %p not found\n", __FUNCTION__, va);
         return;
     }
@@ -235,35 +381,68 @@ static void FreeSlice(PVIRTIO_DMA_MEMORY_SLICED p, PVOID va)
         return;
     }
     ULONG index = (ULONG)(offset / p->slice);
-    if (!RtlTestBit(&p->bitmap, index)) {
+    if (!InterlockedBitTestAndReset(pool->pInUse + index / 32, index % 32)) {
         DPrintf(0, "%s: bit %d is NOT set\n", __FUNCTION__, index);
         return;
     }
-    RtlClearBit(&p->bitmap, index);
+    PushFreeSlice(pool, &pool->pEntries[index]);
+}
+
+static PVIRTIO_DMA_SLICE_POOL AllocateSlicePool(PVIRTIO_WDF_DRIVER pWdfDriver, ULONG nSlices)
+{
+    PVIRTIO_DMA_SLICE_POOL pool;
+    ULONG i, nMagazines = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    size_t entriesOffset = FIELD_OFFSET(VIRTIO_DMA_SLICE_POOL, Magazines) +
+                           nMagazines * sizeof(VIRTIO_DMA_SLICE_MAGAZINE);
+    size_t inUseOffset = entriesOffset + nSlices * sizeof(SLIST_ENTRY);
+    size_t allocSize = inUseOffset + (nSlices + 31) / 32 * sizeof(LONG);
+
+    pool = ExAllocatePoolUninitialized(NonPagedPoolCacheAligned, allocSize, pWdfDriver->MemoryTag);
+    if (!pool) {
+        return NULL;
+    }
+    RtlZeroMemory(pool, allocSize);
+    pool->pEntries = (PSLIST_ENTRY)((PUCHAR)pool + entriesOffset);
+    pool->pInUse = (volatile LONG *)((PUCHAR)pool + inUseOffset);
+    pool->nMagazines = nMagazines;
+    /* let the magazines cache at most a half of the slices */
+    pool->MagazineDepth = (USHORT)min(VIRTIO_DMA_SLICE_MAGAZINE_DEPTH, nSlices / (2 * nMagazines));
+    InitializeSListHead(&pool->Shared.Free);
+    for (i = 0; i < nMagazines; ++i) {
+        InitializeSListHead(&pool->Magazines[i].Free);
+    }
+    /* push in reverse order so the slices are initially handed out from the start */
+    for (i = nSlices; i > 0; --i) {
+        InterlockedPushEntrySList(&pool->Shared.Free, &pool->pEntries[i - 1]);
+    }
+    return pool;
 }
 
 PVIRTIO_DMA_MEMORY_SLICED VirtIOWdfDeviceAllocDmaMemorySliced(VirtIODevice *vdev, size_t blockSize,
                                                               ULONG sliceSize)
 {
     PVIRTIO_WDF_DRIVER pWdfDriver = vdev->DeviceContext;
-    size_t allocSize =
-        sizeof(VIRTIO_DMA_MEMORY_SLICED) + (blockSize / sliceSize) / 8 + sizeof(ULONG);
     PVIRTIO_DMA_MEMORY_SLICED p =
-        ExAllocatePoolUninitialized(NonPagedPool, allocSize, pWdfDriver->MemoryTag);
+        ExAllocatePoolUninitialized(NonPagedPool, sizeof(*p), pWdfDriver->MemoryTag);
     if (!p) {
         return NULL;
     }
-    __analysis_assume(allocSize > sizeof(*p));
     RtlZeroMemory(p, sizeof(*p));
+    p->slice = sliceSize;
+    p->nSlices = (ULONG)blockSize / sliceSize;
+    p->pool = AllocateSlicePool(pWdfDriver, p->nSlices);
+    if (!p->pool) {
+        ExFreePoolWithTag(p, pWdfDriver->MemoryTag);
+        return NULL;
+    }
     p->va = AllocateCommonBuffer(pWdfDriver, blockSize, 0);
     p->pa = GetPhysicalAddress(pWdfDriver, p->va);
     if (!p->va || !p->pa.QuadPart) {
+        ExFreePoolWithTag(p->pool, pWdfDriver->MemoryTag);
         ExFreePoolWithTag(p, pWdfDriver->MemoryTag);
         return NULL;
     }
-    p->slice = sliceSize;
     p->drv = pWdfDriver;
-    RtlInitializeBitMap(&p->bitmap, p->bitmap_buffer, (ULONG)blockSize / sliceSize);
     p->return_slice = FreeSlice;
     p->get_slice = AllocateSlice;
     p->destroy = FreeSlicedBlock;
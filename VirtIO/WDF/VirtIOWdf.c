@@ -43,7 +43,6 @@ NTSTATUS VirtIOWdfInitialize(PVIRTIO_WDF_DRIVER pWdfDriver, WDFDEVICE Device,
 {
     NTSTATUS status = STATUS_SUCCESS;
     WDF_DMA_ENABLER_CONFIG dmaEnablerConfig;
-    WDF_OBJECT_ATTRIBUTES attributes;
 
     RtlZeroMemory(pWdfDriver, sizeof(*pWdfDriver));
     pWdfDriver->MemoryTag = MemoryTag;
@@ -74,15 +73,9 @@ NTSTATUS VirtIOWdfInitialize(PVIRTIO_WDF_DRIVER pWdfDriver, WDFDEVICE Device,
     status = WdfDmaEnablerCreate(Device, &dmaEnablerConfig, WDF_NO_OBJECT_ATTRIBUTES,
                                  &pWdfDriver->DmaEnabler);
     if (NT_SUCCESS(status)) {
-        WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
         DPrintf(0, "%s DMA enabler ready (alignment %d), pWdfDriver %p\n", __FUNCTION__,
                 WdfDeviceGetAlignmentRequirement(Device) + 1, pWdfDriver);
-        attributes.ParentObject = Device;
-        status = WdfCollectionCreate(&attributes, &pWdfDriver->MemoryBlockCollection);
-    }
-
-    if (NT_SUCCESS(status)) {
-        status = WdfSpinLockCreate(&attributes, &pWdfDriver->DmaSpinlock);
+        DmaInitializeMemoryBlockTable(pWdfDriver);
     }
 
     if (!NT_SUCCESS(status)) {
@@ -97,6 +90,12 @@ NTSTATUS VirtIOWdfInitialize(PVIRTIO_WDF_DRIVER pWdfDriver, WDFDEVICE Device,
         status = VirtIOWdfDeviceCheckIOMMUActive(pWdfDriver, Device);
     }
 
+#ifdef VIRTIO_WDF_DMA_BENCHMARK
+    if (NT_SUCCESS(status)) {
+        DmaBenchmarkLookup(pWdfDriver);
+    }
+#endif
+
     if (!NT_SUCCESS(status)) {
         PCIFreeBars(pWdfDriver);
     }
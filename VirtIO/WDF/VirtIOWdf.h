@@ -59,8 +59,10 @@ typedef struct virtio_wdf_driver {
     PVIRTIO_WDF_QUEUE_PARAM pQueueParams;
 
     WDFDMAENABLER DmaEnabler;
-    WDFCOLLECTION MemoryBlockCollection;
-    WDFSPINLOCK DmaSpinlock;
+    /* common buffers indexed by their virtual address range */
+    RTL_AVL_TABLE MemoryBlockTable;
+    PVOID MemoryBlockTableNode;
+    EX_SPIN_LOCK DmaSpinlock;
 
     BOOLEAN IsIoMmuActive;
 
@@ -193,6 +195,8 @@ void VirtIOWdfDeviceDmaTxComplete(VirtIODevice *vdev, WDFDMATRANSACTION transact
 /* <= DISPATCH transaction = VIRTIO_DMA_TRANSACTION_PARAMS.transaction */
 void VirtIOWdfDeviceDmaRxComplete(VirtIODevice *vdev, WDFDMATRANSACTION transaction, ULONG length);
 
+/* get_slice and return_slice are lock-free and may be called concurrently
+ * at IRQL <= DISPATCH_LEVEL without any external synchronization */
 typedef struct virtio_dma_memory_sliced {
     PVOID (*get_slice)(struct virtio_dma_memory_sliced *, PHYSICAL_ADDRESS *ppa);
     void (*return_slice)(struct virtio_dma_memory_sliced *, PVOID va);
@@ -201,9 +205,9 @@ typedef struct virtio_dma_memory_sliced {
     PHYSICAL_ADDRESS pa;
     PVIRTIO_WDF_DRIVER drv;
     PVOID va;
-    RTL_BITMAP bitmap;
     ULONG slice;
-    ULONG bitmap_buffer[1];
+    ULONG nSlices;
+    struct virtio_dma_slice_pool *pool;
 } VIRTIO_DMA_MEMORY_SLICED, *PVIRTIO_DMA_MEMORY_SLICED;
 
 PVIRTIO_DMA_MEMORY_SLICED VirtIOWdfDeviceAllocDmaMemorySliced(VirtIODevice *vdev, size_t blockSize,
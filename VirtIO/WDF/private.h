@@ -75,10 +75,43 @@ typedef struct virtio_wdf_memory_block_context {
     size_t Length;
     ULONG groupTag;
     BOOLEAN bToBeDeleted;
+    /* storage of the MemoryBlockTable node pointing to this context */
+    struct {
+        RTL_BALANCED_LINKS Links;
+        LONGLONG Element;
+    } TableNode;
 } VIRTIO_WDF_MEMORY_BLOCK_CONTEXT, *PVIRTIO_WDF_MEMORY_BLOCK_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(VIRTIO_WDF_MEMORY_BLOCK_CONTEXT, GetMemoryBlockContext)
 
+/* Free slices of a VIRTIO_DMA_MEMORY_SLICED block are kept on interlocked stacks of
+ * SLIST_ENTRY items, one item per slice. Each processor returns slices to its own
+ * magazine until it holds MagazineDepth of them and the overflow goes to the shared
+ * stack. Allocation tries the local magazine, then the shared stack, then steals from
+ * the magazines of other processors.
+ */
+typedef struct DECLSPEC_CACHEALIGN virtio_dma_slice_magazine {
+    SLIST_HEADER Free;
+} VIRTIO_DMA_SLICE_MAGAZINE, *PVIRTIO_DMA_SLICE_MAGAZINE;
+
+#define VIRTIO_DMA_SLICE_MAGAZINE_DEPTH 32
+
+typedef struct virtio_dma_slice_pool {
+    VIRTIO_DMA_SLICE_MAGAZINE Shared;
+    PSLIST_ENTRY pEntries;
+    /* bit per slice, set while the slice is handed out */
+    volatile LONG *pInUse;
+    ULONG nMagazines;
+    USHORT MagazineDepth;
+    VIRTIO_DMA_SLICE_MAGAZINE Magazines[ANYSIZE_ARRAY];
+} VIRTIO_DMA_SLICE_POOL, *PVIRTIO_DMA_SLICE_POOL;
+
+void DmaInitializeMemoryBlockTable(PVIRTIO_WDF_DRIVER pWdfDriver);
+
+#ifdef VIRTIO_WDF_DMA_BENCHMARK
+void DmaBenchmarkLookup(PVIRTIO_WDF_DRIVER pWdfDriver);
+#endif
+
 typedef struct virtio_wdf_dma_transaction_context {
     VIRTIO_DMA_TRANSACTION_PARAMS parameters;
     VirtIOWdfDmaTransactionCallback callback;
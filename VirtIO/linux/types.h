@@ -15,5 +15,6 @@
 #define __u32  unsigned long
 #define __le32 unsigned long
 #define __u64  ULONGLONG
+#define __le64 ULONGLONG
 
 #endif /* _LINUX_TYPES_H */
@@ -32,3 +32,18 @@
 #endif
 
 #define SMP_CACHE_BYTES 64
+
+// Order reads of ring memory written by the device (a descriptor's flags before its id and
+// length) and writes of ring memory read by the device (a chain before the flags of its head).
+// x86 and x64 do not reorder loads with loads nor stores with stores, so only the compiler
+// has to be stopped there.
+#if defined(_M_ARM64)
+#define virtio_rmb() __dmb(_ARM64_BARRIER_ISHLD)
+#define virtio_wmb() __dmb(_ARM64_BARRIER_ISHST)
+#elif defined(_M_AMD64) || defined(_M_IX86)
+#define virtio_rmb() KeMemoryBarrierWithoutFence()
+#define virtio_wmb() KeMemoryBarrierWithoutFence()
+#else
+#define virtio_rmb() KeMemoryBarrier()
+#define virtio_wmb() KeMemoryBarrier()
+#endif
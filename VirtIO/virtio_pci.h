@@ -153,6 +153,15 @@ struct virtio_pci_common_cfg {
     __le32 queue_used_hi;     /* read-write */
 };
 
+/* Fields in VIRTIO_PCI_CAP_COMMON_CFG added after virtio 1.0, devices are not required to
+ * implement them so the length of the common capability must be checked before access */
+struct virtio_pci_modern_common_cfg {
+    struct virtio_pci_common_cfg cfg;
+
+    __le16 queue_notify_data; /* read-write */
+    __le16 queue_reset;       /* read-write */
+};
+
 #define MAX_QUEUES_PER_DEVICE_DEFAULT 8
 
 typedef struct virtio_queue_info {
@@ -243,6 +252,16 @@ struct virtio_device {
     // true if the VIRTIO_F_RING_PACKED feature flag has been negotiated
     bool packed_ring;
 
+    // true if the VIRTIO_F_IN_ORDER feature flag has been negotiated, drivers opt in
+    // by passing it to virtio_set_features
+    bool in_order;
+
+    // true if the VIRTIO_F_NOTIFICATION_DATA feature flag has been negotiated
+    bool notification_data;
+
+    // true if the VIRTIO_F_NOTIF_CONFIG_DATA feature flag has been negotiated
+    bool notif_config_data;
+
     // internal device operations, implemented separately for legacy and modern
     const struct virtio_device_ops *device;
 
@@ -262,6 +281,7 @@ struct virtio_device {
     int notify_map_cap;
     u32 notify_offset_multiplier;
 
+    size_t common_len;
     size_t config_len;
     size_t notify_len;
 
@@ -351,6 +371,9 @@ void virtio_delete_queues(VirtIODevice *vdev);
 
 u32 virtio_get_queue_size(struct virtqueue *vq);
 unsigned long virtio_get_indirect_page_capacity();
+unsigned long virtio_get_indirect_capacity(unsigned int queue_size);
+unsigned long virtqueue_get_indirect_capacity(struct virtqueue *vq);
+unsigned long virtio_get_indirect_table_size(unsigned long num);
 
 ULONG __inline virtio_get_queue_descriptor_size()
 {
@@ -46,7 +46,10 @@
 
 #define VQ_ADD_BUFFER_SUCCESS       0
 
+struct virtqueue_coalesce;
+
 void vring_transport_features(VirtIODevice *vdev, u64 *features);
 unsigned long vring_size(unsigned int num, unsigned long align, bool packed);
+u16 virtqueue_coalesce_delay(struct virtqueue_coalesce *coalesce, u16 outstanding);
 
 #endif /* _UAPI_LINUX_VIRTIO_RING_H */
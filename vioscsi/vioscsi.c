@@ -1431,7 +1431,9 @@ VOID FORCEINLINE DispatchQueue(IN PVOID DeviceExtension, IN ULONG MessageId)
 VOID ProcessQueue(IN PVOID DeviceExtension, IN ULONG MessageID, IN BOOLEAN isr)
 {
     ULONG_PTR srbId;
-    unsigned int len;
+    void *completed[VQ_COMPLETION_BATCH];
+    unsigned int lens[VQ_COMPLETION_BATCH];
+    unsigned int count, i;
     PADAPTER_EXTENSION adaptExt = (PADAPTER_EXTENSION)DeviceExtension;
     ULONG index = MESSAGE_TO_QUEUE(MessageID);
     STOR_LOCK_HANDLE queueLock = {0};
@@ -1453,31 +1455,36 @@ VOID ProcessQueue(IN PVOID DeviceExtension, IN ULONG MessageID, IN BOOLEAN isr)
     do
     {
         virtqueue_disable_cb(vq);
-        while ((srbId = (ULONG_PTR)virtqueue_get_buf(vq, &len)) != 0)
+        while ((count = virtqueue_get_bufs(vq, completed, lens, ARRAYSIZE(completed))) != 0)
         {
-            PLIST_ENTRY le = NULL;
-            BOOLEAN bFound = FALSE;
-
-            for (le = element->srb_list.Flink; le != &element->srb_list && !bFound; le = le->Flink)
+            for (i = 0; i < count; i++)
             {
-                srbExt = CONTAINING_RECORD(le, SRB_EXTENSION, list_entry);
-                if (srbExt->id == srbId)
+                PLIST_ENTRY le = NULL;
+                BOOLEAN bFound = FALSE;
+
+                srbId = (ULONG_PTR)completed[i];
+
+                for (le = element->srb_list.Flink; le != &element->srb_list && !bFound; le = le->Flink)
                 {
-                    RemoveEntryList(le);
-                    bFound = TRUE;
-                    element->srb_cnt--;
-                    break;
+                    srbExt = CONTAINING_RECORD(le, SRB_EXTENSION, list_entry);
+                    if (srbExt->id == srbId)
+                    {
+                        RemoveEntryList(le);
+                        bFound = TRUE;
+                        element->srb_cnt--;
+                        break;
+                    }
                 }
-            }
 
-            if (!bFound)
-            {
-                RhelDbgPrint(TRACE_LEVEL_WARNING, " No SRB found for ID 0x%p\n", (void *)srbId);
-            }
+                if (!bFound)
+                {
+                    RhelDbgPrint(TRACE_LEVEL_WARNING, " No SRB found for ID 0x%p\n", (void *)srbId);
+                }
 
-            if (bFound)
-            {
-                HandleResponse(DeviceExtension, &srbExt->cmd);
+                if (bFound)
+                {
+                    HandleResponse(DeviceExtension, &srbExt->cmd);
+                }
             }
         }
     } while (!virtqueue_enable_cb(vq));
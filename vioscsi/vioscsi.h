@@ -57,6 +57,7 @@ typedef struct VirtIOBufferDescriptor VIO_SG, *PVIO_SG;
 #define SECTOR_SIZE                          512
 #define IO_PORT_LENGTH                       0x40
 #define MAX_CPU                              256
+#define VQ_COMPLETION_BATCH                  16
 
 #define REGISTRY_MAX_PH_BREAKS               "PhysicalBreaks"
 #define REGISTRY_ACTION_ON_RESET             "VioscsiActionOnReset"
@@ -2299,7 +2299,9 @@ UCHAR DeviceToSrbStatus(UCHAR status)
 
 VOID VioStorCompleteRequest(IN PVOID DeviceExtension, IN ULONG MessageID, IN BOOLEAN bIsr)
 {
-    unsigned int len = 0;
+    void *completed[VQ_COMPLETION_BATCH];
+    unsigned int lens[VQ_COMPLETION_BATCH];
+    unsigned int count, i;
     PADAPTER_EXTENSION adaptExt = (PADAPTER_EXTENSION)DeviceExtension;
     ULONG QueueNumber = MessageID - adaptExt->msix_has_config_vector;
     STOR_LOCK_HANDLE queueLock = {0};
@@ -2338,101 +2340,110 @@ VOID VioStorCompleteRequest(IN PVOID DeviceExtension, IN ULONG MessageID, IN BOO
     do
     {
         virtqueue_disable_cb(vq);
-        while ((srbId = (ULONG_PTR)virtqueue_get_buf(vq, &len)) != 0)
+        while ((count = virtqueue_get_bufs(vq, completed, lens, ARRAYSIZE(completed))) != 0)
         {
-            PLIST_ENTRY le = NULL;
-            BOOLEAN bFound = FALSE;
+            for (i = 0; i < count; i++)
+            {
+                PLIST_ENTRY le = NULL;
+                BOOLEAN bFound = FALSE;
+
+                srbId = (ULONG_PTR)completed[i];
 #ifdef DBG
-            InterlockedDecrement((LONG volatile *)&adaptExt->inqueue_cnt);
+                InterlockedDecrement((LONG volatile *)&adaptExt->inqueue_cnt);
 #endif
-            for (le = element->srb_list.Flink; le != &element->srb_list && !bFound; le = le->Flink)
-            {
-                pblk_req req = CONTAINING_RECORD(le, blk_req, list_entry);
+                for (le = element->srb_list.Flink; le != &element->srb_list && !bFound; le = le->Flink)
+                {
+                    pblk_req req = CONTAINING_RECORD(le, blk_req, list_entry);
 
-                Srb = (PSRB_TYPE)req->req;
-                srbExt = SRB_EXTENSION(Srb);
+                    Srb = (PSRB_TYPE)req->req;
+                    srbExt = SRB_EXTENSION(Srb);
 
-                // Only SRBs with existing (i.e. non-NULL) extension
-                // are inserted into our queues, thus, we may help
-                // the Code Analysis and provide it with this information
-                // in order to avoid false-positive warnings.
-                _Analysis_assume_(srbExt != NULL);
-                if (srbExt->id == srbId)
-                {
-                    RemoveEntryList(le);
-                    bFound = TRUE;
-                    element->srb_cnt--;
-                    break;
+                    // Only SRBs with existing (i.e. non-NULL) extension
+                    // are inserted into our queues, thus, we may help
+                    // the Code Analysis and provide it with this information
+                    // in order to avoid false-positive warnings.
+                    _Analysis_assume_(srbExt != NULL);
+                    if (srbExt->id == srbId)
+                    {
+                        RemoveEntryList(le);
+                        bFound = TRUE;
+                        element->srb_cnt--;
+                        break;
+                    }
                 }
-            }
 
-            if (!bFound)
-            {
-                RhelDbgPrint(TRACE_LEVEL_WARNING, " No Srb to complete for ID 0x%p\n", (void *)srbId);
-            }
-
-            if (bFound && srbExt->vbr.out_hdr.type == VIRTIO_BLK_T_GET_ID)
-            {
-                adaptExt->sn_ok = TRUE;
-                if (Srb)
+                if (!bFound)
                 {
-                    PCDB cdb = SRB_CDB(Srb);
+                    RhelDbgPrint(TRACE_LEVEL_WARNING, " No Srb to complete for ID 0x%p\n", (void *)srbId);
+                }
 
-                    if (!cdb)
+                if (bFound && srbExt->vbr.out_hdr.type == VIRTIO_BLK_T_GET_ID)
+                {
+                    adaptExt->sn_ok = TRUE;
+                    if (Srb)
                     {
-                        continue;
-                    }
+                        PCDB cdb = SRB_CDB(Srb);
 
-                    if ((cdb->CDB6INQUIRY3.PageCode == VPD_SERIAL_NUMBER) &&
-                        (cdb->CDB6INQUIRY3.EnableVitalProductData == 1))
-                    {
-                        PVPD_SERIAL_NUMBER_PAGE SerialPage;
-                        ULONG dataLen = SRB_DATA_TRANSFER_LENGTH(Srb);
-                        UCHAR len = strlen(adaptExt->sn);
-
-                        SerialPage = (PVPD_SERIAL_NUMBER_PAGE)SRB_DATA_BUFFER(Srb);
-                        RhelDbgPrint(TRACE_LEVEL_INFORMATION, "dataLen = %d\n", dataLen);
-                        RtlZeroMemory(SerialPage, dataLen);
-                        SerialPage->DeviceType = DIRECT_ACCESS_DEVICE;
-                        SerialPage->DeviceTypeQualifier = DEVICE_CONNECTED;
-                        SerialPage->PageCode = VPD_SERIAL_NUMBER;
-
-                        SerialPage->PageLength = min(BLOCK_SERIAL_STRLEN, len);
-                        StorPortCopyMemory(&SerialPage->SerialNumber, &adaptExt->sn, SerialPage->PageLength);
-                        RhelDbgPrint(TRACE_LEVEL_INFORMATION, "PageLength = %d (%d)\n", SerialPage->PageLength, len);
-
-                        SRB_SET_DATA_TRANSFER_LENGTH(Srb, (sizeof(VPD_SERIAL_NUMBER_PAGE) + SerialPage->PageLength));
-                        CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, SRB_STATUS_SUCCESS);
-                    }
-                    else if ((cdb->CDB6INQUIRY3.PageCode == VPD_DEVICE_IDENTIFIERS) &&
-                             (cdb->CDB6INQUIRY3.EnableVitalProductData == 1))
-                    {
-                        ReportDeviceIdentifier(DeviceExtension, Srb);
-                        CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, SRB_STATUS_SUCCESS);
+                        if (!cdb)
+                        {
+                            continue;
+                        }
+
+                        if ((cdb->CDB6INQUIRY3.PageCode == VPD_SERIAL_NUMBER) &&
+                            (cdb->CDB6INQUIRY3.EnableVitalProductData == 1))
+                        {
+                            PVPD_SERIAL_NUMBER_PAGE SerialPage;
+                            ULONG dataLen = SRB_DATA_TRANSFER_LENGTH(Srb);
+                            UCHAR len = strlen(adaptExt->sn);
+
+                            SerialPage = (PVPD_SERIAL_NUMBER_PAGE)SRB_DATA_BUFFER(Srb);
+                            RhelDbgPrint(TRACE_LEVEL_INFORMATION, "dataLen = %d\n", dataLen);
+                            RtlZeroMemory(SerialPage, dataLen);
+                            SerialPage->DeviceType = DIRECT_ACCESS_DEVICE;
+                            SerialPage->DeviceTypeQualifier = DEVICE_CONNECTED;
+                            SerialPage->PageCode = VPD_SERIAL_NUMBER;
+
+                            SerialPage->PageLength = min(BLOCK_SERIAL_STRLEN, len);
+                            StorPortCopyMemory(&SerialPage->SerialNumber, &adaptExt->sn, SerialPage->PageLength);
+                            RhelDbgPrint(TRACE_LEVEL_INFORMATION,
+                                         "PageLength = %d (%d)\n",
+                                         SerialPage->PageLength,
+                                         len);
+
+                            SRB_SET_DATA_TRANSFER_LENGTH(Srb,
+                                                         (sizeof(VPD_SERIAL_NUMBER_PAGE) + SerialPage->PageLength));
+                            CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, SRB_STATUS_SUCCESS);
+                        }
+                        else if ((cdb->CDB6INQUIRY3.PageCode == VPD_DEVICE_IDENTIFIERS) &&
+                                 (cdb->CDB6INQUIRY3.EnableVitalProductData == 1))
+                        {
+                            ReportDeviceIdentifier(DeviceExtension, Srb);
+                            CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, SRB_STATUS_SUCCESS);
+                        }
                     }
+                    continue;
                 }
-                continue;
-            }
-            if (bFound && Srb)
-            {
-                srbStatus = DeviceToSrbStatus(srbExt->vbr.status);
-                RhelDbgPrint(TRACE_LEVEL_INFORMATION,
-                             " srb %p, QueueNumber %lu, MessageId %lu.\n",
-                             Srb,
-                             QueueNumber,
-                             MessageID);
-                if (srbExt && srbExt->fua == TRUE)
+                if (bFound && Srb)
                 {
-                    SRB_SET_SRB_STATUS(Srb, SRB_STATUS_PENDING);
-                    if (!RhelDoFlush(DeviceExtension, Srb, TRUE, bIsr))
+                    srbStatus = DeviceToSrbStatus(srbExt->vbr.status);
+                    RhelDbgPrint(TRACE_LEVEL_INFORMATION,
+                                 " srb %p, QueueNumber %lu, MessageId %lu.\n",
+                                 Srb,
+                                 QueueNumber,
+                                 MessageID);
+                    if (srbExt && srbExt->fua == TRUE)
                     {
-                        CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, SRB_STATUS_ERROR);
+                        SRB_SET_SRB_STATUS(Srb, SRB_STATUS_PENDING);
+                        if (!RhelDoFlush(DeviceExtension, Srb, TRUE, bIsr))
+                        {
+                            CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, SRB_STATUS_ERROR);
+                        }
+                        srbExt->fua = FALSE;
+                    }
+                    else
+                    {
+                        CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, srbStatus);
                     }
-                    srbExt->fua = FALSE;
-                }
-                else
-                {
-                    CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, srbStatus);
                 }
             }
         }
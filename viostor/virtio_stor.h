@@ -78,6 +78,7 @@ typedef struct VirtIOBufferDescriptor VIO_SG, *PVIO_SG;
 #define SECTOR_SHIFT                       9
 #define IO_PORT_LENGTH                     0x40
 #define MAX_CPU                            256u
+#define VQ_COMPLETION_BATCH                16
 
 /*
  * QEMU's virtio-blk implementation supports only a single segment (as of